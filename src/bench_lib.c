@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_lib.h"
+#include "timer.h"
+
+static const char *op_names[BENCH_NUM_OPS] = {"mult", "scale", "gemv", "send"};
+
+/* Timings of an operation on a shape with a number of threads. The rates
+ * come from the median time, and the efficiency is that of the strong or weak
+ * scaling from one thread, negative for the copies */
+struct bench_result {
+	int op;
+	const char *sweep;
+	struct bench_shape shape;
+	int threads;
+	double median_ms, p99_ms;
+	double gflops, gbytes;
+	double efficiency;
+};
+
+struct bench_output {
+	FILE *file;
+	int json;
+	int num_results;
+};
+
+int bench_parse_shape(const char *arg, struct bench_shape *shape)
+{
+	char *endptr;
+
+	shape->m = strtoul(arg, &endptr, 10);
+	if (*endptr == 0) {
+		shape->n = shape->k = shape->m;
+		return shape->m > 0;
+	}
+
+	if (*endptr != 'x')
+		return 0;
+	shape->n = strtoul(endptr + 1, &endptr, 10);
+	if (*endptr != 'x')
+		return 0;
+	shape->k = strtoul(endptr + 1, &endptr, 10);
+
+	return *endptr == 0 && shape->m > 0 && shape->n > 0 && shape->k > 0;
+}
+
+/* Sizes of the operands of an operation, returning how many it takes */
+static
+int op_operands(int op, const struct bench_shape *shape, unsigned long int dims[3][2])
+{
+	switch (op) {
+	case BENCH_OP_MULT:
+		dims[0][0] = shape->m; dims[0][1] = shape->k;
+		dims[1][0] = shape->k; dims[1][1] = shape->n;
+		dims[2][0] = shape->m; dims[2][1] = shape->n;
+		return 3;
+	case BENCH_OP_GEMV:
+		dims[0][0] = shape->m; dims[0][1] = shape->k;
+		dims[1][0] = shape->k; dims[1][1] = 1;
+		dims[2][0] = shape->m; dims[2][1] = 1;
+		return 3;
+	default:
+		dims[0][0] = shape->m; dims[0][1] = shape->n;
+		return 1;
+	}
+}
+
+/* Operations of an operation, and bytes of float matrices it must read and
+ * write at least */
+static
+void op_work(int op, const struct bench_shape *shape, double *flops, double *bytes)
+{
+	double m = shape->m, n = shape->n, k = shape->k;
+
+	switch (op) {
+	case BENCH_OP_MULT:
+		*flops = 2.0 * m * n * k;
+		*bytes = sizeof(float) * (m * k + k * n + m * n);
+		break;
+	case BENCH_OP_SCALE:
+		*flops = m * n;
+		*bytes = 2.0 * sizeof(float) * m * n;
+		break;
+	case BENCH_OP_GEMV:
+		*flops = 2.0 * m * k;
+		*bytes = sizeof(float) * (m * k + k + m);
+		break;
+	default:
+		*flops = 0.0;
+		*bytes = sizeof(float) * m * n;
+	}
+}
+
+static
+int cmp_times(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Times runs runs of an operation, after BENCH_WARMUPS untimed ones, taking
+ * the 99th percentile by nearest rank */
+static
+int measure(const struct bench_backend *backend, int op, const struct bench_shape *shape, int threads,
+		int runs, double *times, struct bench_result *result)
+{
+	unsigned long int dims[3][2];
+	void *operands[3] = {NULL, NULL, NULL};
+	double start, flops, bytes;
+	int i, num_operands, ret = 0;
+
+	num_operands = op_operands(op, shape, dims);
+	for (i = 0; i < num_operands; i++) {
+		operands[i] = backend->new_matrix(dims[i][0], dims[i][1]);
+		if (!operands[i])
+			goto out;
+	}
+
+	backend->set_threads(threads);
+
+	for (i = 0; i < BENCH_WARMUPS + runs; i++) {
+		start = monotonic_msec();
+		if (!backend->run[op](operands[0], operands[1], operands[2]))
+			goto out;
+		if (i >= BENCH_WARMUPS)
+			times[i - BENCH_WARMUPS] = monotonic_msec() - start;
+	}
+
+	qsort(times, runs, sizeof(double), cmp_times);
+
+	result->op = op;
+	result->shape = *shape;
+	result->threads = threads;
+	result->median_ms = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2.0;
+	result->p99_ms = times[(99 * runs + 99) / 100 - 1];
+
+	op_work(op, shape, &flops, &bytes);
+	result->gflops = flops / result->median_ms / 1e6;
+	result->gbytes = bytes / result->median_ms / 1e6;
+	ret = 1;
+
+out:
+	for (i = 0; i < num_operands; i++)
+		if (operands[i])
+			backend->delete_matrix(operands[i]);
+
+	if (!ret)
+		fprintf(stderr, "ERRO: %s de %lux%lux%lu com %d threads falhou\n",
+				op_names[op], shape->m, shape->n, shape->k, threads);
+	return ret;
+}
+
+static
+int output_open(struct bench_output *output, const struct bench_backend *backend,
+		const struct bench_config *config)
+{
+	size_t len = strlen(config->file_name);
+
+	output->json = len >= 5 && strcmp(config->file_name + len - 5, ".json") == 0;
+	output->num_results = 0;
+
+	output->file = fopen(config->file_name, "w");
+	if (!output->file) {
+		fprintf(stderr, "ERRO: não foi possível escrever arquivo \"%s\"\n", config->file_name);
+		return 0;
+	}
+
+	if (output->json)
+		fprintf(output->file, "{\n  \"backend\": \"%s\",\n  \"warmups\": %d,\n  \"runs\": %d,\n"
+				"  \"results\": [", backend->name, BENCH_WARMUPS, config->runs);
+	else
+		fprintf(output->file, "backend,op,sweep,m,n,k,threads,runs,median_ms,p99_ms,"
+				"gflops,gbytes_per_s,efficiency\n");
+
+	printf("%-6s %-6s %20s %7s %11s %11s %9s %9s %6s\n", "op", "sweep", "shape", "threads",
+			"median ms", "p99 ms", "GFLOP/s", "GB/s", "eff.");
+	return 1;
+}
+
+static
+void output_result(struct bench_output *output, const struct bench_backend *backend,
+		const struct bench_config *config, const struct bench_result *result)
+{
+	char shape[64], efficiency[16];
+
+	snprintf(shape, sizeof(shape), "%lux%lux%lu", result->shape.m, result->shape.n, result->shape.k);
+	if (result->efficiency < 0.0)
+		strcpy(efficiency, output->json ? "null" : "");
+	else
+		snprintf(efficiency, sizeof(efficiency), "%.4f", result->efficiency);
+
+	if (output->json)
+		fprintf(output->file, "%s\n    {\"op\": \"%s\", \"sweep\": \"%s\", \"m\": %lu, \"n\": %lu, "
+				"\"k\": %lu, \"threads\": %d, \"median_ms\": %.6f, \"p99_ms\": %.6f, "
+				"\"gflops\": %.4f, \"gbytes_per_s\": %.4f, \"efficiency\": %s}",
+				output->num_results ? "," : "", op_names[result->op], result->sweep,
+				result->shape.m, result->shape.n, result->shape.k, result->threads,
+				result->median_ms, result->p99_ms, result->gflops, result->gbytes, efficiency);
+	else
+		fprintf(output->file, "%s,%s,%s,%lu,%lu,%lu,%d,%d,%.6f,%.6f,%.4f,%.4f,%s\n",
+				backend->name, op_names[result->op], result->sweep, result->shape.m,
+				result->shape.n, result->shape.k, result->threads, config->runs,
+				result->median_ms, result->p99_ms, result->gflops, result->gbytes, efficiency);
+	output->num_results++;
+
+	printf("%-6s %-6s %20s %7d %11.3f %11.3f %9.2f %9.2f %6s\n", op_names[result->op], result->sweep,
+			shape, result->threads, result->median_ms, result->p99_ms, result->gflops, result->gbytes,
+			result->efficiency < 0.0 ? "-" : efficiency);
+}
+
+static
+int output_close(struct bench_output *output)
+{
+	int ret;
+
+	if (output->json)
+		fprintf(output->file, "\n  ]\n}\n");
+
+	ret = !ferror(output->file);
+	return fclose(output->file) == 0 && ret;
+}
+
+/* Strong and weak scaling of an operation on a shape: the same shape, then
+ * m times the threads, against the time with one thread */
+static
+int sweep_threads(const struct bench_backend *backend, const struct bench_config *config, int op,
+		const struct bench_shape *shape, double *times, struct bench_output *output)
+{
+	struct bench_result result;
+	struct bench_shape weak;
+	double base = 0.0;
+	int threads = 1;
+
+	for (;;) {
+		if (!measure(backend, op, shape, threads, config->runs, times, &result))
+			return 0;
+		if (threads == 1)
+			base = result.median_ms;
+
+		result.sweep = "strong";
+		result.efficiency = base / (threads * result.median_ms);
+		output_result(output, backend, config, &result);
+
+		weak = *shape;
+		weak.m *= threads;
+		if (threads > 1 && !measure(backend, op, &weak, threads, config->runs, times, &result))
+			return 0;
+
+		result.sweep = "weak";
+		result.efficiency = base / result.median_ms;
+		output_result(output, backend, config, &result);
+
+		if (threads >= config->max_threads)
+			return 1;
+		threads = threads * 2 < config->max_threads ? threads * 2 : config->max_threads;
+	}
+}
+
+int bench_run(const struct bench_backend *backend, const struct bench_config *config)
+{
+	struct bench_output output;
+	struct bench_result result;
+	double *times;
+	int s, op, ret = 1;
+
+	if (config->runs < 1 || config->max_threads < 1)
+		return 0;
+
+	times = (double *)malloc(sizeof(double) * config->runs);
+	if (!times)
+		goto fail1;
+
+	if (!output_open(&output, backend, config))
+		goto fail2;
+
+	for (s = 0; s < config->num_shapes && ret; s++) {
+		for (op = 0; op < BENCH_NUM_OPS && ret; op++) {
+			if (!backend->run[op])
+				continue;
+
+			if (op != BENCH_OP_SEND) {
+				ret = sweep_threads(backend, config, op, &config->shapes[s], times, &output);
+				continue;
+			}
+
+			ret = measure(backend, op, &config->shapes[s], 1, config->runs, times, &result);
+			if (ret) {
+				result.sweep = "copy";
+				result.efficiency = -1.0;
+				output_result(&output, backend, config, &result);
+			}
+		}
+	}
+
+	if (!output_close(&output))
+		ret = 0;
+
+	free(times);
+	return ret;
+
+/* ERROR CLEANUP */
+fail2:
+	free(times);
+fail1:
+	return 0;
+}
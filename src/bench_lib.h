@@ -0,0 +1,51 @@
+#ifndef _BENCH_LIB_H
+#define _BENCH_LIB_H
+
+/* Runs of each measure left out of its timings, to warm the caches, the
+ * thread pools and the VE */
+#define BENCH_WARMUPS 2
+
+/* Operations measured, on operands of an m x n x k shape:
+ * MULT  C = A * B, A m x k, B k x n and C m x n
+ * SCALE A = 1 * A, A m x n
+ * GEMV  y = A * x, A m x k, x k x 1 and y m x 1
+ * SEND  host rows of an m x n A sent to the VE, not threaded */
+#define BENCH_OP_MULT  0
+#define BENCH_OP_SCALE 1
+#define BENCH_OP_GEMV  2
+#define BENCH_OP_SEND  3
+#define BENCH_NUM_OPS  4
+
+/* A backend as a driver exposes it to the benchmarks: matrices it allocates,
+ * fills with random elements and, on the VE, loads, and the operations it
+ * runs on them, a NULL one being skipped */
+struct bench_backend {
+	const char *name;
+	void (*set_threads)(int num_threads);
+	void *(*new_matrix)(unsigned long int height, unsigned long int width);
+	void (*delete_matrix)(void *matrix);
+	int (*run[BENCH_NUM_OPS])(void *a, void *b, void *c);
+};
+
+struct bench_shape {
+	unsigned long int m, n, k;
+};
+
+/* Each shape is timed runs times with 1, 2, 4... and max_threads threads, as
+ * is its weak scaling, where m grows with the threads. The results go to
+ * stdout as a table and to file_name, as JSON if it ends in .json and as CSV
+ * otherwise */
+struct bench_config {
+	const struct bench_shape *shapes;
+	int num_shapes;
+	int max_threads;
+	int runs;
+	const char *file_name;
+};
+
+/* Shape written as MxNxK, or N for a square one */
+int bench_parse_shape(const char *arg, struct bench_shape *shape);
+
+int bench_run(const struct bench_backend *backend, const struct bench_config *config);
+
+#endif /* #ifndef _BENCH_LIB_H */
@@ -7,6 +7,19 @@
 
 float fabsf(float x);
 
+/* Matrices of 16-bit dtypes are compared as floats */
+static Matrix *widen_matrix(Matrix *matrix)
+{
+	Matrix *widened;
+
+	if (!matrix || matrix->dtype == MATRIX_DTYPE_F32)
+		return matrix;
+
+	widened = convert_matrix(matrix, MATRIX_DTYPE_F32);
+	delete_matrix(matrix);
+	return widened;
+}
+
 int main(int argc, char *argv[])
 {
 	float tolerance;
@@ -16,26 +29,33 @@ int main(int argc, char *argv[])
 	unsigned long int m_height, m_width, i, j;
 	const char *matrix_a_bfname, *matrix_b_bfname;
 
-	if (argc < 4) {
-		fprintf(stderr, "USAGE: %s <matrix A bin file> <matrix B bin file> <matrixes height> <matrixes width> <tolerance>\n", argv[0]);
+	/* Formatted files carry their dimensions, raw files need them given */
+	if (argc == 4) {
+		m_height = m_width = 0;
+		tolerance = argtof(argv[3]);
+	} else if (argc == 6) {
+		m_height = argtoul(argv[3]);
+		m_width = argtoul(argv[4]);
+		tolerance = argtof(argv[5]);
+	} else {
+		fprintf(stderr, "USAGE: %s <matrix A bin file> <matrix B bin file> [<matrixes height> <matrixes width>] <tolerance>\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
 	matrix_a_bfname = argv[1];
 	matrix_b_bfname = argv[2];
-	m_height = argtoul(argv[3]);
-	m_width = argtoul(argv[4]);
-	tolerance = argtof(argv[5]);
 
-	matrix_a = read_matrix_binfile(matrix_a_bfname, m_width, m_height);
+	matrix_a = widen_matrix(read_matrix_binfile(matrix_a_bfname, m_width, m_height));
 	if (!matrix_a) {
 		fprintf(stderr, "ERROR: Could not open file \"%s\"\n", matrix_a_bfname);
 		goto fail1;
 	}
+	m_height = matrix_a->height;
+	m_width = matrix_a->width;
 
-	matrix_b = read_matrix_binfile(matrix_b_bfname, m_width, m_height);
+	matrix_b = widen_matrix(read_matrix_binfile(matrix_b_bfname, m_width, m_height));
 	if (!matrix_b) {
-		fprintf(stderr, "ERROR: Could not open file \"%s\"\n", matrix_b_bfname);
+		fprintf(stderr, "ERROR: Could not open file \"%s\" as a %lux%lu matrix\n", matrix_b_bfname, m_height, m_width);
 		goto fail2;
 	}
 
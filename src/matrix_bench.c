@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "matrix_lib_o.h"
+#include "arg_lib.h"
+#include "bench_lib.h"
+
+/* Name of the backend in the reports, built against matrix_lib.c, or with
+ * -DBENCH_BACKEND=\"generic\" against matrix_lib_g.c. The host one is followed
+ * by MATRIX_LIB_ISA when it is set */
+#ifndef BENCH_BACKEND
+#define BENCH_BACKEND "host"
+#endif
+
+static struct bench_shape default_shapes[] = {
+	{256, 256, 256}, {1024, 1024, 1024}, {4096, 64, 1024}
+};
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "FATAL ERROR: %s.\nAborting program...\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+static void *new_bench_matrix(unsigned long int height, unsigned long int width)
+{
+	Matrix *matrix = zero_matrix(height, width);
+	unsigned long int i;
+
+	if (matrix)
+		for (i = 0; i < height * width; ++i)
+			matrix->rows[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+
+	return matrix;
+}
+
+static void delete_bench_matrix(void *matrix)
+{
+	delete_matrix((Matrix *)matrix);
+}
+
+static int run_mult(void *a, void *b, void *c)
+{
+	return matrix_matrix_mult((Matrix *)a, (Matrix *)b, (Matrix *)c);
+}
+
+static int run_scale(void *a, void *b, void *c)
+{
+	return scalar_matrix_mult(1.0f, (Matrix *)a);
+}
+
+static int run_gemv(void *a, void *b, void *c)
+{
+	return matrix_vector_gemv(1.0f, (Matrix *)a, (Matrix *)b, 0.0f, (Matrix *)c, 0);
+}
+
+/* Runs the benchmarks of bench_lib.h on the host backend or the generic one */
+int main(int argc, char *argv[])
+{
+	struct bench_backend backend = {
+		BENCH_BACKEND, set_number_threads, new_bench_matrix, delete_bench_matrix,
+		{run_mult, run_scale, run_gemv, NULL}
+	};
+	struct bench_config config;
+	struct bench_shape *shapes = NULL;
+	char name[64];
+	const char *isa = getenv("MATRIX_LIB_ISA");
+	int i, ret;
+
+	if (argc < 4) {
+		fprintf(stderr, "USAGE: %s <max_threads> <runs> <output_file> [<MxNxK> ...]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	config.max_threads = argtoi(argv[1]);
+	config.runs = argtoi(argv[2]);
+	config.file_name = argv[3];
+	if (config.max_threads < 1 || config.runs < 1)
+		die("max_threads and runs must be positive");
+
+	if (argc > 4) {
+		config.num_shapes = argc - 4;
+		shapes = (struct bench_shape *)malloc(sizeof(struct bench_shape) * config.num_shapes);
+		if (!shapes)
+			die("out of memory");
+		for (i = 0; i < config.num_shapes; ++i)
+			if (!bench_parse_shape(argv[i + 4], &shapes[i]))
+				die("invalid shape");
+		config.shapes = shapes;
+	} else {
+		config.num_shapes = sizeof(default_shapes) / sizeof(default_shapes[0]);
+		config.shapes = default_shapes;
+	}
+
+	if (isa && *isa) {
+		snprintf(name, sizeof(name), "%s-%s", BENCH_BACKEND, isa);
+		backend.name = name;
+	}
+
+	if (!init_thread_pool())
+		die("init_thread_pool()");
+
+	ret = bench_run(&backend, &config);
+
+	close_thread_pool();
+	free(shapes);
+
+	if (!ret)
+		die("benchmark failure");
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "matrix_lib.h"
+#include "arg_lib.h"
+#include "bench_lib.h"
+
+/* Name of the backend in the reports. Built with MATRIX_LIB_UNIFIED, against
+ * the unified library, the products go where it dispatches them */
+#ifndef BENCH_BACKEND
+#ifdef MATRIX_LIB_UNIFIED
+#define BENCH_BACKEND "unified"
+#else
+#define BENCH_BACKEND "ve"
+#endif
+#endif
+
+static struct bench_shape default_shapes[] = {
+	{256, 256, 256}, {1024, 1024, 1024}, {4096, 64, 1024}
+};
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "FATAL ERROR: %s.\nAborting program...\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+/* The matrices are loaded, so the operations are timed on the VE rows and
+ * the sends are timed apart */
+static void *new_bench_matrix(unsigned long int height, unsigned long int width)
+{
+	struct matrix *matrix = zero_matrix(height, width);
+	unsigned long int i;
+
+	if (!matrix)
+		return NULL;
+
+	for (i = 0; i < height * width; ++i)
+		matrix->vh_rows[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+
+	if (!load_ve_matrix(matrix)) {
+		delete_matrix(matrix);
+		return NULL;
+	}
+
+	return matrix;
+}
+
+static void delete_bench_matrix(void *matrix)
+{
+	delete_matrix((struct matrix *)matrix);
+}
+
+static int run_mult(void *a, void *b, void *c)
+{
+	return matrix_matrix_mult((struct matrix *)a, (struct matrix *)b, (struct matrix *)c);
+}
+
+static int run_scale(void *a, void *b, void *c)
+{
+	return scalar_matrix_mult(1.0f, (struct matrix *)a);
+}
+
+static int run_gemv(void *a, void *b, void *c)
+{
+	return matrix_vector_gemv(1.0f, (struct matrix *)a, (struct matrix *)b, 0.0f, (struct matrix *)c, 0);
+}
+
+static int run_send(void *a, void *b, void *c)
+{
+	return touch_vh_matrix((struct matrix *)a) && sync_vh_ve_matrix((struct matrix *)a);
+}
+
+/* Runs the benchmarks of bench_lib.h on the VE, up to its 8 threads */
+int main(int argc, char *argv[])
+{
+	struct bench_backend backend = {
+		BENCH_BACKEND, set_number_threads, new_bench_matrix, delete_bench_matrix,
+		{run_mult, run_scale, run_gemv, run_send}
+	};
+	struct bench_config config;
+	struct bench_shape *shapes = NULL;
+	int i, ret;
+
+	if (argc < 5) {
+		fprintf(stderr, "USAGE: %s <ve_id_number> <max_threads> <runs> <output_file> [<MxNxK> ...]\n",
+				argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	set_ve_execution_node(argtoi(argv[1]));
+	config.max_threads = argtoi(argv[2]);
+	config.runs = argtoi(argv[3]);
+	config.file_name = argv[4];
+	if (config.max_threads < 1 || config.max_threads > 8 || config.runs < 1)
+		die("max_threads must be from 1 to 8 and runs positive");
+
+	if (argc > 5) {
+		config.num_shapes = argc - 5;
+		shapes = (struct bench_shape *)malloc(sizeof(struct bench_shape) * config.num_shapes);
+		if (!shapes)
+			die("out of memory");
+		for (i = 0; i < config.num_shapes; ++i)
+			if (!bench_parse_shape(argv[i + 5], &shapes[i]))
+				die("invalid shape");
+		config.shapes = shapes;
+	} else {
+		config.num_shapes = sizeof(default_shapes) / sizeof(default_shapes[0]);
+		config.shapes = default_shapes;
+	}
+
+	if (!init_proc_ve_node())
+		die("init_proc_ve_node()");
+
+	ret = bench_run(&backend, &config);
+
+	close_proc_ve_node();
+	free(shapes);
+
+	if (!ret)
+		die("benchmark failure");
+	return 0;
+}
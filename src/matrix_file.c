@@ -0,0 +1,771 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "matrix_file.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static
+uint64_t checksum_update(uint64_t hash, const void *data, unsigned long int size)
+{
+	const unsigned char *arr_data = (const unsigned char *)data;
+	unsigned long int i;
+	uint64_t word;
+
+	/* FNV-1a over 64 bits words, then over the bytes left */
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&word, arr_data + i, sizeof(word));
+		hash = (hash ^ word) * FNV_PRIME;
+	}
+
+	for (; i < size; ++i)
+		hash = (hash ^ arr_data[i]) * FNV_PRIME;
+
+	return hash;
+}
+
+uint64_t matrix_file_checksum(const void *data, unsigned long int size)
+{
+	return checksum_update(FNV_OFFSET, data, size);
+}
+
+/* Converts a 16-bit element to a float, exactly */
+float matrix_half_to_float(uint16_t half, int dtype)
+{
+	uint32_t bits, exponent, mantissa;
+	float value;
+
+	if (dtype == MATRIX_DTYPE_BF16) {
+		bits = (uint32_t)half << 16;
+	} else {
+		exponent = half >> 10 & 0x1f;
+		mantissa = half & 0x3ff;
+		if (exponent == 0x1f) {
+			/* Infinities and NaNs */
+			bits = 0x7f800000 | mantissa << 13;
+		} else if (exponent) {
+			bits = (exponent + 112) << 23 | mantissa << 13;
+		} else {
+			/* Subnormals are mantissa * 2^-24, exact as a float */
+			value = (float)mantissa * (1.0f / 16777216.0f);
+			return half & 0x8000 ? -value : value;
+		}
+		bits |= (uint32_t)(half & 0x8000) << 16;
+	}
+
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/* Rounds a float to a 16-bit element, to nearest even. Values beyond the
+ * range of f16 become infinities and NaNs stay NaNs */
+uint16_t matrix_float_to_half(float value, int dtype)
+{
+	uint32_t bits, sign, mantissa, shift, rest, half;
+
+	memcpy(&bits, &value, sizeof(bits));
+
+	if (dtype == MATRIX_DTYPE_BF16) {
+		if ((bits & 0x7fffffff) > 0x7f800000)
+			return (uint16_t)(bits >> 16 | 0x40);
+		return (uint16_t)((bits + 0x7fff + (bits >> 16 & 1)) >> 16);
+	}
+
+	sign = bits >> 16 & 0x8000;
+	bits &= 0x7fffffff;
+
+	if (bits > 0x7f800000)
+		return (uint16_t)(sign | 0x7e00);
+
+	/* From 65520 up, halfway above the largest f16, and infinities */
+	if (bits >= 0x477ff000)
+		return (uint16_t)(sign | 0x7c00);
+
+	/* Normal f16, rounding may carry into the exponent */
+	if (bits >= 0x38800000)
+		return (uint16_t)(sign | (bits + 0xfff + (bits >> 13 & 1) - (112U << 23)) >> 13);
+
+	/* Subnormal f16, value * 2^24 rounded to an integer */
+	shift = 126 - (bits >> 23);
+	if (shift > 24)
+		return (uint16_t)sign;
+
+	mantissa = (bits & 0x7fffff) | 0x800000;
+	half = mantissa >> shift;
+	rest = mantissa & ((1U << shift) - 1);
+	if (rest > 1U << (shift - 1) || (rest == 1U << (shift - 1) && (half & 1)))
+		++half;
+
+	return (uint16_t)(sign | half);
+}
+
+/* Converts length elements of src_dtype at src to dst_dtype at dst, which
+ * must not overlap */
+void matrix_dtype_convert(void *dst, int dst_dtype, const void *src, int src_dtype, unsigned long int length)
+{
+	unsigned long int i;
+	float value;
+
+	if (dst_dtype == src_dtype) {
+		memcpy(dst, src, MATRIX_DTYPE_SIZE(dst_dtype) * length);
+		return;
+	}
+
+	for (i = 0; i < length; ++i) {
+		if (src_dtype == MATRIX_DTYPE_F32)
+			value = ((const float *)src)[i];
+		else
+			value = matrix_half_to_float(((const uint16_t *)src)[i], src_dtype);
+
+		if (dst_dtype == MATRIX_DTYPE_F32)
+			((float *)dst)[i] = value;
+		else
+			((uint16_t *)dst)[i] = matrix_float_to_half(value, dst_dtype);
+	}
+}
+
+int matrix_size_mul(unsigned long int a, unsigned long int b, unsigned long int *result)
+{
+	if (b && a > ULONG_MAX / b)
+		return 0;
+
+	*result = a * b;
+	return 1;
+}
+
+int matrix_size_add(unsigned long int a, unsigned long int b, unsigned long int *result)
+{
+	if (a > ULONG_MAX - b)
+		return 0;
+
+	*result = a + b;
+	return 1;
+}
+
+unsigned long int matrix_file_num_blocks(const struct matrix_file *file)
+{
+	const struct matrix_file_header *header = &file->header;
+
+	if (!header->block_size || !header->data_size)
+		return 0;
+
+	return (header->data_size - 1) / header->block_size + 1;
+}
+
+static
+uint64_t header_checksum(const struct matrix_file_header *header, const uint64_t *checksums, unsigned long int num_blocks)
+{
+	struct matrix_file_header copy = *header;
+	uint64_t hash;
+
+	copy.header_checksum = 0;
+	hash = checksum_update(FNV_OFFSET, &copy, sizeof(copy));
+	return checksum_update(hash, checksums, sizeof(uint64_t) * num_blocks);
+}
+
+/* Reads size bytes at offset of the file fd into buffer. Returns 1 if all of
+ * them were read */
+int matrix_file_read_at(int fd, void *buffer, unsigned long int size, unsigned long int offset)
+{
+	char *arr_buffer = (char *)buffer;
+	ssize_t ret;
+
+	while (size) {
+		ret = pread(fd, arr_buffer, size, (off_t)offset);
+		if (ret <= 0)
+			return 0;
+		arr_buffer += ret;
+		offset += (unsigned long int)ret;
+		size -= (unsigned long int)ret;
+	}
+
+	return 1;
+}
+
+/* Writes size bytes of buffer at offset of the file fd. Returns 1 if all of
+ * them were written */
+int matrix_file_write_at(int fd, const void *buffer, unsigned long int size, unsigned long int offset)
+{
+	const char *arr_buffer = (const char *)buffer;
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, arr_buffer, size, (off_t)offset);
+		if (ret <= 0)
+			return 0;
+		arr_buffer += ret;
+		offset += (unsigned long int)ret;
+		size -= (unsigned long int)ret;
+	}
+
+	return 1;
+}
+
+/* Fills the header of a dense height x width matrix, the checksums aside */
+static
+void init_header(struct matrix_file *file, unsigned long int height, unsigned long int width, int dtype)
+{
+	struct matrix_file_header *header = &file->header;
+
+	memset(header, 0, sizeof(*header));
+	header->magic = MATRIX_FILE_MAGIC;
+	header->version = MATRIX_FILE_VERSION;
+	header->dtype = (uint32_t)dtype;
+	header->layout = MATRIX_LAYOUT_ROW_MAJOR;
+	header->height = height;
+	header->width = width;
+	header->stride = width;
+	header->data_size = MATRIX_DTYPE_SIZE(dtype) * height * width;
+	header->block_size = MATRIX_FILE_BLOCK_SIZE;
+	header->data_offset = (sizeof(*header) + sizeof(uint64_t) * matrix_file_num_blocks(file)
+			+ MATRIX_FILE_ALIGN - 1) / MATRIX_FILE_ALIGN * MATRIX_FILE_ALIGN;
+}
+
+/* Writes the header and the checksums table, which must be filled */
+static
+int write_header(struct matrix_file *file)
+{
+	struct matrix_file_header *header = &file->header;
+	unsigned long int num_blocks = matrix_file_num_blocks(file);
+
+	header->header_checksum = header_checksum(header, file->checksums, num_blocks);
+
+	return matrix_file_write_at(file->fd, header, sizeof(*header), 0)
+		&& matrix_file_write_at(file->fd, file->checksums, sizeof(uint64_t) * num_blocks, sizeof(*header));
+}
+
+/* Opens a matrix file and reads and checks its header. Returns 1 for a
+ * formatted file, 0 for a raw file of floats (the header and the checksums of
+ * file are then zeroed) and -1 if the file can not be opened or has a corrupt
+ * header */
+int matrix_file_open(const char *file_name, struct matrix_file *file)
+{
+	struct matrix_file_header *header = &file->header;
+	unsigned long int num_blocks, lines, length, elements, size;
+	struct stat st;
+
+	file->checksums = NULL;
+	file->fd = open(file_name, O_RDONLY);
+	if (file->fd < 0)
+		goto fail1;
+
+	if (fstat(file->fd, &st) != 0)
+		goto fail2;
+
+	/* Anything not starting with the magic number is a raw file */
+	if ((unsigned long int)st.st_size < sizeof(*header)
+			|| !matrix_file_read_at(file->fd, header, sizeof(*header), 0)
+			|| header->magic != MATRIX_FILE_MAGIC) {
+		memset(header, 0, sizeof(*header));
+		return 0;
+	}
+
+	if (header->version != MATRIX_FILE_VERSION || header->dtype > MATRIX_DTYPE_F16
+			|| header->layout > MATRIX_LAYOUT_COL_MAJOR || !header->block_size
+			|| header->data_offset % MATRIX_FILE_ALIGN)
+		goto fail2;
+
+	/* The data must hold every element, with the stride given, and lie in
+	 * the file. A crafted header can make any of these sizes overflow, and
+	 * the elements are at least height * width when they do not */
+	lines = header->layout == MATRIX_LAYOUT_ROW_MAJOR ? header->height : header->width;
+	length = header->layout == MATRIX_LAYOUT_ROW_MAJOR ? header->width : header->height;
+	elements = 0;
+	if (header->stride < length || (lines && (!matrix_size_mul(lines - 1, header->stride, &elements)
+					|| !matrix_size_add(elements, length, &elements))))
+		goto fail2;
+
+	if (!matrix_size_mul(MATRIX_DTYPE_SIZE(header->dtype), elements, &size) || header->data_size < size
+			|| !matrix_size_add(header->data_offset, header->data_size, &size)
+			|| (unsigned long int)st.st_size < size)
+		goto fail2;
+
+	num_blocks = matrix_file_num_blocks(file);
+	if (sizeof(*header) + sizeof(uint64_t) * num_blocks > header->data_offset)
+		goto fail2;
+
+	file->checksums = (uint64_t *)malloc(sizeof(uint64_t) * (num_blocks ? num_blocks : 1));
+	if (!file->checksums)
+		goto fail2;
+
+	if (!matrix_file_read_at(file->fd, file->checksums, sizeof(uint64_t) * num_blocks, sizeof(*header)))
+		goto fail3;
+
+	if (header_checksum(header, file->checksums, num_blocks) != header->header_checksum)
+		goto fail3;
+
+	return 1;
+
+	/* ERROR CLEANUP */
+fail3:
+	free(file->checksums);
+	file->checksums = NULL;
+fail2:
+	close(file->fd);
+	file->fd = -1;
+fail1:
+	return -1;
+}
+
+void matrix_file_close(struct matrix_file *file)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+
+	free(file->checksums);
+	file->fd = -1;
+	file->checksums = NULL;
+}
+
+/* Settles the dimensions of the matrix in an open file: a formatted file gives
+ * its own, which must match *width and *height unless they are 0, while a raw
+ * file needs both, which then fill its header as a dense matrix with no
+ * checksums. Returns 1 if they are consistent */
+int matrix_file_shape(struct matrix_file *file, unsigned long int *width, unsigned long int *height)
+{
+	struct matrix_file_header *header = &file->header;
+	unsigned long int size;
+
+	if (header->magic != MATRIX_FILE_MAGIC) {
+		header->height = *height;
+		header->width = *width;
+		header->stride = *width;
+		if (!*width || !*height || !matrix_size_mul(*height, *width, &size)
+				|| !matrix_size_mul(sizeof(float), size, &size))
+			return 0;
+
+		header->data_size = size;
+		return 1;
+	}
+
+	if ((*width && *width != header->width) || (*height && *height != header->height))
+		return 0;
+
+	*width = header->width;
+	*height = header->height;
+
+	return 1;
+}
+
+/* Tells if the data of the file is exactly the rows of the matrix, as the
+ * library stores them with the dtype of the file, so it can be read or mapped
+ * in place */
+int matrix_file_is_dense(const struct matrix_file *file)
+{
+	const struct matrix_file_header *header = &file->header;
+
+	return header->layout == MATRIX_LAYOUT_ROW_MAJOR && header->stride == header->width
+		&& header->data_size == MATRIX_DTYPE_SIZE(header->dtype) * header->height * header->width;
+}
+
+/* Checks the data region of a formatted file, loaded in memory at data,
+ * against its checksums */
+int matrix_file_verify(const struct matrix_file *file, const void *data)
+{
+	const struct matrix_file_header *header = &file->header;
+	const char *arr_data = (const char *)data;
+	unsigned long int b, size, num_blocks;
+
+	num_blocks = matrix_file_num_blocks(file);
+	for (b = 0; b != num_blocks; ++b, arr_data += header->block_size) {
+		size = header->data_size - b * header->block_size;
+		if (size > header->block_size)
+			size = header->block_size;
+
+		if (matrix_file_checksum(arr_data, size) != file->checksums[b])
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Reads the matrix of the file into rows, stored row major without padding
+ * with the dtype of the file, checking every block against its checksum */
+int matrix_file_read(const struct matrix_file *file, void *rows)
+{
+	const struct matrix_file_header *header = &file->header;
+	unsigned long int b, i, size, first, element, line, num_blocks, index;
+	unsigned long int element_size = MATRIX_DTYPE_SIZE(header->dtype);
+	char *block;
+
+	if (matrix_file_is_dense(file))
+		return matrix_file_read_at(file->fd, rows, header->data_size, header->data_offset)
+			&& matrix_file_verify(file, rows);
+
+	block = (char *)malloc(header->block_size);
+	if (!block)
+		return 0;
+
+	/* Stream the blocks, scattering the elements each one holds */
+	num_blocks = matrix_file_num_blocks(file);
+	for (b = 0; b != num_blocks; ++b) {
+		size = header->data_size - b * header->block_size;
+		if (size > header->block_size)
+			size = header->block_size;
+
+		if (!matrix_file_read_at(file->fd, block, size, header->data_offset + b * header->block_size)
+				|| matrix_file_checksum(block, size) != file->checksums[b]) {
+			free(block);
+			return 0;
+		}
+
+		first = b * header->block_size / element_size;
+		for (i = 0; i < size / element_size; ++i) {
+			element = first + i;
+			line = element / header->stride;
+			if (element % header->stride >= (header->layout == MATRIX_LAYOUT_ROW_MAJOR ? header->width : header->height))
+				continue;
+
+			if (header->layout == MATRIX_LAYOUT_ROW_MAJOR) {
+				if (line >= header->height)
+					continue;
+				index = line * header->width + element % header->stride;
+			} else {
+				if (line >= header->width)
+					continue;
+				index = (element % header->stride) * header->width + line;
+			}
+
+			memcpy((char *)rows + index * element_size, block + i * element_size, element_size);
+		}
+	}
+
+	free(block);
+
+	return 1;
+}
+
+/* Creates a formatted file for a height x width matrix of dtype elements whose
+ * data is then written with matrix_file_write_at, in any order, and
+ * checksummed by matrix_file_finish */
+int matrix_file_create(const char *file_name, unsigned long int height, unsigned long int width, int dtype,
+		struct matrix_file *file)
+{
+	unsigned long int num_blocks;
+
+	init_header(file, height, width, dtype);
+	num_blocks = matrix_file_num_blocks(file);
+
+	file->checksums = (uint64_t *)calloc(num_blocks ? num_blocks : 1, sizeof(uint64_t));
+	if (!file->checksums)
+		goto fail1;
+
+	file->fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file->fd < 0)
+		goto fail2;
+
+	if (ftruncate(file->fd, (off_t)(file->header.data_offset + file->header.data_size)) != 0)
+		goto fail3;
+
+	return 1;
+
+	/* ERROR CLEANUP */
+fail3:
+	close(file->fd);
+fail2:
+	free(file->checksums);
+fail1:
+	file->fd = -1;
+	file->checksums = NULL;
+	return 0;
+}
+
+/* Reads back the data of a file made by matrix_file_create to checksum it and
+ * writes the header */
+int matrix_file_finish(struct matrix_file *file)
+{
+	const struct matrix_file_header *header = &file->header;
+	unsigned long int b, size, num_blocks;
+	char *block;
+
+	block = (char *)malloc(header->block_size);
+	if (!block)
+		return 0;
+
+	num_blocks = matrix_file_num_blocks(file);
+	for (b = 0; b != num_blocks; ++b) {
+		size = header->data_size - b * header->block_size;
+		if (size > header->block_size)
+			size = header->block_size;
+
+		if (!matrix_file_read_at(file->fd, block, size, header->data_offset + b * header->block_size)) {
+			free(block);
+			return 0;
+		}
+		file->checksums[b] = matrix_file_checksum(block, size);
+	}
+
+	free(block);
+
+	return write_header(file);
+}
+
+/* Writes a height x width matrix of dtype elements stored row major in rows
+ * as a formatted file */
+int matrix_file_write(const char *file_name, const void *rows, unsigned long int height, unsigned long int width,
+		int dtype)
+{
+	struct matrix_file file;
+	const struct matrix_file_header *header = &file.header;
+	unsigned long int b, size, num_blocks;
+	int ret;
+
+	if (!matrix_file_create(file_name, height, width, dtype, &file))
+		return 0;
+
+	num_blocks = matrix_file_num_blocks(&file);
+	for (b = 0; b != num_blocks; ++b) {
+		size = header->data_size - b * header->block_size;
+		if (size > header->block_size)
+			size = header->block_size;
+		file.checksums[b] = matrix_file_checksum((const char *)rows + b * header->block_size, size);
+	}
+
+	ret = write_header(&file)
+		&& matrix_file_write_at(file.fd, rows, header->data_size, header->data_offset);
+
+	ret &= close(file.fd) == 0;
+	file.fd = -1;
+	matrix_file_close(&file);
+
+	return ret;
+}
+
+static
+uint64_t sparse_checksum(const struct sparse_file_header *header, const uint64_t *row_ptr,
+		const uint32_t *columns, const float *values)
+{
+	struct sparse_file_header copy = *header;
+	uint64_t hash;
+
+	copy.checksum = 0;
+	hash = checksum_update(FNV_OFFSET, &copy, sizeof(copy));
+	hash = checksum_update(hash, row_ptr, sizeof(uint64_t) * (header->height + 1));
+	hash = checksum_update(hash, columns, sizeof(uint32_t) * header->nnz);
+	return checksum_update(hash, values, sizeof(float) * header->nnz);
+}
+
+/* Opens a sparse file and reads its header, whose sizes must match the size
+ * of the file. Returns 1 on success and 0 on failure */
+int sparse_file_open(const char *file_name, struct sparse_file *file)
+{
+	struct sparse_file_header *header = &file->header;
+	unsigned long int size, cells;
+	struct stat st;
+
+	file->fd = open(file_name, O_RDONLY);
+	if (file->fd < 0)
+		goto fail1;
+
+	if (fstat(file->fd, &st) != 0 || (unsigned long int)st.st_size < sizeof(*header)
+			|| !matrix_file_read_at(file->fd, header, sizeof(*header), 0))
+		goto fail2;
+
+	if (header->magic != SPARSE_FILE_MAGIC || header->version != SPARSE_FILE_VERSION
+			|| header->width > SPARSE_MAX_WIDTH)
+		goto fail2;
+
+	/* The arrays must fit in the file, which bounds the counts before any
+	 * size is computed from them, as a crafted header could overflow it. A
+	 * height * width that overflows is above any nnz */
+	size = (unsigned long int)st.st_size - sizeof(*header);
+	if (header->height >= size / sizeof(uint64_t) || header->nnz > size / (sizeof(uint32_t) + sizeof(float))
+			|| (matrix_size_mul(header->height, header->width, &cells) && header->nnz > cells))
+		goto fail2;
+
+	if (size != sizeof(uint64_t) * (header->height + 1) + (sizeof(uint32_t) + sizeof(float)) * header->nnz)
+		goto fail2;
+
+	return 1;
+
+	/* ERROR CLEANUP */
+fail2:
+	close(file->fd);
+	file->fd = -1;
+fail1:
+	return 0;
+}
+
+void sparse_file_close(struct sparse_file *file)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+
+	file->fd = -1;
+}
+
+/* Reads the arrays of a sparse file, sized from its header, and checks them
+ * against the checksum and for rows and columns out of the matrix */
+int sparse_file_read(const struct sparse_file *file, uint64_t *row_ptr, uint32_t *columns, float *values)
+{
+	const struct sparse_file_header *header = &file->header;
+	unsigned long int offset = sizeof(*header), i;
+
+	if (!matrix_file_read_at(file->fd, row_ptr, sizeof(uint64_t) * (header->height + 1), offset))
+		return 0;
+	offset += sizeof(uint64_t) * (header->height + 1);
+
+	if (!matrix_file_read_at(file->fd, columns, sizeof(uint32_t) * header->nnz, offset))
+		return 0;
+	offset += sizeof(uint32_t) * header->nnz;
+
+	if (!matrix_file_read_at(file->fd, values, sizeof(float) * header->nnz, offset))
+		return 0;
+
+	if (sparse_checksum(header, row_ptr, columns, values) != header->checksum)
+		return 0;
+
+	if (row_ptr[0] != 0 || row_ptr[header->height] != header->nnz)
+		return 0;
+
+	for (i = 0; i < header->height; ++i) {
+		if (row_ptr[i] > row_ptr[i + 1])
+			return 0;
+	}
+
+	for (i = 0; i < header->nnz; ++i) {
+		if (columns[i] >= header->width)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Writes a height x width matrix in CSR, with row_ptr[height] nonzeros, as a
+ * sparse file */
+int sparse_file_write(const char *file_name, unsigned long int height, unsigned long int width,
+		const uint64_t *row_ptr, const uint32_t *columns, const float *values)
+{
+	struct sparse_file_header header;
+	unsigned long int offset = sizeof(header);
+	int fd, ret;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_FILE_MAGIC;
+	header.version = SPARSE_FILE_VERSION;
+	header.height = height;
+	header.width = width;
+	header.nnz = row_ptr[height];
+	header.checksum = sparse_checksum(&header, row_ptr, columns, values);
+
+	fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return 0;
+
+	ret = matrix_file_write_at(fd, &header, sizeof(header), 0)
+		&& matrix_file_write_at(fd, row_ptr, sizeof(uint64_t) * (height + 1), offset)
+		&& matrix_file_write_at(fd, columns, sizeof(uint32_t) * header.nnz, offset + sizeof(uint64_t) * (height + 1))
+		&& matrix_file_write_at(fd, values, sizeof(float) * header.nnz,
+				offset + sizeof(uint64_t) * (height + 1) + sizeof(uint32_t) * header.nnz);
+
+	ret &= close(fd) == 0;
+	return ret;
+}
+
+#define TUNING_LINE_LENGTH 512
+
+/* Splits a line of a tuning file into its CPU model and the rest of the
+ * entry, returning NULL for the header and the malformed lines */
+static
+char *tuning_line_entry(char *line)
+{
+	char *tab;
+
+	if (line[0] == '#')
+		return NULL;
+
+	tab = strchr(line, '\t');
+	if (!tab || !strchr(tab, '\n'))
+		return NULL;
+
+	*tab = '\0';
+	return tab + 1;
+}
+
+/* Reads the entries of the CPU model cpu, up to max_entries of them, and
+ * returns how many there were. A missing file has none */
+int tuning_file_read(const char *file_name, const char *cpu, struct tuning_entry *entries, unsigned int max_entries)
+{
+	char line[TUNING_LINE_LENGTH], *rest;
+	struct tuning_entry *entry;
+	unsigned int num_entries = 0;
+	FILE *file;
+
+	file = fopen(file_name, "r");
+	if (!file)
+		return 0;
+
+	if (!fgets(line, sizeof(line), file) || strcmp(line, TUNING_FILE_HEADER "\n") != 0)
+		goto out;
+
+	while (num_entries < max_entries && fgets(line, sizeof(line), file)) {
+		rest = tuning_line_entry(line);
+		if (!rest || strcmp(line, cpu) != 0)
+			continue;
+
+		entry = &entries[num_entries];
+		if (sscanf(rest, "%u %u %u %15s %u %lu %lu %lu %lf", &entry->m_class, &entry->n_class,
+					&entry->k_class, entry->isa, &entry->num_threads, &entry->mc, &entry->kc, &entry->tile_n,
+					&entry->gflops) == 9)
+			++num_entries;
+	}
+
+out:
+	fclose(file);
+	return (int)num_entries;
+}
+
+/* Replaces the entries of the CPU model cpu, keeping those of the others. The
+ * file is written under another name and renamed over the old one, so
+ * readers never see it half written */
+int tuning_file_write(const char *file_name, const char *cpu, const struct tuning_entry *entries,
+		unsigned int num_entries)
+{
+	char line[TUNING_LINE_LENGTH], tmp_name[4096], *rest;
+	FILE *old_file, *file;
+	unsigned int i;
+	int ret;
+
+	if (snprintf(tmp_name, sizeof(tmp_name), "%s.%ld", file_name, (long)getpid()) >= (int)sizeof(tmp_name))
+		return 0;
+
+	file = fopen(tmp_name, "w");
+	if (!file)
+		goto fail1;
+
+	fprintf(file, "%s\n", TUNING_FILE_HEADER);
+
+	old_file = fopen(file_name, "r");
+	if (old_file) {
+		while (fgets(line, sizeof(line), old_file)) {
+			rest = tuning_line_entry(line);
+			if (rest && strcmp(line, cpu) != 0)
+				fprintf(file, "%s\t%s", line, rest);
+		}
+		fclose(old_file);
+	}
+
+	for (i = 0; i < num_entries; ++i)
+		fprintf(file, "%s\t%u %u %u %s %u %lu %lu %lu %.2f\n", cpu, entries[i].m_class, entries[i].n_class,
+				entries[i].k_class, entries[i].isa, entries[i].num_threads, entries[i].mc, entries[i].kc,
+				entries[i].tile_n, entries[i].gflops);
+
+	ret = !ferror(file);
+	ret &= fclose(file) == 0;
+	if (!ret || rename(tmp_name, file_name) != 0)
+		goto fail2;
+
+	return 1;
+
+	/* ERROR CLEANUP */
+fail2:
+	unlink(tmp_name);
+fail1:
+	return 0;
+}
@@ -0,0 +1,132 @@
+#ifndef _MATRIX_FILE_H
+#define _MATRIX_FILE_H
+
+#include <stdint.h>
+
+/* Binary matrix file: a header, a table of checksums of the data blocks and
+ * the data itself, starting on a page boundary so it can be mapped directly.
+ * All fields are little endian, as are both the VH and the VE */
+
+#define MATRIX_FILE_MAGIC 0x4258544dU /* "MTXB" */
+#define MATRIX_FILE_VERSION 1
+#define MATRIX_FILE_ALIGN 4096UL
+#define MATRIX_FILE_BLOCK_SIZE (1UL << 20)
+
+/* Types of the elements. bf16 is the upper half of a float and f16 the IEEE
+ * 754 half precision */
+#define MATRIX_DTYPE_F32  0
+#define MATRIX_DTYPE_BF16 1
+#define MATRIX_DTYPE_F16  2
+
+/* Bytes of an element of a dtype */
+#define MATRIX_DTYPE_SIZE(dtype) ((dtype) == MATRIX_DTYPE_F32 ? 4UL : 2UL)
+
+#define MATRIX_LAYOUT_ROW_MAJOR 0
+#define MATRIX_LAYOUT_COL_MAJOR 1
+
+struct matrix_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t dtype;
+	uint32_t layout;
+	uint64_t height;
+	uint64_t width;
+	uint64_t stride;          /* elements from a row (column) to the next */
+	uint64_t data_offset;     /* multiple of MATRIX_FILE_ALIGN            */
+	uint64_t data_size;       /* bytes of data, padding included          */
+	uint64_t block_size;      /* bytes covered by each data checksum      */
+	uint64_t header_checksum; /* of the header, with this field zeroed,
+	                           * and of the checksums table               */
+};
+
+/* An open matrix file. For raw files, with no header, header is zeroed and
+ * checksums is NULL */
+struct matrix_file {
+	int fd;
+	struct matrix_file_header header;
+	uint64_t *checksums;
+};
+
+uint64_t matrix_file_checksum(const void *data, unsigned long int size);
+
+float matrix_half_to_float(uint16_t half, int dtype);
+uint16_t matrix_float_to_half(float value, int dtype);
+void matrix_dtype_convert(void *dst, int dst_dtype, const void *src, int src_dtype, unsigned long int length);
+
+int matrix_file_open(const char *file_name, struct matrix_file *file);
+void matrix_file_close(struct matrix_file *file);
+
+int matrix_file_shape(struct matrix_file *file, unsigned long int *width, unsigned long int *height);
+int matrix_file_is_dense(const struct matrix_file *file);
+unsigned long int matrix_file_num_blocks(const struct matrix_file *file);
+int matrix_file_verify(const struct matrix_file *file, const void *data);
+int matrix_file_read(const struct matrix_file *file, void *rows);
+
+/* Sizes taken from headers: *result = a * b or a + b, returning 0 instead if
+ * it overflows */
+int matrix_size_mul(unsigned long int a, unsigned long int b, unsigned long int *result);
+int matrix_size_add(unsigned long int a, unsigned long int b, unsigned long int *result);
+
+int matrix_file_read_at(int fd, void *buffer, unsigned long int size, unsigned long int offset);
+int matrix_file_write_at(int fd, const void *buffer, unsigned long int size, unsigned long int offset);
+
+int matrix_file_create(const char *file_name, unsigned long int height, unsigned long int width, int dtype,
+		struct matrix_file *file);
+int matrix_file_finish(struct matrix_file *file);
+int matrix_file_write(const char *file_name, const void *rows, unsigned long int height, unsigned long int width,
+		int dtype);
+
+/* Binary sparse file, holding a float matrix in CSR: a header, then the
+ * offsets of the rows in the other arrays (height + 1 uint64), the columns of
+ * the nonzeros (nnz uint32) and their values (nnz floats). The checksum covers
+ * the header, with the checksum zeroed, and the arrays */
+
+#define SPARSE_FILE_MAGIC 0x42525343U /* "CSRB" */
+#define SPARSE_FILE_VERSION 1
+
+/* Widest sparse matrix, as the vector kernels index the columns by 32-bit
+ * signed integers */
+#define SPARSE_MAX_WIDTH 0x7fffffffUL
+
+struct sparse_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t height;
+	uint64_t width;
+	uint64_t nnz;
+	uint64_t checksum;
+};
+
+struct sparse_file {
+	int fd;
+	struct sparse_file_header header;
+};
+
+int sparse_file_open(const char *file_name, struct sparse_file *file);
+void sparse_file_close(struct sparse_file *file);
+int sparse_file_read(const struct sparse_file *file, uint64_t *row_ptr, uint32_t *columns, float *values);
+int sparse_file_write(const char *file_name, unsigned long int height, unsigned long int width,
+		const uint64_t *row_ptr, const uint32_t *columns, const float *values);
+
+/* Tuning file, a text file of the kernels, thread counts and block sizes found
+ * fastest for the products of each shape class on each CPU model. Its first
+ * line is TUNING_FILE_HEADER and each of the others an entry,
+ * "cpu<TAB>m_class n_class k_class isa threads mc kc tile_n gflops" */
+
+#define TUNING_FILE_HEADER "# matrix_lib tuning 1"
+#define TUNING_CPU_LENGTH 128
+#define TUNING_ISA_LENGTH 16
+
+struct tuning_entry {
+	unsigned int m_class, n_class, k_class; /* dimensions as log2, rounded up */
+	char isa[TUNING_ISA_LENGTH];
+	unsigned int num_threads;
+	unsigned long int mc, kc, tile_n;
+	double gflops;
+};
+
+int tuning_file_read(const char *file_name, const char *cpu, struct tuning_entry *entries, unsigned int max_entries);
+int tuning_file_write(const char *file_name, const char *cpu, const struct tuning_entry *entries,
+		unsigned int num_entries);
+
+#endif /* #ifndef _MATRIX_FILE_H */
@@ -5,6 +5,7 @@
 #include <float.h>
 
 #include "arg_lib.h"
+#include "matrix_file.h"
 
 int main(int argc, char *argv[])
 {
@@ -14,11 +15,14 @@ int main(int argc, char *argv[])
 	unsigned int random_seed;
 	float const_num;
 	float *rows;
-	FILE *bf;
+	void *elements;
+	const char *dtype_name;
+	int dtype, dtype_arg;
 
 	if (argc < 5) {
 		fprintf(stderr,
-			"USAGE: %s [bin file name] [matrix height] [matrix width] [is random] [if not random: matrix float constant]\n",
+			"USAGE: %s [bin file name] [matrix height] [matrix width] [is random] [if not random: matrix float constant]"
+			" [dtype: f32, bf16 or f16, f32 if not given]\n",
 			argv[0]);
 		exit(EXIT_FAILURE);
 	}
@@ -39,6 +43,20 @@ int main(int argc, char *argv[])
 		srandom(random_seed);
 	}
 
+	/* The dtype follows the constant of non-random matrices */
+	dtype_arg = is_random ? 5 : 6;
+	dtype_name = argc > dtype_arg ? argv[dtype_arg] : "f32";
+	if (!strcmp(dtype_name, "f32")) {
+		dtype = MATRIX_DTYPE_F32;
+	} else if (!strcmp(dtype_name, "bf16")) {
+		dtype = MATRIX_DTYPE_BF16;
+	} else if (!strcmp(dtype_name, "f16")) {
+		dtype = MATRIX_DTYPE_F16;
+	} else {
+		fprintf(stderr, "ERRO: tipo \"%s\" desconhecido\n", dtype_name);
+		exit(EXIT_FAILURE);
+	}
+
 	rows = (float *)malloc(sizeof(float) * m_height * m_width);
 	if (!rows) {
 		fprintf(stderr, "ERRO: Não foi possível alocar memória\n");
@@ -57,13 +75,24 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	bf = fopen(bf_name, "wb");
-	if (!bf) {
+	/* Elements of 16-bit dtypes are rounded from the floats */
+	elements = rows;
+	if (dtype != MATRIX_DTYPE_F32) {
+		elements = malloc(MATRIX_DTYPE_SIZE(dtype) * m_height * m_width);
+		if (!elements) {
+			fprintf(stderr, "ERRO: Não foi possível alocar memória\n");
+			exit(EXIT_FAILURE);
+		}
+		matrix_dtype_convert(elements, dtype, rows, MATRIX_DTYPE_F32, m_height * m_width);
+	}
+
+	if (!matrix_file_write(bf_name, elements, m_height, m_width, dtype)) {
 		fprintf(stderr, "ERRO: Não foi possível criar o arquivo \"%s\"\n", bf_name);
 		exit(EXIT_FAILURE);
 	}
-	fwrite(rows, sizeof(float), m_height * m_width, bf);
-	fclose(bf);
+	if (elements != rows)
+		free(elements);
+	free(rows);
 
 	return 0;
 }
@@ -0,0 +1,31 @@
+#ifndef _MATRIX_HOST_H
+#define _MATRIX_HOST_H
+
+/* The unified library holds both backends: matrix_lib_vh.c, matrix_lib.c,
+ * thread_pool.c, matrix_kernels.c and matrix_file.c built with
+ * MATRIX_LIB_UNIFIED. It exports the API of matrix_lib.h, and the VE backend
+ * runs each operation it can dispatch either on the VE or through the entry
+ * points of the host backend below, which take the host rows of its matrices.
+ * The host backend has none of its own names, see matrix_lib_o.h */
+
+struct matrix_epilogue;
+
+/* Rows of a matrix or view as matrix_lib_o.h lays them out */
+struct host_rows {
+	unsigned long int height;
+	unsigned long int width;
+	void *rows;
+	int dtype;
+	unsigned long int stride;
+	int transposed;
+};
+
+/* matrix_matrix_gemm and scalar_matrix_mult of the host backend */
+int host_rows_gemm(float alpha, const struct host_rows *a, const struct host_rows *b, float beta,
+		const struct host_rows *c, int flags, const struct matrix_epilogue *epilogue);
+int host_rows_scale(float scalar_value, const struct host_rows *matrix);
+
+/* Number of threads of the host pool, set_number_threads of the host backend */
+void host_set_number_threads(int num_threads);
+
+#endif /* #ifndef _MATRIX_HOST_H */
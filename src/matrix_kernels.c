@@ -0,0 +1,952 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <immintrin.h>
+
+#include "matrix_file.h"
+#include "matrix_kernels.h"
+
+/* Kernels for each instruction set supported by the host backend. The vector
+ * versions are compiled for their own target, so the library itself builds and
+ * runs on any x86-64 CPU; matrix_kernels points to the best set this CPU
+ * supports, which can be lowered with the MATRIX_LIB_ISA environment variable
+ * ("generic", "avx2" or "avx512", below "avx512bf16") */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* GELU by its tanh approximation, 0.5 x (1 + tanh(u)) = x / (1 + exp(-2 u))
+ * for u = sqrt(2 / pi) (x + 0.044715 x^3), so -2 u = x (GELU_K0 + GELU_K1 x^2) */
+#define GELU_K0 -1.5957691216f
+#define GELU_K1 -0.0713548163f
+
+/* Polynomial of exp(r) for |r| <= ln(2) / 2 (Cephes expf), used by the vector
+ * exponentials, which scale it by 2^n for x = n ln(2) + r */
+#define EXP_LOG2E 1.44269504089f
+#define EXP_LN2_HI 0.693359375f
+#define EXP_LN2_LO -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+void gemm_epilogue_store(const struct gemm_epilogue *ep, float t, float *c, unsigned long int j)
+{
+	t *= ep->alpha;
+	if (ep->beta != 0.0f)
+		t += ep->beta * *c;
+	if (ep->bias)
+		t += ep->bias[j];
+
+	switch (ep->activation) {
+	case GEMM_ACT_RELU:
+		t = t > 0.0f ? t : 0.0f;
+		break;
+	case GEMM_ACT_CLAMP:
+		t = t < ep->clamp_min ? ep->clamp_min : t > ep->clamp_max ? ep->clamp_max : t;
+		break;
+	case GEMM_ACT_GELU:
+		t = t / (1.0f + expf(t * (GELU_K0 + GELU_K1 * t * t)));
+		break;
+	}
+
+	*c = t;
+}
+
+/* GENERIC */
+
+#define GENERIC_NR 8
+
+static
+void generic_scale(float *arr, unsigned long int length, float scalar)
+{
+	unsigned long int i;
+
+	for (i = 0; i < length; ++i)
+		arr[i] *= scalar;
+}
+
+static
+void generic_copy(float *dst, const float *src, unsigned long int length)
+{
+	memcpy(dst, src, sizeof(float) * length);
+}
+
+static
+void generic_zero(float *dst, unsigned long int length)
+{
+	memset(dst, 0, sizeof(float) * length);
+}
+
+static
+void generic_add(float *dst, const float *x, const float *y, float alpha, unsigned long int length)
+{
+	unsigned long int i;
+
+	for (i = 0; i < length; ++i)
+		dst[i] = x[i] + alpha * y[i];
+}
+
+static
+float generic_dot(const float *x, const float *y, unsigned long int length)
+{
+	unsigned long int i;
+	float sum = 0.0f;
+
+	for (i = 0; i < length; ++i)
+		sum += x[i] * y[i];
+
+	return sum;
+}
+
+static
+float generic_sparse_dot(const float *values, const unsigned int *columns, const float *x, unsigned long int length)
+{
+	unsigned long int i;
+	float sum = 0.0f;
+
+	for (i = 0; i < length; ++i)
+		sum += values[i] * x[columns[i]];
+
+	return sum;
+}
+
+static
+void generic_to_float(float *dst, const void *src, int dtype, unsigned long int length)
+{
+	matrix_dtype_convert(dst, MATRIX_DTYPE_F32, src, dtype, length);
+}
+
+static
+void generic_from_float(void *dst, const float *src, int dtype, unsigned long int length)
+{
+	matrix_dtype_convert(dst, dtype, src, MATRIX_DTYPE_F32, length);
+}
+
+static
+void generic_transpose(unsigned long int rows, unsigned long int cols, const float *a, unsigned long int lda,
+		float *b, unsigned long int ldb)
+{
+	unsigned long int i, j;
+
+	for (i = 0; i < rows; ++i) {
+		for (j = 0; j < cols; ++j)
+			b[j * ldb + i] = a[i * lda + j];
+	}
+}
+
+static
+void generic_pack_b(unsigned long int kc, unsigned long int nc, const float *b, unsigned long int ldb, float *pb)
+{
+	unsigned long int j, jr, p, nr;
+	const float *arr_b;
+
+	for (jr = 0; jr < nc; jr += GENERIC_NR) {
+		nr = MIN(GENERIC_NR, nc - jr);
+		arr_b = b + jr;
+		for (p = 0; p < kc; ++p, arr_b += ldb, pb += GENERIC_NR) {
+			for (j = 0; j < nr; ++j)
+				pb[j] = arr_b[j];
+			for (; j < GENERIC_NR; ++j)
+				pb[j] = 0.0f;
+		}
+	}
+}
+
+static
+void generic_gemm_micro(unsigned long int kc, const float *pa, const float *pb,
+		float *c, unsigned long int ldc, const struct gemm_epilogue *ep)
+{
+	unsigned long int i, j, p;
+	float tile[GEMM_MR][GENERIC_NR];
+
+	memset(tile, 0, sizeof(tile));
+	for (p = 0; p < kc; ++p, pa += GEMM_MR, pb += GENERIC_NR) {
+		for (i = 0; i < GEMM_MR; ++i) {
+			for (j = 0; j < GENERIC_NR; ++j)
+				tile[i][j] += pa[i] * pb[j];
+		}
+	}
+
+	for (i = 0; i < GEMM_MR; ++i, c += ldc) {
+		for (j = 0; j < GENERIC_NR; ++j)
+			gemm_epilogue_store(ep, tile[i][j], c + j, j);
+	}
+}
+
+static const struct matrix_kernels generic_kernels = {
+	"generic", GENERIC_NR,
+	generic_scale, generic_copy, generic_zero, generic_add, generic_dot, generic_sparse_dot,
+	generic_to_float, generic_from_float, generic_transpose,
+	generic_pack_b, generic_gemm_micro
+};
+
+/* AVX2 + FMA */
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+
+#define AVX2_NR 16
+
+/* Returns a mask selecting the first n (n < 8) lanes of a AVX register, used
+ * for the masked loads and stores of the tails of the arrays */
+static inline
+__m256i avx_tail_mask(unsigned long int n)
+{
+	return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+static
+void avx2_scale(float *arr, unsigned long int length, float scalar)
+{
+	unsigned long int i;
+	__m256 vec_scalar, vec_line;
+
+	vec_scalar = _mm256_set1_ps(scalar);
+	for (i = 0; i + 8 <= length; i += 8, arr += 8) {
+		vec_line = _mm256_loadu_ps(arr);
+		vec_line = _mm256_mul_ps(vec_line, vec_scalar);
+		_mm256_storeu_ps(arr, vec_line);
+	}
+
+	if (i != length) {
+		__m256i mask = avx_tail_mask(length - i);
+		vec_line = _mm256_maskload_ps(arr, mask);
+		vec_line = _mm256_mul_ps(vec_line, vec_scalar);
+		_mm256_maskstore_ps(arr, mask, vec_line);
+	}
+}
+
+static
+void avx2_copy(float *dst, const float *src, unsigned long int length)
+{
+	unsigned long int i;
+
+	for (i = 0; i + 8 <= length; i += 8, src += 8, dst += 8)
+		_mm256_storeu_ps(dst, _mm256_loadu_ps(src));
+
+	if (i != length) {
+		__m256i mask = avx_tail_mask(length - i);
+		_mm256_maskstore_ps(dst, mask, _mm256_maskload_ps(src, mask));
+	}
+}
+
+static
+void avx2_zero(float *dst, unsigned long int length)
+{
+	unsigned long int i;
+	__m256 vec_zero = _mm256_setzero_ps();
+
+	for (i = 0; i + 8 <= length; i += 8, dst += 8)
+		_mm256_storeu_ps(dst, vec_zero);
+
+	if (i != length)
+		_mm256_maskstore_ps(dst, avx_tail_mask(length - i), vec_zero);
+}
+
+static
+void avx2_add(float *dst, const float *x, const float *y, float alpha, unsigned long int length)
+{
+	unsigned long int i;
+	__m256 vec_alpha = _mm256_set1_ps(alpha);
+
+	for (i = 0; i + 8 <= length; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_fmadd_ps(vec_alpha, _mm256_loadu_ps(y + i), _mm256_loadu_ps(x + i)));
+
+	if (i != length) {
+		__m256i mask = avx_tail_mask(length - i);
+		_mm256_maskstore_ps(dst + i, mask, _mm256_fmadd_ps(vec_alpha, _mm256_maskload_ps(y + i, mask),
+				_mm256_maskload_ps(x + i, mask)));
+	}
+}
+
+/* Sum of the lanes of a AVX register */
+static inline
+float avx2_sum(__m256 value)
+{
+	__m128 sum;
+
+	sum = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+
+	return _mm_cvtss_f32(sum);
+}
+
+/* Two accumulators hide the latency of the FMAs */
+static
+float avx2_dot(const float *x, const float *y, unsigned long int length)
+{
+	unsigned long int i;
+	__m256 sum0, sum1;
+
+	sum0 = sum1 = _mm256_setzero_ps();
+	for (i = 0; i + 16 <= length; i += 16) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), sum1);
+	}
+
+	for (; i + 8 <= length; i += 8)
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+
+	if (i != length) {
+		__m256i mask = avx_tail_mask(length - i);
+		sum1 = _mm256_fmadd_ps(_mm256_maskload_ps(x + i, mask), _mm256_maskload_ps(y + i, mask), sum1);
+	}
+
+	return avx2_sum(_mm256_add_ps(sum0, sum1));
+}
+
+/* The columns are gathered 8 at a time, the tail element by element */
+static
+float avx2_sparse_dot(const float *values, const unsigned int *columns, const float *x, unsigned long int length)
+{
+	unsigned long int i;
+	__m256 sum = _mm256_setzero_ps();
+	float tail = 0.0f;
+
+	for (i = 0; i + 8 <= length; i += 8)
+		sum = _mm256_fmadd_ps(_mm256_loadu_ps(values + i),
+				_mm256_i32gather_ps(x, _mm256_loadu_si256((const __m256i *)(columns + i)), 4), sum);
+
+	for (; i < length; ++i)
+		tail += values[i] * x[columns[i]];
+
+	return avx2_sum(sum) + tail;
+}
+
+/* The tails of the conversions go element by element */
+static
+void avx2_to_float(float *dst, const void *src, int dtype, unsigned long int length)
+{
+	const uint16_t *arr_src = (const uint16_t *)src;
+	unsigned long int i;
+	__m128i half;
+
+	if (dtype == MATRIX_DTYPE_F32) {
+		avx2_copy(dst, (const float *)src, length);
+		return;
+	}
+
+	for (i = 0; i + 8 <= length; i += 8) {
+		half = _mm_loadu_si128((const __m128i *)(arr_src + i));
+		if (dtype == MATRIX_DTYPE_F16)
+			_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(half));
+		else
+			_mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(half), 16)));
+	}
+
+	matrix_dtype_convert(dst + i, MATRIX_DTYPE_F32, arr_src + i, dtype, length - i);
+}
+
+/* bf16 keeps the upper half of the float rounded to nearest even, or of a
+ * quiet NaN */
+static inline
+__m256i avx2_round_bf16(__m256 value)
+{
+	__m256i bits = _mm256_castps_si256(value);
+	__m256i rounded, quiet;
+
+	rounded = _mm256_add_epi32(bits, _mm256_add_epi32(_mm256_set1_epi32(0x7fff),
+			_mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1))));
+	quiet = _mm256_or_si256(bits, _mm256_set1_epi32(0x400000));
+
+	return _mm256_srli_epi32(_mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(rounded),
+			_mm256_castsi256_ps(quiet), _mm256_cmp_ps(value, value, _CMP_UNORD_Q))), 16);
+}
+
+static
+void avx2_from_float(void *dst, const float *src, int dtype, unsigned long int length)
+{
+	uint16_t *arr_dst = (uint16_t *)dst;
+	unsigned long int i;
+	__m256 value;
+	__m256i half;
+
+	if (dtype == MATRIX_DTYPE_F32) {
+		avx2_copy((float *)dst, src, length);
+		return;
+	}
+
+	for (i = 0; i + 8 <= length; i += 8) {
+		value = _mm256_loadu_ps(src + i);
+		if (dtype == MATRIX_DTYPE_F16) {
+			_mm_storeu_si128((__m128i *)(arr_dst + i), _mm256_cvtps_ph(value, _MM_FROUND_TO_NEAREST_INT));
+			continue;
+		}
+
+		/* The packing interleaves the 128 bits lanes */
+		half = avx2_round_bf16(value);
+		half = _mm256_permute4x64_epi64(_mm256_packus_epi32(half, half), 0x08);
+		_mm_storeu_si128((__m128i *)(arr_dst + i), _mm256_castsi256_si128(half));
+	}
+
+	matrix_dtype_convert(arr_dst + i, dtype, src + i, MATRIX_DTYPE_F32, length - i);
+}
+
+/* 8x8 blocks transposed in registers, the edges element by element */
+static
+void avx2_transpose(unsigned long int rows, unsigned long int cols, const float *a, unsigned long int lda,
+		float *b, unsigned long int ldb)
+{
+	unsigned long int i, j, k;
+	__m256 r[8], t[8];
+
+	for (i = 0; i + 8 <= rows; i += 8) {
+		for (j = 0; j + 8 <= cols; j += 8) {
+			#pragma GCC unroll 8
+			for (k = 0; k < 8; ++k)
+				r[k] = _mm256_loadu_ps(a + (i + k) * lda + j);
+
+			#pragma GCC unroll 4
+			for (k = 0; k < 8; k += 2) {
+				t[k] = _mm256_unpacklo_ps(r[k], r[k + 1]);
+				t[k + 1] = _mm256_unpackhi_ps(r[k], r[k + 1]);
+			}
+
+			#pragma GCC unroll 2
+			for (k = 0; k < 8; k += 4) {
+				r[k] = _mm256_shuffle_ps(t[k], t[k + 2], 0x44);
+				r[k + 1] = _mm256_shuffle_ps(t[k], t[k + 2], 0xee);
+				r[k + 2] = _mm256_shuffle_ps(t[k + 1], t[k + 3], 0x44);
+				r[k + 3] = _mm256_shuffle_ps(t[k + 1], t[k + 3], 0xee);
+			}
+
+			#pragma GCC unroll 4
+			for (k = 0; k < 4; ++k) {
+				_mm256_storeu_ps(b + (j + k) * ldb + i, _mm256_permute2f128_ps(r[k], r[k + 4], 0x20));
+				_mm256_storeu_ps(b + (j + k + 4) * ldb + i, _mm256_permute2f128_ps(r[k], r[k + 4], 0x31));
+			}
+		}
+
+		for (k = i; k < i + 8; ++k)
+			generic_transpose(1, cols - j, a + k * lda + j, lda, b + j * ldb + k, ldb);
+	}
+
+	generic_transpose(rows - i, cols, a + i * lda, lda, b + i, ldb);
+}
+
+static
+void avx2_pack_b(unsigned long int kc, unsigned long int nc, const float *b, unsigned long int ldb, float *pb)
+{
+	unsigned long int jr, p, nr;
+	__m256i mask_lo, mask_hi;
+	const float *arr_b;
+
+	for (jr = 0; jr < nc; jr += AVX2_NR) {
+		nr = MIN(AVX2_NR, nc - jr);
+		arr_b = b + jr;
+		if (nr == AVX2_NR) {
+			for (p = 0; p < kc; ++p, arr_b += ldb, pb += AVX2_NR) {
+				_mm256_store_ps(pb, _mm256_loadu_ps(arr_b));
+				_mm256_store_ps(pb + 8, _mm256_loadu_ps(arr_b + 8));
+			}
+		} else {
+			/* Last sliver: masked loads read the valid columns and zero the
+			 * rest without touching memory past the end of the row */
+			mask_lo = nr >= 8 ? _mm256_set1_epi32(-1) : avx_tail_mask(nr);
+			mask_hi = nr <= 8 ? _mm256_setzero_si256() : avx_tail_mask(nr - 8);
+			for (p = 0; p < kc; ++p, arr_b += ldb, pb += AVX2_NR) {
+				_mm256_store_ps(pb, _mm256_maskload_ps(arr_b, mask_lo));
+				_mm256_store_ps(pb + 8, _mm256_maskload_ps(arr_b + 8, mask_hi));
+			}
+		}
+	}
+}
+
+static inline
+__m256 avx2_exp(__m256 x)
+{
+	__m256 n, r, p;
+	__m256i e;
+
+	x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(88.0f));
+	n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = _mm256_fnmadd_ps(n, _mm256_set1_ps(EXP_LN2_HI), x);
+	r = _mm256_fnmadd_ps(n, _mm256_set1_ps(EXP_LN2_LO), r);
+
+	p = _mm256_fmadd_ps(_mm256_set1_ps(EXP_P0), r, _mm256_set1_ps(EXP_P1));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P2));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P3));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P4));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P5));
+	p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+	e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+/* 8 elements of a row of C, at column j of the tile, through the epilogue */
+static inline
+__m256 avx2_epilogue(__m256 t, const float *c, unsigned long int j, const struct gemm_epilogue *ep)
+{
+	__m256 x2;
+
+	if (ep->alpha != 1.0f)
+		t = _mm256_mul_ps(t, _mm256_set1_ps(ep->alpha));
+	if (ep->beta == 1.0f)
+		t = _mm256_add_ps(t, _mm256_loadu_ps(c));
+	else if (ep->beta != 0.0f)
+		t = _mm256_fmadd_ps(_mm256_set1_ps(ep->beta), _mm256_loadu_ps(c), t);
+	if (ep->bias)
+		t = _mm256_add_ps(t, _mm256_loadu_ps(ep->bias + j));
+
+	switch (ep->activation) {
+	case GEMM_ACT_RELU:
+		t = _mm256_max_ps(t, _mm256_setzero_ps());
+		break;
+	case GEMM_ACT_CLAMP:
+		t = _mm256_min_ps(_mm256_max_ps(t, _mm256_set1_ps(ep->clamp_min)), _mm256_set1_ps(ep->clamp_max));
+		break;
+	case GEMM_ACT_GELU:
+		x2 = _mm256_fmadd_ps(_mm256_mul_ps(t, t), _mm256_set1_ps(GELU_K1), _mm256_set1_ps(GELU_K0));
+		t = _mm256_div_ps(t, _mm256_add_ps(_mm256_set1_ps(1.0f), avx2_exp(_mm256_mul_ps(t, x2))));
+		break;
+	}
+
+	return t;
+}
+
+/* Stores a row of the tile */
+static inline
+void avx2_store_row(float *c, __m256 t0, __m256 t1, const struct gemm_epilogue *ep)
+{
+	_mm256_storeu_ps(c, avx2_epilogue(t0, c, 0, ep));
+	_mm256_storeu_ps(c + 8, avx2_epilogue(t1, c + 8, 8, ep));
+}
+
+/* 6x16 tile of C held in 12 ymm accumulators */
+static
+void avx2_gemm_micro(unsigned long int kc, const float *pa, const float *pb,
+		float *c, unsigned long int ldc, const struct gemm_epilogue *ep)
+{
+	unsigned long int p;
+	__m256 vec_a, vec_b0, vec_b1;
+	__m256 c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51;
+
+	c00 = c01 = c10 = c11 = c20 = c21 = _mm256_setzero_ps();
+	c30 = c31 = c40 = c41 = c50 = c51 = _mm256_setzero_ps();
+
+	for (p = 0; p < kc; ++p, pa += GEMM_MR, pb += AVX2_NR) {
+		vec_b0 = _mm256_load_ps(pb);
+		vec_b1 = _mm256_load_ps(pb + 8);
+
+		vec_a = _mm256_broadcast_ss(pa);
+		c00 = _mm256_fmadd_ps(vec_a, vec_b0, c00);
+		c01 = _mm256_fmadd_ps(vec_a, vec_b1, c01);
+		vec_a = _mm256_broadcast_ss(pa + 1);
+		c10 = _mm256_fmadd_ps(vec_a, vec_b0, c10);
+		c11 = _mm256_fmadd_ps(vec_a, vec_b1, c11);
+		vec_a = _mm256_broadcast_ss(pa + 2);
+		c20 = _mm256_fmadd_ps(vec_a, vec_b0, c20);
+		c21 = _mm256_fmadd_ps(vec_a, vec_b1, c21);
+		vec_a = _mm256_broadcast_ss(pa + 3);
+		c30 = _mm256_fmadd_ps(vec_a, vec_b0, c30);
+		c31 = _mm256_fmadd_ps(vec_a, vec_b1, c31);
+		vec_a = _mm256_broadcast_ss(pa + 4);
+		c40 = _mm256_fmadd_ps(vec_a, vec_b0, c40);
+		c41 = _mm256_fmadd_ps(vec_a, vec_b1, c41);
+		vec_a = _mm256_broadcast_ss(pa + 5);
+		c50 = _mm256_fmadd_ps(vec_a, vec_b0, c50);
+		c51 = _mm256_fmadd_ps(vec_a, vec_b1, c51);
+	}
+
+	avx2_store_row(c + 0 * ldc, c00, c01, ep);
+	avx2_store_row(c + 1 * ldc, c10, c11, ep);
+	avx2_store_row(c + 2 * ldc, c20, c21, ep);
+	avx2_store_row(c + 3 * ldc, c30, c31, ep);
+	avx2_store_row(c + 4 * ldc, c40, c41, ep);
+	avx2_store_row(c + 5 * ldc, c50, c51, ep);
+}
+
+#pragma GCC pop_options
+
+static const struct matrix_kernels avx2_kernels = {
+	"avx2", AVX2_NR,
+	avx2_scale, avx2_copy, avx2_zero, avx2_add, avx2_dot, avx2_sparse_dot,
+	avx2_to_float, avx2_from_float, avx2_transpose,
+	avx2_pack_b, avx2_gemm_micro
+};
+
+/* AVX-512 */
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+
+#define AVX512_NR 32
+
+/* Mask selecting the first n (n < 16) lanes of a AVX-512 register */
+#define AVX512_TAIL_MASK(n) ((__mmask16)((1U << (n)) - 1))
+
+static
+void avx512_scale(float *arr, unsigned long int length, float scalar)
+{
+	unsigned long int i;
+	__m512 vec_scalar, vec_line;
+
+	vec_scalar = _mm512_set1_ps(scalar);
+	for (i = 0; i + 16 <= length; i += 16, arr += 16) {
+		vec_line = _mm512_loadu_ps(arr);
+		vec_line = _mm512_mul_ps(vec_line, vec_scalar);
+		_mm512_storeu_ps(arr, vec_line);
+	}
+
+	if (i != length) {
+		__mmask16 mask = AVX512_TAIL_MASK(length - i);
+		vec_line = _mm512_maskz_loadu_ps(mask, arr);
+		vec_line = _mm512_mul_ps(vec_line, vec_scalar);
+		_mm512_mask_storeu_ps(arr, mask, vec_line);
+	}
+}
+
+static
+void avx512_copy(float *dst, const float *src, unsigned long int length)
+{
+	unsigned long int i;
+
+	for (i = 0; i + 16 <= length; i += 16, src += 16, dst += 16)
+		_mm512_storeu_ps(dst, _mm512_loadu_ps(src));
+
+	if (i != length) {
+		__mmask16 mask = AVX512_TAIL_MASK(length - i);
+		_mm512_mask_storeu_ps(dst, mask, _mm512_maskz_loadu_ps(mask, src));
+	}
+}
+
+static
+void avx512_zero(float *dst, unsigned long int length)
+{
+	unsigned long int i;
+	__m512 vec_zero = _mm512_setzero_ps();
+
+	for (i = 0; i + 16 <= length; i += 16, dst += 16)
+		_mm512_storeu_ps(dst, vec_zero);
+
+	if (i != length)
+		_mm512_mask_storeu_ps(dst, AVX512_TAIL_MASK(length - i), vec_zero);
+}
+
+static
+void avx512_add(float *dst, const float *x, const float *y, float alpha, unsigned long int length)
+{
+	unsigned long int i;
+	__m512 vec_alpha = _mm512_set1_ps(alpha);
+
+	for (i = 0; i + 16 <= length; i += 16)
+		_mm512_storeu_ps(dst + i, _mm512_fmadd_ps(vec_alpha, _mm512_loadu_ps(y + i), _mm512_loadu_ps(x + i)));
+
+	if (i != length) {
+		__mmask16 mask = AVX512_TAIL_MASK(length - i);
+		_mm512_mask_storeu_ps(dst + i, mask, _mm512_fmadd_ps(vec_alpha, _mm512_maskz_loadu_ps(mask, y + i),
+				_mm512_maskz_loadu_ps(mask, x + i)));
+	}
+}
+
+static
+float avx512_dot(const float *x, const float *y, unsigned long int length)
+{
+	unsigned long int i;
+	__m512 sum0, sum1;
+
+	sum0 = sum1 = _mm512_setzero_ps();
+	for (i = 0; i + 32 <= length; i += 32) {
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), sum0);
+		sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), sum1);
+	}
+
+	for (; i + 16 <= length; i += 16)
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), sum0);
+
+	if (i != length) {
+		__mmask16 mask = AVX512_TAIL_MASK(length - i);
+		sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i), sum1);
+	}
+
+	return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+static
+float avx512_sparse_dot(const float *values, const unsigned int *columns, const float *x, unsigned long int length)
+{
+	unsigned long int i;
+	__m512 sum = _mm512_setzero_ps();
+
+	for (i = 0; i + 16 <= length; i += 16)
+		sum = _mm512_fmadd_ps(_mm512_loadu_ps(values + i),
+				_mm512_i32gather_ps(_mm512_loadu_si512(columns + i), x, 4), sum);
+
+	if (i != length) {
+		__mmask16 mask = AVX512_TAIL_MASK(length - i);
+		sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, values + i),
+				_mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, _mm512_maskz_loadu_epi32(mask, columns + i), x, 4),
+				sum);
+	}
+
+	return _mm512_reduce_add_ps(sum);
+}
+
+static
+void avx512_to_float(float *dst, const void *src, int dtype, unsigned long int length)
+{
+	const uint16_t *arr_src = (const uint16_t *)src;
+	unsigned long int i;
+	__m256i half;
+
+	if (dtype == MATRIX_DTYPE_F32) {
+		avx512_copy(dst, (const float *)src, length);
+		return;
+	}
+
+	for (i = 0; i + 16 <= length; i += 16) {
+		half = _mm256_loadu_si256((const __m256i *)(arr_src + i));
+		if (dtype == MATRIX_DTYPE_F16)
+			_mm512_storeu_ps(dst + i, _mm512_cvtph_ps(half));
+		else
+			_mm512_storeu_ps(dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(half), 16)));
+	}
+
+	matrix_dtype_convert(dst + i, MATRIX_DTYPE_F32, arr_src + i, dtype, length - i);
+}
+
+static
+void avx512_from_float(void *dst, const float *src, int dtype, unsigned long int length)
+{
+	uint16_t *arr_dst = (uint16_t *)dst;
+	unsigned long int i;
+	__m512 value;
+	__m512i bits, rounded;
+
+	if (dtype == MATRIX_DTYPE_F32) {
+		avx512_copy((float *)dst, src, length);
+		return;
+	}
+
+	for (i = 0; i + 16 <= length; i += 16) {
+		value = _mm512_loadu_ps(src + i);
+		if (dtype == MATRIX_DTYPE_F16) {
+			_mm256_storeu_si256((__m256i *)(arr_dst + i),
+					_mm512_cvtps_ph(value, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+			continue;
+		}
+
+		/* Rounded to nearest even, NaNs made quiet */
+		bits = _mm512_castps_si512(value);
+		rounded = _mm512_add_epi32(bits, _mm512_add_epi32(_mm512_set1_epi32(0x7fff),
+				_mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1))));
+		rounded = _mm512_mask_or_epi32(rounded, _mm512_cmp_ps_mask(value, value, _CMP_UNORD_Q),
+				bits, _mm512_set1_epi32(0x400000));
+		_mm256_storeu_si256((__m256i *)(arr_dst + i), _mm512_cvtepi32_epi16(_mm512_srli_epi32(rounded, 16)));
+	}
+
+	matrix_dtype_convert(arr_dst + i, dtype, src + i, MATRIX_DTYPE_F32, length - i);
+}
+
+static
+void avx512_pack_b(unsigned long int kc, unsigned long int nc, const float *b, unsigned long int ldb, float *pb)
+{
+	unsigned long int jr, p, nr;
+	__mmask16 mask_lo, mask_hi;
+	const float *arr_b;
+
+	for (jr = 0; jr < nc; jr += AVX512_NR) {
+		nr = MIN(AVX512_NR, nc - jr);
+		arr_b = b + jr;
+		mask_lo = nr >= 16 ? (__mmask16)0xffff : AVX512_TAIL_MASK(nr);
+		mask_hi = nr <= 16 ? (__mmask16)0 : nr == AVX512_NR ? (__mmask16)0xffff : AVX512_TAIL_MASK(nr - 16);
+		for (p = 0; p < kc; ++p, arr_b += ldb, pb += AVX512_NR) {
+			_mm512_store_ps(pb, _mm512_maskz_loadu_ps(mask_lo, arr_b));
+			_mm512_store_ps(pb + 16, _mm512_maskz_loadu_ps(mask_hi, arr_b + 16));
+		}
+	}
+}
+
+static inline
+__m512 avx512_exp(__m512 x)
+{
+	__m512 n, r, p;
+
+	x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.0f)), _mm512_set1_ps(88.0f));
+	n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = _mm512_fnmadd_ps(n, _mm512_set1_ps(EXP_LN2_HI), x);
+	r = _mm512_fnmadd_ps(n, _mm512_set1_ps(EXP_LN2_LO), r);
+
+	p = _mm512_fmadd_ps(_mm512_set1_ps(EXP_P0), r, _mm512_set1_ps(EXP_P1));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P2));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P3));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P4));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P5));
+	p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+
+	return _mm512_scalef_ps(p, n);
+}
+
+/* 16 elements of a row of C, at column j of the tile, through the epilogue */
+static inline
+__m512 avx512_epilogue(__m512 t, const float *c, unsigned long int j, const struct gemm_epilogue *ep)
+{
+	__m512 x2;
+
+	if (ep->alpha != 1.0f)
+		t = _mm512_mul_ps(t, _mm512_set1_ps(ep->alpha));
+	if (ep->beta == 1.0f)
+		t = _mm512_add_ps(t, _mm512_loadu_ps(c));
+	else if (ep->beta != 0.0f)
+		t = _mm512_fmadd_ps(_mm512_set1_ps(ep->beta), _mm512_loadu_ps(c), t);
+	if (ep->bias)
+		t = _mm512_add_ps(t, _mm512_loadu_ps(ep->bias + j));
+
+	switch (ep->activation) {
+	case GEMM_ACT_RELU:
+		t = _mm512_max_ps(t, _mm512_setzero_ps());
+		break;
+	case GEMM_ACT_CLAMP:
+		t = _mm512_min_ps(_mm512_max_ps(t, _mm512_set1_ps(ep->clamp_min)), _mm512_set1_ps(ep->clamp_max));
+		break;
+	case GEMM_ACT_GELU:
+		x2 = _mm512_fmadd_ps(_mm512_mul_ps(t, t), _mm512_set1_ps(GELU_K1), _mm512_set1_ps(GELU_K0));
+		t = _mm512_div_ps(t, _mm512_add_ps(_mm512_set1_ps(1.0f), avx512_exp(_mm512_mul_ps(t, x2))));
+		break;
+	}
+
+	return t;
+}
+
+/* 6x32 tile of C held in 12 zmm accumulators */
+static
+void avx512_gemm_micro(unsigned long int kc, const float *pa, const float *pb,
+		float *c, unsigned long int ldc, const struct gemm_epilogue *ep)
+{
+	unsigned long int i, p;
+	__m512 vec_a, vec_b0, vec_b1;
+	__m512 c0[GEMM_MR], c1[GEMM_MR];
+
+	#pragma GCC unroll 6
+	for (i = 0; i < GEMM_MR; ++i)
+		c0[i] = c1[i] = _mm512_setzero_ps();
+
+	for (p = 0; p < kc; ++p, pa += GEMM_MR, pb += AVX512_NR) {
+		vec_b0 = _mm512_load_ps(pb);
+		vec_b1 = _mm512_load_ps(pb + 16);
+
+		#pragma GCC unroll 6
+		for (i = 0; i < GEMM_MR; ++i) {
+			vec_a = _mm512_set1_ps(pa[i]);
+			c0[i] = _mm512_fmadd_ps(vec_a, vec_b0, c0[i]);
+			c1[i] = _mm512_fmadd_ps(vec_a, vec_b1, c1[i]);
+		}
+	}
+
+	#pragma GCC unroll 6
+	for (i = 0; i < GEMM_MR; ++i) {
+		_mm512_storeu_ps(c + i * ldc, avx512_epilogue(c0[i], c + i * ldc, 0, ep));
+		_mm512_storeu_ps(c + i * ldc + 16, avx512_epilogue(c1[i], c + i * ldc + 16, 16, ep));
+	}
+}
+
+#pragma GCC pop_options
+
+static const struct matrix_kernels avx512_kernels = {
+	"avx512", AVX512_NR,
+	avx512_scale, avx512_copy, avx512_zero, avx512_add, avx512_dot, avx512_sparse_dot,
+	avx512_to_float, avx512_from_float, avx2_transpose,
+	avx512_pack_b, avx512_gemm_micro
+};
+
+/* AVX-512 BF16, rounding to bf16 in a single instruction, which flushes
+ * subnormal floats to zero */
+
+#pragma GCC push_options
+#pragma GCC target("avx512bf16,avx512f,avx2,fma")
+
+/* Rounds floats to bf16 in a single instruction, which flushes subnormal
+ * floats to zero where the other kernels round them */
+static
+void avx512bf16_from_float(void *dst, const float *src, int dtype, unsigned long int length)
+{
+	uint16_t *arr_dst = (uint16_t *)dst;
+	unsigned long int i;
+
+	if (dtype != MATRIX_DTYPE_BF16) {
+		avx512_from_float(dst, src, dtype, length);
+		return;
+	}
+
+	for (i = 0; i + 16 <= length; i += 16)
+		_mm256_storeu_si256((__m256i *)(arr_dst + i), (__m256i)_mm512_cvtneps_pbh(_mm512_loadu_ps(src + i)));
+
+	matrix_dtype_convert(arr_dst + i, dtype, src + i, MATRIX_DTYPE_F32, length - i);
+}
+
+#pragma GCC pop_options
+
+static const struct matrix_kernels avx512bf16_kernels = {
+	"avx512bf16", AVX512_NR,
+	avx512_scale, avx512_copy, avx512_zero, avx512_add, avx512_dot, avx512_sparse_dot,
+	avx512_to_float, avx512bf16_from_float, avx2_transpose,
+	avx512_pack_b, avx512_gemm_micro
+};
+
+const struct matrix_kernels *matrix_kernels = &generic_kernels;
+
+/* Every set, each one needing the features of the ones before it */
+static const struct matrix_kernels *const kernel_sets[] = {
+	&generic_kernels, &avx2_kernels, &avx512_kernels, &avx512bf16_kernels
+};
+
+const struct matrix_kernels *matrix_kernels_find(const char *isa)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(kernel_sets) / sizeof(kernel_sets[0]); ++i) {
+		if (!strcmp(kernel_sets[i]->isa, isa))
+			return kernel_sets[i];
+		if (kernel_sets[i] == matrix_kernels)
+			break;
+	}
+
+	return NULL;
+}
+
+const struct matrix_kernels *matrix_kernels_lower(const struct matrix_kernels *kernels)
+{
+	unsigned int i;
+
+	for (i = 1; i < sizeof(kernel_sets) / sizeof(kernel_sets[0]); ++i) {
+		if (kernel_sets[i] == kernels)
+			return kernel_sets[i - 1];
+	}
+
+	return NULL;
+}
+
+/* Picks the kernels when the library is loaded, before any operation can
+ * run */
+__attribute__((constructor))
+static
+void matrix_kernels_init(void)
+{
+	const char *isa = getenv("MATRIX_LIB_ISA");
+	int max_level = 3;
+
+	if (isa && !strcmp(isa, "generic"))
+		max_level = 0;
+	else if (isa && !strcmp(isa, "avx2"))
+		max_level = 1;
+	else if (isa && !strcmp(isa, "avx512"))
+		max_level = 2;
+
+	__builtin_cpu_init();
+
+	if (max_level >= 3 && __builtin_cpu_supports("avx512bf16") && __builtin_cpu_supports("avx512f")
+			&& __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		matrix_kernels = &avx512bf16_kernels;
+	else if (max_level >= 2 && __builtin_cpu_supports("avx512f")
+			&& __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		matrix_kernels = &avx512_kernels;
+	else if (max_level >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+			&& __builtin_cpu_supports("f16c"))
+		matrix_kernels = &avx2_kernels;
+	else
+		matrix_kernels = &generic_kernels;
+}
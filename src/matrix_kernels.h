@@ -0,0 +1,66 @@
+#ifndef _MATRIX_KERNELS_H
+#define _MATRIX_KERNELS_H
+
+/* Rows of the register tile of every GEMM microkernel, and the widest
+ * register tile among the instruction sets */
+#define GEMM_MR 6
+#define GEMM_MAX_NR 32
+
+/* Activations of the GEMM epilogue, as in matrix_lib_o.h */
+#define GEMM_ACT_NONE  0
+#define GEMM_ACT_RELU  1
+#define GEMM_ACT_CLAMP 2
+#define GEMM_ACT_GELU  3
+
+/* What the microkernel does with its tile T = A * B when storing it:
+ * C = alpha * T + beta * C, plus bias[j] on column j of the tile, then the
+ * activation. C is not read when beta is 0 */
+struct gemm_epilogue {
+	float alpha, beta;
+	const float *bias;
+	int activation;
+	float clamp_min, clamp_max;
+};
+
+/* Vector kernels of one instruction set. The best set the CPU supports is
+ * chosen once, when the library is loaded */
+struct matrix_kernels {
+	const char *isa;
+	unsigned long int gemm_nr; /* columns of the GEMM register tile */
+
+	void (*scale)(float *arr, unsigned long int length, float scalar);
+	void (*copy)(float *dst, const float *src, unsigned long int length);
+	void (*zero)(float *dst, unsigned long int length);
+	/* dst = x + alpha * y, dst may be x or y */
+	void (*add)(float *dst, const float *x, const float *y, float alpha, unsigned long int length);
+	float (*dot)(const float *x, const float *y, unsigned long int length);
+	/* Sum of values[i] * x[columns[i]], for columns below SPARSE_MAX_WIDTH */
+	float (*sparse_dot)(const float *values, const unsigned int *columns, const float *x, unsigned long int length);
+	/* Conversions between floats and the elements of a dtype of
+	 * matrix_file.h, rounding to nearest even */
+	void (*to_float)(float *dst, const void *src, int dtype, unsigned long int length);
+	void (*from_float)(void *dst, const float *src, int dtype, unsigned long int length);
+	/* B = A^T for a rows x cols block of A */
+	void (*transpose)(unsigned long int rows, unsigned long int cols, const float *a, unsigned long int lda,
+			float *b, unsigned long int ldb);
+
+	/* Packs a kc x nc panel of B into slivers of gemm_nr columns */
+	void (*pack_b)(unsigned long int kc, unsigned long int nc, const float *b, unsigned long int ldb, float *pb);
+	/* C = A * B for a GEMM_MR x gemm_nr tile of C and packed slivers,
+	 * stored through the epilogue */
+	void (*gemm_micro)(unsigned long int kc, const float *pa, const float *pb,
+			float *c, unsigned long int ldc, const struct gemm_epilogue *ep);
+};
+
+extern const struct matrix_kernels *matrix_kernels;
+
+/* Set of kernels named isa if it is matrix_kernels or one below it, which the
+ * CPU supports as well, NULL otherwise */
+const struct matrix_kernels *matrix_kernels_find(const char *isa);
+/* Set of kernels right below a set, NULL below the generic one */
+const struct matrix_kernels *matrix_kernels_lower(const struct matrix_kernels *kernels);
+
+/* Stores the element of column j of a tile with sum t through the epilogue */
+void gemm_epilogue_store(const struct gemm_epilogue *ep, float t, float *c, unsigned long int j);
+
+#endif /* #ifndef _MATRIX_KERNELS_H */
@@ -1,18 +1,72 @@
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <immintrin.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "matrix_lib_o.h"
+#include "matrix_file.h"
+#include "matrix_host.h"
+#include "matrix_kernels.h"
+#include "thread_pool.h"
 
-static unsigned int op_thread_num = 1;
+/* Read by the first operations of threads racing set_number_threads */
+static _Atomic unsigned int op_thread_num = 1;
+static int numa_policy = NUMA_POLICY_DEFAULT;
+static unsigned long int stream_budget = MATRIX_STREAM_BUDGET;
+static unsigned long int strassen_cutoff = MATRIX_STRASSEN_CUTOFF;
 
 static
-Matrix *build_matrix(unsigned long int height, unsigned long int width);
+Matrix *build_matrix(unsigned long int height, unsigned long int width, int dtype);
+static
+float matrix_value(Matrix *m, unsigned long int r, unsigned long int c);
+static
+void async_drain(void);
+static
+void async_stop(void);
+
+/* Address of the i-th of the elements of a dtype starting at p */
+#define DTYPE_AT(p, dtype, i) ((void *)((char *)(p) + MATRIX_DTYPE_SIZE(dtype) * (i)))
 
 /* Macro for accessing a matrix m at row r and column c */
-#define MATRIX_EL(m, r, c) ((float *)&m->rows[c + r * m->width])
+#define MATRIX_EL(m, r, c) DTYPE_AT((m)->rows, (m)->dtype, (m)->transposed ? (r) + (c) * (m)->stride : (c) + (r) * (m)->stride)
+
+/* Lines of a matrix in memory, its rows or, if transposed, its columns, and
+ * their length */
+#define MATRIX_LINES(m) ((m)->transposed ? (m)->width : (m)->height)
+#define MATRIX_LINE_LENGTH(m) ((m)->transposed ? (m)->height : (m)->width)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* Elements of a 16-bit matrix converted at a time through a line of floats on
+ * the stack */
+#define CONVERT_CHUNK 1024
+
+/* Splits height rows among num_threads threads, the first height % num_threads
+ * threads getting one extra row. Stores the first row and the number of rows
+ * of thread tid */
+static
+void thread_rows(unsigned long int height, unsigned int num_threads, unsigned int tid,
+		unsigned long int *first_row, unsigned long int *num_rows)
+{
+	unsigned long int rows = height / num_threads;
+	unsigned long int rest = height % num_threads;
+
+	if (tid < rest) {
+		*first_row = tid * (rows + 1);
+		*num_rows = rows + 1;
+	} else {
+		*first_row = tid * rows + rest;
+		*num_rows = rows;
+	}
+}
 
 void set_number_threads(int num_threads)
 {
@@ -20,342 +74,2990 @@ void set_number_threads(int num_threads)
 		return;
 
 	op_thread_num = (unsigned int)num_threads;
+
+	/* Resize a running pool to the new number of threads */
+	if (thread_pool_size() && thread_pool_size() != op_thread_num) {
+		async_drain();
+		thread_pool_resize(op_thread_num, 0);
+	}
+}
+
+void set_numa_policy(int policy)
+{
+	if (policy < NUMA_POLICY_DEFAULT || policy > NUMA_POLICY_BIND)
+		return;
+
+	numa_policy = policy;
+}
+
+/* Sets the memory, in bytes, the out-of-core multiplication may use for its
+ * buffers, the packing buffers of the workers aside */
+void set_memory_budget(unsigned long int bytes)
+{
+	if (bytes)
+		stream_budget = bytes;
+}
+
+/* Sets the size below which the Strassen-Winograd products stop splitting
+ * their operands */
+void set_strassen_cutoff(unsigned long int cutoff)
+{
+	if (cutoff >= 2)
+		strassen_cutoff = cutoff;
+}
+
+void set_thread_affinity(int enable)
+{
+	thread_pool_set_affinity(enable);
+
+	/* Restart a running pool so its workers are (un)pinned */
+	if (thread_pool_size()) {
+		async_drain();
+		thread_pool_resize(op_thread_num, 1);
+	}
+}
+
+int init_thread_pool(void)
+{
+	return thread_pool_create(op_thread_num);
+}
+
+int close_thread_pool(void)
+{
+	async_stop();
+	return thread_pool_destroy();
+}
+
+/* Starts the pool on the first operation if the user did not call
+ * init_thread_pool, once for concurrent first callers, and returns the number
+ * of threads available */
+static
+unsigned int pool_threads(void)
+{
+	return thread_pool_start(op_thread_num);
 }
 
 typedef struct scalar_matrix_mult_data {
-	float *lines;
-	unsigned long int length;
+	Matrix *matrix;
+	unsigned int num_threads;
 	float scalar;
 } _scalar_data;
 
+/* Scales length elements of a dtype, the 16-bit ones being converted to
+ * floats and rounded back a chunk at a time */
 static
-void *scalar_matrix_mult_thread(void *args)
+void scale_elements(void *arr, int dtype, unsigned long int length, float scalar)
 {
-	unsigned long int i;
-	__m256 vec_scalar, vec_line;
-	_scalar_data *data;
-	float *arr_lines;
-	unsigned long int length;
+	float line[CONVERT_CHUNK];
+	unsigned long int i, n;
 
-	if (!args)
-		pthread_exit((void *)-1);
+	if (dtype == MATRIX_DTYPE_F32) {
+		matrix_kernels->scale((float *)arr, length, scalar);
+		return;
+	}
 
-	data = (_scalar_data *)args;
-	arr_lines = data->lines;
-	length = data->length;
+	for (i = 0; i < length; i += n) {
+		n = MIN(CONVERT_CHUNK, length - i);
+		matrix_kernels->to_float(line, DTYPE_AT(arr, dtype, i), dtype, n);
+		matrix_kernels->scale(line, n, scalar);
+		matrix_kernels->from_float(DTYPE_AT(arr, dtype, i), line, dtype, n);
+	}
+}
 
-	vec_scalar = _mm256_set1_ps(data->scalar);
-	for (i = 0; i != length; i += 8, arr_lines += 8) {
-		vec_line = _mm256_load_ps(arr_lines);
-		vec_line = _mm256_mul_ps(vec_line, vec_scalar);
-		_mm256_store_ps(arr_lines, vec_line);
+static
+int scalar_matrix_mult_task(unsigned int tid, void *args)
+{
+	unsigned long int first_line, lines, length, i;
+	_scalar_data *data = (_scalar_data *)args;
+	Matrix *matrix = data->matrix;
+
+	/* Each thread processes its slab of lines as a single array, or line by
+	 * line if they are not contiguous */
+	length = MATRIX_LINE_LENGTH(matrix);
+	thread_rows(MATRIX_LINES(matrix), data->num_threads, tid, &first_line, &lines);
+	if (matrix->stride == length) {
+		scale_elements(DTYPE_AT(matrix->rows, matrix->dtype, first_line * length), matrix->dtype,
+				lines * length, data->scalar);
+	} else {
+		for (i = 0; i < lines; ++i)
+			scale_elements(DTYPE_AT(matrix->rows, matrix->dtype, (first_line + i) * matrix->stride),
+					matrix->dtype, length, data->scalar);
 	}
 
-	pthread_exit(0);
+	return 1;
 }
 
 int scalar_matrix_mult(float scalar_value, Matrix *matrix)
 {
-	pthread_t *threads;
-	pthread_attr_t p_attr;
-	_scalar_data *threads_data;
-	unsigned long int t, length;
-	float *arr_m_rows;
-	void *status;
-	int ret;
+	_scalar_data data;
 
 	/* Check if matrix exists and has a valid number of valid rows */
 	if (!matrix || !matrix->rows || !matrix->height || !matrix->width)
-		goto fail1;
+		return 0;
 
-	/* Check if matrix has a number of lines divisable by the number of threads
-	 * and a number of columns divisable by 8, size of AVX operations */
-	if ((matrix->height % op_thread_num != 0) || (matrix->width % 8 != 0))
-		goto fail1;
+	/* Check if the rows can be written */
+	if (matrix->map_flags & MATRIX_MAP_READONLY)
+		return 0;
 
-	/* Allocate memory for threads and the structs used for arguments */
-	threads = (pthread_t *)calloc(op_thread_num, sizeof(pthread_t));
-	if (!threads)
-		goto fail1;
+	/* Never use more threads than there are lines */
+	data.num_threads = (unsigned int)MIN(pool_threads(), MATRIX_LINES(matrix));
+	if (!data.num_threads)
+		return 0;
 
-	threads_data = (_scalar_data *)calloc(op_thread_num, sizeof(_scalar_data));
-	if (!threads_data)
-		goto fail2;
+	data.matrix = matrix;
+	data.scalar = scalar_value;
+
+	return thread_pool_run(data.num_threads, scalar_matrix_mult_task, &data, 0);
+}
+
+/* Cache blocking parameters of the packed GEMM path. The microkernel keeps a
+ * GEMM_MR x gemm_nr tile of C in registers (12 vector accumulators), a
+ * GEMM_KC x gemm_nr sliver of packed B is sized for L1, a GEMM_MC x GEMM_KC
+ * block of packed A for L2 and a GEMM_KC x GEMM_NC panel of packed B for L3.
+ * GEMM_MC must be a multiple of GEMM_MR and GEMM_NC of GEMM_MAX_NR */
+#define GEMM_KC 256
+#define GEMM_MC 72
+#define GEMM_NC 2048
+
+/* Largest blocks of A the tuner may pick, which size the lines on the stack */
+#define GEMM_MAX_KC 512
+#define GEMM_MAX_MC 144
+
+/* Width of the tiles of C scheduled on the workers, and the number of tiles per
+ * worker below which the tiles are made shorter */
+#define GEMM_TILE_N 512
+#define GEMM_TILES_PER_THREAD 4
+
+/* Kernels, number of workers and blocking of a product, the defaults above
+ * unless matrix_tune found better ones for its shape. num_threads is 0 for
+ * the whole pool, mc is at most GEMM_MAX_MC, kc at most GEMM_MAX_KC and
+ * tile_n at most GEMM_NC */
+struct gemm_blocking {
+	const struct matrix_kernels *kernels;
+	unsigned int num_threads;
+	unsigned long int mc, kc, tile_n;
+};
+
+/* Epilogues of the plain products, storing or accumulating the tiles */
+static const struct gemm_epilogue gemm_store = {1.0f, 0.0f, NULL, GEMM_ACT_NONE, 0.0f, 0.0f};
+static const struct gemm_epilogue gemm_accumulate = {1.0f, 1.0f, NULL, GEMM_ACT_NONE, 0.0f, 0.0f};
+
+/* Packs a mc x kc block of A into slivers of GEMM_MR rows stored column by
+ * column, padding the last sliver with zeros. 16-bit rows are converted to
+ * floats as they are packed */
+static
+void pack_block_a(unsigned long int mc, unsigned long int kc, const void *a, unsigned long int lda, int dtype,
+		float *pa, const struct matrix_kernels *kernels)
+{
+	float line[GEMM_MAX_KC];
+	const float *arr_a = (const float *)a;
+	unsigned long int i, ir, p, mr;
+
+	if (dtype != MATRIX_DTYPE_F32) {
+		for (ir = 0; ir < mc; ir += GEMM_MR, pa += GEMM_MR * kc) {
+			mr = MIN(GEMM_MR, mc - ir);
+			for (i = 0; i < GEMM_MR; ++i) {
+				if (i < mr)
+					kernels->to_float(line, DTYPE_AT(a, dtype, (ir + i) * lda), dtype, kc);
+				for (p = 0; p < kc; ++p)
+					pa[p * GEMM_MR + i] = i < mr ? line[p] : 0.0f;
+			}
+		}
+		return;
+	}
+
+	for (ir = 0; ir < mc; ir += GEMM_MR) {
+		mr = MIN(GEMM_MR, mc - ir);
+		for (p = 0; p < kc; ++p, pa += GEMM_MR) {
+			for (i = 0; i < mr; ++i)
+				pa[i] = arr_a[(ir + i) * lda + p];
+			for (; i < GEMM_MR; ++i)
+				pa[i] = 0.0f;
+		}
+	}
+}
+
+/* Same for a block of A stored transposed, as a kc x mc block */
+static
+void pack_block_at(unsigned long int mc, unsigned long int kc, const void *a, unsigned long int lda, int dtype,
+		float *pa, const struct matrix_kernels *kernels)
+{
+	float line[GEMM_MAX_MC];
+	const float *arr_a = (const float *)a;
+	unsigned long int i, ir, p, mr;
+
+	if (dtype != MATRIX_DTYPE_F32) {
+		for (p = 0; p < kc; ++p) {
+			kernels->to_float(line, DTYPE_AT(a, dtype, p * lda), dtype, mc);
+			for (ir = 0; ir < mc; ir += GEMM_MR) {
+				mr = MIN(GEMM_MR, mc - ir);
+				for (i = 0; i < GEMM_MR; ++i)
+					pa[ir * kc + p * GEMM_MR + i] = i < mr ? line[ir + i] : 0.0f;
+			}
+		}
+		return;
+	}
 
-	pthread_attr_init(&p_attr);
-	pthread_attr_setdetachstate(&p_attr, PTHREAD_CREATE_JOINABLE);
+	for (ir = 0; ir < mc; ir += GEMM_MR) {
+		mr = MIN(GEMM_MR, mc - ir);
+		for (p = 0; p < kc; ++p, pa += GEMM_MR) {
+			for (i = 0; i < mr; ++i)
+				pa[i] = arr_a[p * lda + ir + i];
+			for (; i < GEMM_MR; ++i)
+				pa[i] = 0.0f;
+		}
+	}
+}
 
-	/* Calculate the number of numbers each thread will process */
-	length = matrix->height / op_thread_num * matrix->width;
+/* Packs a kc x nc panel of B into the slivers of gemm_nr columns the pack_b
+ * kernels make, converting 16-bit rows to floats first */
+static
+void pack_block_b(unsigned long int kc, unsigned long int nc, const void *b, unsigned long int ldb, int dtype,
+		float *pb, const struct matrix_kernels *kernels)
+{
+	float line[GEMM_NC];
+	unsigned long int j, jr, p, nr;
+	unsigned long int gemm_nr = kernels->gemm_nr;
 
-	/* Initialise threads with the proper arguments */
-	arr_m_rows = matrix->rows;
-	for (t = 0; t != op_thread_num; ++t, arr_m_rows += length) {
-		threads_data[t].length = length;
-		threads_data[t].lines = arr_m_rows;
-		threads_data[t].scalar = scalar_value;
-		ret = pthread_create(&threads[t], &p_attr, scalar_matrix_mult_thread, (void *)&threads_data[t]);
-		if (ret)
-			goto fail4;
+	if (dtype == MATRIX_DTYPE_F32) {
+		kernels->pack_b(kc, nc, (const float *)b, ldb, pb);
+		return;
 	}
 
-	/* Wait for threads to finish while checking if they terminated ok */
-	for (t = 0; t != op_thread_num; ++t) {
-		ret = pthread_join(threads[t], &status);
-		if (ret || (long)(status))
-			goto fail4;
+	for (p = 0; p < kc; ++p) {
+		kernels->to_float(line, DTYPE_AT(b, dtype, p * ldb), dtype, nc);
+		for (jr = 0; jr < nc; jr += gemm_nr) {
+			nr = MIN(gemm_nr, nc - jr);
+			memcpy(pb + jr * kc + p * gemm_nr, line + jr, sizeof(float) * nr);
+			for (j = nr; j < gemm_nr; ++j)
+				pb[jr * kc + p * gemm_nr + j] = 0.0f;
+		}
 	}
+}
 
-	pthread_attr_destroy(&p_attr);
-	free(threads_data);
-	free(threads);
+/* Same for a panel of B stored transposed, as a nc x kc panel */
+static
+void pack_block_bt(unsigned long int kc, unsigned long int nc, const void *b, unsigned long int ldb, int dtype,
+		float *pb, const struct matrix_kernels *kernels)
+{
+	float line[GEMM_MAX_KC];
+	const float *row;
+	unsigned long int j, jr, p, nr;
+	unsigned long int gemm_nr = kernels->gemm_nr;
+
+	for (jr = 0; jr < nc; jr += gemm_nr, pb += kc * gemm_nr) {
+		nr = MIN(gemm_nr, nc - jr);
+		for (j = 0; j < nr; ++j) {
+			row = (const float *)DTYPE_AT(b, dtype, (jr + j) * ldb);
+			if (dtype != MATRIX_DTYPE_F32) {
+				kernels->to_float(line, row, dtype, kc);
+				row = line;
+			}
+			for (p = 0; p < kc; ++p)
+				pb[p * gemm_nr + j] = row[p];
+		}
+		for (; j < gemm_nr; ++j) {
+			for (p = 0; p < kc; ++p)
+				pb[p * gemm_nr + j] = 0.0f;
+		}
+	}
+}
 
-	return 1;
+/* Multiplies a packed mc x kc block of A by a packed kc x nc panel of B into
+ * C through the epilogue, its bias starting at the first column of the panel.
+ * Tiles on the bottom and right edges are computed into a scratch tile and
+ * only their valid part is written back */
+static
+void gemm_macro_kernel(unsigned long int mc, unsigned long int nc, unsigned long int kc,
+		const float *pa, const float *pb, float *c, unsigned long int ldc,
+		const struct gemm_epilogue *ep, const struct matrix_kernels *kernels)
+{
+	unsigned long int i, j, ir, jr, mr, nr;
+	unsigned long int gemm_nr = kernels->gemm_nr;
+	float tile[GEMM_MR * GEMM_MAX_NR] __attribute__((aligned(64)));
+	struct gemm_epilogue tile_ep = *ep;
+
+	for (jr = 0; jr < nc; jr += gemm_nr) {
+		nr = MIN(gemm_nr, nc - jr);
+		tile_ep.bias = ep->bias ? ep->bias + jr : NULL;
+		for (ir = 0; ir < mc; ir += GEMM_MR) {
+			mr = MIN(GEMM_MR, mc - ir);
+			if (mr == GEMM_MR && nr == gemm_nr) {
+				kernels->gemm_micro(kc, pa + ir * kc, pb + jr * kc, c + ir * ldc + jr, ldc, &tile_ep);
+				continue;
+			}
 
-	/* ERROR CLEANUP */
-fail4:
-	for (t = 0; t != op_thread_num; ++t) {
-		if (threads[t])
-			pthread_join(threads[t], &status);
+			kernels->gemm_micro(kc, pa + ir * kc, pb + jr * kc, tile, gemm_nr, &gemm_store);
+			for (i = 0; i < mr; ++i) {
+				for (j = 0; j < nr; ++j)
+					gemm_epilogue_store(&tile_ep, tile[i * gemm_nr + j], &c[(ir + i) * ldc + jr + j], j);
+			}
+		}
+	}
+}
+
+/* C = alpha * op(A) * op(B) + beta * C through the epilogue, for a m x k
+ * matrix op(A) and a k x n matrix op(B), op transposing the operands set in
+ * trans (MATRIX_TRANS_*). All of them are stored row major with leading
+ * dimensions lda, ldb and ldc, A and B with elements of dtype_a and dtype_b.
+ * pa and pb are the packing buffers, of mc * kc and kc * GEMM_NC floats for
+ * the blocks of the blocking */
+static
+void gemm_blocked(unsigned long int m, unsigned long int n, unsigned long int k,
+		const void *a, unsigned long int lda, int dtype_a,
+		const void *b, unsigned long int ldb, int dtype_b,
+		float *c, unsigned long int ldc,
+		int trans, const struct gemm_epilogue *ep, const struct gemm_blocking *blocking, float *pa, float *pb)
+{
+	const struct matrix_kernels *kernels = blocking->kernels;
+	unsigned long int ic, jc, pc, mc, nc, kc;
+	struct gemm_epilogue pass = *ep;
+
+	for (jc = 0; jc < n; jc += GEMM_NC) {
+		nc = MIN(GEMM_NC, n - jc);
+		for (pc = 0; pc < k; pc += blocking->kc) {
+			kc = MIN(blocking->kc, k - pc);
+
+			/* alpha scales every pass over the depth, beta only the first
+			 * one, and the bias and the activation go with the last one */
+			pass.beta = pc ? 1.0f : ep->beta;
+			pass.bias = ep->bias && pc + kc == k ? ep->bias + jc : NULL;
+			pass.activation = pc + kc == k ? ep->activation : GEMM_ACT_NONE;
+
+			if (trans & MATRIX_TRANS_B)
+				pack_block_bt(kc, nc, DTYPE_AT(b, dtype_b, jc * ldb + pc), ldb, dtype_b, pb, kernels);
+			else
+				pack_block_b(kc, nc, DTYPE_AT(b, dtype_b, pc * ldb + jc), ldb, dtype_b, pb, kernels);
+			for (ic = 0; ic < m; ic += blocking->mc) {
+				mc = MIN(blocking->mc, m - ic);
+				if (trans & MATRIX_TRANS_A)
+					pack_block_at(mc, kc, DTYPE_AT(a, dtype_a, pc * lda + ic), lda, dtype_a, pa, kernels);
+				else
+					pack_block_a(mc, kc, DTYPE_AT(a, dtype_a, ic * lda + pc), lda, dtype_a, pa, kernels);
+				gemm_macro_kernel(mc, nc, kc, pa, pb, c + ic * ldc + jc, ldc, &pass, kernels);
+			}
+		}
 	}
-	pthread_attr_destroy(&p_attr);
-	free(threads_data);
-fail2:
-	free(threads);
-fail1:
-	return 0;
 }
 
 typedef struct matrix_matrix_mult_data {
-	float *arr_rows_a, *arr_rows_c;
-	Matrix *matrixA, *matrixB, *matrixC;
-	unsigned long int lines;
+	const void *a, *b;
+	void *c;
+	unsigned long int m, n, k, lda, ldb, ldc;
+	int dtype_a, dtype_b, dtype_c;
+	int trans;
+	const struct gemm_epilogue *ep;
+	const struct gemm_blocking *blocking;
+	unsigned long int tile_m, tile_n, tiles_n;
 } _matrix_matrix_data;
 
-void *matrix_matrix_mult_thread(void *args)
+/* Computes the tile-th tile of C, tiles being numbered row by row. A 16-bit
+ * C is computed into a float tile and rounded once at the end */
+static
+int matrix_matrix_mult_tile(unsigned int tid, unsigned long int tile, void *args)
 {
-	unsigned long int i, j, k;
-	__m256 vec_rows_b, vec_rows_c, vec_maij;
-	float *arr_rows_b, *arr_ik_c;
+	unsigned long int ic, jc, mc, nc, i, size_a;
+	float *pack_a, *pack_b, *tile_c;
+	struct gemm_epilogue ep;
 
 	_matrix_matrix_data *data = (_matrix_matrix_data *)args;
-	Matrix *matrixA = data->matrixA;
-	Matrix *matrixB = data->matrixB;
-	Matrix *matrixC = data->matrixC;
-	float *arr_rows_a = data->arr_rows_a;
-	float *arr_rows_c = data->arr_rows_c;
-	unsigned long int lines = data->lines;
-
-	/* i = linhas da matriz A
-	 * j = colunas da matriz B
-	 * k = colunas da matriz C (igual ao num de colunas de B)
-	 */
-	for (i = 0; i < lines; ++i, arr_rows_a += matrixA->width, arr_rows_c += matrixC->width) {
-		arr_rows_b = matrixB->rows; /* primeira linha de B */
-		for (j = 0; j < matrixA->width; ++j) {
-			vec_maij = _mm256_set1_ps(arr_rows_a[j]);
-			arr_ik_c = arr_rows_c;
-			for (k = 0; k < matrixB->width; k += 8, arr_rows_b += 8, arr_ik_c += 8) {
-				vec_rows_b = _mm256_load_ps(arr_rows_b);
-				vec_rows_c = _mm256_load_ps(arr_ik_c);
-
-				if (j == 0)
-					vec_rows_c = _mm256_mul_ps(vec_maij, vec_rows_b);
-				else
-					vec_rows_c = _mm256_fmadd_ps(vec_maij, vec_rows_b, vec_rows_c);
+	const struct gemm_blocking *blocking = data->blocking;
+
+	/* The packing buffers live in the scratch memory of the worker, so they
+	 * are only allocated on its first multiplication. The buffer of B starts
+	 * on 64 bytes, as the microkernels load it aligned */
+	size_a = (blocking->mc * blocking->kc + 15) / 16 * 16;
+	pack_a = (float *)thread_pool_scratch(tid, sizeof(float) * (size_a + blocking->kc * GEMM_NC
+				+ (data->dtype_c != MATRIX_DTYPE_F32 ? blocking->mc * blocking->tile_n : 0)));
+	if (!pack_a)
+		return 0;
+	pack_b = pack_a + size_a;
+
+	ic = tile / data->tiles_n * data->tile_m;
+	jc = tile % data->tiles_n * data->tile_n;
+	mc = MIN(data->tile_m, data->m - ic);
+	nc = MIN(data->tile_n, data->n - jc);
+
+	ep = *data->ep;
+	ep.bias = ep.bias ? ep.bias + jc : NULL;
+
+	if (data->dtype_c == MATRIX_DTYPE_F32) {
+		gemm_blocked(mc, nc, data->k,
+				DTYPE_AT(data->a, data->dtype_a, data->trans & MATRIX_TRANS_A ? ic : ic * data->lda),
+				data->lda, data->dtype_a,
+				DTYPE_AT(data->b, data->dtype_b, data->trans & MATRIX_TRANS_B ? jc * data->ldb : jc),
+				data->ldb, data->dtype_b,
+				(float *)data->c + ic * data->ldc + jc, data->ldc,
+				data->trans, &ep, blocking, pack_a, pack_b);
+		return 1;
+	}
 
-				_mm256_store_ps(arr_ik_c, vec_rows_c);
-			}
-		}
+	tile_c = pack_b + blocking->kc * GEMM_NC;
+	if (ep.beta != 0.0f) {
+		for (i = 0; i < mc; ++i)
+			blocking->kernels->to_float(tile_c + i * nc, DTYPE_AT(data->c, data->dtype_c, (ic + i) * data->ldc + jc),
+					data->dtype_c, nc);
 	}
 
-	pthread_exit(0);
+	gemm_blocked(mc, nc, data->k,
+			DTYPE_AT(data->a, data->dtype_a, data->trans & MATRIX_TRANS_A ? ic : ic * data->lda),
+			data->lda, data->dtype_a,
+			DTYPE_AT(data->b, data->dtype_b, data->trans & MATRIX_TRANS_B ? jc * data->ldb : jc),
+			data->ldb, data->dtype_b,
+			tile_c, nc, data->trans, &ep, blocking, pack_a, pack_b);
+
+	for (i = 0; i < mc; ++i)
+		blocking->kernels->from_float(DTYPE_AT(data->c, data->dtype_c, (ic + i) * data->ldc + jc), tile_c + i * nc,
+				data->dtype_c, nc);
+
+	return 1;
 }
 
-int matrix_matrix_mult(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC)
+/* Blocking of the products nothing was tuned for */
+static
+void gemm_default_blocking(struct gemm_blocking *blocking)
 {
-	pthread_t *threads;
-	pthread_attr_t p_attr;
-	_matrix_matrix_data *threads_data;
-	unsigned long int t, lines;
-	float *arr_rows_a;
-	float *arr_rows_c;
-	void *status;
-	int ret;
+	blocking->kernels = matrix_kernels;
+	blocking->num_threads = 0;
+	blocking->mc = GEMM_MC;
+	blocking->kc = GEMM_KC;
+	blocking->tile_n = GEMM_TILE_N;
+}
 
-	/* Check if matrices are valid */
-	if (!matrixA || !matrixB || !matrixC)
-		goto fail1;
+/* Splits the product over the pool workers, or as many of them as the
+ * blocking asks for (the default one if NULL). C is split in tiles of
+ * mc x tile_n, made shorter while there are too few of them for the workers
+ * to balance the load by stealing */
+static
+int gemm_parallel(unsigned long int m, unsigned long int n, unsigned long int k,
+		const void *a, unsigned long int lda, int dtype_a,
+		const void *b, unsigned long int ldb, int dtype_b,
+		void *c, unsigned long int ldc, int dtype_c,
+		int trans, const struct gemm_epilogue *ep, const struct gemm_blocking *blocking)
+{
+	_matrix_matrix_data data;
+	struct gemm_blocking defaults;
+	unsigned long int tile_m, tiles_n, num_tiles;
+	unsigned int num_threads;
+
+	if (!blocking) {
+		gemm_default_blocking(&defaults);
+		blocking = &defaults;
+	}
 
-	/* Check if matrices have valid array of rows */
-	if (!matrixA->rows || !matrixB->rows || !matrixC->rows)
-		goto fail1;
+	num_threads = pool_threads();
+	if (!num_threads)
+		return 0;
+	if (blocking->num_threads)
+		num_threads = MIN(num_threads, blocking->num_threads);
+
+	tile_m = blocking->mc;
+	tiles_n = (n + blocking->tile_n - 1) / blocking->tile_n;
+	while (tile_m > GEMM_MR && (m + tile_m - 1) / tile_m * tiles_n < GEMM_TILES_PER_THREAD * num_threads)
+		tile_m = (tile_m / 2 + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+	num_tiles = (m + tile_m - 1) / tile_m * tiles_n;
+
+	data.a = a;
+	data.b = b;
+	data.c = c;
+	data.m = m;
+	data.n = n;
+	data.k = k;
+	data.lda = lda;
+	data.ldb = ldb;
+	data.ldc = ldc;
+	data.dtype_a = dtype_a;
+	data.dtype_b = dtype_b;
+	data.dtype_c = dtype_c;
+	data.trans = trans;
+	data.ep = ep;
+	data.blocking = blocking;
+	data.tile_m = tile_m;
+	data.tile_n = blocking->tile_n;
+	data.tiles_n = tiles_n;
+
+	return thread_pool_run_items((unsigned int)MIN(num_threads, num_tiles), num_tiles, matrix_matrix_mult_tile, &data);
+}
 
-	/* Check if dimensions of matrices match according to multiplication rules */
-	if (matrixC->height != matrixA->height || matrixC->width != matrixB->width
-			|| matrixA->width != matrixB->height) {
-		goto fail1;
-	}
+/* Tuning of the plain products. The entries of the CPU model the library runs
+ * on are read from the tuning file on the first product and kept in memory,
+ * under tuning_lock as the asynchronous thread multiplies too */
 
-	/* Check if the final height is divisible by the number of threads
-	 * and if the final width is divisibel by 8, size of AVX operations */
-	if ((matrixA->height % op_thread_num != 0) || (matrixB->width % 8 != 0))
-		goto fail1;
+#define TUNING_MAX_ENTRIES 256
+#define TUNING_FILE_NAME ".matrix_lib_tuning"
+#define TUNING_RUNS 3
 
-	threads = (pthread_t *)calloc(op_thread_num, sizeof(pthread_t));
-	if (!threads)
-		goto fail1;
+static pthread_mutex_t tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tuning_entry tuning_entries[TUNING_MAX_ENTRIES];
+static unsigned int tuning_num_entries = 0;
+static int tuning_loaded = 0;
+static int tuning_file_set = 0;
+static char tuning_cpu[TUNING_CPU_LENGTH];
+static char tuning_file[4096]; /* empty for no tuning file */
 
-	threads_data = (_matrix_matrix_data *)calloc(op_thread_num, sizeof(_matrix_matrix_data));
-	if (!threads_data)
-		goto fail2;
+/* log2 of a dimension, rounded up, the products whose dimensions have the
+ * same classes sharing their tuning */
+static
+unsigned int shape_class(unsigned long int dim)
+{
+	unsigned int class = 0;
 
-	pthread_attr_init(&p_attr);
-	pthread_attr_setdetachstate(&p_attr, PTHREAD_CREATE_JOINABLE);
-
-	/* Calculate how many lines each thread will calculate */
-	lines = matrixA->height / op_thread_num;
-
-	/* Initialise threads with the proper arguments */
-	arr_rows_a = matrixA->rows;
-	arr_rows_c = matrixC->rows;
-	for (t = 0; t != op_thread_num; ++t, arr_rows_a += matrixA->width*lines, arr_rows_c += matrixC->width*lines) {
-		threads_data[t].lines = lines;
-		threads_data[t].matrixA = matrixA;
-		threads_data[t].matrixB = matrixB;
-		threads_data[t].matrixC = matrixC;
-		threads_data[t].arr_rows_a = arr_rows_a;
-		threads_data[t].arr_rows_c = arr_rows_c;
-		ret = pthread_create(&threads[t], &p_attr, matrix_matrix_mult_thread, (void *)&threads_data[t]);
-		if (ret)
-			goto fail3;
+	while (class < 63 && (1UL << class) < dim)
+		++class;
+
+	return class;
+}
+
+/* Model name of the CPU as /proc/cpuinfo gives it, the key of the tuning
+ * entries, with its tabs made spaces for the tuning file */
+static
+void cpu_model(char *model, unsigned long int size)
+{
+	char line[TUNING_CPU_LENGTH + 64], *value, *end;
+	FILE *file;
+
+	snprintf(model, size, "unknown");
+
+	file = fopen("/proc/cpuinfo", "r");
+	if (!file)
+		return;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, "model name", 10) != 0 || !(value = strchr(line, ':')))
+			continue;
+
+		for (++value; *value == ' ' || *value == '\t'; ++value);
+		end = value + strcspn(value, "\n");
+		*end = '\0';
+		if (value != end)
+			snprintf(model, size, "%s", value);
+		break;
 	}
+	fclose(file);
 
-	/* Wait for threads to finish while checking if they terminated ok */
-	for (t = 0; t != op_thread_num; ++t) {
-		ret = pthread_join(threads[t], &status);
-		if (ret || (long)(status))
-			goto fail3;
+	for (value = model; *value; ++value) {
+		if (*value == '\t')
+			*value = ' ';
 	}
+}
+
+/* Reads the entries of the tuning file once, the file being
+ * $MATRIX_LIB_TUNING, or ~/.matrix_lib_tuning, unless set_tuning_file set
+ * another. Called with tuning_lock held */
+static
+void tuning_load(void)
+{
+	const char *name;
+	int num_entries;
 
-	pthread_attr_destroy(&p_attr);
-	free(threads_data);
-	free(threads);
+	if (tuning_loaded)
+		return;
 
-	return 1;
+	cpu_model(tuning_cpu, sizeof(tuning_cpu));
 
-	/* ERROR CLEANUP */
-fail3:
-	for (t = 0; t != op_thread_num; ++t) {
-		if (threads[t])
-			pthread_join(threads[t], &status);
+	if (!tuning_file_set) {
+		tuning_file[0] = '\0';
+		if ((name = getenv("MATRIX_LIB_TUNING")))
+			snprintf(tuning_file, sizeof(tuning_file), "%s", name);
+		else if ((name = getenv("HOME")))
+			snprintf(tuning_file, sizeof(tuning_file), "%s/%s", name, TUNING_FILE_NAME);
 	}
-	pthread_attr_destroy(&p_attr);
-	free(threads_data);
-fail2:
-	free(threads);
-fail1:
-	return 0;
+
+	num_entries = tuning_file[0] ? tuning_file_read(tuning_file, tuning_cpu, tuning_entries, TUNING_MAX_ENTRIES) : 0;
+	tuning_num_entries = (unsigned int)num_entries;
+	tuning_loaded = 1;
 }
 
-void print_matrix(Matrix *matrix)
+/* Sets the tuning file, none if NULL. Its entries are read on the next
+ * product, replacing the ones in memory */
+void set_tuning_file(const char *file_name)
 {
-	register unsigned long int lin, col;
-	for (lin = 0; lin < matrix->height; ++lin) {
-		for (col = 0; col < matrix->width; ++col) {
-			printf("%5.2f\t", *MATRIX_EL(matrix, lin, col));
-		}
-		printf("\n");
-	}
-	printf("\n");
+	pthread_mutex_lock(&tuning_lock);
+
+	tuning_file[0] = '\0';
+	if (file_name && snprintf(tuning_file, sizeof(tuning_file), "%s", file_name) >= (int)sizeof(tuning_file))
+		tuning_file[0] = '\0';
+
+	tuning_file_set = 1;
+	tuning_loaded = 0;
+	tuning_num_entries = 0;
+
+	pthread_mutex_unlock(&tuning_lock);
 }
 
 static
-Matrix *build_matrix(unsigned long int height, unsigned long int width)
+struct tuning_entry *tuning_find(unsigned int m_class, unsigned int n_class, unsigned int k_class)
 {
-	Matrix *matrix = (Matrix *)malloc(sizeof(Matrix));
-	if (!matrix) {
-		return NULL;
-	}
+	unsigned int i;
 
-	matrix->rows = (float *)aligned_alloc(32, sizeof(float) * height * width);
-	if (!matrix->rows) {
-		free(matrix);
-		return NULL;
+	for (i = 0; i < tuning_num_entries; ++i) {
+		if (tuning_entries[i].m_class == m_class && tuning_entries[i].n_class == n_class
+				&& tuning_entries[i].k_class == k_class)
+			return &tuning_entries[i];
 	}
 
-	matrix->width = width;
-	matrix->height = height;
+	return NULL;
+}
 
-	return matrix;
+/* Blocking of an entry, or 0 if the file gave blocks the kernels can not take
+ * or kernels this CPU, or MATRIX_LIB_ISA, does not allow */
+static
+int tuning_blocking(const struct tuning_entry *entry, struct gemm_blocking *blocking)
+{
+	const struct matrix_kernels *kernels = matrix_kernels_find(entry->isa);
+
+	if (!kernels)
+		return 0;
+
+	if (!entry->mc || entry->mc > GEMM_MAX_MC || entry->mc % GEMM_MR)
+		return 0;
+
+	if (!entry->kc || entry->kc > GEMM_MAX_KC)
+		return 0;
+
+	if (!entry->tile_n || entry->tile_n > GEMM_NC || entry->tile_n % GEMM_MAX_NR)
+		return 0;
+
+	blocking->kernels = kernels;
+	blocking->num_threads = entry->num_threads;
+	blocking->mc = entry->mc;
+	blocking->kc = entry->kc;
+	blocking->tile_n = entry->tile_n;
+
+	return 1;
 }
 
-Matrix *new_matrix(unsigned long int height, unsigned long int width, float *rows)
+/* Blocking of the products of m x k by k x n matrices, the one tuned for
+ * their shape class if there is one */
+static
+void tuned_blocking(unsigned long int m, unsigned long int n, unsigned long int k, struct gemm_blocking *blocking)
 {
-	Matrix *matrix = build_matrix(height, width);
+	struct tuning_entry *entry;
 
-	if (matrix) {
-		__m256 vec_rows;
-		unsigned long int i;
-		float *arr_rows = rows, *arr_m_rows = matrix->rows;
+	gemm_default_blocking(blocking);
 
-		for (i = 0; i < height * width; i += 8, arr_rows += 8, arr_m_rows += 8) {
-			vec_rows = _mm256_load_ps(arr_rows);
-			_mm256_store_ps(arr_m_rows, vec_rows);
-		}
-	}
+	pthread_mutex_lock(&tuning_lock);
 
-	return matrix;
+	tuning_load();
+	entry = tuning_find(shape_class(m), shape_class(n), shape_class(k));
+	if (entry && !tuning_blocking(entry, blocking))
+		gemm_default_blocking(blocking);
+
+	pthread_mutex_unlock(&tuning_lock);
 }
 
-Matrix *zero_matrix(unsigned long int height, unsigned long int width)
+static
+double tuning_seconds(void)
 {
-	Matrix *matrix = build_matrix(height, width);
+	struct timespec now;
 
-	if (matrix) {
-		__m256 vec_zero;
-		unsigned long int i;
-		float *arr_m_rows = matrix->rows;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
 
-		vec_zero = _mm256_set1_ps(0.0f);
-		for (i = 0; i < height * width; i += 8, arr_m_rows += 8) {
-			_mm256_store_ps(arr_m_rows, vec_zero);
-		}
+/* Best time of a few products with a blocking, after one more to warm the
+ * caches and the scratch memory up, or a negative time if one failed */
+static
+double tuning_time(unsigned long int m, unsigned long int n, unsigned long int k,
+		const float *a, const float *b, float *c, const struct gemm_blocking *blocking)
+{
+	double start, seconds, best = -1.0;
+	int run;
+
+	for (run = 0; run <= TUNING_RUNS; ++run) {
+		start = tuning_seconds();
+		if (!gemm_parallel(m, n, k, a, k, MATRIX_DTYPE_F32, b, n, MATRIX_DTYPE_F32, c, n, MATRIX_DTYPE_F32,
+					0, &gemm_store, blocking))
+			return -1.0;
+		seconds = tuning_seconds() - start;
+
+		if (run && (best < 0.0 || seconds < best))
+			best = seconds;
 	}
 
-	return matrix;
+	return best;
 }
 
-Matrix *read_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height)
+/* Times the candidate in blocking, keeping it in best if it is faster */
+static
+int tuning_try(unsigned long int m, unsigned long int n, unsigned long int k,
+		const float *a, const float *b, float *c, const struct gemm_blocking *blocking,
+		struct gemm_blocking *best, double *best_seconds)
 {
-	Matrix *matrix;
-	unsigned long int matrix_size = m_width * m_height;
-	float *rows = (float *)aligned_alloc(32, sizeof(float) * matrix_size);
-	FILE *bf = fopen(file_name, "rb");
-	if (rows == NULL || bf == NULL) return NULL;
-
-	fread(rows, sizeof(float), matrix_size, bf);
-	fclose(bf);
-	matrix = new_matrix(m_height, m_width, rows);
-	free(rows);
-	return matrix;
+	double seconds = tuning_time(m, n, k, a, b, c, blocking);
+
+	if (seconds < 0.0)
+		return 0;
+
+	if (*best_seconds < 0.0 || seconds < *best_seconds) {
+		*best = *blocking;
+		*best_seconds = seconds;
+	}
+
+	return 1;
 }
 
-void dump_matrix_binfile(const char *file_name, Matrix *matrix)
+/* Candidates of the blocks, a block past the dimension it splits being tried
+ * only if the smaller ones all were below it */
+static const unsigned long int tuning_mc[] = {48, 72, 96, 144};
+static const unsigned long int tuning_kc[] = {128, 256, 384, 512};
+static const unsigned long int tuning_tile_n[] = {256, 512, 1024, 2048};
+
+#define TUNING_CANDIDATES 4
+
+/* Tunes the parameters one after the other, from the kernels to the tiles,
+ * each one keeping the best values of the ones before */
+int matrix_tune(unsigned long int m, unsigned long int n, unsigned long int k)
 {
-	FILE *bf = fopen(file_name, "wb");
-	if (!bf) {
-		fprintf(stderr, "ERRO: não foi possível abrir arquivo \"%s\"\n", file_name);
-		exit(EXIT_FAILURE);
+	const struct matrix_kernels *kernels, *above;
+	struct gemm_blocking best, candidate;
+	struct tuning_entry entry, *old_entry;
+	double best_seconds = -1.0;
+	unsigned int num_threads, i;
+	unsigned long int x;
+	float *a, *b, *c;
+	int ret;
+
+	if (!m || !n || !k)
+		return 0;
+
+	num_threads = pool_threads();
+	if (!num_threads)
+		return 0;
+
+	a = (float *)malloc(sizeof(float) * (m * k + k * n + m * n));
+	if (!a)
+		return 0;
+	b = a + m * k;
+	c = b + k * n;
+
+	for (x = 0; x < m * k + k * n; ++x)
+		a[x] = (float)((int)(x % 17) - 8) / 8.0f;
+
+	gemm_default_blocking(&best);
+	if (!tuning_try(m, n, k, a, b, c, &best, &best, &best_seconds))
+		goto fail;
+
+	/* The generic kernels are only tried on CPUs without any others, and the
+	 * sets with the GEMM microkernel of the set above them are skipped */
+	candidate = best;
+	for (above = matrix_kernels, kernels = matrix_kernels_lower(above); kernels && matrix_kernels_lower(kernels);
+			above = kernels, kernels = matrix_kernels_lower(kernels)) {
+		candidate.kernels = kernels;
+		if (kernels->gemm_micro != above->gemm_micro
+				&& !tuning_try(m, n, k, a, b, c, &candidate, &best, &best_seconds))
+			goto fail;
+	}
+
+	candidate = best;
+	for (i = num_threads / 2; i >= 1 && i * 8 >= num_threads; i /= 2) {
+		candidate.num_threads = i;
+		if (!tuning_try(m, n, k, a, b, c, &candidate, &best, &best_seconds))
+			goto fail;
+	}
+
+	candidate = best;
+	for (i = 0; i < TUNING_CANDIDATES && (!i || tuning_kc[i - 1] < k); ++i) {
+		candidate.kc = tuning_kc[i];
+		if (candidate.kc != best.kc && !tuning_try(m, n, k, a, b, c, &candidate, &best, &best_seconds))
+			goto fail;
+	}
+
+	candidate = best;
+	for (i = 0; i < TUNING_CANDIDATES && (!i || tuning_mc[i - 1] < m); ++i) {
+		candidate.mc = tuning_mc[i];
+		if (candidate.mc != best.mc && !tuning_try(m, n, k, a, b, c, &candidate, &best, &best_seconds))
+			goto fail;
+	}
+
+	candidate = best;
+	for (i = 0; i < TUNING_CANDIDATES && (!i || tuning_tile_n[i - 1] < n); ++i) {
+		candidate.tile_n = tuning_tile_n[i];
+		if (candidate.tile_n != best.tile_n && !tuning_try(m, n, k, a, b, c, &candidate, &best, &best_seconds))
+			goto fail;
+	}
+
+	free(a);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.m_class = shape_class(m);
+	entry.n_class = shape_class(n);
+	entry.k_class = shape_class(k);
+	snprintf(entry.isa, sizeof(entry.isa), "%s", best.kernels->isa);
+	entry.num_threads = best.num_threads;
+	entry.mc = best.mc;
+	entry.kc = best.kc;
+	entry.tile_n = best.tile_n;
+	entry.gflops = 2.0 * m * n * k / best_seconds * 1e-9;
+
+	/* Entries past the last one the memory holds replace the last one */
+	pthread_mutex_lock(&tuning_lock);
+
+	tuning_load();
+	old_entry = tuning_find(entry.m_class, entry.n_class, entry.k_class);
+	if (!old_entry) {
+		tuning_num_entries = MIN(tuning_num_entries + 1, TUNING_MAX_ENTRIES);
+		old_entry = &tuning_entries[tuning_num_entries - 1];
 	}
+	*old_entry = entry;
+
+	ret = !tuning_file[0] || tuning_file_write(tuning_file, tuning_cpu, tuning_entries, tuning_num_entries);
+
+	pthread_mutex_unlock(&tuning_lock);
+
+	return ret;
 
-	fwrite(matrix->rows, sizeof(float), matrix->height * matrix->width, bf);
-	fclose(bf);
+	/* ERROR CLEANUP */
+fail:
+	free(a);
+	return 0;
 }
 
-void delete_matrix(Matrix *matrix)
+/* Transposes the kernels apply to read op(A) and op(B), op transposing the
+ * operands set in flags, from the rows of A and B */
+static
+int kernel_trans(Matrix *matrixA, Matrix *matrixB, int flags)
 {
-	free(matrix->rows);
-	free(matrix);
+	if (matrixA->transposed)
+		flags ^= MATRIX_TRANS_A;
+	if (matrixB->transposed)
+		flags ^= MATRIX_TRANS_B;
+
+	return flags & (MATRIX_TRANS_A | MATRIX_TRANS_B);
+}
+
+/* Checks that C = op(A) * op(B) can be computed and written, op transposing
+ * the operands set in trans */
+static
+int check_mult(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC, int trans)
+{
+	unsigned long int a_height, a_width, b_height, b_width;
+
+	/* Check if matrices are valid */
+	if (!matrixA || !matrixB || !matrixC)
+		return 0;
+
+	/* Check if matrices have valid array of rows */
+	if (!matrixA->rows || !matrixB->rows || !matrixC->rows)
+		return 0;
+
+	a_height = trans & MATRIX_TRANS_A ? matrixA->width : matrixA->height;
+	a_width = trans & MATRIX_TRANS_A ? matrixA->height : matrixA->width;
+	b_height = trans & MATRIX_TRANS_B ? matrixB->width : matrixB->height;
+	b_width = trans & MATRIX_TRANS_B ? matrixB->height : matrixB->width;
+
+	/* Check if dimensions of matrices match according to multiplication rules */
+	if (matrixC->height != a_height || matrixC->width != b_width || a_width != b_height)
+		return 0;
+
+	/* Check if the matrices are not empty */
+	if (!matrixC->height || !matrixC->width || !a_width)
+		return 0;
+
+	/* Check if the result can be written */
+	return !matrixC->transposed && !(matrixC->map_flags & MATRIX_MAP_READONLY);
 }
 
+int matrix_matrix_mult(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC)
+{
+	struct gemm_blocking blocking;
+
+	if (!check_mult(matrixA, matrixB, matrixC, 0))
+		return 0;
+
+	tuned_blocking(matrixC->height, matrixC->width, matrixA->width, &blocking);
+
+	return gemm_parallel(matrixC->height, matrixC->width, matrixA->width,
+			matrixA->rows, matrixA->stride, matrixA->dtype,
+			matrixB->rows, matrixB->stride, matrixB->dtype,
+			matrixC->rows, matrixC->stride, matrixC->dtype,
+			kernel_trans(matrixA, matrixB, 0), &gemm_store, &blocking);
+}
+
+int matrix_matrix_gemm(float alpha, Matrix *matrixA, Matrix *matrixB, float beta, Matrix *matrixC,
+		int flags, const MatrixEpilogue *epilogue)
+{
+	struct gemm_epilogue ep = {alpha, beta, NULL, GEMM_ACT_NONE, 0.0f, 0.0f};
+	struct gemm_blocking blocking;
+	int trans = flags & (MATRIX_TRANS_A | MATRIX_TRANS_B);
+
+	if (!check_mult(matrixA, matrixB, matrixC, trans))
+		return 0;
+
+	if (epilogue) {
+		if (epilogue->activation < MATRIX_ACT_NONE || epilogue->activation > MATRIX_ACT_GELU)
+			return 0;
+
+		if (epilogue->activation == MATRIX_ACT_CLAMP && !(epilogue->clamp_min <= epilogue->clamp_max))
+			return 0;
+
+		ep.bias = epilogue->bias;
+		ep.activation = epilogue->activation;
+		ep.clamp_min = epilogue->clamp_min;
+		ep.clamp_max = epilogue->clamp_max;
+	}
+
+	tuned_blocking(matrixC->height, matrixC->width, trans & MATRIX_TRANS_A ? matrixA->height : matrixA->width,
+			&blocking);
+
+	return gemm_parallel(matrixC->height, matrixC->width,
+			trans & MATRIX_TRANS_A ? matrixA->height : matrixA->width,
+			matrixA->rows, matrixA->stride, matrixA->dtype,
+			matrixB->rows, matrixB->stride, matrixB->dtype,
+			matrixC->rows, matrixC->stride, matrixC->dtype,
+			kernel_trans(matrixA, matrixB, trans), &ep, &blocking);
+}
+
+/* Products of a batch, given as arrays of matrices or stacked in the rows of
+ * single matrices with the stride of each operand, a stride of 0 sharing the
+ * operand between all products */
+typedef struct matrix_batch_data {
+	Matrix **a, **b, **c;
+	const void *a_rows, *b_rows;
+	float *c_rows;
+	unsigned long int m, n, k, lda, ldb, ldc, stride_a, stride_b, stride_c;
+	int dtype_a, dtype_b;
+} _matrix_batch_data;
+
+/* Computes the item-th product of the batch by a single worker, as the
+ * products are small and many */
+static
+int matrix_matrix_mult_item(unsigned int tid, unsigned long int item, void *args)
+{
+	struct gemm_blocking blocking;
+	float *pack_a, *pack_b;
+
+	_matrix_batch_data *data = (_matrix_batch_data *)args;
+
+	pack_a = (float *)thread_pool_scratch(tid, sizeof(float) * (GEMM_MC * GEMM_KC + GEMM_KC * GEMM_NC));
+	if (!pack_a)
+		return 0;
+	pack_b = pack_a + GEMM_MC * GEMM_KC;
+	gemm_default_blocking(&blocking);
+
+	if (data->a) {
+		gemm_blocked(data->c[item]->height, data->c[item]->width, data->a[item]->width,
+				data->a[item]->rows, data->a[item]->stride, data->a[item]->dtype,
+				data->b[item]->rows, data->b[item]->stride, data->b[item]->dtype,
+				data->c[item]->rows, data->c[item]->stride,
+				kernel_trans(data->a[item], data->b[item], 0), &gemm_store, &blocking, pack_a, pack_b);
+	} else {
+		gemm_blocked(data->m, data->n, data->k,
+				DTYPE_AT(data->a_rows, data->dtype_a, item * data->stride_a), data->lda, data->dtype_a,
+				DTYPE_AT(data->b_rows, data->dtype_b, item * data->stride_b), data->ldb, data->dtype_b,
+				data->c_rows + item * data->stride_c, data->ldc, 0, &gemm_store, &blocking, pack_a, pack_b);
+	}
+
+	return 1;
+}
+
+/* The workers take whole products of the batch, stealing from each other */
+static
+int matrix_matrix_mult_batch(_matrix_batch_data *data, unsigned long int batch)
+{
+	unsigned int num_threads = pool_threads();
+
+	if (!num_threads)
+		return 0;
+
+	return thread_pool_run_items((unsigned int)MIN(num_threads, batch), batch, matrix_matrix_mult_item, data);
+}
+
+int matrix_matrix_mult_batched(Matrix **matrixA, Matrix **matrixB, Matrix **matrixC, unsigned long int batch)
+{
+	_matrix_batch_data data;
+	unsigned long int i;
+
+	if (!matrixA || !matrixB || !matrixC || !batch)
+		return 0;
+
+	/* The products of a batch are small, so C is not rounded by tiles */
+	for (i = 0; i < batch; ++i) {
+		if (!check_mult(matrixA[i], matrixB[i], matrixC[i], 0) || matrixC[i]->dtype != MATRIX_DTYPE_F32)
+			return 0;
+	}
+
+	data.a = matrixA;
+	data.b = matrixB;
+	data.c = matrixC;
+
+	return matrix_matrix_mult_batch(&data, batch);
+}
+
+/* The products of a strided batch are stacked in the rows of A, B and C, and
+ * a B holding a single product is shared by all of them. Transposed views
+ * stack them in their columns, so they are not taken */
+int matrix_matrix_mult_strided(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC, unsigned long int batch)
+{
+	_matrix_batch_data data;
+
+	if (!matrixA || !matrixB || !matrixC || !batch)
+		return 0;
+
+	if (!matrixA->rows || !matrixB->rows || !matrixC->rows)
+		return 0;
+
+	if (matrixA->transposed || matrixB->transposed || matrixC->transposed)
+		return 0;
+
+	if (matrixA->height % batch || matrixC->height != matrixA->height || matrixC->width != matrixB->width)
+		return 0;
+
+	if (matrixC->dtype != MATRIX_DTYPE_F32 || matrixC->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	/* Products of m x k by k x n matrices, as gemm_blocked names them */
+	data.a = NULL;
+	data.m = matrixA->height / batch;
+	data.k = matrixA->width;
+	data.n = matrixB->width;
+
+	if (matrixB->height == data.k)
+		data.stride_b = 0;
+	else if (matrixB->height == batch * data.k)
+		data.stride_b = data.k * matrixB->stride;
+	else
+		return 0;
+
+	if (!data.m || !data.n || !data.k)
+		return 0;
+
+	data.a_rows = matrixA->rows;
+	data.b_rows = matrixB->rows;
+	data.c_rows = matrixC->rows;
+	data.dtype_a = matrixA->dtype;
+	data.dtype_b = matrixB->dtype;
+	data.lda = matrixA->stride;
+	data.ldb = matrixB->stride;
+	data.ldc = matrixC->stride;
+	data.stride_a = data.m * matrixA->stride;
+	data.stride_c = data.m * matrixC->stride;
+
+	return matrix_matrix_mult_batch(&data, batch);
+}
+
+/* Sums of the quadrants of the Strassen-Winograd products, dst = x + alpha * y
+ * for rows x cols blocks with leading dimensions ldd, ldx and ldy */
+typedef struct strassen_add_data {
+	float *dst;
+	const float *x, *y;
+	unsigned long int rows, cols, ldd, ldx, ldy;
+	float alpha;
+	unsigned int num_threads;
+} _strassen_add_data;
+
+static
+int strassen_add_task(unsigned int tid, void *args)
+{
+	unsigned long int first_row, num_rows, i;
+	_strassen_add_data *data = (_strassen_add_data *)args;
+
+	thread_rows(data->rows, data->num_threads, tid, &first_row, &num_rows);
+	for (i = first_row; i < first_row + num_rows; ++i)
+		matrix_kernels->add(data->dst + i * data->ldd, data->x + i * data->ldx, data->y + i * data->ldy,
+				data->alpha, data->cols);
+
+	return 1;
+}
+
+static
+int strassen_add(unsigned long int rows, unsigned long int cols, const float *x, unsigned long int ldx,
+		const float *y, unsigned long int ldy, float alpha, float *dst, unsigned long int ldd)
+{
+	_strassen_add_data data;
+
+	data.num_threads = (unsigned int)MIN(pool_threads(), rows);
+	if (!data.num_threads)
+		return 0;
+
+	data.dst = dst;
+	data.x = x;
+	data.y = y;
+	data.rows = rows;
+	data.cols = cols;
+	data.ldd = ldd;
+	data.ldx = ldx;
+	data.ldy = ldy;
+	data.alpha = alpha;
+
+	return thread_pool_run(data.num_threads, strassen_add_task, &data, 0);
+}
+
+/* Floats of workspace used by a Strassen-Winograd product of a m x k matrix
+ * by a k x n matrix: each level splitting the operands needs a temporary for
+ * the sums of A, also holding a product, and one for the sums of B, and the
+ * levels run one at a time. 0 if the product is not split */
+static
+unsigned long int strassen_workspace(unsigned long int m, unsigned long int n, unsigned long int k)
+{
+	unsigned long int size = 0;
+
+	while (m >= strassen_cutoff && n >= strassen_cutoff && k >= strassen_cutoff) {
+		m /= 2;
+		n /= 2;
+		k /= 2;
+		size += m * MAX(k, n) + k * n;
+	}
+
+	return size;
+}
+
+/* C = A * B for a m x k matrix A and a k x n matrix B, all stored row major
+ * with leading dimensions lda, ldb and ldc. The even part of the operands is
+ * split in quadrants and multiplied with the 7 products and 15 sums of
+ * Winograd's variant, scheduled to use the quadrants of C and the temporaries
+ * x and y only; the odd row, column and depth left are added by the blocked
+ * kernel. Products below the cutoff are computed by the blocked kernel */
+static
+int strassen(unsigned long int m, unsigned long int n, unsigned long int k,
+		const float *a, unsigned long int lda,
+		const float *b, unsigned long int ldb,
+		float *c, unsigned long int ldc, float *workspace)
+{
+	unsigned long int m2, n2, k2;
+	const float *a11, *a12, *a21, *a22, *b11, *b12, *b21, *b22;
+	float *c11, *c12, *c21, *c22, *x, *y, *next;
+
+	if (m < strassen_cutoff || n < strassen_cutoff || k < strassen_cutoff)
+		return gemm_parallel(m, n, k, a, lda, MATRIX_DTYPE_F32, b, ldb, MATRIX_DTYPE_F32,
+				c, ldc, MATRIX_DTYPE_F32, 0, &gemm_store, NULL);
+
+	m2 = m / 2;
+	n2 = n / 2;
+	k2 = k / 2;
+
+	a11 = a;
+	a12 = a + k2;
+	a21 = a + m2 * lda;
+	a22 = a21 + k2;
+	b11 = b;
+	b12 = b + n2;
+	b21 = b + k2 * ldb;
+	b22 = b21 + n2;
+	c11 = c;
+	c12 = c + n2;
+	c21 = c + m2 * ldc;
+	c22 = c21 + n2;
+
+	/* x holds m2 x k2 sums of A, with leading dimension k2, or a m2 x n2
+	 * product, with leading dimension n2. y holds k2 x n2 sums of B */
+	x = workspace;
+	y = x + m2 * MAX(k2, n2);
+	next = y + k2 * n2;
+
+	if (!strassen_add(m2, k2, a11, lda, a21, lda, -1.0f, x, k2)               /* S3 = A11 - A21 */
+			|| !strassen_add(k2, n2, b22, ldb, b12, ldb, -1.0f, y, n2)  /* T3 = B22 - B12 */
+			|| !strassen(m2, n2, k2, x, k2, y, n2, c21, ldc, next)      /* P7 = S3 T3 */
+			|| !strassen_add(m2, k2, a21, lda, a22, lda, 1.0f, x, k2)   /* S1 = A21 + A22 */
+			|| !strassen_add(k2, n2, b12, ldb, b11, ldb, -1.0f, y, n2)  /* T1 = B12 - B11 */
+			|| !strassen(m2, n2, k2, x, k2, y, n2, c22, ldc, next)      /* P5 = S1 T1 */
+			|| !strassen_add(m2, k2, x, k2, a11, lda, -1.0f, x, k2)     /* S2 = S1 - A11 */
+			|| !strassen_add(k2, n2, b22, ldb, y, n2, -1.0f, y, n2)     /* T2 = B22 - T1 */
+			|| !strassen(m2, n2, k2, x, k2, y, n2, c12, ldc, next)      /* P6 = S2 T2 */
+			|| !strassen_add(m2, k2, a12, lda, x, k2, -1.0f, x, k2)     /* S4 = A12 - S2 */
+			|| !strassen(m2, n2, k2, x, k2, b22, ldb, c11, ldc, next)   /* P3 = S4 B22 */
+			|| !strassen(m2, n2, k2, a11, lda, b11, ldb, x, n2, next)   /* P1 = A11 B11 */
+			|| !strassen_add(m2, n2, x, n2, c12, ldc, 1.0f, c12, ldc)   /* U2 = P1 + P6 */
+			|| !strassen_add(m2, n2, c12, ldc, c21, ldc, 1.0f, c21, ldc) /* U3 = U2 + P7 */
+			|| !strassen_add(m2, n2, c12, ldc, c22, ldc, 1.0f, c12, ldc) /* U4 = U2 + P5 */
+			|| !strassen_add(m2, n2, c21, ldc, c22, ldc, 1.0f, c22, ldc) /* U7 = U3 + P5 */
+			|| !strassen_add(m2, n2, c12, ldc, c11, ldc, 1.0f, c12, ldc) /* U5 = U4 + P3 */
+			|| !strassen_add(k2, n2, y, n2, b21, ldb, -1.0f, y, n2)     /* T4 = T2 - B21 */
+			|| !strassen(m2, n2, k2, a22, lda, y, n2, c11, ldc, next)   /* P4 = A22 T4 */
+			|| !strassen_add(m2, n2, c21, ldc, c11, ldc, -1.0f, c21, ldc) /* U6 = U3 - P4 */
+			|| !strassen(m2, n2, k2, a12, lda, b21, ldb, c11, ldc, next) /* P2 = A12 B21 */
+			|| !strassen_add(m2, n2, x, n2, c11, ldc, 1.0f, c11, ldc))  /* U1 = P1 + P2 */
+		return 0;
+
+	/* The odd depth is added to the even part of C, then its odd column and
+	 * row are computed whole */
+	if (k > 2 * k2 && !gemm_parallel(2 * m2, 2 * n2, 1, a + 2 * k2, lda, MATRIX_DTYPE_F32,
+				b + 2 * k2 * ldb, ldb, MATRIX_DTYPE_F32, c, ldc, MATRIX_DTYPE_F32, 0, &gemm_accumulate, NULL))
+		return 0;
+
+	if (n > 2 * n2 && !gemm_parallel(m, 1, k, a, lda, MATRIX_DTYPE_F32, b + 2 * n2, ldb, MATRIX_DTYPE_F32,
+				c + 2 * n2, ldc, MATRIX_DTYPE_F32, 0, &gemm_store, NULL))
+		return 0;
+
+	if (m > 2 * m2 && !gemm_parallel(1, 2 * n2, k, a + 2 * m2 * lda, lda, MATRIX_DTYPE_F32, b, ldb, MATRIX_DTYPE_F32,
+				c + 2 * m2 * ldc, ldc, MATRIX_DTYPE_F32, 0, &gemm_store, NULL))
+		return 0;
+
+	return 1;
+}
+
+int matrix_matrix_mult_strassen(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC)
+{
+	unsigned long int size;
+	float *workspace;
+	int ret;
+
+	if (!check_mult(matrixA, matrixB, matrixC, 0))
+		return 0;
+
+	/* The quadrants of transposed views are not summed row by row, the sums
+	 * of 16-bit quadrants would be rounded, and products below the cutoff are
+	 * not split */
+	size = strassen_workspace(matrixC->height, matrixC->width, matrixA->width);
+	if (kernel_trans(matrixA, matrixB, 0) || !size || matrixA->dtype != MATRIX_DTYPE_F32
+			|| matrixB->dtype != MATRIX_DTYPE_F32 || matrixC->dtype != MATRIX_DTYPE_F32)
+		return matrix_matrix_mult(matrixA, matrixB, matrixC);
+
+	/* A single arena holds the temporaries of every level */
+	workspace = (float *)malloc(sizeof(float) * size);
+	if (!workspace)
+		return 0;
+
+	ret = strassen(matrixC->height, matrixC->width, matrixA->width,
+			matrixA->rows, matrixA->stride,
+			matrixB->rows, matrixB->stride,
+			matrixC->rows, matrixC->stride, workspace);
+
+	free(workspace);
+	return ret;
+}
+
+/* Strides, in elements, from a row and from a column of a matrix to the next
+ * in memory */
+#define MATRIX_ROW_STEP(m) ((m)->transposed ? 1 : (m)->stride)
+#define MATRIX_COL_STEP(m) ((m)->transposed ? (m)->stride : 1)
+
+/* The transposes halve the larger side of a block until it fits a leaf of
+ * TRANSPOSE_LEAF elements a side, whatever the size of the caches, and the
+ * in-place transpose swaps tiles of TRANSPOSE_TILE elements a side */
+#define TRANSPOSE_LEAF 32
+#define TRANSPOSE_TILE 64
+
+/* B = A^T for a rows x cols block of A, the element (i, j) of A being at
+ * a + i * a_row + j * a_col and the element (j, i) of B at b + j * b_row +
+ * i * b_col */
+typedef struct transpose_data {
+	const void *a;
+	void *b;
+	unsigned long int rows, cols, a_row, a_col, b_row, b_col;
+	int dtype;
+	unsigned int num_threads;
+} _transpose_data;
+
+static
+void transpose_leaf(const _transpose_data *data, unsigned long int first_row, unsigned long int first_col,
+		unsigned long int rows, unsigned long int cols)
+{
+	const char *a = (const char *)DTYPE_AT(data->a, data->dtype, first_row * data->a_row + first_col * data->a_col);
+	char *b = (char *)DTYPE_AT(data->b, data->dtype, first_col * data->b_row + first_row * data->b_col);
+	unsigned long int i, j;
+
+	if (data->dtype == MATRIX_DTYPE_F32 && data->a_col == 1 && data->b_col == 1) {
+		matrix_kernels->transpose(rows, cols, (const float *)a, data->a_row, (float *)b, data->b_row);
+		return;
+	}
+
+	for (i = 0; i < rows; ++i) {
+		for (j = 0; j < cols; ++j) {
+			if (data->dtype == MATRIX_DTYPE_F32)
+				((float *)b)[j * data->b_row + i * data->b_col] = ((const float *)a)[i * data->a_row + j * data->a_col];
+			else
+				((uint16_t *)b)[j * data->b_row + i * data->b_col] = ((const uint16_t *)a)[i * data->a_row + j * data->a_col];
+		}
+	}
+}
+
+static
+void transpose_block(const _transpose_data *data, unsigned long int first_row, unsigned long int first_col,
+		unsigned long int rows, unsigned long int cols)
+{
+	if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF) {
+		transpose_leaf(data, first_row, first_col, rows, cols);
+	} else if (rows >= cols) {
+		transpose_block(data, first_row, first_col, rows / 2, cols);
+		transpose_block(data, first_row + rows / 2, first_col, rows - rows / 2, cols);
+	} else {
+		transpose_block(data, first_row, first_col, rows, cols / 2);
+		transpose_block(data, first_row, first_col + cols / 2, rows, cols - cols / 2);
+	}
+}
+
+/* Each thread writes its slab of rows of B, the columns of A */
+static
+int matrix_transpose_task(unsigned int tid, void *args)
+{
+	unsigned long int first_col, num_cols;
+	_transpose_data *data = (_transpose_data *)args;
+
+	thread_rows(data->cols, data->num_threads, tid, &first_col, &num_cols);
+	transpose_block(data, 0, first_col, data->rows, num_cols);
+
+	return 1;
+}
+
+/* Swaps the item-th pair of tiles of a square matrix across the diagonal,
+ * one of them being copied aside first, or transposes a tile of the diagonal
+ * through the same copy */
+static
+int matrix_transpose_tile(unsigned int tid, unsigned long int item, void *args)
+{
+	_transpose_data *data = (_transpose_data *)args;
+	_transpose_data tile = *data;
+	float buffer[TRANSPOSE_TILE * TRANSPOSE_TILE];
+	unsigned long int tiles, ti, tj, rows, cols, i;
+	size_t size = MATRIX_DTYPE_SIZE(data->dtype);
+	char *a = (char *)data->b;
+
+	(void)tid;
+
+	tiles = (data->rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+	ti = item / tiles * TRANSPOSE_TILE;
+	tj = item % tiles * TRANSPOSE_TILE;
+	if (ti > tj)
+		return 1;
+
+	rows = MIN(TRANSPOSE_TILE, data->rows - ti);
+	cols = MIN(TRANSPOSE_TILE, data->rows - tj);
+
+	/* buffer = X^T for the tile X at (ti, tj) */
+	tile.a = a + (ti * data->a_row + tj) * size;
+	tile.b = buffer;
+	tile.b_row = rows;
+	transpose_leaf(&tile, 0, 0, rows, cols);
+
+	/* X = Y^T for the tile Y at (tj, ti), then Y = buffer */
+	if (ti != tj)
+		transpose_leaf(data, tj, ti, cols, rows);
+	for (i = 0; i < cols; ++i)
+		memcpy(a + ((tj + i) * data->a_row + ti) * size, (char *)buffer + i * rows * size, rows * size);
+
+	return 1;
+}
+
+int matrix_transpose(Matrix *matrixA, Matrix *matrixB)
+{
+	_transpose_data data;
+	unsigned long int tiles;
+
+	if (!matrixA || !matrixB || !matrixA->rows || !matrixB->rows)
+		return 0;
+
+	if (matrixA->height != matrixB->width || matrixA->width != matrixB->height)
+		return 0;
+
+	if (!matrixA->height || !matrixA->width || matrixA->dtype != matrixB->dtype)
+		return 0;
+
+	/* Check if B can be written and does not share the rows of A, unless A
+	 * is transposed in place */
+	if (matrixB->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+	if (matrixA != matrixB && matrixA->rows == matrixB->rows)
+		return 0;
+
+	data.a = matrixA->rows;
+	data.b = matrixB->rows;
+	data.rows = matrixA->height;
+	data.cols = matrixA->width;
+	data.a_row = MATRIX_ROW_STEP(matrixA);
+	data.a_col = MATRIX_COL_STEP(matrixA);
+	data.b_row = MATRIX_ROW_STEP(matrixB);
+	data.b_col = MATRIX_COL_STEP(matrixB);
+	data.dtype = matrixA->dtype;
+
+	if (matrixA != matrixB) {
+		data.num_threads = (unsigned int)MIN(pool_threads(), data.cols);
+		if (!data.num_threads)
+			return 0;
+
+		return thread_pool_run(data.num_threads, matrix_transpose_task, &data, 0);
+	}
+
+	/* A square matrix is transposed in place as stored, whether it is a
+	 * transposed view or not */
+	data.a_row = data.b_row = matrixA->stride;
+	data.a_col = data.b_col = 1;
+
+	tiles = (data.rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+	data.num_threads = (unsigned int)MIN(pool_threads(), tiles * (tiles + 1) / 2);
+	if (!data.num_threads)
+		return 0;
+
+	return thread_pool_run_items(data.num_threads, tiles * tiles, matrix_transpose_tile, &data);
+}
+
+/* n elements of a dtype at p as floats: p itself for floats, else their
+ * conversion into line */
+static
+const float *float_line(float *line, const void *p, int dtype, unsigned long int n)
+{
+	if (dtype == MATRIX_DTYPE_F32)
+		return (const float *)p;
+
+	matrix_kernels->to_float(line, p, dtype, n);
+	return line;
+}
+
+/* Vectors are matrices of a single row or column, whose i-th element is at
+ * rows + i * VECTOR_STEP(v) */
+#define VECTOR_LENGTH(v) ((v)->height * (v)->width)
+#define VECTOR_STEP(v) ((v)->height == 1 ? MATRIX_COL_STEP(v) : MATRIX_ROW_STEP(v))
+
+/* y = alpha * op(A) * x + beta * y for dense float vectors, the rows of A in
+ * memory being the rows of op(A) or, if trans, its columns */
+typedef struct gemv_data {
+	Matrix *a;
+	const float *x;
+	float *y;
+	unsigned long int m, n;
+	float alpha, beta;
+	int trans;
+	unsigned int num_threads;
+} _gemv_data;
+
+/* Each thread computes its slab of y, by dot products of the rows of A or by
+ * sums of the slabs of the rows of A scaled by x */
+static
+int matrix_vector_gemv_task(unsigned int tid, void *args)
+{
+	_gemv_data *data = (_gemv_data *)args;
+	Matrix *a = data->a;
+	float line[CONVERT_CHUNK];
+	unsigned long int first, num, i, j, c, n;
+	const void *row;
+	float sum;
+
+	thread_rows(data->m, data->num_threads, tid, &first, &num);
+
+	if (!data->trans) {
+		for (i = first; i < first + num; ++i) {
+			row = DTYPE_AT(a->rows, a->dtype, i * a->stride);
+			for (c = 0, sum = 0.0f; c < data->n; c += n) {
+				n = MIN(CONVERT_CHUNK, data->n - c);
+				sum += matrix_kernels->dot(float_line(line, DTYPE_AT(row, a->dtype, c), a->dtype, n), data->x + c, n);
+			}
+			data->y[i] = data->beta == 0.0f ? data->alpha * sum : data->alpha * sum + data->beta * data->y[i];
+		}
+
+		return 1;
+	}
+
+	if (data->beta == 0.0f)
+		matrix_kernels->zero(data->y + first, num);
+	else if (data->beta != 1.0f)
+		matrix_kernels->scale(data->y + first, num, data->beta);
+
+	for (j = 0; j < data->n; ++j) {
+		row = DTYPE_AT(a->rows, a->dtype, j * a->stride + first);
+		for (c = 0; c < num; c += n) {
+			n = MIN(CONVERT_CHUNK, num - c);
+			matrix_kernels->add(data->y + first + c, data->y + first + c,
+					float_line(line, DTYPE_AT(row, a->dtype, c), a->dtype, n), data->alpha * data->x[j], n);
+		}
+	}
+
+	return 1;
+}
+
+/* Copies the elements of a vector to or from dense floats */
+static
+void vector_load(Matrix *v, float *dst)
+{
+	unsigned long int i;
+
+	for (i = 0; i < VECTOR_LENGTH(v); ++i)
+		dst[i] = v->height == 1 ? matrix_value(v, 0, i) : matrix_value(v, i, 0);
+}
+
+static
+void vector_store(Matrix *v, const float *src)
+{
+	unsigned long int i;
+	void *el;
+
+	for (i = 0; i < VECTOR_LENGTH(v); ++i) {
+		el = DTYPE_AT(v->rows, v->dtype, i * VECTOR_STEP(v));
+		if (v->dtype == MATRIX_DTYPE_F32)
+			*(float *)el = src[i];
+		else
+			*(uint16_t *)el = matrix_float_to_half(src[i], v->dtype);
+	}
+}
+
+int matrix_vector_gemv(float alpha, Matrix *matrixA, Matrix *vectorX, float beta, Matrix *vectorY, int flags)
+{
+	_gemv_data data;
+	float *x = NULL, *y = NULL;
+	int ret = 0;
+
+	if (!matrixA || !vectorX || !vectorY || !matrixA->rows || !vectorX->rows || !vectorY->rows)
+		return 0;
+
+	/* Check if x and y are vectors of the sizes of op(A) */
+	data.m = flags & MATRIX_TRANS_A ? matrixA->width : matrixA->height;
+	data.n = flags & MATRIX_TRANS_A ? matrixA->height : matrixA->width;
+	if (!data.m || !data.n || (vectorX->height != 1 && vectorX->width != 1)
+			|| (vectorY->height != 1 && vectorY->width != 1))
+		return 0;
+
+	if (VECTOR_LENGTH(vectorX) != data.n || VECTOR_LENGTH(vectorY) != data.m)
+		return 0;
+
+	if (vectorY->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	/* Vectors that are not dense floats go through dense copies */
+	if (vectorX->dtype == MATRIX_DTYPE_F32 && VECTOR_STEP(vectorX) == 1) {
+		data.x = vectorX->rows;
+	} else {
+		x = (float *)malloc(sizeof(float) * data.n);
+		if (!x)
+			goto fail1;
+
+		vector_load(vectorX, x);
+		data.x = x;
+	}
+
+	if (vectorY->dtype == MATRIX_DTYPE_F32 && VECTOR_STEP(vectorY) == 1) {
+		data.y = vectorY->rows;
+	} else {
+		y = (float *)malloc(sizeof(float) * data.m);
+		if (!y)
+			goto fail2;
+
+		if (beta != 0.0f)
+			vector_load(vectorY, y);
+		data.y = y;
+	}
+
+	data.a = matrixA;
+	data.alpha = alpha;
+	data.beta = beta;
+	data.trans = !(flags & MATRIX_TRANS_A) != !matrixA->transposed;
+
+	/* Never use more threads than there are elements of y */
+	data.num_threads = (unsigned int)MIN(pool_threads(), data.m);
+	if (!data.num_threads)
+		goto fail3;
+
+	ret = thread_pool_run(data.num_threads, matrix_vector_gemv_task, &data, 0);
+	if (ret && y)
+		vector_store(vectorY, y);
+
+fail3:
+	free(y);
+fail2:
+	free(x);
+fail1:
+	return ret;
+}
+
+/* dst = x + alpha * y for matrices of the same size, computed along the lines
+ * of dst */
+typedef struct matrix_add_data {
+	Matrix *x, *y, *dst;
+	float alpha;
+	unsigned int num_threads;
+} _matrix_add_data;
+
+/* n elements of line l of a matrix m, from the element first on, taken along
+ * the lines of a matrix stored transposed or not as floats. They are read in
+ * place when m is stored as such and holds floats */
+static
+const float *line_floats(float *line, Matrix *m, int transposed, unsigned long int l, unsigned long int first,
+		unsigned long int n)
+{
+	unsigned long int i;
+
+	if (m->transposed == transposed)
+		return float_line(line, transposed ? MATRIX_EL(m, first, l) : MATRIX_EL(m, l, first), m->dtype, n);
+
+	for (i = 0; i < n; ++i)
+		line[i] = transposed ? matrix_value(m, first + i, l) : matrix_value(m, l, first + i);
+
+	return line;
+}
+
+static
+int matrix_add_task(unsigned int tid, void *args)
+{
+	_matrix_add_data *data = (_matrix_add_data *)args;
+	Matrix *dst = data->dst;
+	float line_x[CONVERT_CHUNK], line_y[CONVERT_CHUNK];
+	unsigned long int first_line, lines, length, l, c, n;
+	const float *x, *y;
+	void *el;
+
+	length = MATRIX_LINE_LENGTH(dst);
+	thread_rows(MATRIX_LINES(dst), data->num_threads, tid, &first_line, &lines);
+	for (l = first_line; l < first_line + lines; ++l) {
+		for (c = 0; c < length; c += n) {
+			n = MIN(CONVERT_CHUNK, length - c);
+			x = line_floats(line_x, data->x, dst->transposed, l, c, n);
+			y = line_floats(line_y, data->y, dst->transposed, l, c, n);
+			el = DTYPE_AT(dst->rows, dst->dtype, l * dst->stride + c);
+			if (dst->dtype == MATRIX_DTYPE_F32) {
+				matrix_kernels->add((float *)el, x, y, data->alpha, n);
+			} else {
+				matrix_kernels->add(line_x, x, y, data->alpha, n);
+				matrix_kernels->from_float(el, line_x, dst->dtype, n);
+			}
+		}
+	}
+
+	return 1;
+}
+
+static
+int matrix_add(Matrix *matrixX, float alpha, Matrix *matrixY, Matrix *matrixD)
+{
+	_matrix_add_data data;
+
+	if (!matrixX || !matrixY || !matrixD || !matrixX->rows || !matrixY->rows || !matrixD->rows)
+		return 0;
+
+	if (matrixX->height != matrixD->height || matrixX->width != matrixD->width
+			|| matrixY->height != matrixD->height || matrixY->width != matrixD->width)
+		return 0;
+
+	if (matrixD->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	/* Never use more threads than there are lines */
+	data.num_threads = (unsigned int)MIN(pool_threads(), MATRIX_LINES(matrixD));
+	if (!data.num_threads)
+		return 0;
+
+	data.x = matrixX;
+	data.y = matrixY;
+	data.dst = matrixD;
+	data.alpha = alpha;
+
+	return thread_pool_run(data.num_threads, matrix_add_task, &data, 0);
+}
+
+int matrix_matrix_add(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC)
+{
+	return matrix_add(matrixA, 1.0f, matrixB, matrixC);
+}
+
+int matrix_axpy(float alpha, Matrix *matrixX, Matrix *matrixY)
+{
+	return matrix_add(matrixY, alpha, matrixX, matrixY);
+}
+
+/* First row of a sparse matrix starting at or past its nonzero nz, height if
+ * there is none */
+static
+unsigned long int sparse_row_at(const SparseMatrix *matrix, unsigned long int nz)
+{
+	unsigned long int low = 0, high = matrix->height, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (matrix->row_ptr[mid] < nz)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Splits the rows of a sparse matrix among num_threads threads so each gets
+ * about as many nonzeros, the last one taking the empty rows at the end.
+ * Stores the first row and the number of rows of thread tid */
+static
+void sparse_rows(const SparseMatrix *matrix, unsigned int num_threads, unsigned int tid,
+		unsigned long int *first_row, unsigned long int *num_rows)
+{
+	unsigned long int last_row;
+
+	*first_row = tid ? sparse_row_at(matrix, matrix->nnz / num_threads * tid
+			+ MIN(tid, matrix->nnz % num_threads)) : 0;
+	last_row = tid + 1 == num_threads ? matrix->height : sparse_row_at(matrix,
+			matrix->nnz / num_threads * (tid + 1) + MIN(tid + 1, matrix->nnz % num_threads));
+	*num_rows = last_row - *first_row;
+}
+
+/* C = A * B with A sparse, or A dense and B sparse, and y = A * x. The dense
+ * operands are float matrices or views stored as such */
+typedef struct sparse_mult_data {
+	SparseMatrix *s;
+	Matrix *d, *c;
+	const float *x;
+	float *y;
+	unsigned int num_threads;
+} _sparse_mult_data;
+
+/* Each row of C sums the rows of B picked by the nonzeros of its row of A */
+static
+int sparse_matrix_mult_task(unsigned int tid, void *args)
+{
+	_sparse_mult_data *data = (_sparse_mult_data *)args;
+	SparseMatrix *a = data->s;
+	Matrix *b = data->d, *c = data->c;
+	unsigned long int first_row, num_rows, i, p;
+	float *arr_c;
+
+	sparse_rows(a, data->num_threads, tid, &first_row, &num_rows);
+	for (i = first_row; i < first_row + num_rows; ++i) {
+		arr_c = c->rows + i * c->stride;
+		matrix_kernels->zero(arr_c, c->width);
+		for (p = a->row_ptr[i]; p < a->row_ptr[i + 1]; ++p)
+			matrix_kernels->add(arr_c, arr_c, b->rows + a->columns[p] * b->stride, a->values[p], c->width);
+	}
+
+	return 1;
+}
+
+/* Each row of C sums the rows of B scaled by its row of A, as the nonzeros of
+ * a row of B have distinct columns */
+static
+int matrix_sparse_mult_task(unsigned int tid, void *args)
+{
+	_sparse_mult_data *data = (_sparse_mult_data *)args;
+	SparseMatrix *b = data->s;
+	Matrix *a = data->d, *c = data->c;
+	unsigned long int first_row, num_rows, i, k, p;
+	float *arr_c, value;
+
+	thread_rows(c->height, data->num_threads, tid, &first_row, &num_rows);
+	for (i = first_row; i < first_row + num_rows; ++i) {
+		arr_c = c->rows + i * c->stride;
+		matrix_kernels->zero(arr_c, c->width);
+		for (k = 0; k < b->height; ++k) {
+			value = *(float *)MATRIX_EL(a, i, k);
+			if (value == 0.0f)
+				continue;
+
+			for (p = b->row_ptr[k]; p < b->row_ptr[k + 1]; ++p)
+				arr_c[b->columns[p]] += value * b->values[p];
+		}
+	}
+
+	return 1;
+}
+
+static
+int sparse_vector_mult_task(unsigned int tid, void *args)
+{
+	_sparse_mult_data *data = (_sparse_mult_data *)args;
+	SparseMatrix *a = data->s;
+	unsigned long int first_row, num_rows, i;
+
+	sparse_rows(a, data->num_threads, tid, &first_row, &num_rows);
+	for (i = first_row; i < first_row + num_rows; ++i)
+		data->y[i] = matrix_kernels->sparse_dot(a->values + a->row_ptr[i], a->columns + a->row_ptr[i], data->x,
+				a->row_ptr[i + 1] - a->row_ptr[i]);
+
+	return 1;
+}
+
+/* Checks that C = A * B can be computed and written, for float A, B and C, A
+ * or B being sparse */
+static
+int check_sparse_mult(unsigned long int m, unsigned long int n, unsigned long int k, Matrix *dense,
+		Matrix *matrixC)
+{
+	if (!dense || !matrixC || !dense->rows || !matrixC->rows)
+		return 0;
+
+	if (matrixC->height != m || matrixC->width != n || !m || !n || !k)
+		return 0;
+
+	if (dense->dtype != MATRIX_DTYPE_F32 || matrixC->dtype != MATRIX_DTYPE_F32)
+		return 0;
+
+	return !matrixC->transposed && !(matrixC->map_flags & MATRIX_MAP_READONLY);
+}
+
+int sparse_matrix_mult(SparseMatrix *matrixA, Matrix *matrixB, Matrix *matrixC)
+{
+	_sparse_mult_data data;
+
+	if (!matrixA || !matrixB || matrixB->height != matrixA->width || matrixB->transposed)
+		return 0;
+
+	if (!check_sparse_mult(matrixA->height, matrixB->width, matrixA->width, matrixB, matrixC))
+		return 0;
+
+	/* Never use more threads than there are rows */
+	data.num_threads = (unsigned int)MIN(pool_threads(), matrixC->height);
+	if (!data.num_threads)
+		return 0;
+
+	data.s = matrixA;
+	data.d = matrixB;
+	data.c = matrixC;
+
+	return thread_pool_run(data.num_threads, sparse_matrix_mult_task, &data, 0);
+}
+
+int matrix_sparse_mult(Matrix *matrixA, SparseMatrix *matrixB, Matrix *matrixC)
+{
+	_sparse_mult_data data;
+
+	if (!matrixA || !matrixB || matrixA->width != matrixB->height)
+		return 0;
+
+	if (!check_sparse_mult(matrixA->height, matrixB->width, matrixB->height, matrixA, matrixC))
+		return 0;
+
+	data.num_threads = (unsigned int)MIN(pool_threads(), matrixC->height);
+	if (!data.num_threads)
+		return 0;
+
+	data.s = matrixB;
+	data.d = matrixA;
+	data.c = matrixC;
+
+	return thread_pool_run(data.num_threads, matrix_sparse_mult_task, &data, 0);
+}
+
+int sparse_vector_mult(SparseMatrix *matrixA, Matrix *vectorX, Matrix *vectorY)
+{
+	_sparse_mult_data data;
+	float *x = NULL, *y = NULL;
+	int ret = 0;
+
+	if (!matrixA || !vectorX || !vectorY || !vectorX->rows || !vectorY->rows)
+		return 0;
+
+	if (!matrixA->height || !matrixA->width || (vectorX->height != 1 && vectorX->width != 1)
+			|| (vectorY->height != 1 && vectorY->width != 1))
+		return 0;
+
+	if (VECTOR_LENGTH(vectorX) != matrixA->width || VECTOR_LENGTH(vectorY) != matrixA->height)
+		return 0;
+
+	if (vectorY->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	/* Vectors that are not dense floats go through dense copies */
+	if (vectorX->dtype == MATRIX_DTYPE_F32 && VECTOR_STEP(vectorX) == 1) {
+		data.x = vectorX->rows;
+	} else {
+		x = (float *)malloc(sizeof(float) * matrixA->width);
+		if (!x)
+			goto fail1;
+
+		vector_load(vectorX, x);
+		data.x = x;
+	}
+
+	if (vectorY->dtype == MATRIX_DTYPE_F32 && VECTOR_STEP(vectorY) == 1) {
+		data.y = vectorY->rows;
+	} else {
+		y = (float *)malloc(sizeof(float) * matrixA->height);
+		if (!y)
+			goto fail2;
+
+		data.y = y;
+	}
+
+	data.s = matrixA;
+	data.num_threads = (unsigned int)MIN(pool_threads(), matrixA->height);
+	if (!data.num_threads)
+		goto fail3;
+
+	ret = thread_pool_run(data.num_threads, sparse_vector_mult_task, &data, 0);
+	if (ret && y)
+		vector_store(vectorY, y);
+
+fail3:
+	free(y);
+fail2:
+	free(x);
+fail1:
+	return ret;
+}
+
+static
+SparseMatrix *build_sparse_matrix(unsigned long int height, unsigned long int width, unsigned long int nnz)
+{
+	SparseMatrix *matrix;
+	unsigned long int size;
+
+	/* Counts from file headers may not fit in memory */
+	if (width > SPARSE_MAX_WIDTH || !matrix_size_add(height, 1, &size)
+			|| !matrix_size_mul(sizeof(unsigned long int), size, &size)
+			|| !matrix_size_mul(sizeof(float), nnz, &size))
+		return NULL;
+
+	matrix = (SparseMatrix *)malloc(sizeof(SparseMatrix));
+	if (!matrix)
+		goto fail1;
+
+	matrix->height = height;
+	matrix->width = width;
+	matrix->nnz = nnz;
+	matrix->row_ptr = (unsigned long int *)malloc(sizeof(unsigned long int) * (height + 1));
+	matrix->columns = (unsigned int *)malloc(sizeof(unsigned int) * (nnz ? nnz : 1));
+	matrix->values = (float *)malloc(sizeof(float) * (nnz ? nnz : 1));
+	if (!matrix->row_ptr || !matrix->columns || !matrix->values)
+		goto fail2;
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail2:
+	delete_sparse_matrix(matrix);
+fail1:
+	return NULL;
+}
+
+/* Counts the nonzeros first, then stores them row by row */
+SparseMatrix *convert_sparse_matrix(Matrix *matrix)
+{
+	SparseMatrix *sparse;
+	unsigned long int lin, col, nnz = 0;
+	float value;
+
+	if (!matrix || !matrix->rows)
+		return NULL;
+
+	for (lin = 0; lin < matrix->height; ++lin) {
+		for (col = 0; col < matrix->width; ++col)
+			nnz += matrix_value(matrix, lin, col) != 0.0f;
+	}
+
+	sparse = build_sparse_matrix(matrix->height, matrix->width, nnz);
+	if (!sparse)
+		return NULL;
+
+	for (lin = 0, nnz = 0; lin < matrix->height; ++lin) {
+		sparse->row_ptr[lin] = nnz;
+		for (col = 0; col < matrix->width; ++col) {
+			value = matrix_value(matrix, lin, col);
+			if (value == 0.0f)
+				continue;
+
+			sparse->columns[nnz] = (unsigned int)col;
+			sparse->values[nnz++] = value;
+		}
+	}
+	sparse->row_ptr[lin] = nnz;
+
+	return sparse;
+}
+
+SparseMatrix *read_sparse_binfile(const char *file_name)
+{
+	struct sparse_file file;
+	SparseMatrix *matrix;
+
+	if (!sparse_file_open(file_name, &file))
+		goto fail1;
+
+	matrix = build_sparse_matrix(file.header.height, file.header.width, file.header.nnz);
+	if (!matrix)
+		goto fail2;
+
+	if (!sparse_file_read(&file, (uint64_t *)matrix->row_ptr, matrix->columns, matrix->values))
+		goto fail3;
+
+	sparse_file_close(&file);
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail3:
+	delete_sparse_matrix(matrix);
+fail2:
+	sparse_file_close(&file);
+fail1:
+	return NULL;
+}
+
+void dump_sparse_binfile(const char *file_name, SparseMatrix *matrix)
+{
+	if (!sparse_file_write(file_name, matrix->height, matrix->width, (const uint64_t *)matrix->row_ptr,
+				matrix->columns, matrix->values)) {
+		fprintf(stderr, "ERRO: não foi possível escrever arquivo \"%s\"\n", file_name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void delete_sparse_matrix(SparseMatrix *matrix)
+{
+	if (!matrix)
+		return;
+
+	free(matrix->row_ptr);
+	free(matrix->columns);
+	free(matrix->values);
+	free(matrix);
+}
+
+/* Operations of the asynchronous calls. A dispatcher thread runs them in the
+ * order they were queued, each with the whole pool, while the caller goes on */
+#define REQUEST_SCALAR_MULT 0
+#define REQUEST_MATRIX_MULT 1
+
+struct matrix_request {
+	int op;
+	float scalar;
+	Matrix *a;
+	Matrix *b;
+	Matrix *c;
+	int done;
+	int result;
+	struct matrix_request *next;
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t async_thread;
+static int async_running = 0;
+static int async_shutdown = 0;
+static unsigned int async_pending = 0;
+static MatrixRequest *async_head = NULL;
+static MatrixRequest *async_tail = NULL;
+
+static
+void *async_main(void *args)
+{
+	MatrixRequest *request;
+	int ret;
+
+	(void)args;
+
+	pthread_mutex_lock(&async_lock);
+	for (;;) {
+		while (!async_head && !async_shutdown)
+			pthread_cond_wait(&async_work_cond, &async_lock);
+
+		/* The queue is drained before the thread stops */
+		if (!async_head)
+			break;
+
+		request = async_head;
+		async_head = request->next;
+		if (!async_head)
+			async_tail = NULL;
+		pthread_mutex_unlock(&async_lock);
+
+		if (request->op == REQUEST_SCALAR_MULT)
+			ret = scalar_matrix_mult(request->scalar, request->a);
+		else
+			ret = matrix_matrix_mult(request->a, request->b, request->c);
+
+		pthread_mutex_lock(&async_lock);
+		request->result = ret;
+		request->done = 1;
+		async_pending--;
+		pthread_cond_broadcast(&async_done_cond);
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return NULL;
+}
+
+/* Queues a request, starting the dispatcher on the first one. The pool is
+ * started here, so the dispatcher never races the caller to create it */
+static
+MatrixRequest *async_submit(MatrixRequest *request)
+{
+	if (!request)
+		return NULL;
+
+	if (!pool_threads())
+		goto fail1;
+
+	pthread_mutex_lock(&async_lock);
+	if (!async_running) {
+		async_shutdown = 0;
+		if (pthread_create(&async_thread, NULL, async_main, NULL))
+			goto fail2;
+		async_running = 1;
+	}
+
+	request->next = NULL;
+	if (async_tail)
+		async_tail->next = request;
+	else
+		async_head = request;
+	async_tail = request;
+	async_pending++;
+
+	pthread_cond_signal(&async_work_cond);
+	pthread_mutex_unlock(&async_lock);
+
+	return request;
+
+	/* ERROR CLEANUP */
+fail2:
+	pthread_mutex_unlock(&async_lock);
+fail1:
+	free(request);
+	return NULL;
+}
+
+/* Waits for the queued requests, so the pool can be changed */
+static
+void async_drain(void)
+{
+	pthread_mutex_lock(&async_lock);
+	while (async_pending)
+		pthread_cond_wait(&async_done_cond, &async_lock);
+	pthread_mutex_unlock(&async_lock);
+}
+
+static
+void async_stop(void)
+{
+	pthread_mutex_lock(&async_lock);
+	if (!async_running) {
+		pthread_mutex_unlock(&async_lock);
+		return;
+	}
+	async_shutdown = 1;
+	pthread_cond_signal(&async_work_cond);
+	pthread_mutex_unlock(&async_lock);
+
+	pthread_join(async_thread, NULL);
+	async_running = 0;
+}
+
+MatrixRequest *scalar_matrix_mult_async(float scalar_value, Matrix *matrix)
+{
+	MatrixRequest *request = (MatrixRequest *)calloc(1, sizeof(MatrixRequest));
+
+	if (request) {
+		request->op = REQUEST_SCALAR_MULT;
+		request->scalar = scalar_value;
+		request->a = matrix;
+	}
+
+	return async_submit(request);
+}
+
+MatrixRequest *matrix_matrix_mult_async(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC)
+{
+	MatrixRequest *request = (MatrixRequest *)calloc(1, sizeof(MatrixRequest));
+
+	if (request) {
+		request->op = REQUEST_MATRIX_MULT;
+		request->a = matrixA;
+		request->b = matrixB;
+		request->c = matrixC;
+	}
+
+	return async_submit(request);
+}
+
+/* Waits for the request and frees it. Returns 1 if it succeeded */
+int wait_matrix_request(MatrixRequest *request)
+{
+	int ret;
+
+	if (!request)
+		return 0;
+
+	pthread_mutex_lock(&async_lock);
+	while (!request->done)
+		pthread_cond_wait(&async_done_cond, &async_lock);
+	pthread_mutex_unlock(&async_lock);
+
+	ret = request->result;
+	free(request);
+
+	return ret;
+}
+
+/* Returns 1 and frees the request, storing in result whether it succeeded, if
+ * it is done, 0 if it is still running */
+int test_matrix_request(MatrixRequest *request, int *result)
+{
+	int done;
+
+	if (!request)
+		return 0;
+
+	pthread_mutex_lock(&async_lock);
+	done = request->done;
+	pthread_mutex_unlock(&async_lock);
+
+	if (!done)
+		return 0;
+
+	if (result)
+		*result = request->result;
+	free(request);
+
+	return 1;
+}
+
+/* Waits for one of the requests, skipping the NULL ones, and frees it. Returns
+ * its index, which is set to NULL, or -1 if all are NULL */
+int wait_any_matrix_request(MatrixRequest **requests, int num_requests, int *result)
+{
+	int i, any;
+
+	pthread_mutex_lock(&async_lock);
+	for (;;) {
+		any = 0;
+		for (i = 0; i < num_requests; ++i) {
+			if (!requests[i])
+				continue;
+
+			if (requests[i]->done)
+				goto found;
+			any = 1;
+		}
+
+		if (!any) {
+			pthread_mutex_unlock(&async_lock);
+			return -1;
+		}
+
+		pthread_cond_wait(&async_done_cond, &async_lock);
+	}
+
+found:
+	pthread_mutex_unlock(&async_lock);
+
+	if (result)
+		*result = requests[i]->result;
+	free(requests[i]);
+	requests[i] = NULL;
+
+	return i;
+}
+
+/* Value of the element of a matrix m at row r and column c */
+static
+float matrix_value(Matrix *m, unsigned long int r, unsigned long int c)
+{
+	if (m->dtype == MATRIX_DTYPE_F32)
+		return *(float *)MATRIX_EL(m, r, c);
+
+	return matrix_half_to_float(*(uint16_t *)MATRIX_EL(m, r, c), m->dtype);
+}
+
+void print_matrix(Matrix *matrix)
+{
+	register unsigned long int lin, col;
+	for (lin = 0; lin < matrix->height; ++lin) {
+		for (col = 0; col < matrix->width; ++col) {
+			printf("%5.2f\t", matrix_value(matrix, lin, col));
+		}
+		printf("\n");
+	}
+	printf("\n");
+}
+
+/* Number of bits of the node masks passed to the memory policy calls */
+#define NUMA_MAX_NODES 1024
+
+/* Interleaves the pages of [addr, addr + size) over the nodes the process may
+ * allocate memory from. Placement is a hint, so failures are ignored */
+static
+void numa_interleave(void *addr, unsigned long int size)
+{
+	unsigned long int nodes[NUMA_MAX_NODES / (8 * sizeof(unsigned long int))];
+
+	if (syscall(SYS_get_mempolicy, NULL, nodes, NUMA_MAX_NODES, NULL, MPOL_F_MEMS_ALLOWED) == 0)
+		syscall(SYS_mbind, addr, size, MPOL_INTERLEAVE, nodes, NUMA_MAX_NODES, 0);
+}
+
+/* Binds the pages of [addr, addr + size) to the node the calling thread runs
+ * on, moving the ones already touched */
+static
+void numa_bind_local(void *addr, unsigned long int size)
+{
+	unsigned long int nodes[NUMA_MAX_NODES / (8 * sizeof(unsigned long int))];
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= NUMA_MAX_NODES)
+		return;
+
+	memset(nodes, 0, sizeof(nodes));
+	nodes[node / (8 * sizeof(unsigned long int))] = 1UL << (node % (8 * sizeof(unsigned long int)));
+	syscall(SYS_mbind, addr, size, MPOL_BIND, nodes, NUMA_MAX_NODES, MPOL_MF_MOVE);
+}
+
+/* Reads count elements of a dtype at offset of the file fd into dst. Returns
+ * 1 if all of them were read */
+static
+int read_elements(int fd, void *dst, int dtype, unsigned long int count, off_t offset)
+{
+	char *arr_dst = (char *)dst;
+	size_t left = MATRIX_DTYPE_SIZE(dtype) * count;
+	ssize_t ret;
+
+	while (left) {
+		ret = pread(fd, arr_dst, left, offset);
+		if (ret <= 0)
+			return 0;
+		arr_dst += ret;
+		offset += ret;
+		left -= (size_t)ret;
+	}
+
+	return 1;
+}
+
+typedef struct fill_matrix_data {
+	Matrix *matrix;
+	const float *rows;
+	int fd;
+	off_t offset;
+	unsigned int num_threads;
+} _fill_data;
+
+/* First touch of the slab of rows of worker tid, split as in the kernels, so
+ * its pages are placed on the node of the worker that will use them */
+static
+int fill_matrix_task(unsigned int tid, void *args)
+{
+	unsigned long int first_row, lines, begin, end;
+	long int page = sysconf(_SC_PAGESIZE);
+	_fill_data *data = (_fill_data *)args;
+	Matrix *matrix = data->matrix;
+	unsigned long int size = MATRIX_DTYPE_SIZE(matrix->dtype);
+	char *arr_rows;
+
+	thread_rows(matrix->height, data->num_threads, tid, &first_row, &lines);
+	arr_rows = (char *)matrix->rows + size * first_row * matrix->width;
+
+	/* A page shared by two slabs goes with the slab it starts in */
+	if (numa_policy == NUMA_POLICY_BIND) {
+		begin = (unsigned long int)arr_rows & ~(page - 1);
+		if (tid == data->num_threads - 1)
+			end = (unsigned long int)matrix->map_addr + matrix->map_size;
+		else
+			end = (unsigned long int)(arr_rows + size * lines * matrix->width) & ~(page - 1);
+
+		if (end > begin)
+			numa_bind_local((void *)begin, end - begin);
+	}
+
+	if (data->fd >= 0)
+		return read_elements(data->fd, arr_rows, matrix->dtype, lines * matrix->width,
+				data->offset + size * first_row * matrix->width);
+	else if (data->rows)
+		matrix_kernels->copy((float *)arr_rows, data->rows + first_row * matrix->width, lines * matrix->width);
+	else if (matrix->dtype == MATRIX_DTYPE_F32)
+		matrix_kernels->zero((float *)arr_rows, lines * matrix->width);
+	else
+		memset(arr_rows, 0, size * lines * matrix->width);
+
+	return 1;
+}
+
+/* Fills the matrix with the elements at offset of the file fd if fd >= 0, with
+ * the floats of rows if it is not NULL or with zeroes otherwise. Depending on
+ * the NUMA policy the first touch is done by the pool workers */
+static
+int fill_matrix(Matrix *matrix, const float *rows, int fd, off_t offset)
+{
+	_fill_data data;
+
+	if (numa_policy == NUMA_POLICY_FIRST_TOUCH || numa_policy == NUMA_POLICY_BIND) {
+		data.num_threads = (unsigned int)MIN(pool_threads(), matrix->height);
+		if (data.num_threads) {
+			data.matrix = matrix;
+			data.rows = rows;
+			data.fd = fd;
+			data.offset = offset;
+			return thread_pool_run(data.num_threads, fill_matrix_task, &data, 0);
+		}
+	}
+
+	if (fd >= 0)
+		return read_elements(fd, matrix->rows, matrix->dtype, matrix->height * matrix->width, offset);
+	else if (rows)
+		matrix_kernels->copy(matrix->rows, rows, matrix->height * matrix->width);
+	else if (matrix->dtype == MATRIX_DTYPE_F32)
+		matrix_kernels->zero(matrix->rows, matrix->height * matrix->width);
+	else
+		memset(matrix->rows, 0, MATRIX_DTYPE_SIZE(matrix->dtype) * matrix->height * matrix->width);
+
+	return 1;
+}
+
+static
+Matrix *build_matrix(unsigned long int height, unsigned long int width, int dtype)
+{
+	unsigned long int size, page;
+	Matrix *matrix;
+
+	/* Dimensions from file headers may not fit in memory */
+	if (!matrix_size_mul(height, width, &size) || !matrix_size_mul(MATRIX_DTYPE_SIZE(dtype), size, &size)
+			|| !matrix_size_add(size, 31, &size))
+		return NULL;
+
+	matrix = (Matrix *)malloc(sizeof(Matrix));
+	if (!matrix) {
+		return NULL;
+	}
+
+	matrix->width = width;
+	matrix->height = height;
+	matrix->dtype = dtype;
+	matrix->stride = width;
+	matrix->transposed = 0;
+	matrix->parent = NULL;
+	matrix->map_addr = NULL;
+	matrix->map_size = 0;
+	matrix->map_flags = 0;
+
+	/* aligned_alloc needs a size multiple of the alignment */
+	size &= ~31UL;
+
+	if (numa_policy == NUMA_POLICY_DEFAULT) {
+		matrix->rows = (float *)aligned_alloc(32, size);
+		if (!matrix->rows) {
+			free(matrix);
+			return NULL;
+		}
+
+		return matrix;
+	}
+
+	/* Other policies need fresh pages that nobody touched yet */
+	page = (unsigned long int)sysconf(_SC_PAGESIZE);
+	size = size ? (size + page - 1) & ~(page - 1) : page;
+	matrix->map_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (matrix->map_addr == MAP_FAILED) {
+		free(matrix);
+		return NULL;
+	}
+
+	matrix->map_size = size;
+	matrix->rows = (float *)matrix->map_addr;
+
+	if (numa_policy == NUMA_POLICY_INTERLEAVE)
+		numa_interleave(matrix->map_addr, size);
+
+	return matrix;
+}
+
+Matrix *new_matrix(unsigned long int height, unsigned long int width, float *rows)
+{
+	Matrix *matrix = build_matrix(height, width, MATRIX_DTYPE_F32);
+
+	if (matrix && !fill_matrix(matrix, rows, -1, 0)) {
+		delete_matrix(matrix);
+		return NULL;
+	}
+
+	return matrix;
+}
+
+Matrix *zero_matrix(unsigned long int height, unsigned long int width)
+{
+	return zero_matrix_dtype(height, width, MATRIX_DTYPE_F32);
+}
+
+Matrix *zero_matrix_dtype(unsigned long int height, unsigned long int width, int dtype)
+{
+	Matrix *matrix;
+
+	if (dtype < MATRIX_DTYPE_F32 || dtype > MATRIX_DTYPE_F16)
+		return NULL;
+
+	matrix = build_matrix(height, width, dtype);
+	if (matrix && !fill_matrix(matrix, NULL, -1, 0)) {
+		delete_matrix(matrix);
+		return NULL;
+	}
+
+	return matrix;
+}
+
+/* The elements are converted a chunk of a row at a time, through floats */
+Matrix *convert_matrix(Matrix *matrix, int dtype)
+{
+	float line[CONVERT_CHUNK];
+	unsigned long int lin, col, i, n;
+	Matrix *copy;
+
+	if (!matrix || !matrix->rows)
+		return NULL;
+
+	copy = zero_matrix_dtype(matrix->height, matrix->width, dtype);
+	if (!copy)
+		return NULL;
+
+	for (lin = 0; lin < matrix->height; ++lin) {
+		for (col = 0; col < matrix->width; col += n) {
+			n = MIN(CONVERT_CHUNK, matrix->width - col);
+			if (matrix->transposed) {
+				for (i = 0; i < n; ++i)
+					line[i] = matrix_value(matrix, lin, col + i);
+			} else {
+				matrix_kernels->to_float(line, MATRIX_EL(matrix, lin, col), matrix->dtype, n);
+			}
+			matrix_kernels->from_float(MATRIX_EL(copy, lin, col), line, dtype, n);
+		}
+	}
+
+	return copy;
+}
+
+/* Reads the matrix straight into its rows. A formatted file gives its own
+ * dimensions, which must match m_width and m_height unless they are 0, and its
+ * data is checked against the checksums. A raw file of floats needs both
+ * dimensions and must hold all of the rows */
+Matrix *read_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height)
+{
+	struct matrix_file file;
+	Matrix *matrix;
+
+	if (matrix_file_open(file_name, &file) < 0)
+		goto fail1;
+
+	if (!matrix_file_shape(&file, &m_width, &m_height))
+		goto fail2;
+
+	matrix = build_matrix(m_height, m_width, (int)file.header.dtype);
+	if (!matrix)
+		goto fail2;
+
+	/* Dense data is read by the workers placing the pages */
+	if (matrix_file_is_dense(&file)) {
+		if (!fill_matrix(matrix, NULL, file.fd, (off_t)file.header.data_offset)
+				|| !matrix_file_verify(&file, matrix->rows))
+			goto fail3;
+	} else if (!matrix_file_read(&file, matrix->rows)) {
+		goto fail3;
+	}
+
+	matrix_file_close(&file);
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail3:
+	delete_matrix(matrix);
+fail2:
+	matrix_file_close(&file);
+fail1:
+	return NULL;
+}
+
+/* Builds a matrix whose rows are the pages of the file itself, so nothing is
+ * read up front: pages come in on first access while the kernels run, which
+ * also means the checksums of a formatted file are not checked. Only formatted
+ * files stored as the library stores matrices, and raw files, can be mapped.
+ * MATRIX_MAP_READONLY shares the pages with the file and rejects operations
+ * writing to the matrix; MATRIX_MAP_COW gives the matrix private copies of the
+ * pages it writes to, leaving the file untouched */
+Matrix *map_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height, int flags)
+{
+	struct matrix_file file;
+	Matrix *matrix;
+	struct stat st;
+	unsigned long int offset, size;
+	int prot, mode;
+
+	if (matrix_file_open(file_name, &file) < 0)
+		goto fail1;
+
+	if (!matrix_file_shape(&file, &m_width, &m_height) || !matrix_file_is_dense(&file))
+		goto fail2;
+
+	offset = file.header.data_offset;
+	size = offset + MATRIX_DTYPE_SIZE(file.header.dtype) * m_width * m_height;
+	if (fstat(file.fd, &st) != 0 || (unsigned long int)st.st_size < size)
+		goto fail2;
+
+	matrix = (Matrix *)malloc(sizeof(Matrix));
+	if (!matrix)
+		goto fail2;
+
+	if (flags & MATRIX_MAP_READONLY) {
+		prot = PROT_READ;
+		mode = MAP_SHARED;
+	} else {
+		prot = PROT_READ | PROT_WRITE;
+		mode = MAP_PRIVATE;
+	}
+
+	/* The data starts on a page boundary, but the header is mapped too so
+	 * the whole file goes with a single mapping */
+	matrix->map_addr = mmap(NULL, size, prot, mode, file.fd, 0);
+	if (matrix->map_addr == MAP_FAILED)
+		goto fail3;
+
+	/* Start reading the file in the background */
+	madvise((char *)matrix->map_addr + offset, size - offset, MADV_WILLNEED);
+	matrix_file_close(&file);
+
+	matrix->height = m_height;
+	matrix->width = m_width;
+	matrix->dtype = (int)file.header.dtype;
+	matrix->stride = m_width;
+	matrix->transposed = 0;
+	matrix->parent = NULL;
+	matrix->rows = (float *)((char *)matrix->map_addr + offset);
+	matrix->map_size = size;
+	matrix->map_flags = flags;
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail3:
+	free(matrix);
+fail2:
+	matrix_file_close(&file);
+fail1:
+	return NULL;
+}
+
+void dump_matrix_binfile(const char *file_name, Matrix *matrix)
+{
+	unsigned long int lin, col;
+	unsigned long int size = MATRIX_DTYPE_SIZE(matrix->dtype);
+	void *rows = matrix->rows;
+
+	/* The elements of views are gathered in a dense copy first */
+	if (matrix->transposed || matrix->stride != matrix->width) {
+		rows = malloc(size * matrix->height * matrix->width);
+		for (lin = 0; rows && lin < matrix->height; ++lin) {
+			for (col = 0; col < matrix->width; ++col)
+				memcpy(DTYPE_AT(rows, matrix->dtype, lin * matrix->width + col),
+						MATRIX_EL(matrix, lin, col), size);
+		}
+	}
+
+	if (!rows || !matrix_file_write(file_name, rows, matrix->height, matrix->width, matrix->dtype)) {
+		fprintf(stderr, "ERRO: não foi possível escrever arquivo \"%s\"\n", file_name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (rows != matrix->rows)
+		free(rows);
+}
+
+/* The out-of-core multiplication holds a panel of rows of C and, for each step,
+ * the chunk of the panel rows of A and the chunk of rows of B over the same
+ * range of k. A reader thread loads the chunks of the next step and writes
+ * finished panels of C while the pool computes, so every buffer is doubled */
+typedef struct gemm_stream {
+	struct matrix_file file_a, file_b, file_c;
+	unsigned long int m, n, k, panel_m, chunk_k, num_chunks, num_steps, num_panels;
+	float *buf_a[2], *buf_b[2], *buf_c[2];
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long int loaded, consumed; /* steps */
+	unsigned long int finished, written; /* panels */
+	int failed;
+} _gemm_stream;
+
+/* Loads the chunks of A and B of step s into the buffers s % 2 */
+static
+int gemm_stream_load(_gemm_stream *stream, unsigned long int s)
+{
+	unsigned long int i, rows, first_row, first_k, chunk_k;
+	float *buf_a = stream->buf_a[s % 2];
+	int fd_a = stream->file_a.fd;
+	unsigned long int a_offset = stream->file_a.header.data_offset;
+
+	first_row = s / stream->num_chunks * stream->panel_m;
+	first_k = s % stream->num_chunks * stream->chunk_k;
+	rows = MIN(stream->panel_m, stream->m - first_row);
+	chunk_k = MIN(stream->chunk_k, stream->k - first_k);
+
+	if (chunk_k == stream->k) {
+		if (!read_elements(fd_a, buf_a, MATRIX_DTYPE_F32, rows * chunk_k,
+					a_offset + sizeof(float) * first_row * stream->k))
+			return 0;
+	} else {
+		for (i = 0; i < rows; ++i) {
+			if (!read_elements(fd_a, buf_a + i * chunk_k, MATRIX_DTYPE_F32, chunk_k,
+						a_offset + sizeof(float) * ((first_row + i) * stream->k + first_k)))
+				return 0;
+		}
+	}
+
+	/* With one or two chunks the buffer already holds the chunk of B */
+	if (s >= 2 && stream->num_chunks <= 2)
+		return 1;
+
+	return read_elements(stream->file_b.fd, stream->buf_b[s % 2], MATRIX_DTYPE_F32, chunk_k * stream->n,
+			stream->file_b.header.data_offset + sizeof(float) * first_k * stream->n);
+}
+
+static
+int gemm_stream_write(_gemm_stream *stream, unsigned long int panel)
+{
+	unsigned long int first_row = panel * stream->panel_m;
+	unsigned long int rows = MIN(stream->panel_m, stream->m - first_row);
+
+	return matrix_file_write_at(stream->file_c.fd, stream->buf_c[panel % 2], sizeof(float) * rows * stream->n,
+			stream->file_c.header.data_offset + sizeof(float) * first_row * stream->n);
+}
+
+/* Reader thread: writes the panels of C as they are finished and loads the
+ * steps ahead as their buffers are released */
+static
+void *gemm_stream_reader(void *args)
+{
+	_gemm_stream *stream = (_gemm_stream *)args;
+	unsigned long int s;
+	int ret;
+
+	pthread_mutex_lock(&stream->lock);
+	while (!stream->failed) {
+		if (stream->written < stream->finished) {
+			s = stream->written;
+			pthread_mutex_unlock(&stream->lock);
+			ret = gemm_stream_write(stream, s);
+			pthread_mutex_lock(&stream->lock);
+			stream->written += ret;
+		} else if (stream->loaded < stream->num_steps && stream->loaded < stream->consumed + 2) {
+			s = stream->loaded;
+			pthread_mutex_unlock(&stream->lock);
+			ret = gemm_stream_load(stream, s);
+			pthread_mutex_lock(&stream->lock);
+			stream->loaded += ret;
+		} else if (stream->written == stream->num_panels) {
+			break;
+		} else {
+			pthread_cond_wait(&stream->cond, &stream->lock);
+			continue;
+		}
+
+		stream->failed = !ret;
+		pthread_cond_broadcast(&stream->cond);
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return NULL;
+}
+
+/* Sizes the chunks so the doubled buffers fit in the memory budget: the
+ * chunks of B take at most half of it, the panels of C and chunks of A the
+ * rest. Returns 0 if not even a row fits */
+static
+int gemm_stream_plan(_gemm_stream *stream)
+{
+	unsigned long int floats = stream_budget / sizeof(float);
+	unsigned long int m = stream->m, n = stream->n, k = stream->k;
+	unsigned long int chunk_k, panel_m;
+
+	chunk_k = MIN(k, floats / (4 * n));
+	if (chunk_k > GEMM_KC)
+		chunk_k -= chunk_k % GEMM_KC;
+	if (!chunk_k)
+		return 0;
+
+	panel_m = MIN(m, (floats - 2 * chunk_k * n) / (2 * n + 2 * chunk_k));
+	if (panel_m > GEMM_MC && panel_m < m)
+		panel_m -= panel_m % GEMM_MC;
+	if (!panel_m)
+		return 0;
+
+	stream->chunk_k = chunk_k;
+	stream->panel_m = panel_m;
+	stream->num_chunks = (k + chunk_k - 1) / chunk_k;
+	stream->num_panels = (m + panel_m - 1) / panel_m;
+	stream->num_steps = stream->num_chunks * stream->num_panels;
+
+	return 1;
+}
+
+/* Multiplies the matrices of two formatted files into a new file without
+ * loading them: C is computed a panel of rows at a time while the chunks of A
+ * and B it needs are streamed from the files, using at most the memory set
+ * with set_memory_budget. The checksums of A and B are not checked, those of C
+ * are computed once it is written */
+int matrix_matrix_mult_binfile(const char *matrixA_file, const char *matrixB_file, const char *matrixC_file)
+{
+	_gemm_stream stream;
+	pthread_t reader;
+	unsigned long int s, i, p, rows, chunk_k;
+	int ret = 0;
+
+	if (matrix_file_open(matrixA_file, &stream.file_a) != 1)
+		goto fail1;
+
+	if (matrix_file_open(matrixB_file, &stream.file_b) != 1)
+		goto fail2;
+
+	/* Only dense, non empty, float matrices that can be multiplied */
+	stream.m = stream.file_a.header.height;
+	stream.k = stream.file_a.header.width;
+	stream.n = stream.file_b.header.width;
+	if (!matrix_file_is_dense(&stream.file_a) || !matrix_file_is_dense(&stream.file_b)
+			|| stream.file_a.header.dtype != MATRIX_DTYPE_F32 || stream.file_b.header.dtype != MATRIX_DTYPE_F32
+			|| stream.file_b.header.height != stream.k || !stream.m || !stream.n || !stream.k)
+		goto fail3;
+
+	if (!gemm_stream_plan(&stream))
+		goto fail3;
+
+	stream.buf_a[0] = (float *)malloc(sizeof(float) * 2 * (stream.panel_m * stream.chunk_k
+				+ stream.chunk_k * stream.n + stream.panel_m * stream.n));
+	if (!stream.buf_a[0])
+		goto fail3;
+	stream.buf_a[1] = stream.buf_a[0] + stream.panel_m * stream.chunk_k;
+	stream.buf_b[0] = stream.buf_a[1] + stream.panel_m * stream.chunk_k;
+	stream.buf_b[1] = stream.buf_b[0] + stream.chunk_k * stream.n;
+	stream.buf_c[0] = stream.buf_b[1] + stream.chunk_k * stream.n;
+	stream.buf_c[1] = stream.buf_c[0] + stream.panel_m * stream.n;
+
+	if (!matrix_file_create(matrixC_file, stream.m, stream.n, MATRIX_DTYPE_F32, &stream.file_c))
+		goto fail4;
+
+	pthread_mutex_init(&stream.lock, NULL);
+	pthread_cond_init(&stream.cond, NULL);
+	stream.loaded = stream.consumed = stream.finished = stream.written = 0;
+	stream.failed = 0;
+
+	if (pthread_create(&reader, NULL, gemm_stream_reader, &stream) != 0)
+		goto fail5;
+
+	for (s = 0; s < stream.num_steps; ++s) {
+		i = s / stream.num_chunks;
+		p = s % stream.num_chunks;
+		rows = MIN(stream.panel_m, stream.m - i * stream.panel_m);
+		chunk_k = MIN(stream.chunk_k, stream.k - p * stream.chunk_k);
+
+		/* Wait for the chunks of the step and, on a new panel, for the
+		 * panel that used its buffer to be written */
+		pthread_mutex_lock(&stream.lock);
+		while (!stream.failed && (stream.loaded <= s || (p == 0 && stream.written + 2 <= i)))
+			pthread_cond_wait(&stream.cond, &stream.lock);
+		ret = !stream.failed;
+		pthread_mutex_unlock(&stream.lock);
+		if (!ret)
+			break;
+
+		ret = gemm_parallel(rows, stream.n, chunk_k,
+				stream.buf_a[s % 2], chunk_k, MATRIX_DTYPE_F32,
+				stream.buf_b[s % 2], stream.n, MATRIX_DTYPE_F32,
+				stream.buf_c[i % 2], stream.n, MATRIX_DTYPE_F32, 0, p ? &gemm_accumulate : &gemm_store, NULL);
+
+		pthread_mutex_lock(&stream.lock);
+		stream.failed |= !ret;
+		stream.consumed = s + 1;
+		if (p == stream.num_chunks - 1)
+			stream.finished = i + 1;
+		pthread_cond_broadcast(&stream.cond);
+		pthread_mutex_unlock(&stream.lock);
+	}
+
+	/* A failed step stops the reader, which otherwise stops once the last
+	 * panel is written */
+	pthread_mutex_lock(&stream.lock);
+	stream.failed |= s != stream.num_steps;
+	pthread_cond_broadcast(&stream.cond);
+	pthread_mutex_unlock(&stream.lock);
+	pthread_join(reader, NULL);
+
+	ret = !stream.failed && matrix_file_finish(&stream.file_c);
+
+	/* ERROR CLEANUP */
+fail5:
+	pthread_cond_destroy(&stream.cond);
+	pthread_mutex_destroy(&stream.lock);
+	matrix_file_close(&stream.file_c);
+	if (!ret)
+		unlink(matrixC_file);
+fail4:
+	free(stream.buf_a[0]);
+fail3:
+	matrix_file_close(&stream.file_b);
+fail2:
+	matrix_file_close(&stream.file_a);
+fail1:
+	return ret;
+}
+
+/* Builds a height x width view of the matrix from row r and column c, with
+ * its rows transposed if set */
+static
+Matrix *build_view(Matrix *matrix, unsigned long int r, unsigned long int c,
+		unsigned long int height, unsigned long int width, int transposed)
+{
+	Matrix *view = (Matrix *)malloc(sizeof(Matrix));
+	if (!view)
+		return NULL;
+
+	*view = *matrix;
+	view->height = height;
+	view->width = width;
+	view->rows = (float *)MATRIX_EL(matrix, r, c);
+	view->transposed = transposed;
+	view->parent = matrix->parent ? matrix->parent : matrix;
+	view->map_addr = NULL;
+	view->map_size = 0;
+
+	return view;
+}
+
+Matrix *view_matrix_rows(Matrix *matrix, unsigned long int first_row, unsigned long int num_rows)
+{
+	if (!matrix || !matrix->rows || !num_rows || first_row >= matrix->height
+			|| num_rows > matrix->height - first_row)
+		return NULL;
+
+	return build_view(matrix, first_row, 0, num_rows, matrix->width, matrix->transposed);
+}
+
+Matrix *view_matrix_columns(Matrix *matrix, unsigned long int first_column, unsigned long int num_columns)
+{
+	if (!matrix || !matrix->rows || !num_columns || first_column >= matrix->width
+			|| num_columns > matrix->width - first_column)
+		return NULL;
+
+	return build_view(matrix, 0, first_column, matrix->height, num_columns, matrix->transposed);
+}
+
+Matrix *view_matrix_transpose(Matrix *matrix)
+{
+	if (!matrix || !matrix->rows)
+		return NULL;
+
+	return build_view(matrix, 0, 0, matrix->width, matrix->height, !matrix->transposed);
+}
+
+void delete_matrix(Matrix *matrix)
+{
+	/* Views only own their struct */
+	if (!matrix->parent) {
+		if (matrix->map_addr)
+			munmap(matrix->map_addr, matrix->map_size);
+		else
+			free(matrix->rows);
+	}
+	free(matrix);
+}
+
+#ifdef MATRIX_LIB_UNIFIED
+/* Matrix on the stack for host rows, owning nothing */
+static
+void host_matrix(Matrix *matrix, const struct host_rows *rows)
+{
+	memset(matrix, 0, sizeof(Matrix));
+	matrix->height = rows->height;
+	matrix->width = rows->width;
+	matrix->rows = (float *)rows->rows;
+	matrix->dtype = rows->dtype;
+	matrix->stride = rows->stride;
+	matrix->transposed = rows->transposed;
+}
+
+int host_rows_gemm(float alpha, const struct host_rows *a, const struct host_rows *b, float beta,
+		const struct host_rows *c, int flags, const struct matrix_epilogue *epilogue)
+{
+	Matrix matrixA, matrixB, matrixC;
+
+	host_matrix(&matrixA, a);
+	host_matrix(&matrixB, b);
+	host_matrix(&matrixC, c);
+
+	return matrix_matrix_gemm(alpha, &matrixA, &matrixB, beta, &matrixC, flags, epilogue);
+}
+
+int host_rows_scale(float scalar_value, const struct host_rows *matrix)
+{
+	Matrix host;
+
+	host_matrix(&host, matrix);
+
+	return scalar_matrix_mult(scalar_value, &host);
+}
+#endif
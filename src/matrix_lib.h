@@ -1,35 +1,209 @@
 #ifndef _MATRIX_LIB_H
 #define _MATRIX_LIB_H
 
+/* Nodes a host can have */
+#define VE_MAX_NODES 8
+
+struct ve_node;
+struct matrix_request;
+
 struct matrix {
 	unsigned long int height;
 	unsigned long int width;
-	float *vh_rows;
+	float *vh_rows;              /* 16-bit dtypes are read as uint16_t       */
 	void *ve_rows;
+	int dtype;                   /* MATRIX_DTYPE_* of the elements           */
+	unsigned long int stride;    /* elements between the rows in memory      */
+	int transposed;              /* rows stored as columns, stride apart     */
+	struct matrix *parent;       /* matrix holding the rows of a view        */
+	unsigned long int offset;    /* elements from the rows of the parent     */
+	void *map_addr;              /* mapping holding vh_rows, NULL if malloc'd */
+	unsigned long int map_size;  /* size of the mapping in bytes             */
+	int map_flags;               /* MATRIX_MAP_* flags of file mappings      */
+	int vh_valid;                /* vh_rows hold the current values          */
+	int ve_valid;                /* ve_rows hold the current values          */
+};
+
+/* Float matrix in CSR: the nonzeros of row i are the values[p] at columns
+ * columns[p], for p from row_ptr[i] to row_ptr[i + 1] - 1 */
+struct sparse_matrix {
+	unsigned long int height;
+	unsigned long int width;     /* at most SPARSE_MAX_WIDTH              */
+	unsigned long int nnz;       /* nonzeros, row_ptr[height]             */
+	unsigned long int *row_ptr;  /* height + 1 offsets                    */
+	unsigned int *columns;
+	float *values;
+	void *ve_arrays;             /* the arrays on the VE, NULL if not loaded */
+};
+
+/* Types of the elements of the matrices, as in the matrix files. bf16 is the
+ * upper half of a float and f16 the IEEE 754 half precision */
+#define MATRIX_DTYPE_F32  0
+#define MATRIX_DTYPE_BF16 1
+#define MATRIX_DTYPE_F16  2
+
+/* Modes of the matrices mapped from files */
+#define MATRIX_MAP_COW      0 /* writes go to private copies of the pages */
+#define MATRIX_MAP_READONLY 1 /* pages shared with the file, no writes    */
+
+/* Transposes of the operands of matrix_matrix_gemm */
+#define MATRIX_TRANS_A 1
+#define MATRIX_TRANS_B 2
+
+/* Activations of the GEMM epilogue */
+#define MATRIX_ACT_NONE  0
+#define MATRIX_ACT_RELU  1
+#define MATRIX_ACT_CLAMP 2 /* to [clamp_min, clamp_max]     */
+#define MATRIX_ACT_GELU  3 /* tanh approximation of the GELU */
+
+/* Applied by the VE to each element of C while it is in vector registers:
+ * bias[j] is added to column j (no bias if NULL), then the activation */
+struct matrix_epilogue {
+	const float *bias;
+	int activation;
+	float clamp_min, clamp_max;
 };
 
+/* The scalar and general products take matrices of any dtype, sent to the VE
+ * as they are stored: the VE converts them to floats, accumulates in floats
+ * and rounds the elements of C once. The batched, pipelined and sharded
+ * products take float matrices only */
 int scalar_matrix_mult(float scalar_value, struct matrix *matrix);
 int matrix_matrix_mult(struct matrix *matrixA, struct matrix * matrixB, struct matrix * matrixC);
+/* C = alpha * op(A) * op(B) + beta * C followed by the epilogue (none if
+ * NULL), op transposing the operands set in flags (MATRIX_TRANS_*). C is only
+ * sent to the VE when beta is not 0 */
+int matrix_matrix_gemm(float alpha, struct matrix *matrixA, struct matrix *matrixB, float beta,
+		struct matrix *matrixC, int flags, const struct matrix_epilogue *epilogue);
+/* Products of a batch run by a single VE call, each one by a single thread.
+ * The strided batch stacks them in the rows of A, B and C, and a B holding a
+ * single product is shared by all */
+int matrix_matrix_mult_batched(struct matrix **matrixA, struct matrix **matrixB, struct matrix **matrixC,
+		unsigned long int batch);
+int matrix_matrix_mult_strided(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC,
+		unsigned long int batch);
+int matrix_matrix_mult_pipelined(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC);
+int matrix_matrix_mult_sharded(struct ve_node **nodes, int num_nodes, struct matrix *matrixA,
+		struct matrix *matrixB, struct matrix *matrixC);
+
+/* B = A^T, A being transposed in place if B is A itself, which must then be
+ * square. Otherwise A and B must not share their rows, and must have the same
+ * dtype, which may be any */
+int matrix_transpose(struct matrix *matrixA, struct matrix *matrixB);
+/* y = alpha * op(A) * x + beta * y for float matrices, op transposing A if
+ * MATRIX_TRANS_A is set in flags, x and y being matrices of a single row or
+ * column. y is only sent to the VE when beta is not 0 */
+int matrix_vector_gemv(float alpha, struct matrix *matrixA, struct matrix *vectorX, float beta,
+		struct matrix *vectorY, int flags);
+/* C = A + B and Y = alpha * X + Y for float matrices of the same size. The
+ * result may be one of the operands but must not overlap them otherwise */
+int matrix_matrix_add(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC);
+int matrix_axpy(float alpha, struct matrix *matrixX, struct matrix *matrixY);
+/* C = A * B with A or B sparse, and y = A * x with A sparse and x and y
+ * matrices of a single row or column. The VE threads split the rows of a
+ * sparse A by their nonzeros. The dense A, B and C are float matrices, B not
+ * being a transposed view when A is sparse */
+int sparse_matrix_mult(struct sparse_matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC);
+int matrix_sparse_mult(struct matrix *matrixA, struct sparse_matrix *matrixB, struct matrix *matrixC);
+int sparse_vector_mult(struct sparse_matrix *matrixA, struct matrix *vectorX, struct matrix *vectorY);
 
 void set_ve_execution_node(int num_node);
 void set_number_threads(int num_threads);
+void set_ve_panel_rows(unsigned long int rows);
 
+/* The matrices are loaded on the node set with set_ve_execution_node, and the
+ * sharded product runs on nodes opened on their own */
 int init_proc_ve_node(void);
 int close_proc_ve_node(void);
 
+struct ve_node *open_ve_node(int num_node);
+int close_ve_node(struct ve_node *node);
+
 int load_ve_matrix(struct matrix *matrix);
 int unload_ve_matrix(struct matrix *matrix);
+/* Sparse matrices are sent whole when they are loaded, and must be unloaded
+ * and loaded again for changes of their host arrays to reach the VE */
+int load_ve_sparse_matrix(struct sparse_matrix *matrix);
+int unload_ve_sparse_matrix(struct sparse_matrix *matrix);
 
+/* The copies of a matrix are synced lazily: the VE rows are sent when a VE
+ * operation reads them and the host rows come back when the host reads them,
+ * through sync_ve_vh_matrix or dump_matrix_binfile. Writes to the host rows of
+ * a loaded matrix must be reported with touch_vh_matrix */
 int sync_vh_ve_matrix(struct matrix *matrix);
 int sync_ve_vh_matrix(struct matrix *matrix);
+int touch_vh_matrix(struct matrix *matrix);
+
+/* The VE operations called between these are queued without waiting, and
+ * ve_chain_end returns 0 if any failed. Host reads of matrices the chain
+ * writes wait for the operations queued before them */
+int ve_chain_begin(void);
+int ve_chain_end(void);
+
+/* Operations queued on the VE without waiting, which run in the order they
+ * were queued with the synchronous ones. They return NULL if they could not
+ * be queued. The host rows the requests read or write must not be touched
+ * before they are done */
+struct matrix_request *scalar_matrix_mult_async(float scalar_value, struct matrix *matrix);
+struct matrix_request *matrix_matrix_mult_async(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC);
+struct matrix_request *sync_vh_ve_matrix_async(struct matrix *matrix);
+struct matrix_request *sync_ve_vh_matrix_async(struct matrix *matrix);
+
+int wait_matrix_request(struct matrix_request *request);
+int test_matrix_request(struct matrix_request *request, int *result);
+int wait_any_matrix_request(struct matrix_request **requests, int num_requests, int *result);
 
 struct matrix *new_matrix(unsigned long int height, unsigned long int width, float *rows);
 struct matrix *zero_matrix(unsigned long int height, unsigned long int width);
+struct matrix *zero_matrix_dtype(unsigned long int height, unsigned long int width, int dtype);
+/* Dense copy of the host rows of a matrix or view with its elements rounded to
+ * dtype, not loaded on the VE */
+struct matrix *convert_matrix(struct matrix *matrix, int dtype);
+/* Matrices read and mapped from files have the dtype of the file, and are
+ * dumped with their own */
 struct matrix *read_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height);
+struct matrix *map_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height, int flags);
 
 void dump_matrix_binfile(const char *file_name, struct matrix *matrix);
 
 void delete_matrix(struct matrix *matrix);
 
+/* Sparse copy of the nonzeros of the host rows of a matrix or view, not loaded
+ * on the VE. Sparse files hold CSR matrices as matrix_file.h describes */
+struct sparse_matrix *convert_sparse_matrix(struct matrix *matrix);
+struct sparse_matrix *read_sparse_binfile(const char *file_name);
+void dump_sparse_binfile(const char *file_name, struct sparse_matrix *matrix);
+void delete_sparse_matrix(struct sparse_matrix *matrix);
+
+/* Views share the rows of their matrix, which must outlive them, on the host
+ * and on the VE, and are deleted with delete_matrix without touching the rows.
+ * The matrix is loaded, synced and touched as a whole for its views. Products
+ * read transposed views but do not write them, and the batched, pipelined and
+ * sharded ones only take views of whole rows */
+struct matrix *view_matrix_rows(struct matrix *matrix, unsigned long int first_row, unsigned long int num_rows);
+struct matrix *view_matrix_columns(struct matrix *matrix, unsigned long int first_column, unsigned long int num_columns);
+struct matrix *view_matrix_transpose(struct matrix *matrix);
+
+#ifdef MATRIX_LIB_UNIFIED
+/* The unified library, see matrix_host.h, runs the synchronous scalar and
+ * general products on the host or on the VE. Those of matrices not loaded on
+ * the VE, or without a VE node, run on the host, those queued in a chain on
+ * the VE, and the others where a cost model expects them to finish first. It
+ * weighs the work on each side and the copies of the operands whose rows are
+ * stale there, from the latency and bandwidth of the copies, the latency of the
+ * VE calls and the speeds of the VE and of the host, which calibrate_dispatch
+ * measures on the first product after the node or a number of threads change.
+ * C stays where it was computed: sync_ve_vh_matrix brings it back as before,
+ * and returns 1 for matrices not loaded. The other operations run on the VE */
+#define MATRIX_DISPATCH_AUTO 0
+#define MATRIX_DISPATCH_HOST 1 /* always on the host                   */
+#define MATRIX_DISPATCH_VE   2 /* on the VE if the matrices are loaded */
+
+void set_dispatch_policy(int policy);
+/* Threads of the host products, 1 by default */
+void set_host_number_threads(int num_threads);
+int calibrate_dispatch(void);
+#endif
+
 #endif /* ifndef _Mstruct matrixLIB_H */
 
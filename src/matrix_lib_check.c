@@ -0,0 +1,336 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matrix_lib.h"
+#include "matrix_host.h"
+
+/* Checks the products of the VE kernels, run by the VEO emulator of veo_emu/,
+ * against those of the host backend on the same host rows, through make check.
+ * Built with MATRIX_LIB_UNIFIED, see matrix_host.h, with the products forced
+ * on the VE */
+
+/* Largest difference allowed, relative to the largest element of the host
+ * result */
+#define CHECK_TOLERANCE 1e-5
+
+/* Emulated nodes the sharded products are split across, 2 and 3 of them */
+#define CHECK_NODES 3
+
+/* Blocking of the VE kernels in matrix_lib_ve.c, which the shapes go past */
+#define VE_MR 4
+#define VE_KB 256
+#define VE_JB 2048
+
+struct check_shape {
+	unsigned long int m, n, k; /* A is m x n, B n x k and C m x k */
+};
+
+/* Shapes smaller than the blocks, with edge tiles in each dimension, and
+ * multiples of the blocks. Their rows are fewer than the nodes, or split
+ * evenly or not across them */
+static const struct check_shape check_shapes[] = {
+	{1, 1, 1},
+	{VE_MR + 1, 3, 7},
+	{2 * VE_MR + 3, VE_KB + 5, 37},
+	{VE_MR + 3, 19, VE_JB + 9},
+	{3 * VE_MR, 2 * VE_KB, 64},
+};
+
+static int num_checks = 0;
+static int num_failures = 0;
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "FATAL ERROR: %s.\nAborting program...\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+/* Loaded matrix of random elements */
+static struct matrix *random_matrix(unsigned long int height, unsigned long int width)
+{
+	struct matrix *matrix = zero_matrix(height, width);
+	unsigned long int i;
+
+	if (!matrix)
+		die("Matrixes creation failure");
+
+	for (i = 0; i < height * width; ++i)
+		matrix->vh_rows[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+
+	if (!load_ve_matrix(matrix))
+		die("load_ve_matrix()");
+
+	return matrix;
+}
+
+static struct matrix *checked_view(struct matrix *view)
+{
+	if (!view)
+		die("view creation failure");
+
+	return view;
+}
+
+static void host_view(struct host_rows *rows, struct matrix *matrix, float *vh_rows)
+{
+	rows->height = matrix->height;
+	rows->width = matrix->width;
+	rows->rows = vh_rows;
+	rows->dtype = matrix->dtype;
+	rows->stride = matrix->stride;
+	rows->transposed = matrix->transposed;
+}
+
+/* Largest difference between the elements of x and of the reference, relative
+ * to the largest element of the reference */
+static double relative_error(const float *x, const float *reference, unsigned long int size)
+{
+	double diff = 0.0, norm = 0.0;
+	unsigned long int i;
+
+	for (i = 0; i < size; ++i) {
+		diff = fmax(diff, fabs((double)x[i] - reference[i]));
+		norm = fmax(norm, fabs((double)reference[i]));
+	}
+
+	return norm > 0.0 ? diff / norm : diff;
+}
+
+static void report(const char *name, int ret, double error)
+{
+	++num_checks;
+	if (ret && error <= CHECK_TOLERANCE) {
+		printf("ok     %-52s %.2e\n", name, error);
+		return;
+	}
+
+	++num_failures;
+	if (ret)
+		printf("FAILED %-52s %.2e\n", name, error);
+	else
+		printf("FAILED %-52s call failed\n", name);
+}
+
+/* Host copy of the rows of the matrix holding C, with C = alpha * op(A) *
+ * op(B) + beta * C run on it by the host library */
+static float *host_reference(float alpha, struct matrix *matrixA, struct matrix *matrixB, float beta,
+		struct matrix *matrixC, int flags)
+{
+	struct matrix *owner = matrixC->parent ? matrixC->parent : matrixC;
+	unsigned long int size = owner->height * owner->width;
+	struct host_rows a, b, c;
+	float *reference;
+
+	reference = (float *)malloc(sizeof(float) * size);
+	if (!reference)
+		die("out of memory");
+	memcpy(reference, owner->vh_rows, sizeof(float) * size);
+
+	host_view(&a, matrixA, matrixA->vh_rows);
+	host_view(&b, matrixB, matrixB->vh_rows);
+	host_view(&c, matrixC, reference + (matrixC->vh_rows - owner->vh_rows));
+	if (!host_rows_gemm(alpha, &a, &b, beta, &c, flags, NULL))
+		die("host_rows_gemm()");
+
+	return reference;
+}
+
+/* Compares all the rows of the matrix holding C, after the VE product that
+ * returned ret, with the reference, so elements of that matrix outside a view
+ * of C must be left alone */
+static void compare(const char *name, int ret, struct matrix *matrixC, float *reference)
+{
+	struct matrix *owner = matrixC->parent ? matrixC->parent : matrixC;
+
+	ret = ret && sync_ve_vh_matrix(matrixC);
+	report(name, ret, ret ? relative_error(owner->vh_rows, reference, owner->height * owner->width) : 0.0);
+
+	free(reference);
+}
+
+/* C = alpha * op(A) * op(B) + beta * C, through matrix_matrix_mult when alpha
+ * is 1, beta 0 and flags 0 */
+static void check_gemm(const char *name, float alpha, struct matrix *matrixA, struct matrix *matrixB,
+		float beta, struct matrix *matrixC, int flags)
+{
+	float *reference = host_reference(alpha, matrixA, matrixB, beta, matrixC, flags);
+	int ret;
+
+	if (alpha == 1.0f && beta == 0.0f && !flags)
+		ret = matrix_matrix_mult(matrixA, matrixB, matrixC);
+	else
+		ret = matrix_matrix_gemm(alpha, matrixA, matrixB, beta, matrixC, flags, NULL);
+
+	compare(name, ret, matrixC, reference);
+}
+
+/* The product and every transpose of the general product on a shape */
+static void check_shape(const struct check_shape *shape, int num_threads)
+{
+	struct matrix *matrixA, *matrixB, *matrixC;
+	char name[128];
+	int flags;
+
+	for (flags = -1; flags <= (MATRIX_TRANS_A | MATRIX_TRANS_B); ++flags) {
+		matrixA = flags > 0 && (flags & MATRIX_TRANS_A) ? random_matrix(shape->n, shape->m)
+			: random_matrix(shape->m, shape->n);
+		matrixB = flags > 0 && (flags & MATRIX_TRANS_B) ? random_matrix(shape->k, shape->n)
+			: random_matrix(shape->n, shape->k);
+		matrixC = random_matrix(shape->m, shape->k);
+
+		if (flags < 0) {
+			snprintf(name, sizeof(name), "mult %lux%lux%lu, %d threads", shape->m, shape->n, shape->k,
+					num_threads);
+			check_gemm(name, 1.0f, matrixA, matrixB, 0.0f, matrixC, 0);
+		} else {
+			snprintf(name, sizeof(name), "gemm %lux%lux%lu flags %d, %d threads", shape->m, shape->n,
+					shape->k, flags, num_threads);
+			check_gemm(name, 0.5f, matrixA, matrixB, 0.25f, matrixC, flags);
+		}
+
+		delete_matrix(matrixA);
+		delete_matrix(matrixB);
+		delete_matrix(matrixC);
+	}
+}
+
+/* Products of views with strides, offsets and transposes, into views of C */
+static void check_views(const struct check_shape *shape, int num_threads)
+{
+	struct matrix *parentA, *parentB, *parentC, *matrixA, *matrixB, *matrixC;
+	char name[128];
+
+	/* Columns of a wider A, B transposed, rows of a taller C */
+	parentA = random_matrix(shape->m, shape->n + 3);
+	parentB = random_matrix(shape->k, shape->n);
+	parentC = random_matrix(shape->m + 2, shape->k);
+	matrixA = checked_view(view_matrix_columns(parentA, 2, shape->n));
+	matrixB = checked_view(view_matrix_transpose(parentB));
+	matrixC = checked_view(view_matrix_rows(parentC, 1, shape->m));
+
+	snprintf(name, sizeof(name), "mult views %lux%lux%lu, %d threads", shape->m, shape->n, shape->k,
+			num_threads);
+	check_gemm(name, 1.0f, matrixA, matrixB, 0.0f, matrixC, 0);
+	delete_matrix(matrixA);
+	delete_matrix(matrixB);
+	delete_matrix(matrixC);
+
+	/* Rows of a taller A, columns of a wider B transposed by the flags,
+	 * columns of a wider C */
+	delete_matrix(parentA);
+	delete_matrix(parentB);
+	delete_matrix(parentC);
+	parentA = random_matrix(shape->m + 3, shape->n);
+	parentB = random_matrix(shape->k, shape->n + 2);
+	parentC = random_matrix(shape->m, shape->k + 5);
+	matrixA = checked_view(view_matrix_rows(parentA, 2, shape->m));
+	matrixB = checked_view(view_matrix_columns(parentB, 1, shape->n));
+	matrixC = checked_view(view_matrix_columns(parentC, 4, shape->k));
+
+	snprintf(name, sizeof(name), "gemm views %lux%lux%lu flags %d, %d threads", shape->m, shape->n,
+			shape->k, MATRIX_TRANS_B, num_threads);
+	check_gemm(name, 2.0f, matrixA, matrixB, 1.0f, matrixC, MATRIX_TRANS_B);
+	delete_matrix(matrixA);
+	delete_matrix(matrixB);
+	delete_matrix(matrixC);
+
+	delete_matrix(parentA);
+	delete_matrix(parentB);
+	delete_matrix(parentC);
+}
+
+/* Pipelined products with panels of A of one row, of a few rows, the last
+ * panel being shorter, and of more rows than A */
+static void check_pipelined(const struct check_shape *shape, int num_threads)
+{
+	static const unsigned long int panel_rows[] = {1, VE_MR - 1, 256};
+	struct matrix *matrixA, *matrixB, *matrixC;
+	float *reference;
+	char name[128];
+	unsigned int p;
+
+	matrixA = random_matrix(shape->m, shape->n);
+	matrixB = random_matrix(shape->n, shape->k);
+	matrixC = random_matrix(shape->m, shape->k);
+
+	for (p = 0; p < sizeof(panel_rows) / sizeof(panel_rows[0]); ++p) {
+		set_ve_panel_rows(panel_rows[p]);
+		snprintf(name, sizeof(name), "pipelined %lux%lux%lu panels %lu, %d threads", shape->m,
+				shape->n, shape->k, panel_rows[p], num_threads);
+		reference = host_reference(1.0f, matrixA, matrixB, 0.0f, matrixC, 0);
+		compare(name, matrix_matrix_mult_pipelined(matrixA, matrixB, matrixC), matrixC, reference);
+	}
+
+	delete_matrix(matrixA);
+	delete_matrix(matrixB);
+	delete_matrix(matrixC);
+}
+
+/* Sharded products across 2 and 3 nodes */
+static void check_sharded(const struct check_shape *shape, struct ve_node **nodes, int num_threads)
+{
+	struct matrix *matrixA, *matrixB, *matrixC;
+	float *reference;
+	char name[128];
+	int num_nodes;
+
+	matrixA = random_matrix(shape->m, shape->n);
+	matrixB = random_matrix(shape->n, shape->k);
+	matrixC = random_matrix(shape->m, shape->k);
+
+	for (num_nodes = 2; num_nodes <= CHECK_NODES; ++num_nodes) {
+		snprintf(name, sizeof(name), "sharded %lux%lux%lu on %d nodes, %d threads", shape->m,
+				shape->n, shape->k, num_nodes, num_threads);
+		reference = host_reference(1.0f, matrixA, matrixB, 0.0f, matrixC, 0);
+		compare(name, matrix_matrix_mult_sharded(nodes, num_nodes, matrixA, matrixB, matrixC), matrixC,
+				reference);
+	}
+
+	delete_matrix(matrixA);
+	delete_matrix(matrixB);
+	delete_matrix(matrixC);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int threads[] = {1, 3};
+	struct ve_node *nodes[CHECK_NODES];
+	unsigned long int s;
+	unsigned int t;
+	int i;
+
+	srand(1);
+	set_dispatch_policy(MATRIX_DISPATCH_VE);
+
+	if (!init_proc_ve_node())
+		die("init_proc_ve_node()");
+
+	for (i = 0; i < CHECK_NODES; ++i) {
+		nodes[i] = open_ve_node(i);
+		if (!nodes[i])
+			die("open_ve_node()");
+	}
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+		set_number_threads(threads[t]);
+		for (s = 0; s < sizeof(check_shapes) / sizeof(check_shapes[0]); ++s) {
+			check_shape(&check_shapes[s], threads[t]);
+			check_views(&check_shapes[s], threads[t]);
+			check_pipelined(&check_shapes[s], threads[t]);
+			check_sharded(&check_shapes[s], nodes, threads[t]);
+		}
+	}
+
+	for (i = 0; i < CHECK_NODES; ++i) {
+		if (!close_ve_node(nodes[i]))
+			die("close_ve_node()");
+	}
+
+	if (!close_proc_ve_node())
+		die("close_proc_ve_node()");
+
+	printf("%d of %d checks failed\n", num_failures, num_checks);
+	return num_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,25 +1,91 @@
 #include <immintrin.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-struct matrix {
-	unsigned long int height;
-	unsigned long int width;
-	float *rows;
-};
+#include "matrix_lib_o.h"
+#include "matrix_file.h"
 
-typedef struct matrix Matrix;
+#define DTYPE_AT(p, dtype, i) ((void *)((char *)(p) + MATRIX_DTYPE_SIZE(dtype) * (i)))
+#define MATRIX_INDEX(m, r, c) ((m)->transposed ? (r) + (c) * (m)->stride : (c) + (r) * (m)->stride)
+#define MATRIX_EL(m, r, c) DTYPE_AT((m)->rows, (m)->dtype, MATRIX_INDEX(m, r, c))
 
-#define MATRIX_EL(m, r, c) ((float *)&m->rows[c + r * m->width])
+static unsigned long int stream_budget = MATRIX_STREAM_BUDGET;
+
+/* Elements of the rows of a matrix, i elements from the first one, converted
+ * from and rounded to its dtype */
+static
+float get_element(const Matrix *matrix, unsigned long int i)
+{
+	if (matrix->dtype == MATRIX_DTYPE_F32)
+		return matrix->rows[i];
+
+	return matrix_half_to_float(((const uint16_t *)matrix->rows)[i], matrix->dtype);
+}
+
+static
+void set_element(Matrix *matrix, unsigned long int i, float value)
+{
+	if (matrix->dtype == MATRIX_DTYPE_F32)
+		matrix->rows[i] = value;
+	else
+		((uint16_t *)matrix->rows)[i] = matrix_float_to_half(value, matrix->dtype);
+}
 
 void set_number_threads(int num_threads)
 {
 
 }
 
+void set_numa_policy(int policy)
+{
+
+}
+
+void set_thread_affinity(int enable)
+{
+
+}
+
+void set_memory_budget(unsigned long int bytes)
+{
+	if (bytes)
+		stream_budget = bytes;
+}
+
+/* Without the blocked kernel the products are never split */
+void set_strassen_cutoff(unsigned long int cutoff)
+{
+
+}
+
+/* Without threads nor blocking there is nothing to tune */
+int matrix_tune(unsigned long int m, unsigned long int n, unsigned long int k)
+{
+	return 1;
+}
+
+void set_tuning_file(const char *file_name)
+{
+
+}
+
+int init_thread_pool(void)
+{
+	return 1;
+}
+
+int close_thread_pool(void)
+{
+	return 1;
+}
+
 int scalar_matrix_mult(float scalar_value, struct matrix *matrix) {
-  unsigned long int i;
+  unsigned long int i, line, lines, length;
   unsigned long int N;
 
   /* Check the numbers of the elements of the matrix */
@@ -28,8 +94,16 @@ int scalar_matrix_mult(float scalar_value, struct matrix *matrix) {
   /* Check the integrity of the matrix */
   if (N == 0 || matrix->rows == NULL) return 0;
 
-  for (i = 0; i < N; ++i) {
-        matrix->rows[i] = matrix->rows[i] * scalar_value;
+  /* Check if the rows can be written */
+  if (matrix->map_flags & MATRIX_MAP_READONLY) return 0;
+
+  /* The lines in memory are the rows, or the columns of transposed views */
+  lines = matrix->transposed ? matrix->width : matrix->height;
+  length = N / lines;
+  for (line = 0; line < lines; ++line) {
+    for (i = 0; i < length; ++i)
+        set_element(matrix, line * matrix->stride + i,
+            get_element(matrix, line * matrix->stride + i) * scalar_value);
   }
 
   return 1;
@@ -49,11 +123,20 @@ int matrix_matrix_mult(struct matrix *a, struct matrix *b, struct matrix *c) {
        (NB == 0 || b->rows == NULL) ||
        (NC == 0 || c->rows == NULL) ) return 0;
 
+  /* Check if the result can be written */
+  if (c->map_flags & MATRIX_MAP_READONLY) return 0;
+
   /* Check if we can execute de product of matrix A and matrix B */
   if ( (a->width != b->height) ||
        (c->height != a->height) ||
        (c->width != b->width) ) return 0;
 
+  /* Transposed views are read through their strides, and 16-bit matrices
+   * converted element by element */
+  if (a->transposed || b->transposed || c->transposed ||
+      a->dtype != MATRIX_DTYPE_F32 || b->dtype != MATRIX_DTYPE_F32 || c->dtype != MATRIX_DTYPE_F32)
+    return matrix_matrix_gemm(1.0f, a, b, 0.0f, c, 0, NULL);
+
   /* Compute the product of matrix A and B using the optimized algorithm. */
   /* Compute the result for each line of C on each iteration of the loop. */
   /* Each aij of the correspondent line of cij execute an scalar product  */
@@ -61,10 +144,10 @@ int matrix_matrix_mult(struct matrix *a, struct matrix *b, struct matrix *c) {
   /* partial value of one cij (one of the factors) of the current line of */
   /* matrix C.                   					  */
   for (c_line = 0; c_line < c->height; ++c_line) {
-	first_c_i_j = c->rows + (c_line * c->width);
-	next_a_i_j = a->rows + (c_line * a->width);
-	next_b_i_j = b->rows;
+	first_c_i_j = c->rows + (c_line * c->stride);
+	next_a_i_j = a->rows + (c_line * a->stride);
 	for (a_col = 0; a_col < a->width; ++a_col, ++next_a_i_j) {
+		next_b_i_j = b->rows + (a_col * b->stride);
 		next_c_i_j = first_c_i_j;
 		for (b_col = 0; b_col < b->width; ++b_col, ++next_b_i_j, ++next_c_i_j) {
 			if (a_col == 0) *(next_c_i_j) = 0.0f;
@@ -77,12 +160,319 @@ int matrix_matrix_mult(struct matrix *a, struct matrix *b, struct matrix *c) {
   return 1;
 }
 
+/* Each element of C is computed as a dot product of op(A) and op(B), read
+ * through their strides, then scaled, summed with beta * C and passed through
+ * the epilogue */
+int matrix_matrix_gemm(float alpha, Matrix *a, Matrix *b, float beta, Matrix *c,
+    int flags, const MatrixEpilogue *epilogue) {
+  unsigned long int m, n, k, i, j, p, a_row, a_col, b_row, b_col;
+  float sum;
+  int trans;
+  int activation = epilogue ? epilogue->activation : MATRIX_ACT_NONE;
+
+  if (a == NULL || b == NULL || c == NULL) return 0;
+  if (a->rows == NULL || b->rows == NULL || c->rows == NULL) return 0;
+  if (c->transposed || (c->map_flags & MATRIX_MAP_READONLY)) return 0;
+  if (activation < MATRIX_ACT_NONE || activation > MATRIX_ACT_GELU) return 0;
+  if (activation == MATRIX_ACT_CLAMP && !(epilogue->clamp_min <= epilogue->clamp_max)) return 0;
+
+  /* Strides of the rows and columns of op(A) and op(B) in memory, where
+   * transposed views are transposed once more */
+  m = c->height;
+  n = c->width;
+  k = flags & MATRIX_TRANS_A ? a->height : a->width;
+  trans = flags ^ (a->transposed ? MATRIX_TRANS_A : 0) ^ (b->transposed ? MATRIX_TRANS_B : 0);
+  a_row = trans & MATRIX_TRANS_A ? 1 : a->stride;
+  a_col = trans & MATRIX_TRANS_A ? a->stride : 1;
+  b_row = trans & MATRIX_TRANS_B ? 1 : b->stride;
+  b_col = trans & MATRIX_TRANS_B ? b->stride : 1;
+
+  if ((flags & MATRIX_TRANS_A ? a->width : a->height) != m) return 0;
+  if ((flags & MATRIX_TRANS_B ? b->height : b->width) != n) return 0;
+  if ((flags & MATRIX_TRANS_B ? b->width : b->height) != k) return 0;
+  if (m == 0 || n == 0 || k == 0) return 0;
+
+  for (i = 0; i < m; ++i) {
+    for (j = 0; j < n; ++j) {
+      sum = 0.0f;
+      for (p = 0; p < k; ++p)
+        sum += get_element(a, i * a_row + p * a_col) * get_element(b, p * b_row + j * b_col);
+
+      sum = alpha * sum + (beta != 0.0f ? beta * get_element(c, MATRIX_INDEX(c, i, j)) : 0.0f);
+      if (epilogue && epilogue->bias) sum += epilogue->bias[j];
+
+      if (activation == MATRIX_ACT_RELU) sum = sum > 0.0f ? sum : 0.0f;
+      else if (activation == MATRIX_ACT_CLAMP)
+        sum = sum < epilogue->clamp_min ? epilogue->clamp_min : sum > epilogue->clamp_max ? epilogue->clamp_max : sum;
+      else if (activation == MATRIX_ACT_GELU)
+        sum = 0.5f * sum * (1.0f + tanhf(0.7978845608f * (sum + 0.044715f * sum * sum * sum)));
+
+      set_element(c, MATRIX_INDEX(c, i, j), sum);
+    }
+  }
+
+  return 1;
+}
+
+int matrix_matrix_mult_batched(Matrix **a, Matrix **b, Matrix **c, unsigned long int batch) {
+  unsigned long int i;
+
+  if (a == NULL || b == NULL || c == NULL || batch == 0) return 0;
+
+  /* Batched products write float matrices only */
+  for (i = 0; i < batch; ++i) {
+    if (c[i] == NULL || c[i]->dtype != MATRIX_DTYPE_F32) return 0;
+    if (!matrix_matrix_mult(a[i], b[i], c[i])) return 0;
+  }
+
+  return 1;
+}
+
+/* Each product of the batch is multiplied through matrices pointing to its
+ * rows; a B holding a single product is shared by all of them */
+int matrix_matrix_mult_strided(Matrix *a, Matrix *b, Matrix *c, unsigned long int batch) {
+  Matrix pa, pb, pc;
+  unsigned long int i, m, n, stride_b;
+
+  if (a == NULL || b == NULL || c == NULL || batch == 0) return 0;
+  if (a->rows == NULL || b->rows == NULL || c->rows == NULL) return 0;
+  if (a->transposed || b->transposed || c->transposed) return 0;
+  if (c->dtype != MATRIX_DTYPE_F32) return 0;
+  if (a->height % batch || c->height != a->height) return 0;
+
+  m = a->height / batch;
+  n = a->width;
+  if (b->height == n) stride_b = 0;
+  else if (b->height == batch * n) stride_b = n * b->stride;
+  else return 0;
+
+  pa = *a; pa.height = m;
+  pb = *b; pb.height = n;
+  pc = *c; pc.height = m;
+
+  for (i = 0; i < batch; ++i) {
+    pa.rows = (float *)DTYPE_AT(a->rows, a->dtype, i * m * a->stride);
+    pb.rows = (float *)DTYPE_AT(b->rows, b->dtype, i * stride_b);
+    pc.rows = c->rows + i * m * c->stride;
+    if (!matrix_matrix_mult(&pa, &pb, &pc)) return 0;
+  }
+
+  return 1;
+}
+
+int matrix_matrix_mult_strassen(Matrix *a, Matrix *b, Matrix *c) {
+  return matrix_matrix_mult(a, b, c);
+}
+
+/* B = A^T element by element. A square matrix is transposed in place as
+ * stored, swapping the elements across the diagonal */
+int matrix_transpose(Matrix *a, Matrix *b) {
+  unsigned long int i, j;
+  float value;
+
+  if (a == NULL || b == NULL || a->rows == NULL || b->rows == NULL) return 0;
+  if (a->height != b->width || a->width != b->height) return 0;
+  if (a->height == 0 || a->width == 0 || a->dtype != b->dtype) return 0;
+  if (b->map_flags & MATRIX_MAP_READONLY) return 0;
+  if (a != b && a->rows == b->rows) return 0;
+
+  if (a == b) {
+    for (i = 0; i < a->height; ++i) {
+      for (j = i + 1; j < a->width; ++j) {
+        value = get_element(a, i * a->stride + j);
+        set_element(a, i * a->stride + j, get_element(a, j * a->stride + i));
+        set_element(a, j * a->stride + i, value);
+      }
+    }
+    return 1;
+  }
+
+  for (i = 0; i < a->height; ++i) {
+    for (j = 0; j < a->width; ++j)
+      set_element(b, MATRIX_INDEX(b, j, i), get_element(a, MATRIX_INDEX(a, i, j)));
+  }
+
+  return 1;
+}
+
+/* Vectors are matrices of a single row or column */
+#define VECTOR_INDEX(v, i) ((v)->height == 1 ? MATRIX_INDEX(v, 0, i) : MATRIX_INDEX(v, i, 0))
+
+int matrix_vector_gemv(float alpha, Matrix *a, Matrix *x, float beta, Matrix *y, int flags) {
+  unsigned long int m, n, i, j;
+  float sum;
+
+  if (a == NULL || x == NULL || y == NULL) return 0;
+  if (a->rows == NULL || x->rows == NULL || y->rows == NULL) return 0;
+  if (y->map_flags & MATRIX_MAP_READONLY) return 0;
+
+  m = flags & MATRIX_TRANS_A ? a->width : a->height;
+  n = flags & MATRIX_TRANS_A ? a->height : a->width;
+  if (m == 0 || n == 0) return 0;
+  if ((x->height != 1 && x->width != 1) || x->height * x->width != n) return 0;
+  if ((y->height != 1 && y->width != 1) || y->height * y->width != m) return 0;
+
+  for (i = 0; i < m; ++i) {
+    sum = 0.0f;
+    for (j = 0; j < n; ++j)
+      sum += get_element(a, flags & MATRIX_TRANS_A ? MATRIX_INDEX(a, j, i) : MATRIX_INDEX(a, i, j))
+          * get_element(x, VECTOR_INDEX(x, j));
+
+    sum = alpha * sum + (beta != 0.0f ? beta * get_element(y, VECTOR_INDEX(y, i)) : 0.0f);
+    set_element(y, VECTOR_INDEX(y, i), sum);
+  }
+
+  return 1;
+}
+
+/* d = x + alpha * y element by element */
+static int matrix_add(Matrix *x, float alpha, Matrix *y, Matrix *d) {
+  unsigned long int i, j;
+
+  if (x == NULL || y == NULL || d == NULL) return 0;
+  if (x->rows == NULL || y->rows == NULL || d->rows == NULL) return 0;
+  if (x->height != d->height || x->width != d->width) return 0;
+  if (y->height != d->height || y->width != d->width) return 0;
+  if (d->height == 0 || d->width == 0) return 0;
+  if (d->map_flags & MATRIX_MAP_READONLY) return 0;
+
+  for (i = 0; i < d->height; ++i) {
+    for (j = 0; j < d->width; ++j)
+      set_element(d, MATRIX_INDEX(d, i, j),
+          get_element(x, MATRIX_INDEX(x, i, j)) + alpha * get_element(y, MATRIX_INDEX(y, i, j)));
+  }
+
+  return 1;
+}
+
+int matrix_matrix_add(Matrix *a, Matrix *b, Matrix *c) {
+  return matrix_add(a, 1.0f, b, c);
+}
+
+int matrix_axpy(float alpha, Matrix *x, Matrix *y) {
+  return matrix_add(y, alpha, x, y);
+}
+
+/* C = A * B with A or B sparse and y = A * x, a nonzero at a time */
+int sparse_matrix_mult(SparseMatrix *a, Matrix *b, Matrix *c) {
+  unsigned long int i, j, p;
+  float value;
+
+  if (a == NULL || b == NULL || c == NULL || b->rows == NULL || c->rows == NULL) return 0;
+  if (b->dtype != MATRIX_DTYPE_F32 || c->dtype != MATRIX_DTYPE_F32) return 0;
+  if (b->transposed || c->transposed || (c->map_flags & MATRIX_MAP_READONLY)) return 0;
+  if (b->height != a->width || c->height != a->height || c->width != b->width) return 0;
+  if (c->height == 0 || c->width == 0 || a->width == 0) return 0;
+
+  for (i = 0; i < c->height; ++i) {
+    memset(c->rows + i * c->stride, 0, sizeof(float) * c->width);
+    for (p = a->row_ptr[i]; p < a->row_ptr[i + 1]; ++p) {
+      value = a->values[p];
+      for (j = 0; j < c->width; ++j)
+        c->rows[i * c->stride + j] += value * b->rows[a->columns[p] * b->stride + j];
+    }
+  }
+
+  return 1;
+}
+
+int matrix_sparse_mult(Matrix *a, SparseMatrix *b, Matrix *c) {
+  unsigned long int i, k, p;
+  float value;
+
+  if (a == NULL || b == NULL || c == NULL || a->rows == NULL || c->rows == NULL) return 0;
+  if (a->dtype != MATRIX_DTYPE_F32 || c->dtype != MATRIX_DTYPE_F32) return 0;
+  if (c->transposed || (c->map_flags & MATRIX_MAP_READONLY)) return 0;
+  if (a->width != b->height || c->height != a->height || c->width != b->width) return 0;
+  if (c->height == 0 || c->width == 0 || a->width == 0) return 0;
+
+  for (i = 0; i < c->height; ++i) {
+    memset(c->rows + i * c->stride, 0, sizeof(float) * c->width);
+    for (k = 0; k < b->height; ++k) {
+      value = a->rows[MATRIX_INDEX(a, i, k)];
+      for (p = b->row_ptr[k]; p < b->row_ptr[k + 1]; ++p)
+        c->rows[i * c->stride + b->columns[p]] += value * b->values[p];
+    }
+  }
+
+  return 1;
+}
+
+int sparse_vector_mult(SparseMatrix *a, Matrix *x, Matrix *y) {
+  unsigned long int i, p;
+  float sum;
+
+  if (a == NULL || x == NULL || y == NULL || x->rows == NULL || y->rows == NULL) return 0;
+  if (y->map_flags & MATRIX_MAP_READONLY) return 0;
+  if (a->height == 0 || a->width == 0) return 0;
+  if ((x->height != 1 && x->width != 1) || x->height * x->width != a->width) return 0;
+  if ((y->height != 1 && y->width != 1) || y->height * y->width != a->height) return 0;
+
+  for (i = 0; i < a->height; ++i) {
+    sum = 0.0f;
+    for (p = a->row_ptr[i]; p < a->row_ptr[i + 1]; ++p)
+      sum += a->values[p] * get_element(x, VECTOR_INDEX(x, a->columns[p]));
+    set_element(y, VECTOR_INDEX(y, i), sum);
+  }
+
+  return 1;
+}
+
+/* Without threads the requests are done when they are queued */
+struct matrix_request {
+  int result;
+};
+
+static MatrixRequest *done_request(int result) {
+  MatrixRequest *request = (MatrixRequest *)malloc(sizeof(MatrixRequest));
+
+  if (request) request->result = result;
+  return request;
+}
+
+MatrixRequest *scalar_matrix_mult_async(float scalar_value, Matrix *matrix) {
+  return done_request(scalar_matrix_mult(scalar_value, matrix));
+}
+
+MatrixRequest *matrix_matrix_mult_async(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC) {
+  return done_request(matrix_matrix_mult(matrixA, matrixB, matrixC));
+}
+
+int wait_matrix_request(MatrixRequest *request) {
+  int ret;
+
+  if (request == NULL) return 0;
+  ret = request->result;
+  free(request);
+  return ret;
+}
+
+int test_matrix_request(MatrixRequest *request, int *result) {
+  if (request == NULL) return 0;
+  if (result != NULL) *result = request->result;
+  free(request);
+  return 1;
+}
+
+int wait_any_matrix_request(MatrixRequest **requests, int num_requests, int *result) {
+  int i;
+
+  for (i = 0; i < num_requests; ++i) {
+    if (requests[i] == NULL) continue;
+    test_matrix_request(requests[i], result);
+    requests[i] = NULL;
+    return i;
+  }
+
+  return -1;
+}
+
 void print_matrix(Matrix *matrix)
 {
 	register unsigned long int lin, col;
 	for (lin = 0; lin < matrix->height; ++lin) {
 		for (col = 0; col < matrix->width; ++col) {
-			printf("%5.2f\t", *MATRIX_EL(matrix, lin, col));
+			printf("%5.2f\t", get_element(matrix, MATRIX_INDEX(matrix, lin, col)));
 		}
 		printf("\n");
 	}
@@ -90,14 +480,21 @@ void print_matrix(Matrix *matrix)
 }
 
 static
-Matrix *build_matrix(unsigned long int height, unsigned long int width)
+Matrix *build_matrix(unsigned long int height, unsigned long int width, int dtype)
 {
-	Matrix *matrix = (Matrix *)malloc(sizeof(Matrix));
+	unsigned long int size;
+	Matrix *matrix;
+
+	/* Dimensions from file headers may not fit in memory */
+	if (!matrix_size_mul(height, width, &size) || !matrix_size_mul(MATRIX_DTYPE_SIZE(dtype), size, &size))
+		return NULL;
+
+	matrix = (Matrix *)malloc(sizeof(Matrix));
 	if (!matrix) {
 		return NULL;
 	}
 
-	matrix->rows = (float *)malloc(sizeof(float) * height * width);
+	matrix->rows = (float *)malloc(size);
 	if (!matrix->rows) {
 		free(matrix);
 		return NULL;
@@ -105,13 +502,20 @@ Matrix *build_matrix(unsigned long int height, unsigned long int width)
 
 	matrix->width = width;
 	matrix->height = height;
+	matrix->dtype = dtype;
+	matrix->stride = width;
+	matrix->transposed = 0;
+	matrix->parent = NULL;
+	matrix->map_addr = NULL;
+	matrix->map_size = 0;
+	matrix->map_flags = 0;
 
 	return matrix;
 }
 
 Matrix *new_matrix(unsigned long int height, unsigned long int width, float *rows)
 {
-	Matrix *matrix = build_matrix(height, width);
+	Matrix *matrix = build_matrix(height, width, MATRIX_DTYPE_F32);
 
 	if (matrix)
 		memcpy(matrix->rows, rows, sizeof(float) * height * width);
@@ -121,41 +525,358 @@ Matrix *new_matrix(unsigned long int height, unsigned long int width, float *row
 
 Matrix *zero_matrix(unsigned long int height, unsigned long int width)
 {
-	Matrix *matrix = build_matrix(height, width);
+	return zero_matrix_dtype(height, width, MATRIX_DTYPE_F32);
+}
+
+Matrix *zero_matrix_dtype(unsigned long int height, unsigned long int width, int dtype)
+{
+	Matrix *matrix;
+
+	if (dtype < MATRIX_DTYPE_F32 || dtype > MATRIX_DTYPE_F16)
+		return NULL;
 
+	matrix = build_matrix(height, width, dtype);
 	if (matrix)
-		memset(matrix->rows, 0, sizeof(float) * height * width);
+		memset(matrix->rows, 0, MATRIX_DTYPE_SIZE(dtype) * height * width);
 
 	return matrix;
 }
 
+Matrix *convert_matrix(Matrix *matrix, int dtype)
+{
+	unsigned long int lin, col;
+	Matrix *copy;
+
+	if (!matrix || !matrix->rows)
+		return NULL;
+
+	copy = zero_matrix_dtype(matrix->height, matrix->width, dtype);
+	for (lin = 0; copy && lin < matrix->height; ++lin) {
+		for (col = 0; col < matrix->width; ++col)
+			set_element(copy, lin * copy->stride + col, get_element(matrix, MATRIX_INDEX(matrix, lin, col)));
+	}
+
+	return copy;
+}
+
 Matrix *read_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height)
 {
 	Matrix *matrix;
-	unsigned long int matrix_size = m_width * m_height;
-	float *rows = (float *)malloc(sizeof(float) * matrix_size);
-	FILE *bf = fopen(file_name, "rb");
-	if (rows == NULL || bf == NULL) return NULL;
-	fread(rows, sizeof(float), matrix_size, bf);
-	fclose(bf);
-	matrix = new_matrix(m_height, m_width, rows);
-	free(rows);
+	struct matrix_file file;
+	if (matrix_file_open(file_name, &file) < 0) return NULL;
+	if (!matrix_file_shape(&file, &m_width, &m_height)) {
+		matrix_file_close(&file);
+		return NULL;
+	}
+	matrix = build_matrix(m_height, m_width, (int)file.header.dtype);
+	if (matrix && !matrix_file_read(&file, matrix->rows)) {
+		delete_matrix(matrix);
+		matrix = NULL;
+	}
+	matrix_file_close(&file);
+	return matrix;
+}
+
+Matrix *map_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height, int flags)
+{
+	Matrix *matrix;
+	struct stat st;
+	struct matrix_file file;
+	unsigned long int size;
+	if (matrix_file_open(file_name, &file) < 0) return NULL;
+	if (!matrix_file_shape(&file, &m_width, &m_height) || !matrix_file_is_dense(&file)) {
+		matrix_file_close(&file);
+		return NULL;
+	}
+	size = file.header.data_offset + MATRIX_DTYPE_SIZE(file.header.dtype) * m_width * m_height;
+	if (fstat(file.fd, &st) != 0 || (unsigned long int)st.st_size < size) {
+		matrix_file_close(&file);
+		return NULL;
+	}
+	matrix = (Matrix *)malloc(sizeof(Matrix));
+	if (!matrix) {
+		matrix_file_close(&file);
+		return NULL;
+	}
+	if (flags & MATRIX_MAP_READONLY)
+		matrix->map_addr = mmap(NULL, size, PROT_READ, MAP_SHARED, file.fd, 0);
+	else
+		matrix->map_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.fd, 0);
+	matrix_file_close(&file);
+	if (matrix->map_addr == MAP_FAILED) {
+		free(matrix);
+		return NULL;
+	}
+	matrix->height = m_height;
+	matrix->width = m_width;
+	matrix->dtype = (int)file.header.dtype;
+	matrix->stride = m_width;
+	matrix->transposed = 0;
+	matrix->parent = NULL;
+	matrix->rows = (float *)((char *)matrix->map_addr + file.header.data_offset);
+	madvise(matrix->rows, size - file.header.data_offset, MADV_WILLNEED);
+	matrix->map_size = size;
+	matrix->map_flags = flags;
 	return matrix;
 }
 
 void dump_matrix_binfile(const char *file_name, Matrix *matrix)
 {
-	FILE *bf = fopen(file_name, "wb");
-	if (!bf) {
-		fprintf(stderr, "ERRO: não foi possível abrir arquivo \"%s\"\n", file_name);
+	unsigned long int lin, col;
+	unsigned long int size = MATRIX_DTYPE_SIZE(matrix->dtype);
+	void *rows = matrix->rows;
+
+	/* The elements of views are gathered in a dense copy first */
+	if (matrix->transposed || matrix->stride != matrix->width) {
+		rows = malloc(size * matrix->height * matrix->width);
+		for (lin = 0; rows && lin < matrix->height; ++lin) {
+			for (col = 0; col < matrix->width; ++col)
+				memcpy(DTYPE_AT(rows, matrix->dtype, lin * matrix->width + col),
+						MATRIX_EL(matrix, lin, col), size);
+		}
+	}
+
+	if (!rows || !matrix_file_write(file_name, rows, matrix->height, matrix->width, matrix->dtype)) {
+		fprintf(stderr, "ERRO: não foi possível escrever arquivo \"%s\"\n", file_name);
 		exit(EXIT_FAILURE);
 	}
-	fwrite(matrix->rows, sizeof(float), matrix->height * matrix->width, bf);
-	fclose(bf);
+
+	if (rows != matrix->rows)
+		free(rows);
+}
+
+/* Reference out-of-core product: holds as many rows of A and C as the budget
+ * allows, besides a row of B, and streams B a row at a time for each panel */
+int matrix_matrix_mult_binfile(const char *matrixA_file, const char *matrixB_file, const char *matrixC_file)
+{
+	struct matrix_file file_a, file_b, file_c;
+	unsigned long int m, n, k, panel_m, rows, first_row, i, p, j, floats;
+	float *panel_a, *panel_c, *row_b;
+	int ret = 0;
+
+	if (matrix_file_open(matrixA_file, &file_a) != 1) return 0;
+	if (matrix_file_open(matrixB_file, &file_b) != 1) {
+		matrix_file_close(&file_a);
+		return 0;
+	}
+	m = file_a.header.height;
+	k = file_a.header.width;
+	n = file_b.header.width;
+	floats = stream_budget / sizeof(float);
+	panel_m = floats > n ? (floats - n) / (k + n) : 0;
+	if (panel_m > m) panel_m = m;
+	if (!matrix_file_is_dense(&file_a) || !matrix_file_is_dense(&file_b) || file_b.header.height != k
+			|| file_a.header.dtype != MATRIX_DTYPE_F32 || file_b.header.dtype != MATRIX_DTYPE_F32
+			|| !m || !n || !k || !panel_m
+			|| !(panel_a = (float *)malloc(sizeof(float) * (panel_m * (k + n) + n)))) {
+		matrix_file_close(&file_a);
+		matrix_file_close(&file_b);
+		return 0;
+	}
+	panel_c = panel_a + panel_m * k;
+	row_b = panel_c + panel_m * n;
+
+	if (matrix_file_create(matrixC_file, m, n, MATRIX_DTYPE_F32, &file_c)) {
+		for (first_row = 0; first_row < m; first_row += panel_m) {
+			rows = m - first_row < panel_m ? m - first_row : panel_m;
+			if (!matrix_file_read_at(file_a.fd, panel_a, sizeof(float) * rows * k,
+						file_a.header.data_offset + sizeof(float) * first_row * k))
+				break;
+			memset(panel_c, 0, sizeof(float) * rows * n);
+			for (p = 0; p < k; ++p) {
+				if (!matrix_file_read_at(file_b.fd, row_b, sizeof(float) * n,
+							file_b.header.data_offset + sizeof(float) * p * n))
+					break;
+				for (i = 0; i < rows; ++i)
+					for (j = 0; j < n; ++j)
+						panel_c[i * n + j] += panel_a[i * k + p] * row_b[j];
+			}
+			if (p != k || !matrix_file_write_at(file_c.fd, panel_c, sizeof(float) * rows * n,
+						file_c.header.data_offset + sizeof(float) * first_row * n))
+				break;
+		}
+		ret = first_row >= m && matrix_file_finish(&file_c);
+		matrix_file_close(&file_c);
+		if (!ret) unlink(matrixC_file);
+	}
+
+	free(panel_a);
+	matrix_file_close(&file_a);
+	matrix_file_close(&file_b);
+	return ret;
+}
+
+static
+Matrix *build_view(Matrix *matrix, unsigned long int r, unsigned long int c,
+		unsigned long int height, unsigned long int width, int transposed)
+{
+	Matrix *view = (Matrix *)malloc(sizeof(Matrix));
+	if (!view)
+		return NULL;
+
+	*view = *matrix;
+	view->height = height;
+	view->width = width;
+	view->rows = (float *)MATRIX_EL(matrix, r, c);
+	view->transposed = transposed;
+	view->parent = matrix->parent ? matrix->parent : matrix;
+	view->map_addr = NULL;
+	view->map_size = 0;
+
+	return view;
+}
+
+Matrix *view_matrix_rows(Matrix *matrix, unsigned long int first_row, unsigned long int num_rows)
+{
+	if (!matrix || !matrix->rows || !num_rows || first_row >= matrix->height
+			|| num_rows > matrix->height - first_row)
+		return NULL;
+
+	return build_view(matrix, first_row, 0, num_rows, matrix->width, matrix->transposed);
+}
+
+Matrix *view_matrix_columns(Matrix *matrix, unsigned long int first_column, unsigned long int num_columns)
+{
+	if (!matrix || !matrix->rows || !num_columns || first_column >= matrix->width
+			|| num_columns > matrix->width - first_column)
+		return NULL;
+
+	return build_view(matrix, 0, first_column, matrix->height, num_columns, matrix->transposed);
+}
+
+Matrix *view_matrix_transpose(Matrix *matrix)
+{
+	if (!matrix || !matrix->rows)
+		return NULL;
+
+	return build_view(matrix, 0, 0, matrix->width, matrix->height, !matrix->transposed);
 }
 
 void delete_matrix(Matrix *matrix)
 {
-	free(matrix->rows);
+	/* Views only own their struct */
+	if (!matrix->parent) {
+		if (matrix->map_addr)
+			munmap(matrix->map_addr, matrix->map_size);
+		else
+			free(matrix->rows);
+	}
+	free(matrix);
+}
+
+static
+SparseMatrix *build_sparse_matrix(unsigned long int height, unsigned long int width, unsigned long int nnz)
+{
+	SparseMatrix *matrix;
+	unsigned long int size;
+
+	/* Counts from file headers may not fit in memory */
+	if (width > SPARSE_MAX_WIDTH || !matrix_size_add(height, 1, &size)
+			|| !matrix_size_mul(sizeof(unsigned long int), size, &size)
+			|| !matrix_size_mul(sizeof(float), nnz, &size))
+		return NULL;
+
+	matrix = (SparseMatrix *)malloc(sizeof(SparseMatrix));
+	if (!matrix)
+		goto fail1;
+
+	matrix->height = height;
+	matrix->width = width;
+	matrix->nnz = nnz;
+	matrix->row_ptr = (unsigned long int *)malloc(sizeof(unsigned long int) * (height + 1));
+	matrix->columns = (unsigned int *)malloc(sizeof(unsigned int) * (nnz ? nnz : 1));
+	matrix->values = (float *)malloc(sizeof(float) * (nnz ? nnz : 1));
+	if (!matrix->row_ptr || !matrix->columns || !matrix->values)
+		goto fail2;
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail2:
+	delete_sparse_matrix(matrix);
+fail1:
+	return NULL;
+}
+
+/* Counts the nonzeros first, then stores them row by row */
+SparseMatrix *convert_sparse_matrix(Matrix *matrix)
+{
+	SparseMatrix *sparse;
+	unsigned long int lin, col, nnz = 0;
+	float value;
+
+	if (!matrix || !matrix->rows)
+		return NULL;
+
+	for (lin = 0; lin < matrix->height; ++lin) {
+		for (col = 0; col < matrix->width; ++col)
+			nnz += get_element(matrix, MATRIX_INDEX(matrix, lin, col)) != 0.0f;
+	}
+
+	sparse = build_sparse_matrix(matrix->height, matrix->width, nnz);
+	if (!sparse)
+		return NULL;
+
+	for (lin = 0, nnz = 0; lin < matrix->height; ++lin) {
+		sparse->row_ptr[lin] = nnz;
+		for (col = 0; col < matrix->width; ++col) {
+			value = get_element(matrix, MATRIX_INDEX(matrix, lin, col));
+			if (value == 0.0f)
+				continue;
+
+			sparse->columns[nnz] = (unsigned int)col;
+			sparse->values[nnz++] = value;
+		}
+	}
+	sparse->row_ptr[lin] = nnz;
+
+	return sparse;
+}
+
+SparseMatrix *read_sparse_binfile(const char *file_name)
+{
+	struct sparse_file file;
+	SparseMatrix *matrix;
+
+	if (!sparse_file_open(file_name, &file))
+		goto fail1;
+
+	matrix = build_sparse_matrix(file.header.height, file.header.width, file.header.nnz);
+	if (!matrix)
+		goto fail2;
+
+	if (!sparse_file_read(&file, (uint64_t *)matrix->row_ptr, matrix->columns, matrix->values))
+		goto fail3;
+
+	sparse_file_close(&file);
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail3:
+	delete_sparse_matrix(matrix);
+fail2:
+	sparse_file_close(&file);
+fail1:
+	return NULL;
+}
+
+void dump_sparse_binfile(const char *file_name, SparseMatrix *matrix)
+{
+	if (!sparse_file_write(file_name, matrix->height, matrix->width, (const uint64_t *)matrix->row_ptr,
+				matrix->columns, matrix->values)) {
+		fprintf(stderr, "ERRO: não foi possível escrever arquivo \"%s\"\n", file_name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void delete_sparse_matrix(SparseMatrix *matrix)
+{
+	if (!matrix)
+		return;
+
+	free(matrix->row_ptr);
+	free(matrix->columns);
+	free(matrix->values);
 	free(matrix);
 }
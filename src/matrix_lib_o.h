@@ -1,21 +1,227 @@
 #ifndef _MATRIX_LIB_H
 #define _MATRIX_LIB_H
 
+/* Built into the unified library, see matrix_host.h, the functions of the host
+ * backend take a host_ prefix, as the VE backend exports the same names */
+#ifdef MATRIX_LIB_UNIFIED
+#define scalar_matrix_mult          host_scalar_matrix_mult
+#define matrix_matrix_mult          host_matrix_matrix_mult
+#define set_number_threads          host_set_number_threads
+#define matrix_tune                 host_matrix_tune
+#define set_tuning_file             host_set_tuning_file
+#define matrix_matrix_gemm          host_matrix_matrix_gemm
+#define matrix_matrix_mult_batched  host_matrix_matrix_mult_batched
+#define matrix_matrix_mult_strided  host_matrix_matrix_mult_strided
+#define matrix_matrix_mult_strassen host_matrix_matrix_mult_strassen
+#define set_strassen_cutoff         host_set_strassen_cutoff
+#define matrix_transpose            host_matrix_transpose
+#define matrix_vector_gemv          host_matrix_vector_gemv
+#define matrix_matrix_add           host_matrix_matrix_add
+#define matrix_axpy                 host_matrix_axpy
+#define sparse_matrix_mult          host_sparse_matrix_mult
+#define matrix_sparse_mult          host_matrix_sparse_mult
+#define sparse_vector_mult          host_sparse_vector_mult
+#define scalar_matrix_mult_async    host_scalar_matrix_mult_async
+#define matrix_matrix_mult_async    host_matrix_matrix_mult_async
+#define wait_matrix_request         host_wait_matrix_request
+#define test_matrix_request         host_test_matrix_request
+#define wait_any_matrix_request     host_wait_any_matrix_request
+#define set_numa_policy             host_set_numa_policy
+#define set_thread_affinity         host_set_thread_affinity
+#define set_memory_budget           host_set_memory_budget
+#define init_thread_pool            host_init_thread_pool
+#define close_thread_pool           host_close_thread_pool
+#define print_matrix                host_print_matrix
+#define new_matrix                  host_new_matrix
+#define zero_matrix                 host_zero_matrix
+#define zero_matrix_dtype           host_zero_matrix_dtype
+#define convert_matrix              host_convert_matrix
+#define read_matrix_binfile         host_read_matrix_binfile
+#define map_matrix_binfile          host_map_matrix_binfile
+#define dump_matrix_binfile         host_dump_matrix_binfile
+#define matrix_matrix_mult_binfile  host_matrix_matrix_mult_binfile
+#define delete_matrix               host_delete_matrix
+#define convert_sparse_matrix       host_convert_sparse_matrix
+#define read_sparse_binfile         host_read_sparse_binfile
+#define dump_sparse_binfile         host_dump_sparse_binfile
+#define delete_sparse_matrix        host_delete_sparse_matrix
+#define view_matrix_rows            host_view_matrix_rows
+#define view_matrix_columns         host_view_matrix_columns
+#define view_matrix_transpose       host_view_matrix_transpose
+#endif
+
 typedef struct matrix {
 	unsigned long int height; /* rows    */
 	unsigned long int width;  /* columns */
-	float *rows;
+	float *rows;                 /* 16-bit dtypes are read as uint16_t     */
+	int dtype;                   /* MATRIX_DTYPE_* of the elements         */
+	unsigned long int stride;    /* elements between the rows in memory    */
+	int transposed;              /* rows stored as columns, stride apart   */
+	struct matrix *parent;       /* matrix holding the rows of a view      */
+	void *map_addr;              /* mapping holding rows, NULL if malloc'd */
+	unsigned long int map_size;  /* size of the mapping in bytes          */
+	int map_flags;               /* MATRIX_MAP_* flags of file mappings   */
 } Matrix;
 
+/* Float matrix in CSR: the nonzeros of row i are the values[p] at columns
+ * columns[p], for p from row_ptr[i] to row_ptr[i + 1] - 1 */
+typedef struct sparse_matrix {
+	unsigned long int height;
+	unsigned long int width;     /* at most SPARSE_MAX_WIDTH   */
+	unsigned long int nnz;       /* nonzeros, row_ptr[height]  */
+	unsigned long int *row_ptr;  /* height + 1 offsets         */
+	unsigned int *columns;
+	float *values;
+} SparseMatrix;
+
+typedef struct matrix_request MatrixRequest;
+
+/* Types of the elements of the matrices, as in the matrix files. bf16 is the
+ * upper half of a float and f16 the IEEE 754 half precision */
+#define MATRIX_DTYPE_F32  0
+#define MATRIX_DTYPE_BF16 1
+#define MATRIX_DTYPE_F16  2
+
+/* Modes of the matrices mapped from files */
+#define MATRIX_MAP_COW      0 /* writes go to private copies of the pages */
+#define MATRIX_MAP_READONLY 1 /* pages shared with the file, no writes    */
+
+/* Placement of the pages of the matrices created by the library */
+#define NUMA_POLICY_DEFAULT     0 /* pages placed by the creating thread      */
+#define NUMA_POLICY_FIRST_TOUCH 1 /* rows first touched by the owning workers */
+#define NUMA_POLICY_INTERLEAVE  2 /* pages interleaved over all nodes         */
+#define NUMA_POLICY_BIND        3 /* rows bound to the node of their worker   */
+
+/* Transposes of the operands of matrix_matrix_gemm */
+#define MATRIX_TRANS_A 1
+#define MATRIX_TRANS_B 2
+
+/* Activations of the GEMM epilogue */
+#define MATRIX_ACT_NONE  0
+#define MATRIX_ACT_RELU  1
+#define MATRIX_ACT_CLAMP 2 /* to [clamp_min, clamp_max]     */
+#define MATRIX_ACT_GELU  3 /* tanh approximation of the GELU */
+
+/* Applied to each element of C while its tile is in registers: bias[j] is
+ * added to column j (no bias if NULL), then the activation */
+typedef struct matrix_epilogue {
+	const float *bias;
+	int activation;
+	float clamp_min, clamp_max;
+} MatrixEpilogue;
+
+/* Memory used by default by the out-of-core multiplication of matrix files */
+#define MATRIX_STREAM_BUDGET (1UL << 30)
+
+/* Size below which the Strassen-Winograd products use the blocked kernel */
+#define MATRIX_STRASSEN_CUTOFF 1024
+
+/* The operations take matrices of any dtype: their elements are converted to
+ * floats as they are loaded and the products accumulate in floats, rounding
+ * the elements of C once. Batched products write float matrices only, and the
+ * Strassen-Winograd product takes float matrices only */
 int scalar_matrix_mult(float scalar_value, Matrix *matrix);
 int matrix_matrix_mult(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC);
 void set_number_threads(int num_threads);
 
+/* Auto-tuning of matrix_matrix_mult and matrix_matrix_gemm. matrix_tune times
+ * products of m x k by k x n float matrices with other kernels, numbers of
+ * threads and block sizes, one after the other, and keeps the fastest for the
+ * shape class of (m, n, k), the dimensions rounded up to powers of two. The
+ * winners are saved in the tuning file, keyed by the CPU model, and the
+ * products of a class use the ones found for it. The tuning file is
+ * $MATRIX_LIB_TUNING, or ~/.matrix_lib_tuning, unless set_tuning_file sets
+ * another (none if NULL) */
+int matrix_tune(unsigned long int m, unsigned long int n, unsigned long int k);
+void set_tuning_file(const char *file_name);
+
+/* C = alpha * op(A) * op(B) + beta * C followed by the epilogue (none if
+ * NULL), op transposing the operands set in flags (MATRIX_TRANS_*). C is not
+ * read when beta is 0 */
+int matrix_matrix_gemm(float alpha, Matrix *matrixA, Matrix *matrixB, float beta, Matrix *matrixC,
+		int flags, const MatrixEpilogue *epilogue);
+
+/* Products of a batch run in parallel, each one by a single worker. The
+ * strided batch stacks them in the rows of A, B and C, and a B holding a
+ * single product is shared by all */
+int matrix_matrix_mult_batched(Matrix **matrixA, Matrix **matrixB, Matrix **matrixC, unsigned long int batch);
+int matrix_matrix_mult_strided(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC, unsigned long int batch);
+
+/* C = A * B by Strassen-Winograd, splitting A, B and C in quadrants while all
+ * their dimensions are at least the cutoff set by set_strassen_cutoff. Each
+ * level saves an eighth of the multiplications but adds sums whose rounding
+ * errors grow with the depth and are bounded normwise, not elementwise, so
+ * small elements of C can lose most of their precision. strassen_bench
+ * measures the speedup and the error against matrix_matrix_mult */
+int matrix_matrix_mult_strassen(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC);
+void set_strassen_cutoff(unsigned long int cutoff);
+
+/* B = A^T, A being transposed in place if B is A itself, which must then be
+ * square. Otherwise A and B must not share their rows, and must have the same
+ * dtype */
+int matrix_transpose(Matrix *matrixA, Matrix *matrixB);
+
+/* y = alpha * op(A) * x + beta * y, op transposing A if MATRIX_TRANS_A is set
+ * in flags, x and y being matrices of a single row or column. y is not read
+ * when beta is 0 and must not share the rows of A or x */
+int matrix_vector_gemv(float alpha, Matrix *matrixA, Matrix *vectorX, float beta, Matrix *vectorY, int flags);
+
+/* C = A + B and Y = alpha * X + Y for matrices of the same size. The result
+ * may be one of the operands but must not overlap them otherwise */
+int matrix_matrix_add(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC);
+int matrix_axpy(float alpha, Matrix *matrixX, Matrix *matrixY);
+
+/* C = A * B with A or B sparse, and y = A * x with A sparse and x and y
+ * matrices of a single row or column. The threads split the rows of a sparse
+ * A by their nonzeros. The dense A, B and C are float matrices, B not being a
+ * transposed view when A is sparse */
+int sparse_matrix_mult(SparseMatrix *matrixA, Matrix *matrixB, Matrix *matrixC);
+int matrix_sparse_mult(Matrix *matrixA, SparseMatrix *matrixB, Matrix *matrixC);
+int sparse_vector_mult(SparseMatrix *matrixA, Matrix *vectorX, Matrix *vectorY);
+
+/* Operations queued without waiting, run in the order they were queued by a
+ * thread of the library with the whole pool. They return NULL if they could
+ * not be queued. The matrices of the requests must not be touched before they
+ * are done */
+MatrixRequest *scalar_matrix_mult_async(float scalar_value, Matrix *matrix);
+MatrixRequest *matrix_matrix_mult_async(Matrix *matrixA, Matrix *matrixB, Matrix *matrixC);
+int wait_matrix_request(MatrixRequest *request);
+int test_matrix_request(MatrixRequest *request, int *result);
+int wait_any_matrix_request(MatrixRequest **requests, int num_requests, int *result);
+
+void set_numa_policy(int policy);
+void set_thread_affinity(int enable);
+void set_memory_budget(unsigned long int bytes);
+
+int init_thread_pool(void);
+int close_thread_pool(void);
+
 void print_matrix(Matrix *matrix);
 Matrix *new_matrix(unsigned long int height, unsigned long int width, float *rows);
 Matrix *zero_matrix(unsigned long int height, unsigned long int width);
+Matrix *zero_matrix_dtype(unsigned long int height, unsigned long int width, int dtype);
+/* Dense copy of a matrix or view with its elements rounded to dtype */
+Matrix *convert_matrix(Matrix *matrix, int dtype);
+/* Matrices read and mapped from files have the dtype of the file, and are
+ * dumped with their own. The out-of-core multiplication takes float files */
 Matrix *read_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height);
+Matrix *map_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height, int flags);
 void dump_matrix_binfile(const char *file_name, Matrix *matrix);
+int matrix_matrix_mult_binfile(const char *matrixA_file, const char *matrixB_file, const char *matrixC_file);
 void delete_matrix(Matrix *matrix);
 
+/* Sparse copy of the nonzeros of a matrix or view. Sparse files hold CSR
+ * matrices as matrix_file.h describes */
+SparseMatrix *convert_sparse_matrix(Matrix *matrix);
+SparseMatrix *read_sparse_binfile(const char *file_name);
+void dump_sparse_binfile(const char *file_name, SparseMatrix *matrix);
+void delete_sparse_matrix(SparseMatrix *matrix);
+
+/* Views share the rows of their matrix, which must outlive them, and are
+ * deleted with delete_matrix without touching the rows. Products read
+ * transposed views but do not write them */
+Matrix *view_matrix_rows(Matrix *matrix, unsigned long int first_row, unsigned long int num_rows);
+Matrix *view_matrix_columns(Matrix *matrix, unsigned long int first_column, unsigned long int num_columns);
+Matrix *view_matrix_transpose(Matrix *matrix);
+
 #endif /* #ifndef _MATRIX_LIB_H */
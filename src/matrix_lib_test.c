@@ -23,42 +23,56 @@ int main(int argc, char *argv[])
 
 	gettimeofday(&overall_t1, NULL);
 
-	if (argc != 12) {
-		fprintf(stderr, "USAGE: %s <scalar> <matrix_a_height> <matrix_a_width>"
-						" <matrix_b_height> <matrix_b_width> <ve_id_number>"
+	/* Formatted files carry their dimensions, raw files need them given */
+	if (argc == 8) {
+		escalar = argtof(argv[1]);
+		a_height = a_width = b_height = b_width = 0;
+		ve_id_number = argtoi(argv[2]);
+		ve_num_threads = argtoi(argv[3]);
+		bf1 = argv[4];
+		bf2 = argv[5];
+		bf3 = argv[6];
+		bf4 = argv[7];
+	} else if (argc == 12) {
+		escalar = argtof(argv[1]);
+		a_height = argtoul(argv[2]);
+		a_width = argtoul(argv[3]);
+		b_height = argtoul(argv[4]);
+		b_width = argtoul(argv[5]);
+		ve_id_number = argtoi(argv[6]);
+		ve_num_threads = argtoi(argv[7]);
+		bf1 = argv[8];
+		bf2 = argv[9];
+		bf3 = argv[10];
+		bf4 = argv[11];
+	} else {
+		fprintf(stderr, "USAGE: %s <scalar> [<matrix_a_height> <matrix_a_width>"
+						" <matrix_b_height> <matrix_b_width>] <ve_id_number>"
 						" <ve_num_threads> <matrix_a_file> <matrix_b_file>"
 						" <result1_file> <result2_file>\n",
 						argv[0]);
 		die("Insuficient arguments");
 	}
 
-	escalar = argtof(argv[1]);
-	a_height = argtoul(argv[2]);
-	a_width = argtoul(argv[3]);
-	b_height = argtoul(argv[4]);
-	b_width = argtoul(argv[5]);
-	ve_id_number = argtoi(argv[6]);
-	ve_num_threads = argtoi(argv[7]);
-	bf1 = argv[8];
-	bf2 = argv[9];
-	bf3 = argv[10];
-	bf4 = argv[11];
-
 	gettimeofday(&start, NULL);
 	set_ve_execution_node(ve_id_number);
 	set_number_threads(ve_num_threads);
 	ret = init_proc_ve_node();
 	matrixA = read_matrix_binfile(bf1, a_width, a_height);
+	if (!matrixA)
+		die("Matrixes creation failure");
 	ret = load_ve_matrix(matrixA);
 	if (!ret)
 		die("load_ve_matrix()");
 
 	matrixB = read_matrix_binfile(bf2, b_width, b_height);
+	if (!matrixB)
+		die("Matrixes creation failure");
 	ret = load_ve_matrix(matrixB);
 	if (!ret)
 		die("load_ve_matrix()");
 
-	matrixC = zero_matrix(a_height, b_width);
+	matrixC = zero_matrix(matrixA->height, matrixB->width);
 	ret = load_ve_matrix(matrixC);
 	if (!ret)
 		die("load_ve_matrix()");
@@ -73,11 +87,9 @@ int main(int argc, char *argv[])
 
 	printf("matrix init time: %f ms\n", timedifference_msec(start, stop));
 
+	/* The operations send the matrices they read to the VE, and the
+	 * results come back only when the host reads them */
 	gettimeofday(&start, NULL);
-	ret = sync_vh_ve_matrix(matrixA);
-	if (!ret)
-		die("sync_vh_ve_matrix()");
-
 	ret = scalar_matrix_mult(escalar, matrixA);
 	if (!ret)
 		die("scalar_matrix_mult()");
@@ -92,26 +104,10 @@ int main(int argc, char *argv[])
 	dump_matrix_binfile(bf3, matrixA);
 
 	gettimeofday(&start, NULL);
-	ret = sync_vh_ve_matrix(matrixA);
-	if (!ret)
-		die("sync_vh_ve_matrix()");
-
-	ret = sync_vh_ve_matrix(matrixB);
-	if (!ret)
-		die("sync_vh_ve_matrix()");
-
 	ret = matrix_matrix_mult(matrixA, matrixB, matrixC);
 	if (!ret)
 		die("matrix_matrix_mult() call failure");
 
-	ret = sync_ve_vh_matrix(matrixA);
-	if (!ret)
-		die("sync_ve_vh_matrix()");
-
-	ret = sync_ve_vh_matrix(matrixB);
-	if (!ret)
-		die("sync_ve_vh_matrix()");
-
 	ret = sync_ve_vh_matrix(matrixC);
 	if (!ret)
 		die("sync_ve_vh_matrix()");
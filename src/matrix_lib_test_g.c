@@ -23,34 +23,47 @@ int main(int argc, char *argv[])
 
 	gettimeofday(&overall_t1, NULL);
 
-	if (argc != 11) {
-		fprintf(stderr, "USAGE: %s <scalar> <matrix_a_height> <matrix_a_width>"
-						" <matrix_b_height> <matrix_b_width> <num_threads>"
+	/* Formatted files carry their dimensions, raw files need them given */
+	if (argc == 7) {
+		escalar = argtof(argv[1]);
+		a_height = a_width = b_height = b_width = 0;
+		num_threads = argtoi(argv[2]);
+		bf1 = argv[3];
+		bf2 = argv[4];
+		bf3 = argv[5];
+		bf4 = argv[6];
+	} else if (argc == 11) {
+		escalar = argtof(argv[1]);
+		a_height = argtoul(argv[2]);
+		a_width = argtoul(argv[3]);
+		b_height = argtoul(argv[4]);
+		b_width = argtoul(argv[5]);
+		num_threads = argtoi(argv[6]);
+		bf1 = argv[7];
+		bf2 = argv[8];
+		bf3 = argv[9];
+		bf4 = argv[10];
+	} else {
+		fprintf(stderr, "USAGE: %s <scalar> [<matrix_a_height> <matrix_a_width>"
+						" <matrix_b_height> <matrix_b_width>] <num_threads>"
 						" <matrix_a_file> <matrix_b_file> <result1_file>"
 						" <result2_file>\n",
 						argv[0]);
 		die("Insuficient arguments");
 	}
 
-	escalar = argtof(argv[1]);
-	a_height = argtoul(argv[2]);
-	a_width = argtoul(argv[3]);
-	b_height = argtoul(argv[4]);
-	b_width = argtoul(argv[5]);
-	num_threads = argtoi(argv[6]);
-	bf1 = argv[7];
-	bf2 = argv[8];
-	bf3 = argv[9];
-	bf4 = argv[10];
-
 	gettimeofday(&start, NULL);
 	set_number_threads(num_threads);
+	if (!init_thread_pool())
+		die("init_thread_pool()");
 	matrixA = read_matrix_binfile(bf1, a_width, a_height);
 	matrixB = read_matrix_binfile(bf2, b_width, b_height);
-	matrixC = zero_matrix(a_height, b_width);
+	if (!matrixA || !matrixB)
+		die("Matrixes creation failure");
+	matrixC = zero_matrix(matrixA->height, matrixB->width);
 	gettimeofday(&stop, NULL);
 
-	if (!matrixA || !matrixB || !matrixC)
+	if (!matrixC)
 		die("Matrixes creation failure");
 
 	printf("matrix init time: %f ms\n", timedifference_msec(start, stop));
@@ -79,6 +92,9 @@ int main(int argc, char *argv[])
 	delete_matrix(matrixB);
 	delete_matrix(matrixC);
 
+	if (!close_thread_pool())
+		die("close_thread_pool()");
+
 	gettimeofday(&overall_t2, NULL);
 	printf("overall time: %f ms\n", timedifference_msec(overall_t1, overall_t2));
 
@@ -1,11 +1,111 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <omp.h>
 #include <veo_hmem.h>
 
-uint64_t scalar_matrix_mult(int num_threads, unsigned long int height, unsigned long int width, float *rows, float scalar)
+/* Types of the elements, as in matrix_lib.h, and their size in bytes */
+#define DTYPE_F32  0
+#define DTYPE_BF16 1
+#define DTYPE_F16  2
+#define DTYPE_SIZE(dtype) ((dtype) == DTYPE_F32 ? 4UL : 2UL)
+
+/* Address of the i-th of the elements of a dtype starting at p */
+#define DTYPE_AT(p, dtype, i) ((void *)((char *)(p) + DTYPE_SIZE(dtype) * (i)))
+
+/* Converts a 16-bit element to a float, exactly, as matrix_file.c does */
+static inline
+float half_to_float(uint16_t half, int dtype)
+{
+	uint32_t bits, exponent, mantissa;
+	float value;
+
+	if (dtype == DTYPE_BF16) {
+		bits = (uint32_t)half << 16;
+	} else {
+		exponent = half >> 10 & 0x1f;
+		mantissa = half & 0x3ff;
+		if (exponent == 0x1f) {
+			bits = 0x7f800000 | mantissa << 13;
+		} else if (exponent) {
+			bits = (exponent + 112) << 23 | mantissa << 13;
+		} else {
+			value = (float)mantissa * (1.0f / 16777216.0f);
+			return half & 0x8000 ? -value : value;
+		}
+		bits |= (uint32_t)(half & 0x8000) << 16;
+	}
+
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/* Rounds a float to a 16-bit element, to nearest even, as matrix_file.c does */
+static inline
+uint16_t float_to_half(float value, int dtype)
+{
+	uint32_t bits, sign, mantissa, shift, rest, half;
+
+	memcpy(&bits, &value, sizeof(bits));
+
+	if (dtype == DTYPE_BF16) {
+		if ((bits & 0x7fffffff) > 0x7f800000)
+			return (uint16_t)(bits >> 16 | 0x40);
+		return (uint16_t)((bits + 0x7fff + (bits >> 16 & 1)) >> 16);
+	}
+
+	sign = bits >> 16 & 0x8000;
+	bits &= 0x7fffffff;
+
+	if (bits > 0x7f800000)
+		return (uint16_t)(sign | 0x7e00);
+
+	if (bits >= 0x477ff000)
+		return (uint16_t)(sign | 0x7c00);
+
+	if (bits >= 0x38800000)
+		return (uint16_t)(sign | (bits + 0xfff + (bits >> 13 & 1) - (112U << 23)) >> 13);
+
+	shift = 126 - (bits >> 23);
+	if (shift > 24)
+		return (uint16_t)sign;
+
+	mantissa = (bits & 0x7fffff) | 0x800000;
+	half = mantissa >> shift;
+	rest = mantissa & ((1U << shift) - 1);
+	if (rest > 1U << (shift - 1) || (rest == 1U << (shift - 1) && (half & 1)))
+		++half;
+
+	return (uint16_t)(sign | half);
+}
+
+/* Scales length elements of a dtype, the 16-bit ones through floats */
+static
+void scale_line(void *line, int dtype, unsigned long int length, float scalar)
+{
+	float *arr = (float *)line;
+	uint16_t *halves = (uint16_t *)line;
+	unsigned long int i;
+
+	if (dtype == DTYPE_F32) {
+		for (i = 0; i < length; ++i)
+			arr[i] *= scalar;
+		return;
+	}
+
+	for (i = 0; i < length; ++i)
+		halves[i] = float_to_half(half_to_float(halves[i], dtype) * scalar, dtype);
+}
+
+/* Scales the lines of length elements of a dtype, stride apart, of a matrix
+ * or view. The threads split the elements when the lines are contiguous and
+ * the lines otherwise */
+uint64_t scalar_matrix_mult(int num_threads, unsigned long int lines, unsigned long int length, float *rows,
+		float scalar, unsigned long int stride, int dtype)
 {
 	int tid;
-	unsigned long int matrix_size = height * width;
+	unsigned long int matrix_size = stride == length ? lines * length : lines;
 	const unsigned long int n = matrix_size / num_threads;
 	const unsigned long int rest = matrix_size % num_threads;
 
@@ -28,13 +128,290 @@ uint64_t scalar_matrix_mult(int num_threads, unsigned long int height, unsigned
 			last_index = first_index + n;
 		}
 
-		for (i = first_index; i < last_index; ++i)
-			rows[i] *= scalar;
+		if (stride == length) {
+			scale_line(DTYPE_AT(rows, dtype, first_index), dtype, last_index - first_index, scalar);
+		} else {
+			for (i = first_index; i < last_index; ++i)
+				scale_line(DTYPE_AT(rows, dtype, i * stride), dtype, length, scalar);
+		}
+	}
+
+	return 1;
+}
+
+/* Blocking of the product: a VE_KB x VE_JB panel of B is packed for all the
+ * threads (2 MB, kept in the LLC) and each thread runs over its rows of C in
+ * groups of VE_MR, keeping VE_MR segments of VE_VLEN columns of C in vector
+ * registers across the whole depth of the panel */
+#define VE_VLEN 256
+#define VE_MR 4
+#define VE_KB 256
+#define VE_JB 2048
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Flags of the calls of matrix_matrix_gemm: the transposes of matrix_lib.h
+ * and a bias sent after the parameters */
+#define GEMM_TRANS_A 1
+#define GEMM_TRANS_B 2
+#define GEMM_BIAS 4
+
+/* Parameters of matrix_matrix_gemm, followed by the bias */
+#define GEMM_ALPHA 0
+#define GEMM_BETA 1
+#define GEMM_CLAMP_MIN 2
+#define GEMM_CLAMP_MAX 3
+#define GEMM_PARAMS 4
+
+/* Activations of the epilogue, as in matrix_lib.h */
+#define GEMM_ACT_NONE 0
+#define GEMM_ACT_RELU 1
+#define GEMM_ACT_CLAMP 2
+#define GEMM_ACT_GELU 3
+
+/* GELU by its tanh approximation, x / (1 + exp(-2 u)) for
+ * u = sqrt(2 / pi) (x + 0.044715 x^3) */
+#define GELU_K0 -1.5957691216f
+#define GELU_K1 -0.0713548163f
+
+/* What a pass over a panel of B does with the segments of C it computes:
+ * C = alpha * T + beta * C, then the bias and the activation */
+struct ve_epilogue {
+	float alpha, beta;
+	int activation;
+	float clamp_min, clamp_max;
+};
+
+/* C = alpha * op(A) * op(B) + beta * C through the epilogue, for a m x n
+ * matrix op(A) and a n x k matrix op(B). The elements (i, p) of op(A) and
+ * (p, j) of op(B) are at a[i * a_row + p * a_col] and b[p * b_row + j * b_col],
+ * and the rows of C ldc floats apart */
+struct ve_gemm {
+	unsigned long int m, n, k;
+	const float *a, *b;
+	float *c;
+	unsigned long int a_row, a_col, b_row, b_col, ldc;
+	struct ve_epilogue ep;
+	const float *bias;
+};
+
+/* Stores a segment of jb columns of a row of C from its accumulator, which is
+ * still in vector registers, through the epilogue */
+static inline
+void store_segment(unsigned long int jb, float *acc, float *c, const struct ve_epilogue *ep, const float *bias)
+{
+	unsigned long int j;
+
+	if (ep->alpha != 1.0f) {
+		for (j = 0; j < jb; ++j)
+			acc[j] *= ep->alpha;
+	}
+	if (ep->beta != 0.0f) {
+		for (j = 0; j < jb; ++j)
+			acc[j] += ep->beta * c[j];
+	}
+	if (bias) {
+		for (j = 0; j < jb; ++j)
+			acc[j] += bias[j];
+	}
+
+	switch (ep->activation) {
+	case GEMM_ACT_RELU:
+		for (j = 0; j < jb; ++j)
+			acc[j] = acc[j] > 0.0f ? acc[j] : 0.0f;
+		break;
+	case GEMM_ACT_CLAMP:
+		for (j = 0; j < jb; ++j)
+			acc[j] = acc[j] < ep->clamp_min ? ep->clamp_min : acc[j] > ep->clamp_max ? ep->clamp_max : acc[j];
+		break;
+	case GEMM_ACT_GELU:
+		for (j = 0; j < jb; ++j)
+			acc[j] = acc[j] / (1.0f + expf(acc[j] * (GELU_K0 + GELU_K1 * acc[j] * acc[j])));
+		break;
+	}
+
+	for (j = 0; j < jb; ++j)
+		c[j] = acc[j];
+}
+
+/* C[0..VE_MR) = A[0..VE_MR) * B over a kb x jb packed panel of B, for a
+ * segment of jb <= VE_VLEN columns, stored through the epilogue. The rows of A
+ * are a_row apart and their elements a_col, the rows of C ldc */
+static
+void mult_segment_mr(unsigned long int kb, unsigned long int jb, const float *a, unsigned long int a_row,
+		unsigned long int a_col, const float *pb, unsigned long int ldpb, float *c, unsigned long int ldc,
+		const struct ve_epilogue *ep, const float *bias)
+{
+	float acc0[VE_VLEN], acc1[VE_VLEN], acc2[VE_VLEN], acc3[VE_VLEN];
+#ifdef __ve__
+#pragma _NEC vreg(acc0)
+#pragma _NEC vreg(acc1)
+#pragma _NEC vreg(acc2)
+#pragma _NEC vreg(acc3)
+#endif
+	unsigned long int p, j;
+	float a0, a1, a2, a3, b;
+
+	for (j = 0; j < jb; ++j)
+		acc0[j] = acc1[j] = acc2[j] = acc3[j] = 0.0f;
+
+	for (p = 0; p < kb; ++p) {
+		a0 = a[p * a_col];
+		a1 = a[a_row + p * a_col];
+		a2 = a[2 * a_row + p * a_col];
+		a3 = a[3 * a_row + p * a_col];
+		for (j = 0; j < jb; ++j) {
+			b = pb[p * ldpb + j];
+			acc0[j] += a0 * b;
+			acc1[j] += a1 * b;
+			acc2[j] += a2 * b;
+			acc3[j] += a3 * b;
+		}
+	}
+
+	store_segment(jb, acc0, c, ep, bias);
+	store_segment(jb, acc1, c + ldc, ep, bias);
+	store_segment(jb, acc2, c + 2 * ldc, ep, bias);
+	store_segment(jb, acc3, c + 3 * ldc, ep, bias);
+}
+
+/* Same for a single row, for the rows left after the groups of VE_MR */
+static
+void mult_segment_1(unsigned long int kb, unsigned long int jb, const float *a, unsigned long int a_col,
+		const float *pb, unsigned long int ldpb, float *c, const struct ve_epilogue *ep, const float *bias)
+{
+	float acc0[VE_VLEN];
+#ifdef __ve__
+#pragma _NEC vreg(acc0)
+#endif
+	unsigned long int p, j;
+
+	for (j = 0; j < jb; ++j)
+		acc0[j] = 0.0f;
+
+	for (p = 0; p < kb; ++p) {
+		for (j = 0; j < jb; ++j)
+			acc0[j] += a[p * a_col] * pb[p * ldpb + j];
+	}
+
+	store_segment(jb, acc0, c, ep, bias);
+}
+
+/* Packs the rows [first, last) of the kb x jb panel of op(B) at rows pc and
+ * columns jc */
+static
+void pack_panel(const struct ve_gemm *g, unsigned long int pc, unsigned long int jc, unsigned long int jb,
+		unsigned long int first, unsigned long int last, float *panel)
+{
+	unsigned long int p, j;
+
+	for (p = first; p < last; ++p) {
+		for (j = 0; j < jb; ++j)
+			panel[p * jb + j] = g->b[(pc + p) * g->b_row + (jc + j) * g->b_col];
+	}
+}
+
+/* Rows [first_line, last_line) of C for the kb x jb panel packed from rows pc
+ * and columns jc of op(B): alpha scales every pass over the depth, beta only
+ * the first one, and the bias and the activation go with the last one */
+static
+void mult_panel(const struct ve_gemm *g, unsigned long int first_line, unsigned long int last_line,
+		unsigned long int pc, unsigned long int jc, unsigned long int kb, unsigned long int jb,
+		const float *panel)
+{
+	unsigned long int ln, j;
+	struct ve_epilogue pass = g->ep;
+	const float *bias = pc + kb == g->n ? g->bias : NULL;
+
+	pass.beta = pc ? 1.0f : g->ep.beta;
+	pass.activation = pc + kb == g->n ? g->ep.activation : GEMM_ACT_NONE;
+
+	for (ln = first_line; ln + VE_MR <= last_line; ln += VE_MR) {
+		for (j = 0; j < jb; j += VE_VLEN)
+			mult_segment_mr(kb, MIN(VE_VLEN, jb - j), g->a + ln * g->a_row + pc * g->a_col, g->a_row, g->a_col,
+					panel + j, jb, g->c + ln * g->ldc + jc + j, g->ldc, &pass, bias ? bias + jc + j : NULL);
+	}
+	for (; ln < last_line; ++ln) {
+		for (j = 0; j < jb; j += VE_VLEN)
+			mult_segment_1(kb, MIN(VE_VLEN, jb - j), g->a + ln * g->a_row + pc * g->a_col, g->a_col,
+					panel + j, jb, g->c + ln * g->ldc + jc + j, &pass, bias ? bias + jc + j : NULL);
+	}
+}
+
+/* Rows of C split among num_threads threads, in i-k-j order over packed
+ * panels of op(B). Returns 0 if the panel can not be allocated */
+static
+int mult_rows(int num_threads, const struct ve_gemm *g)
+{
+	int tid;
+	const unsigned long int els = g->m / num_threads;
+	const unsigned long int rest = g->m % num_threads;
+	float *panel;
+
+	panel = (float *)malloc(sizeof(float) * VE_KB * MIN(VE_JB, g->k));
+	if (!panel)
+		return 0;
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel private (num_threads, tid)
+	{
+		unsigned long int first_line, last_line, jc, pc, jb, kb, p;
+		tid = omp_get_thread_num();
+
+		if (tid < rest) {
+			first_line = tid * (els+1);
+			last_line = first_line + els+1;
+		} else {
+			first_line = tid*els + rest;
+			last_line = first_line + els;
+		}
+
+		for (jc = 0; jc < g->k; jc += VE_JB) {
+			jb = MIN(VE_JB, g->k - jc);
+			for (pc = 0; pc < g->n; pc += VE_KB) {
+				kb = MIN(VE_KB, g->n - pc);
+
+				/* All the threads pack the panel, then use it */
+				#pragma omp for
+				for (p = 0; p < kb; ++p)
+					pack_panel(g, pc, jc, jb, p, p + 1, panel);
+
+				mult_panel(g, first_line, last_line, pc, jc, kb, jb, panel);
+
+				/* Nobody packs the next panel before all are done */
+				#pragma omp barrier
+			}
+		}
 	}
 
+	free(panel);
+
 	return 1;
 }
 
+/* Plain C = A * B for row major A, B and C */
+static
+void plain_gemm(struct ve_gemm *g, unsigned long int m, unsigned long int n, unsigned long int k,
+		const float *mA_rows, const float *mB_rows, float *mC_rows)
+{
+	g->m = m;
+	g->n = n;
+	g->k = k;
+	g->a = mA_rows;
+	g->b = mB_rows;
+	g->c = mC_rows;
+	g->a_row = n;
+	g->a_col = 1;
+	g->b_row = k;
+	g->b_col = 1;
+	g->ldc = k;
+	g->ep.alpha = 1.0f;
+	g->ep.beta = 0.0f;
+	g->ep.activation = GEMM_ACT_NONE;
+	g->bias = NULL;
+}
+
 uint64_t matrix_matrix_mult(int num_threads,
 							unsigned long int m,
 							unsigned long int n,
@@ -43,9 +420,7 @@ uint64_t matrix_matrix_mult(int num_threads,
 							float *mB_rows,
 							float *mC_rows)
 {
-	int tid;
-	const unsigned long int els = m / num_threads;
-	const unsigned long int rest = m % num_threads;
+	struct ve_gemm g;
 
 	mA_rows = (float *)veo_get_hmem_addr(mA_rows);
 	if (!mA_rows)
@@ -59,32 +434,579 @@ uint64_t matrix_matrix_mult(int num_threads,
 	if (!mC_rows)
 		return 0;
 
+	plain_gemm(&g, m, n, k, mA_rows, mB_rows, mC_rows);
+	return mult_rows(num_threads, &g);
+}
+
+/* Converts length elements of src_dtype at src to dst_dtype at dst */
+static
+void convert_line(void *dst, int dst_dtype, const void *src, int src_dtype, unsigned long int length)
+{
+	unsigned long int i;
+
+	if (dst_dtype == DTYPE_F32) {
+		for (i = 0; i < length; ++i)
+			((float *)dst)[i] = half_to_float(((const uint16_t *)src)[i], src_dtype);
+	} else {
+		for (i = 0; i < length; ++i)
+			((uint16_t *)dst)[i] = float_to_half(((const float *)src)[i], dst_dtype);
+	}
+}
+
+/* Dense float copy of the rows x cols 16-bit elements of a dtype at src, whose
+ * rows are ld apart, converted by the threads. NULL if it can not be
+ * allocated */
+static
+float *widen_rows(int num_threads, const void *src, int dtype, unsigned long int rows, unsigned long int cols,
+		unsigned long int ld)
+{
+	float *dst = (float *)malloc(sizeof(float) * rows * cols);
+	unsigned long int i;
+
+	if (!dst)
+		return NULL;
+
 	omp_set_num_threads(num_threads);
 
-	#pragma omp parallel private (num_threads, tid)
+	#pragma omp parallel for
+	for (i = 0; i < rows; ++i)
+		convert_line(dst + i * cols, DTYPE_F32, DTYPE_AT(src, dtype, i * ld), dtype, cols);
+
+	return dst;
+}
+
+/* Rounds the dense rows x cols floats at src to the rows of a dtype, ld apart,
+ * at dst */
+static
+void narrow_rows(int num_threads, void *dst, int dtype, unsigned long int rows, unsigned long int cols,
+		unsigned long int ld, const float *src)
+{
+	unsigned long int i;
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel for
+	for (i = 0; i < rows; ++i)
+		convert_line(DTYPE_AT(dst, dtype, i * ld), dtype, src + i * cols, DTYPE_F32, cols);
+}
+
+/* C = alpha * op(A) * op(B) + beta * C through the epilogue, with alpha, beta,
+ * the bounds of the clamp and the bias in params. The rows of A, B and C are
+ * lda, ldb and ldc elements of dtype_a, dtype_b and dtype_c apart. 16-bit
+ * operands are widened to float copies first, and a 16-bit C is computed in
+ * a float copy rounded once at the end */
+uint64_t matrix_matrix_gemm(int num_threads,
+							unsigned long int m,
+							unsigned long int n,
+							unsigned long int k,
+							float *mA_rows,
+							unsigned long int lda,
+							float *mB_rows,
+							unsigned long int ldb,
+							float *mC_rows,
+							unsigned long int ldc,
+							int flags,
+							int activation,
+							float *params,
+							int dtype_a,
+							int dtype_b,
+							int dtype_c)
+{
+	struct ve_gemm g;
+	float *wide_a = NULL, *wide_b = NULL, *wide_c = NULL;
+	unsigned long int a_rows = flags & GEMM_TRANS_A ? n : m, a_cols = flags & GEMM_TRANS_A ? m : n;
+	unsigned long int b_rows = flags & GEMM_TRANS_B ? k : n, b_cols = flags & GEMM_TRANS_B ? n : k;
+	uint64_t ret = 0;
+
+	mA_rows = (float *)veo_get_hmem_addr(mA_rows);
+	mB_rows = (float *)veo_get_hmem_addr(mB_rows);
+	mC_rows = (float *)veo_get_hmem_addr(mC_rows);
+	params = (float *)veo_get_hmem_addr(params);
+	if (!mA_rows || !mB_rows || !mC_rows || !params)
+		return 0;
+
+	if (dtype_a != DTYPE_F32) {
+		wide_a = widen_rows(num_threads, mA_rows, dtype_a, a_rows, a_cols, lda);
+		if (!wide_a)
+			goto out;
+		lda = a_cols;
+	}
+
+	if (dtype_b != DTYPE_F32) {
+		wide_b = widen_rows(num_threads, mB_rows, dtype_b, b_rows, b_cols, ldb);
+		if (!wide_b)
+			goto out;
+		ldb = b_cols;
+	}
+
+	if (dtype_c != DTYPE_F32) {
+		if (params[GEMM_BETA] != 0.0f)
+			wide_c = widen_rows(num_threads, mC_rows, dtype_c, m, k, ldc);
+		else
+			wide_c = (float *)malloc(sizeof(float) * m * k);
+		if (!wide_c)
+			goto out;
+	}
+
+	plain_gemm(&g, m, n, k, wide_a ? wide_a : mA_rows, wide_b ? wide_b : mB_rows, wide_c ? wide_c : mC_rows);
+	g.a_row = flags & GEMM_TRANS_A ? 1 : lda;
+	g.a_col = flags & GEMM_TRANS_A ? lda : 1;
+	g.b_row = flags & GEMM_TRANS_B ? 1 : ldb;
+	g.b_col = flags & GEMM_TRANS_B ? ldb : 1;
+	g.ldc = wide_c ? k : ldc;
+
+	g.ep.alpha = params[GEMM_ALPHA];
+	g.ep.beta = params[GEMM_BETA];
+	g.ep.activation = activation;
+	g.ep.clamp_min = params[GEMM_CLAMP_MIN];
+	g.ep.clamp_max = params[GEMM_CLAMP_MAX];
+	if (flags & GEMM_BIAS)
+		g.bias = params + GEMM_PARAMS;
+
+	ret = mult_rows(num_threads, &g);
+	if (ret && wide_c)
+		narrow_rows(num_threads, mC_rows, dtype_c, m, k, ldc, wide_c);
+
+out:
+	free(wide_a);
+	free(wide_b);
+	free(wide_c);
+
+	return ret;
+}
+
+/* Multiplies a panel of m rows of A by B into a panel of C, all of them given
+ * by their VE addresses, as the pipelined product sends them */
+uint64_t matrix_matrix_mult_panel(int num_threads,
+							unsigned long int m,
+							unsigned long int n,
+							unsigned long int k,
+							uint64_t mA_panel,
+							uint64_t mB_rows,
+							uint64_t mC_panel)
+{
+	struct ve_gemm g;
+
+	if (!mA_panel || !mB_rows || !mC_panel)
+		return 0;
+
+	plain_gemm(&g, m, n, k, (const float *)mA_panel, (const float *)mB_rows, (float *)mC_panel);
+	return mult_rows(num_threads, &g);
+}
+
+/* C = A * B by a single thread, which packs the panels of B in its own panel
+ * of VE_KB x MIN(VE_JB, k) floats */
+static
+void mult_single(const struct ve_gemm *g, float *panel)
+{
+	unsigned long int jc, pc, jb, kb;
+
+	for (jc = 0; jc < g->k; jc += VE_JB) {
+		jb = MIN(VE_JB, g->k - jc);
+		for (pc = 0; pc < g->n; pc += VE_KB) {
+			kb = MIN(VE_KB, g->n - pc);
+			pack_panel(g, pc, jc, jb, 0, kb, panel);
+			mult_panel(g, 0, g->m, pc, jc, kb, jb, panel);
+		}
+	}
+}
+/* Fields of each product of a batch in the table the VH sends: its
+ * dimensions, the hmem addresses of its matrices and their leading dimensions */
+#define BATCH_M 0
+#define BATCH_N 1
+#define BATCH_K 2
+#define BATCH_A 3
+#define BATCH_B 4
+#define BATCH_C 5
+#define BATCH_LDA 6
+#define BATCH_LDB 7
+#define BATCH_LDC 8
+#define BATCH_FIELDS 9
+
+/* Runs the products of a batch in a single call, each one by a single thread,
+ * the threads taking them as they finish the previous ones */
+uint64_t matrix_matrix_mult_batch(int num_threads, unsigned long int batch, uint64_t *table)
+{
+	unsigned long int i, max_k = 0;
+	int failed = 0;
+
+	table = (uint64_t *)veo_get_hmem_addr(table);
+	if (!table)
+		return 0;
+
+	for (i = 0; i < batch; ++i) {
+		if (table[i * BATCH_FIELDS + BATCH_K] > max_k)
+			max_k = table[i * BATCH_FIELDS + BATCH_K];
+	}
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel reduction(|:failed)
 	{
-		unsigned long int first_line, last_line, ln, cl, ij;
+		const uint64_t *item;
+		struct ve_gemm g;
+		float *panel = (float *)malloc(sizeof(float) * VE_KB * MIN(VE_JB, max_k));
+
+		if (!panel)
+			failed = 1;
+
+		#pragma omp for schedule(dynamic)
+		for (i = 0; i < batch; ++i) {
+			item = table + i * BATCH_FIELDS;
+			if (panel) {
+				plain_gemm(&g, item[BATCH_M], item[BATCH_N], item[BATCH_K],
+						(const float *)veo_get_hmem_addr((void *)item[BATCH_A]),
+						(const float *)veo_get_hmem_addr((void *)item[BATCH_B]),
+						(float *)veo_get_hmem_addr((void *)item[BATCH_C]));
+				g.a_row = item[BATCH_LDA];
+				g.b_row = item[BATCH_LDB];
+				g.ldc = item[BATCH_LDC];
+				mult_single(&g, panel);
+			}
+		}
+
+		free(panel);
+	}
+
+	return !failed;
+}
+
+/* Tiles the transposes go through, in elements a side, so the lines of a tile
+ * they read and write stay in the cache */
+#define TRANSPOSE_TILE 64
+
+/* Copies the element (i, j) of a rows x cols tile of A, of a dtype, to the
+ * element (j, i) of B */
+static
+void transpose_tile(const void *a, unsigned long int a_row, unsigned long int a_col,
+		void *b, unsigned long int b_row, unsigned long int b_col,
+		unsigned long int rows, unsigned long int cols, int dtype)
+{
+	unsigned long int i, j;
+
+	for (j = 0; j < cols; ++j) {
+		if (dtype == DTYPE_F32) {
+			for (i = 0; i < rows; ++i)
+				((float *)b)[j * b_row + i * b_col] = ((const float *)a)[i * a_row + j * a_col];
+		} else {
+			for (i = 0; i < rows; ++i)
+				((uint16_t *)b)[j * b_row + i * b_col] = ((const uint16_t *)a)[i * a_row + j * a_col];
+		}
+	}
+}
+
+/* Swaps the elements of the tiles at (ti, tj) and (tj, ti) of a square matrix
+ * across the diagonal, the elements above the diagonal only if they are the
+ * same tile */
+static
+void swap_tiles(void *a, unsigned long int ld, unsigned long int ti, unsigned long int tj,
+		unsigned long int rows, unsigned long int cols, int dtype)
+{
+	float *arr = (float *)a, value;
+	uint16_t *halves = (uint16_t *)a, half;
+	unsigned long int i, j;
+
+	for (i = ti; i < ti + rows; ++i) {
+		for (j = ti == tj ? i + 1 : tj; j < tj + cols; ++j) {
+			if (dtype == DTYPE_F32) {
+				value = arr[i * ld + j];
+				arr[i * ld + j] = arr[j * ld + i];
+				arr[j * ld + i] = value;
+			} else {
+				half = halves[i * ld + j];
+				halves[i * ld + j] = halves[j * ld + i];
+				halves[j * ld + i] = half;
+			}
+		}
+	}
+}
+
+/* B = A^T for a rows x cols matrix A of a dtype, the element (i, j) of A being
+ * at a + i * a_row + j * a_col and the element (j, i) of B at b + j * b_row +
+ * i * b_col. A square A given as B too is transposed in place, its rows a_row
+ * apart. The threads take the tiles of A, or the pairs of tiles across the
+ * diagonal */
+uint64_t matrix_transpose(int num_threads, unsigned long int rows, unsigned long int cols,
+		void *a, unsigned long int a_row, unsigned long int a_col,
+		void *b, unsigned long int b_row, unsigned long int b_col, int dtype)
+{
+	unsigned long int tiles_r = (rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+	unsigned long int tiles_c = (cols + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+	unsigned long int t, ti, tj;
+	int in_place = a == b;
+
+	a = veo_get_hmem_addr(a);
+	b = veo_get_hmem_addr(b);
+	if (!a || !b)
+		return 0;
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel for private (ti, tj) schedule(dynamic)
+	for (t = 0; t < tiles_r * tiles_c; ++t) {
+		ti = t / tiles_c * TRANSPOSE_TILE;
+		tj = t % tiles_c * TRANSPOSE_TILE;
+		if (in_place) {
+			if (ti <= tj)
+				swap_tiles(a, a_row, ti, tj, MIN(TRANSPOSE_TILE, rows - ti), MIN(TRANSPOSE_TILE, cols - tj), dtype);
+		} else {
+			transpose_tile(DTYPE_AT(a, dtype, ti * a_row + tj * a_col), a_row, a_col,
+					DTYPE_AT(b, dtype, tj * b_row + ti * b_col), b_row, b_col,
+					MIN(TRANSPOSE_TILE, rows - ti), MIN(TRANSPOSE_TILE, cols - tj), dtype);
+		}
+	}
+
+	return 1;
+}
+
+/* y = alpha * op(A) * x + beta * y for floats, the rows of A being lda apart
+ * and holding the rows of op(A) or, if trans, its columns, and the elements of
+ * x and y incx and incy apart. The threads split y, summing the rows of A
+ * scaled by x into their slab of y when they hold the columns of op(A) */
+uint64_t matrix_vector_gemv(int num_threads, unsigned long int m, unsigned long int n,
+		float *a, unsigned long int lda, int trans,
+		float *x, unsigned long int incx, float *y, unsigned long int incy,
+		float alpha, float beta)
+{
+	int tid;
+	const unsigned long int rows = m / num_threads;
+	const unsigned long int rest = m % num_threads;
+
+	a = (float *)veo_get_hmem_addr(a);
+	x = (float *)veo_get_hmem_addr(x);
+	y = (float *)veo_get_hmem_addr(y);
+	if (!a || !x || !y)
+		return 0;
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel private (tid)
+	{
+		unsigned long int first_row, last_row, i, j;
+		float sum, scalar;
 		tid = omp_get_thread_num();
 
 		if (tid < rest) {
-			first_line = tid * (els+1);
-			last_line = first_line + els+1;
+			first_row = tid * (rows+1);
+			last_row = first_row + rows+1;
 		} else {
-			first_line = tid*els + rest;
-			last_line = first_line + els;
+			first_row = tid*rows + rest;
+			last_row = first_row + rows;
+		}
+
+		if (!trans) {
+			for (i = first_row; i < last_row; ++i) {
+				sum = 0.0f;
+				for (j = 0; j < n; ++j)
+					sum += a[i * lda + j] * x[j * incx];
+				y[i * incy] = alpha * sum + (beta != 0.0f ? beta * y[i * incy] : 0.0f);
+			}
+		} else {
+			for (i = first_row; i < last_row; ++i)
+				y[i * incy] = beta != 0.0f ? beta * y[i * incy] : 0.0f;
+
+			for (j = 0; j < n; ++j) {
+				scalar = alpha * x[j * incx];
+				for (i = first_row; i < last_row; ++i)
+					y[i * incy] += scalar * a[j * lda + i];
+			}
 		}
+	}
+
+	return 1;
+}
+
+/* d = x + alpha * y for floats, along the lines of d, ldd apart. The element p
+ * of the line l of x is at x + l * x_line + p * x_el, and likewise for y. The
+ * threads split the lines */
+uint64_t matrix_matrix_add(int num_threads, unsigned long int lines, unsigned long int length,
+		float *x, unsigned long int x_line, unsigned long int x_el,
+		float *y, unsigned long int y_line, unsigned long int y_el,
+		float *d, unsigned long int ldd, float alpha)
+{
+	unsigned long int l, p;
+
+	x = (float *)veo_get_hmem_addr(x);
+	y = (float *)veo_get_hmem_addr(y);
+	d = (float *)veo_get_hmem_addr(d);
+	if (!x || !y || !d)
+		return 0;
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel for private (p)
+	for (l = 0; l < lines; ++l) {
+		for (p = 0; p < length; ++p)
+			d[l * ldd + p] = x[l * x_line + p * x_el] + alpha * y[l * y_line + p * y_el];
+	}
+
+	return 1;
+}
+
+/* A sparse matrix of a given height is sent as a single VE array holding its
+ * row offsets, then its values and then their columns */
+#define SPARSE_ROW_PTR(arrays) ((const uint64_t *)(arrays))
+#define SPARSE_VALUES(arrays, height) ((const float *)(SPARSE_ROW_PTR(arrays) + (height) + 1))
+#define SPARSE_COLUMNS(arrays, height, nnz) ((const uint32_t *)(SPARSE_VALUES(arrays, height) + (nnz)))
+
+/* First row starting at or past the nonzero nz */
+static
+unsigned long int sparse_row_at(const uint64_t *row_ptr, unsigned long int height, unsigned long int nz)
+{
+	unsigned long int low = 0, high = height, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (row_ptr[mid] < nz)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Rows of thread tid when the rows are split so each thread gets about as
+ * many nonzeros, the last one taking the empty rows at the end */
+static
+void sparse_rows(const uint64_t *row_ptr, unsigned long int height, unsigned long int nnz, int num_threads,
+		int tid, unsigned long int *first_row, unsigned long int *last_row)
+{
+	const unsigned long int n = nnz / num_threads;
+	const unsigned long int rest = nnz % num_threads;
+
+	*first_row = tid ? sparse_row_at(row_ptr, height, n * tid + MIN(tid, rest)) : 0;
+	*last_row = tid + 1 == num_threads ? height : sparse_row_at(row_ptr, height, n * (tid + 1) + MIN(tid + 1, rest));
+}
+
+/* C = A * B for a sparse m x k A and a float k x n B, the rows of B and C being
+ * ldb and ldc apart. Each row of C sums the rows of B picked by the nonzeros
+ * of its row of A */
+uint64_t sparse_matrix_mult(int num_threads, unsigned long int m, unsigned long int n,
+		void *arrays, unsigned long int nnz,
+		float *b, unsigned long int ldb, float *c, unsigned long int ldc)
+{
+	const uint64_t *row_ptr;
+	const float *values;
+	const uint32_t *columns;
 
-		for (ln = first_line; ln < last_line; ++ln) {
-			for (cl = 0; cl < k; ++cl) {
-				float sum = 0.0f;
-				for (ij = 0; ij < n; ++ij)
-					sum += mA_rows[ln * n + ij] * mB_rows[ij * k + cl];
-				mC_rows[ln * k + cl] = sum;
+	arrays = veo_get_hmem_addr(arrays);
+	b = (float *)veo_get_hmem_addr(b);
+	c = (float *)veo_get_hmem_addr(c);
+	if (!arrays || !b || !c)
+		return 0;
+
+	row_ptr = SPARSE_ROW_PTR(arrays);
+	values = SPARSE_VALUES(arrays, m);
+	columns = SPARSE_COLUMNS(arrays, m, nnz);
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel
+	{
+		unsigned long int first_row, last_row, i, j, p;
+		const float *arr_b;
+		float *arr_c;
+
+		sparse_rows(row_ptr, m, nnz, omp_get_num_threads(), omp_get_thread_num(), &first_row, &last_row);
+		for (i = first_row; i < last_row; ++i) {
+			arr_c = c + i * ldc;
+			for (j = 0; j < n; ++j)
+				arr_c[j] = 0.0f;
+
+			for (p = row_ptr[i]; p < row_ptr[i + 1]; ++p) {
+				arr_b = b + columns[p] * ldb;
+				for (j = 0; j < n; ++j)
+					arr_c[j] += values[p] * arr_b[j];
 			}
 		}
 	}
 
 	return 1;
+}
+
+/* C = A * B for a float m x k A, its element (i, p) being at a + i * a_row +
+ * p * a_col, and a sparse k x n B. Each row of C sums the rows of B scaled by
+ * its row of A, as the nonzeros of a row of B have distinct columns */
+uint64_t matrix_sparse_mult(int num_threads, unsigned long int m, unsigned long int n, unsigned long int k,
+		float *a, unsigned long int a_row, unsigned long int a_col,
+		void *arrays, unsigned long int nnz, float *c, unsigned long int ldc)
+{
+	const uint64_t *row_ptr;
+	const float *values;
+	const uint32_t *columns;
+	unsigned long int i;
+
+	a = (float *)veo_get_hmem_addr(a);
+	arrays = veo_get_hmem_addr(arrays);
+	c = (float *)veo_get_hmem_addr(c);
+	if (!a || !arrays || !c)
+		return 0;
+
+	row_ptr = SPARSE_ROW_PTR(arrays);
+	values = SPARSE_VALUES(arrays, k);
+	columns = SPARSE_COLUMNS(arrays, k, nnz);
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel for
+	for (i = 0; i < m; ++i) {
+		unsigned long int j, q, p;
+		float *arr_c = c + i * ldc, value;
+
+		for (j = 0; j < n; ++j)
+			arr_c[j] = 0.0f;
+
+		for (q = 0; q < k; ++q) {
+			value = a[i * a_row + q * a_col];
+			if (value == 0.0f)
+				continue;
 
+#ifdef __ve__
+#pragma _NEC ivdep
+#endif
+			for (p = row_ptr[q]; p < row_ptr[q + 1]; ++p)
+				arr_c[columns[p]] += value * values[p];
+		}
+	}
+
+	return 1;
 }
 
+/* y = A * x for a sparse m x n A and float vectors, the elements of x and y
+ * being incx and incy apart. The rows are split by their nonzeros */
+uint64_t sparse_vector_mult(int num_threads, unsigned long int m, void *arrays, unsigned long int nnz,
+		float *x, unsigned long int incx, float *y, unsigned long int incy)
+{
+	const uint64_t *row_ptr;
+	const float *values;
+	const uint32_t *columns;
+
+	arrays = veo_get_hmem_addr(arrays);
+	x = (float *)veo_get_hmem_addr(x);
+	y = (float *)veo_get_hmem_addr(y);
+	if (!arrays || !x || !y)
+		return 0;
+
+	row_ptr = SPARSE_ROW_PTR(arrays);
+	values = SPARSE_VALUES(arrays, m);
+	columns = SPARSE_COLUMNS(arrays, m, nnz);
+
+	omp_set_num_threads(num_threads);
+
+	#pragma omp parallel
+	{
+		unsigned long int first_row, last_row, i, p;
+		float sum;
+
+		sparse_rows(row_ptr, m, nnz, omp_get_num_threads(), omp_get_thread_num(), &first_row, &last_row);
+		for (i = first_row; i < last_row; ++i) {
+			sum = 0.0f;
+			for (p = row_ptr[i]; p < row_ptr[i + 1]; ++p)
+				sum += values[p] * x[columns[p] * incx];
+			y[i * incy] = sum;
+		}
+	}
+
+	return 1;
+}
@@ -2,130 +2,2068 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <ve_offload.h>
 
 #include "matrix_lib.h"
+#include "matrix_file.h"
+#ifdef MATRIX_LIB_UNIFIED
+#include "matrix_host.h"
+#endif
 
 static int _ve_num_node = 0;
 static int _ve_num_threads = 1;
-static uint64_t _ve_lib_handle = 0;
-static struct veo_proc_handle *_ve_proc = NULL;
-static struct veo_thr_ctxt *_veo_ctxt = NULL;
-static struct veo_args *_veo_argp = NULL;
+static unsigned long int _ve_panel_rows = 256;
 
 static const char *_ve_lib_path = "./matrix_lib_ve.so";
 static const char *_lib_scalar_matrix_mult = "scalar_matrix_mult";
 static const char *_lib_matrix_matrix_mult = "matrix_matrix_mult";
+static const char *_lib_matrix_matrix_gemm = "matrix_matrix_gemm";
+static const char *_lib_matrix_matrix_mult_panel = "matrix_matrix_mult_panel";
+static const char *_lib_matrix_matrix_mult_batch = "matrix_matrix_mult_batch";
+static const char *_lib_matrix_transpose = "matrix_transpose";
+static const char *_lib_matrix_vector_gemv = "matrix_vector_gemv";
+static const char *_lib_matrix_matrix_add = "matrix_matrix_add";
+static const char *_lib_sparse_matrix_mult = "sparse_matrix_mult";
+static const char *_lib_matrix_sparse_mult = "matrix_sparse_mult";
+static const char *_lib_sparse_vector_mult = "sparse_vector_mult";
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Matrix holding the rows of a view, which also tracks where they are valid */
+#define MATRIX_OWNER(m) ((m)->parent ? (m)->parent : (m))
+
+/* Views of whole rows, stored like a matrix of their own */
+#define MATRIX_DENSE(m) (!(m)->transposed && (m)->stride == (m)->width)
+
+/* Lines of a matrix in memory, its rows or, if transposed, its columns, and
+ * their length */
+#define MATRIX_LINES(m) ((m)->transposed ? (m)->width : (m)->height)
+#define MATRIX_LINE_LENGTH(m) ((m)->transposed ? (m)->height : (m)->width)
+
+/* Address of the i-th of the elements of a dtype starting at p */
+#define DTYPE_AT(p, dtype, i) ((void *)((char *)(p) + MATRIX_DTYPE_SIZE(dtype) * (i)))
+
+#define MATRIX_EL(m, r, c) DTYPE_AT((m)->vh_rows, (m)->dtype, (m)->transposed ? (r) + (c) * (m)->stride : (c) + (r) * (m)->stride)
+
+/* Commands queued on the call context of a node and not waited for yet, oldest
+ * first: the calls of the VE library, with the arguments and VE memory they
+ * own, and the copies between the host and VE rows, run in order with them.
+ * Each belongs to a request, or to the chain open on the node when it has
+ * none */
+#define NODE_MAX_CMDS 64
+
+struct matrix_request {
+	struct ve_node *node;
+	int pending;              /* commands not waited for yet */
+	int failed;
+};
+
+struct ve_copy {
+	void *dst;
+	void *src;
+	size_t size;
+};
+
+struct ve_command {
+	uint64_t reqid;
+	struct veo_args *argp;
+	void *hmem;
+	struct ve_copy *copy;
+	struct matrix_request *request;
+};
+
+/* A VE process with the VE library loaded, a context for the calls and one
+ * for the transfers that overlap them */
+struct ve_node {
+	int num_node;
+	uint64_t lib_handle;
+	struct veo_proc_handle *proc;
+	struct veo_thr_ctxt *ctxt;
+	struct veo_thr_ctxt *xfer_ctxt;
+	struct ve_command cmds[NODE_MAX_CMDS];
+	int num_cmds;
+	int chain_active;
+	int chain_failed;
+};
+
+/* Node of the matrices loaded on the VE and of their operations */
+static struct ve_node *_ve_node = NULL;
+
+static
+void command_done(struct ve_node *node, struct ve_command *cmd, int ok)
+{
+	if (cmd->request) {
+		cmd->request->failed |= !ok;
+		cmd->request->pending--;
+	} else if (!ok) {
+		node->chain_failed = 1;
+	}
+
+	if (cmd->argp)
+		veo_args_free(cmd->argp);
+	if (cmd->hmem)
+		veo_free_hmem(cmd->hmem);
+	free(cmd->copy);
+}
+
+/* Takes the result of the oldest command, which must return 1. Returns 0 if
+ * wait is not set and it is still running */
+static
+int node_retire(struct ve_node *node, int wait)
+{
+	struct ve_command *cmd = &node->cmds[0];
+	uint64_t veo_ret;
+	int ret;
+
+	if (wait)
+		ret = veo_call_wait_result(node->ctxt, cmd->reqid, &veo_ret);
+	else
+		ret = veo_call_peek_result(node->ctxt, cmd->reqid, &veo_ret);
+
+	if (ret == VEO_COMMAND_UNFINISHED)
+		return 0;
+
+	command_done(node, cmd, ret == VEO_COMMAND_OK && veo_ret == 1);
+	memmove(&node->cmds[0], &node->cmds[1], --node->num_cmds * sizeof(struct ve_command));
+
+	return 1;
+}
+
+/* Records a command just submitted, which takes argp, hmem and copy */
+static
+int node_track(struct ve_node *node, uint64_t reqid, struct veo_args *argp, void *hmem,
+		struct ve_copy *copy, struct matrix_request *request)
+{
+	struct ve_command *cmd = &node->cmds[node->num_cmds];
+
+	cmd->argp = argp;
+	cmd->hmem = hmem;
+	cmd->copy = copy;
+	cmd->request = request;
+
+	if (reqid == VEO_REQUEST_ID_INVALID) {
+		if (request)
+			request->pending++;
+		command_done(node, cmd, 0);
+		return 0;
+	}
+
+	cmd->reqid = reqid;
+	if (request)
+		request->pending++;
+	node->num_cmds++;
+
+	return 1;
+}
+
+/* Waits for the commands queued on the node of the loaded matrices */
+static
+void ve_flush(void)
+{
+	while (_ve_node && _ve_node->num_cmds)
+		node_retire(_ve_node, 1);
+}
+
+/* Queues a call of the VE library, which takes argp and the VE memory hmem,
+ * freed once it is done */
+static
+int ve_call(const char *symname, struct veo_args *argp, void *hmem, struct matrix_request *request)
+{
+	uint64_t reqid;
+
+	if (_ve_node->num_cmds == NODE_MAX_CMDS)
+		node_retire(_ve_node, 1);
+
+	reqid = veo_call_async_by_name(_ve_node->ctxt, _ve_node->lib_handle, symname, argp);
+
+	return node_track(_ve_node, reqid, argp, hmem, NULL, request);
+}
+
+static
+uint64_t ve_copy_run(void *args)
+{
+	struct ve_copy *copy = (struct ve_copy *)args;
+
+	return veo_hmemcpy(copy->dst, copy->src, copy->size) == 0;
+}
+
+/* Queues a copy between the host and VE rows of a matrix, run by the VH in
+ * order with the calls */
+static
+int ve_copy(void *dst, void *src, struct matrix *matrix, struct matrix_request *request)
+{
+	struct ve_copy *copy = (struct ve_copy *)malloc(sizeof(struct ve_copy));
+	uint64_t reqid = VEO_REQUEST_ID_INVALID;
+
+	if (_ve_node->num_cmds == NODE_MAX_CMDS)
+		node_retire(_ve_node, 1);
+
+	if (copy) {
+		copy->dst = dst;
+		copy->src = src;
+		copy->size = MATRIX_DTYPE_SIZE(matrix->dtype) * matrix->height * matrix->width;
+		reqid = veo_call_async_vh(_ve_node->ctxt, ve_copy_run, copy);
+	}
+
+	return node_track(_ve_node, reqid, NULL, NULL, copy, request);
+}
+
+/* VE address of the rows of a matrix or view, NULL if they are not loaded */
+static
+void *ve_addr(struct matrix *matrix)
+{
+	struct matrix *owner = MATRIX_OWNER(matrix);
+
+	if (!owner->ve_rows)
+		return NULL;
+
+	return DTYPE_AT(owner->ve_rows, matrix->dtype, matrix->offset);
+}
+
+/* Sends the host rows to the VE if the VE copy is stale. No queued command can
+ * be using the VE rows then, see touch_vh_matrix */
+static
+int ve_read(struct matrix *matrix, struct matrix_request *request)
+{
+	matrix = MATRIX_OWNER(matrix);
+	if (matrix->ve_valid)
+		return 1;
+
+	if (!ve_copy(matrix->ve_rows, matrix->vh_rows, matrix, request))
+		return 0;
+
+	matrix->ve_valid = 1;
+	return 1;
+}
+
+/* Brings the VE rows back to the host if the host copy is stale, once the
+ * queued commands that may write them or bring them back are done */
+static
+int vh_read(struct matrix *matrix)
+{
+	matrix = MATRIX_OWNER(matrix);
+	if (matrix->ve_rows)
+		ve_flush();
+
+	if (matrix->vh_valid)
+		return 1;
+
+	if (veo_hmemcpy(matrix->vh_rows, matrix->ve_rows,
+				MATRIX_DTYPE_SIZE(matrix->dtype) * matrix->height * matrix->width) != 0)
+		return 0;
+
+	matrix->vh_valid = 1;
+	return 1;
+}
+
+static
+void request_wait(struct matrix_request *request)
+{
+	while (request->pending)
+		node_retire(request->node, 1);
+}
+
+/* The synchronous operations wait for their own request, or leave their
+ * commands to the chain open */
+static
+struct matrix_request *sync_request(struct matrix_request *request)
+{
+	if (_ve_node->chain_active)
+		return NULL;
+
+	request->node = _ve_node;
+	request->pending = 0;
+	request->failed = 0;
+
+	return request;
+}
+
+static
+int sync_result(int ret, struct matrix_request *request)
+{
+	if (!request)
+		return ret;
+
+	request_wait(request);
+	return ret && !request->failed;
+}
+
+static
+struct matrix_request *async_request(void)
+{
+	struct matrix_request *request;
+
+	if (!_ve_node)
+		return NULL;
+
+	request = (struct matrix_request *)calloc(1, sizeof(struct matrix_request));
+	if (request)
+		request->node = _ve_node;
+
+	return request;
+}
+
+/* An operation not queued whole fails at once, once what was queued is done */
+static
+struct matrix_request *async_result(int ret, struct matrix_request *request)
+{
+	if (!request)
+		return NULL;
+
+	if (!ret) {
+		request_wait(request);
+		free(request);
+		return NULL;
+	}
+
+	return request;
+}
+
+static
+int scalar_matrix_mult_submit(float scalar_value, struct matrix *matrix, struct matrix_request *request)
+{
+	struct veo_args *argp;
+
+	if (!matrix || !matrix->vh_rows || !ve_addr(matrix))
+		return 0;
+
+	if (matrix->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	if (!ve_read(matrix, request))
+		return 0;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, MATRIX_LINES(matrix)) != 0
+			|| veo_args_set_u64(argp, 2, MATRIX_LINE_LENGTH(matrix)) != 0
+			|| veo_args_set_hmem(argp, 3, ve_addr(matrix)) != 0
+			|| veo_args_set_float(argp, 4, scalar_value) != 0
+			|| veo_args_set_u64(argp, 5, matrix->stride) != 0
+			|| veo_args_set_i32(argp, 6, matrix->dtype) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_scalar_matrix_mult, argp, NULL, request))
+		return 0;
+
+	MATRIX_OWNER(matrix)->vh_valid = 0;
+	return 1;
+}
+
+/* A matrix or view whose rows are loaded on the VE */
+static
+int loaded_matrix(struct matrix *matrix)
+{
+	return matrix && matrix->vh_rows && ve_addr(matrix);
+}
+
+/* Operands of a product loaded on the VE, with a result that can be written */
+static
+int loaded_operands(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC)
+{
+	if (!loaded_matrix(matrixA) || !loaded_matrix(matrixB) || !loaded_matrix(matrixC))
+		return 0;
+
+	return !matrixC->transposed && !(matrixC->map_flags & MATRIX_MAP_READONLY);
+}
+
+/* The kernels of the batched, pipelined and sharded products, of the
+ * matrix-vector products and of the sums read and write floats only */
+static
+int float_operands(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC)
+{
+	return matrixA->dtype == MATRIX_DTYPE_F32 && matrixB->dtype == MATRIX_DTYPE_F32
+		&& matrixC->dtype == MATRIX_DTYPE_F32;
+}
+
+/* Sends the operands a product reads, and C when it is a view, as the VE
+ * rows around it must stay valid */
+static
+int read_operands(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC,
+		int read_c, struct matrix_request *request)
+{
+	if (!ve_read(matrixA, request) || !ve_read(matrixB, request))
+		return 0;
+
+	return !(read_c || matrixC->parent) || ve_read(matrixC, request);
+}
+
+/* The product wrote C on the VE */
+static
+void written_on_ve(struct matrix *matrix)
+{
+	matrix = MATRIX_OWNER(matrix);
+	matrix->ve_valid = 1;
+	matrix->vh_valid = 0;
+}
+
+/* The product wrote C on the host */
+static
+void written_on_vh(struct matrix *matrix)
+{
+	matrix = MATRIX_OWNER(matrix);
+	matrix->vh_valid = 1;
+	matrix->ve_valid = 0;
+}
+
+static
+int matrix_matrix_gemm_submit(float alpha, struct matrix *matrixA, struct matrix *matrixB, float beta,
+		struct matrix *matrixC, int flags, const struct matrix_epilogue *epilogue,
+		struct matrix_request *request);
+
+static
+int matrix_matrix_mult_submit(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC,
+		struct matrix_request *request)
+{
+	struct veo_args *argp;
+	unsigned long int m, n, k;
+
+	if (!loaded_operands(matrixA, matrixB, matrixC))
+		return 0;
+
+	if (matrixC->height != matrixA->height || matrixC->width != matrixB->width
+			|| matrixA->width != matrixB->height)
+		return 0;
+
+	/* Views with strides and 16-bit matrices go through the general product */
+	if (!MATRIX_DENSE(matrixA) || !MATRIX_DENSE(matrixB) || !MATRIX_DENSE(matrixC)
+			|| matrixA->dtype != MATRIX_DTYPE_F32 || matrixB->dtype != MATRIX_DTYPE_F32
+			|| matrixC->dtype != MATRIX_DTYPE_F32)
+		return matrix_matrix_gemm_submit(1.0f, matrixA, matrixB, 0.0f, matrixC, 0, NULL, request);
+
+	/* C is overwritten, so its rows are never sent */
+	if (!read_operands(matrixA, matrixB, matrixC, 0, request))
+		return 0;
+
+	m = matrixA->height;
+	n = matrixA->width;
+	k = matrixB->width;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, m) != 0
+			|| veo_args_set_u64(argp, 2, n) != 0
+			|| veo_args_set_u64(argp, 3, k) != 0
+			|| veo_args_set_hmem(argp, 4, ve_addr(matrixA)) != 0
+			|| veo_args_set_hmem(argp, 5, ve_addr(matrixB)) != 0
+			|| veo_args_set_hmem(argp, 6, ve_addr(matrixC)) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_matrix_matrix_mult, argp, NULL, request))
+		return 0;
+
+	written_on_ve(matrixC);
+	return 1;
+}
+
+/* Flag of the calls of matrix_matrix_gemm with a bias, and its parameters
+ * sent before the bias, as matrix_lib_ve.c reads them. Its transposes are
+ * those of the rows of A and B, where transposed views are transposed once
+ * more */
+#define GEMM_BIAS 4
+#define GEMM_ALPHA 0
+#define GEMM_BETA 1
+#define GEMM_CLAMP_MIN 2
+#define GEMM_CLAMP_MAX 3
+#define GEMM_PARAMS 4
+
+/* The parameters of the epilogue are sent with the bias in VE memory the call
+ * frees once it is done */
+static
+int matrix_matrix_gemm_submit(float alpha, struct matrix *matrixA, struct matrix *matrixB, float beta,
+		struct matrix *matrixC, int flags, const struct matrix_epilogue *epilogue,
+		struct matrix_request *request)
+{
+	struct veo_args *argp;
+	unsigned long int m, n, k, num_params;
+	float *params;
+	void *hmem;
+	int activation = epilogue ? epilogue->activation : MATRIX_ACT_NONE;
+
+	if (!loaded_operands(matrixA, matrixB, matrixC))
+		return 0;
+
+	flags &= MATRIX_TRANS_A | MATRIX_TRANS_B;
+	m = matrixC->height;
+	n = flags & MATRIX_TRANS_A ? matrixA->height : matrixA->width;
+	k = matrixC->width;
+
+	if ((flags & MATRIX_TRANS_A ? matrixA->width : matrixA->height) != m
+			|| (flags & MATRIX_TRANS_B ? matrixB->width : matrixB->height) != n
+			|| (flags & MATRIX_TRANS_B ? matrixB->height : matrixB->width) != k)
+		return 0;
+
+	if (!m || !n || !k)
+		return 0;
+
+	if (activation < MATRIX_ACT_NONE || activation > MATRIX_ACT_GELU)
+		return 0;
+
+	if (activation == MATRIX_ACT_CLAMP && !(epilogue->clamp_min <= epilogue->clamp_max))
+		return 0;
+
+	if (!read_operands(matrixA, matrixB, matrixC, beta != 0.0f, request))
+		return 0;
+
+	if (matrixA->transposed)
+		flags ^= MATRIX_TRANS_A;
+	if (matrixB->transposed)
+		flags ^= MATRIX_TRANS_B;
+
+	num_params = GEMM_PARAMS + (epilogue && epilogue->bias ? k : 0);
+	params = (float *)malloc(sizeof(float) * num_params);
+	if (!params)
+		return 0;
+
+	params[GEMM_ALPHA] = alpha;
+	params[GEMM_BETA] = beta;
+	params[GEMM_CLAMP_MIN] = epilogue ? epilogue->clamp_min : 0.0f;
+	params[GEMM_CLAMP_MAX] = epilogue ? epilogue->clamp_max : 0.0f;
+	if (num_params > GEMM_PARAMS) {
+		memcpy(params + GEMM_PARAMS, epilogue->bias, sizeof(float) * k);
+		flags |= GEMM_BIAS;
+	}
+
+	if (veo_alloc_hmem(_ve_node->proc, &hmem, sizeof(float) * num_params) != 0)
+		goto fail1;
+
+	if (veo_hmemcpy(hmem, params, sizeof(float) * num_params) != 0)
+		goto fail2;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		goto fail2;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, m) != 0
+			|| veo_args_set_u64(argp, 2, n) != 0
+			|| veo_args_set_u64(argp, 3, k) != 0
+			|| veo_args_set_hmem(argp, 4, ve_addr(matrixA)) != 0
+			|| veo_args_set_u64(argp, 5, matrixA->stride) != 0
+			|| veo_args_set_hmem(argp, 6, ve_addr(matrixB)) != 0
+			|| veo_args_set_u64(argp, 7, matrixB->stride) != 0
+			|| veo_args_set_hmem(argp, 8, ve_addr(matrixC)) != 0
+			|| veo_args_set_u64(argp, 9, matrixC->stride) != 0
+			|| veo_args_set_i32(argp, 10, flags) != 0
+			|| veo_args_set_i32(argp, 11, activation) != 0
+			|| veo_args_set_hmem(argp, 12, hmem) != 0
+			|| veo_args_set_i32(argp, 13, matrixA->dtype) != 0
+			|| veo_args_set_i32(argp, 14, matrixB->dtype) != 0
+			|| veo_args_set_i32(argp, 15, matrixC->dtype) != 0)
+		goto fail3;
+
+	free(params);
+
+	if (!ve_call(_lib_matrix_matrix_gemm, argp, hmem, request))
+		return 0;
+
+	written_on_ve(matrixC);
+	return 1;
+
+	/* ERROR CLEANUP */
+fail3:
+	veo_args_free(argp);
+fail2:
+	veo_free_hmem(hmem);
+fail1:
+	free(params);
+	return 0;
+}
+
+/* Fields of each product in the table of a batch, as matrix_lib_ve.c reads
+ * them: its dimensions, the hmem addresses of its matrices and their leading
+ * dimensions */
+#define BATCH_M 0
+#define BATCH_N 1
+#define BATCH_K 2
+#define BATCH_A 3
+#define BATCH_B 4
+#define BATCH_C 5
+#define BATCH_LDA 6
+#define BATCH_LDB 7
+#define BATCH_LDC 8
+#define BATCH_FIELDS 9
+
+static
+void batch_item(uint64_t *item, unsigned long int m, unsigned long int n, unsigned long int k,
+		const char *a, const char *b, const char *c, struct matrix *matrixA, struct matrix *matrixB,
+		struct matrix *matrixC)
+{
+	item[BATCH_M] = m;
+	item[BATCH_N] = n;
+	item[BATCH_K] = k;
+	item[BATCH_A] = (uint64_t)a;
+	item[BATCH_B] = (uint64_t)b;
+	item[BATCH_C] = (uint64_t)c;
+	item[BATCH_LDA] = matrixA->stride;
+	item[BATCH_LDB] = matrixB->stride;
+	item[BATCH_LDC] = matrixC->stride;
+}
+
+/* Sends the table of a batch and queues the call running it, which frees the
+ * table once it is done */
+static
+int batch_submit(uint64_t *table, unsigned long int batch, struct matrix_request *request)
+{
+	struct veo_args *argp;
+	void *hmem;
+	int ret;
+
+	if (veo_alloc_hmem(_ve_node->proc, &hmem, sizeof(uint64_t) * BATCH_FIELDS * batch) != 0)
+		return 0;
+
+	ret = veo_hmemcpy(hmem, table, sizeof(uint64_t) * BATCH_FIELDS * batch) == 0;
+	argp = ret ? veo_args_alloc() : NULL;
+	if (!argp)
+		goto fail1;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, batch) != 0
+			|| veo_args_set_hmem(argp, 2, hmem) != 0)
+		goto fail2;
+
+	return ve_call(_lib_matrix_matrix_mult_batch, argp, hmem, request);
+
+	/* ERROR CLEANUP */
+fail2:
+	veo_args_free(argp);
+fail1:
+	veo_free_hmem(hmem);
+	return 0;
+}
+
+static
+int matrix_matrix_mult_batched_submit(struct matrix **matrixA, struct matrix **matrixB,
+		struct matrix **matrixC, unsigned long int batch, struct matrix_request *request)
+{
+	uint64_t *table;
+	unsigned long int i;
+	int ret = 0;
+
+	if (!matrixA || !matrixB || !matrixC || !batch)
+		return 0;
+
+	for (i = 0; i < batch; ++i) {
+		if (!loaded_operands(matrixA[i], matrixB[i], matrixC[i]))
+			return 0;
+
+		if (matrixC[i]->height != matrixA[i]->height || matrixC[i]->width != matrixB[i]->width
+				|| matrixA[i]->width != matrixB[i]->height)
+			return 0;
+
+		if (!matrixC[i]->height || !matrixC[i]->width || !matrixA[i]->width)
+			return 0;
+
+		if (matrixA[i]->transposed || matrixB[i]->transposed)
+			return 0;
+
+		if (!float_operands(matrixA[i], matrixB[i], matrixC[i]))
+			return 0;
+	}
+
+	table = (uint64_t *)malloc(sizeof(uint64_t) * BATCH_FIELDS * batch);
+	if (!table)
+		return 0;
+
+	for (i = 0; i < batch; ++i) {
+		if (!read_operands(matrixA[i], matrixB[i], matrixC[i], 0, request))
+			goto out;
+
+		batch_item(table + i * BATCH_FIELDS, matrixA[i]->height, matrixA[i]->width, matrixB[i]->width,
+				ve_addr(matrixA[i]), ve_addr(matrixB[i]), ve_addr(matrixC[i]),
+				matrixA[i], matrixB[i], matrixC[i]);
+	}
+
+	ret = batch_submit(table, batch, request);
+	for (i = 0; ret && i < batch; ++i)
+		written_on_ve(matrixC[i]);
+
+out:
+	free(table);
+	return ret;
+}
+
+/* The products of a strided batch are stacked in the rows of A, B and C, and
+ * a B holding a single product is shared by all of them */
+static
+int matrix_matrix_mult_strided_submit(struct matrix *matrixA, struct matrix *matrixB,
+		struct matrix *matrixC, unsigned long int batch, struct matrix_request *request)
+{
+	uint64_t *table;
+	unsigned long int i, m, n, k, stride_b;
+	int ret = 0;
+
+	if (!loaded_operands(matrixA, matrixB, matrixC) || !batch)
+		return 0;
+
+	if (matrixA->transposed || matrixB->transposed || !float_operands(matrixA, matrixB, matrixC))
+		return 0;
+
+	if (matrixA->height % batch || matrixC->height != matrixA->height || matrixC->width != matrixB->width)
+		return 0;
+
+	m = matrixA->height / batch;
+	n = matrixA->width;
+	k = matrixB->width;
+
+	if (matrixB->height == n)
+		stride_b = 0;
+	else if (matrixB->height == batch * n)
+		stride_b = sizeof(float) * n * matrixB->stride;
+	else
+		return 0;
+
+	if (!m || !n || !k)
+		return 0;
+
+	if (!read_operands(matrixA, matrixB, matrixC, 0, request))
+		return 0;
+
+	table = (uint64_t *)malloc(sizeof(uint64_t) * BATCH_FIELDS * batch);
+	if (!table)
+		return 0;
+
+	for (i = 0; i < batch; ++i)
+		batch_item(table + i * BATCH_FIELDS, m, n, k,
+				(char *)ve_addr(matrixA) + i * sizeof(float) * m * matrixA->stride,
+				(char *)ve_addr(matrixB) + i * stride_b,
+				(char *)ve_addr(matrixC) + i * sizeof(float) * m * matrixC->stride,
+				matrixA, matrixB, matrixC);
+
+	ret = batch_submit(table, batch, request);
+	if (ret)
+		written_on_ve(matrixC);
+
+	free(table);
+	return ret;
+}
+
+/* Strides, in elements, from a row and from a column of a matrix to the next
+ * in memory */
+#define MATRIX_ROW_STEP(m) ((m)->transposed ? 1 : (m)->stride)
+#define MATRIX_COL_STEP(m) ((m)->transposed ? (m)->stride : 1)
+
+/* Vectors are matrices of a single row or column, whose i-th element is at
+ * i * VECTOR_STEP(v) from their first one */
+#define VECTOR_LENGTH(v) ((v)->height * (v)->width)
+#define VECTOR_STEP(v) ((v)->height == 1 ? MATRIX_COL_STEP(v) : MATRIX_ROW_STEP(v))
+
+/* A transposed in place is sent as B too, with the rows of A as they are
+ * stored */
+static
+int matrix_transpose_submit(struct matrix *matrixA, struct matrix *matrixB, struct matrix_request *request)
+{
+	struct veo_args *argp;
+	int in_place = matrixA == matrixB;
+
+	if (!loaded_matrix(matrixA) || !loaded_matrix(matrixB))
+		return 0;
+
+	if (matrixA->height != matrixB->width || matrixA->width != matrixB->height)
+		return 0;
+
+	if (!matrixA->height || !matrixA->width || matrixA->dtype != matrixB->dtype)
+		return 0;
+
+	if (matrixB->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+	if (!in_place && ve_addr(matrixA) == ve_addr(matrixB))
+		return 0;
+
+	if (!read_operands(matrixA, matrixA, matrixB, 0, request))
+		return 0;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, matrixA->height) != 0
+			|| veo_args_set_u64(argp, 2, matrixA->width) != 0
+			|| veo_args_set_hmem(argp, 3, ve_addr(matrixA)) != 0
+			|| veo_args_set_u64(argp, 4, in_place ? matrixA->stride : MATRIX_ROW_STEP(matrixA)) != 0
+			|| veo_args_set_u64(argp, 5, in_place ? 1 : MATRIX_COL_STEP(matrixA)) != 0
+			|| veo_args_set_hmem(argp, 6, ve_addr(matrixB)) != 0
+			|| veo_args_set_u64(argp, 7, in_place ? matrixB->stride : MATRIX_ROW_STEP(matrixB)) != 0
+			|| veo_args_set_u64(argp, 8, in_place ? 1 : MATRIX_COL_STEP(matrixB)) != 0
+			|| veo_args_set_i32(argp, 9, matrixA->dtype) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_matrix_transpose, argp, NULL, request))
+		return 0;
+
+	written_on_ve(matrixB);
+	return 1;
+}
+
+static
+int matrix_vector_gemv_submit(float alpha, struct matrix *matrixA, struct matrix *vectorX, float beta,
+		struct matrix *vectorY, int flags, struct matrix_request *request)
+{
+	struct veo_args *argp;
+	unsigned long int m, n;
+
+	if (!loaded_matrix(matrixA) || !loaded_matrix(vectorX) || !loaded_matrix(vectorY))
+		return 0;
+
+	if ((vectorY->map_flags & MATRIX_MAP_READONLY) || !float_operands(matrixA, vectorX, vectorY))
+		return 0;
+
+	m = flags & MATRIX_TRANS_A ? matrixA->width : matrixA->height;
+	n = flags & MATRIX_TRANS_A ? matrixA->height : matrixA->width;
+	if (!m || !n || (vectorX->height != 1 && vectorX->width != 1)
+			|| (vectorY->height != 1 && vectorY->width != 1))
+		return 0;
+
+	if (VECTOR_LENGTH(vectorX) != n || VECTOR_LENGTH(vectorY) != m)
+		return 0;
+
+	if (!read_operands(matrixA, vectorX, vectorY, beta != 0.0f, request))
+		return 0;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, m) != 0
+			|| veo_args_set_u64(argp, 2, n) != 0
+			|| veo_args_set_hmem(argp, 3, ve_addr(matrixA)) != 0
+			|| veo_args_set_u64(argp, 4, matrixA->stride) != 0
+			|| veo_args_set_i32(argp, 5, !(flags & MATRIX_TRANS_A) != !matrixA->transposed) != 0
+			|| veo_args_set_hmem(argp, 6, ve_addr(vectorX)) != 0
+			|| veo_args_set_u64(argp, 7, VECTOR_STEP(vectorX)) != 0
+			|| veo_args_set_hmem(argp, 8, ve_addr(vectorY)) != 0
+			|| veo_args_set_u64(argp, 9, VECTOR_STEP(vectorY)) != 0
+			|| veo_args_set_float(argp, 10, alpha) != 0
+			|| veo_args_set_float(argp, 11, beta) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_matrix_vector_gemv, argp, NULL, request))
+		return 0;
+
+	written_on_ve(vectorY);
+	return 1;
+}
+
+/* D = X + alpha * Y along the lines of D, X and Y being read across their
+ * lines when they are stored the other way */
+static
+int matrix_add_submit(struct matrix *matrixX, float alpha, struct matrix *matrixY, struct matrix *matrixD,
+		struct matrix_request *request)
+{
+	struct veo_args *argp;
+	int x_same, y_same;
+
+	if (!loaded_matrix(matrixX) || !loaded_matrix(matrixY) || !loaded_matrix(matrixD))
+		return 0;
+
+	if ((matrixD->map_flags & MATRIX_MAP_READONLY) || !float_operands(matrixX, matrixY, matrixD))
+		return 0;
+
+	if (matrixX->height != matrixD->height || matrixX->width != matrixD->width
+			|| matrixY->height != matrixD->height || matrixY->width != matrixD->width)
+		return 0;
+
+	if (!matrixD->height || !matrixD->width)
+		return 0;
+
+	if (!read_operands(matrixX, matrixY, matrixD, 0, request))
+		return 0;
+
+	x_same = matrixX->transposed == matrixD->transposed;
+	y_same = matrixY->transposed == matrixD->transposed;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, MATRIX_LINES(matrixD)) != 0
+			|| veo_args_set_u64(argp, 2, MATRIX_LINE_LENGTH(matrixD)) != 0
+			|| veo_args_set_hmem(argp, 3, ve_addr(matrixX)) != 0
+			|| veo_args_set_u64(argp, 4, x_same ? matrixX->stride : 1) != 0
+			|| veo_args_set_u64(argp, 5, x_same ? 1 : matrixX->stride) != 0
+			|| veo_args_set_hmem(argp, 6, ve_addr(matrixY)) != 0
+			|| veo_args_set_u64(argp, 7, y_same ? matrixY->stride : 1) != 0
+			|| veo_args_set_u64(argp, 8, y_same ? 1 : matrixY->stride) != 0
+			|| veo_args_set_hmem(argp, 9, ve_addr(matrixD)) != 0
+			|| veo_args_set_u64(argp, 10, matrixD->stride) != 0
+			|| veo_args_set_float(argp, 11, alpha) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_matrix_matrix_add, argp, NULL, request))
+		return 0;
+
+	written_on_ve(matrixD);
+	return 1;
+}
+
+/* The row offsets, values and columns of a sparse matrix are sent as a single
+ * VE array, in this order, as matrix_lib_ve.c reads them */
+static
+unsigned long int sparse_ve_size(struct sparse_matrix *matrix)
+{
+	return sizeof(uint64_t) * (matrix->height + 1) + (sizeof(float) + sizeof(uint32_t)) * matrix->nnz;
+}
+
+static
+int sparse_matrix_mult_submit(struct sparse_matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC,
+		struct matrix_request *request)
+{
+	struct veo_args *argp;
+
+	if (!matrixA || !matrixA->ve_arrays || !loaded_operands(matrixB, matrixB, matrixC)
+			|| !float_operands(matrixB, matrixB, matrixC) || matrixB->transposed)
+		return 0;
+
+	if (matrixB->height != matrixA->width || matrixC->height != matrixA->height
+			|| matrixC->width != matrixB->width)
+		return 0;
+
+	if (!matrixC->height || !matrixC->width || !matrixA->width)
+		return 0;
+
+	if (!read_operands(matrixB, matrixB, matrixC, 0, request))
+		return 0;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, matrixC->height) != 0
+			|| veo_args_set_u64(argp, 2, matrixC->width) != 0
+			|| veo_args_set_hmem(argp, 3, matrixA->ve_arrays) != 0
+			|| veo_args_set_u64(argp, 4, matrixA->nnz) != 0
+			|| veo_args_set_hmem(argp, 5, ve_addr(matrixB)) != 0
+			|| veo_args_set_u64(argp, 6, matrixB->stride) != 0
+			|| veo_args_set_hmem(argp, 7, ve_addr(matrixC)) != 0
+			|| veo_args_set_u64(argp, 8, matrixC->stride) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_sparse_matrix_mult, argp, NULL, request))
+		return 0;
+
+	written_on_ve(matrixC);
+	return 1;
+}
+
+static
+int matrix_sparse_mult_submit(struct matrix *matrixA, struct sparse_matrix *matrixB, struct matrix *matrixC,
+		struct matrix_request *request)
+{
+	struct veo_args *argp;
+
+	if (!matrixB || !matrixB->ve_arrays || !loaded_operands(matrixA, matrixA, matrixC)
+			|| !float_operands(matrixA, matrixA, matrixC))
+		return 0;
+
+	if (matrixA->width != matrixB->height || matrixC->height != matrixA->height
+			|| matrixC->width != matrixB->width)
+		return 0;
+
+	if (!matrixC->height || !matrixC->width || !matrixA->width)
+		return 0;
+
+	if (!read_operands(matrixA, matrixA, matrixC, 0, request))
+		return 0;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, matrixC->height) != 0
+			|| veo_args_set_u64(argp, 2, matrixC->width) != 0
+			|| veo_args_set_u64(argp, 3, matrixA->width) != 0
+			|| veo_args_set_hmem(argp, 4, ve_addr(matrixA)) != 0
+			|| veo_args_set_u64(argp, 5, MATRIX_ROW_STEP(matrixA)) != 0
+			|| veo_args_set_u64(argp, 6, MATRIX_COL_STEP(matrixA)) != 0
+			|| veo_args_set_hmem(argp, 7, matrixB->ve_arrays) != 0
+			|| veo_args_set_u64(argp, 8, matrixB->nnz) != 0
+			|| veo_args_set_hmem(argp, 9, ve_addr(matrixC)) != 0
+			|| veo_args_set_u64(argp, 10, matrixC->stride) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_matrix_sparse_mult, argp, NULL, request))
+		return 0;
+
+	written_on_ve(matrixC);
+	return 1;
+}
+
+static
+int sparse_vector_mult_submit(struct sparse_matrix *matrixA, struct matrix *vectorX, struct matrix *vectorY,
+		struct matrix_request *request)
+{
+	struct veo_args *argp;
+
+	if (!matrixA || !matrixA->ve_arrays || !loaded_matrix(vectorX) || !loaded_matrix(vectorY))
+		return 0;
+
+	if ((vectorY->map_flags & MATRIX_MAP_READONLY) || !float_operands(vectorX, vectorX, vectorY))
+		return 0;
+
+	if (!matrixA->height || !matrixA->width || (vectorX->height != 1 && vectorX->width != 1)
+			|| (vectorY->height != 1 && vectorY->width != 1))
+		return 0;
+
+	if (VECTOR_LENGTH(vectorX) != matrixA->width || VECTOR_LENGTH(vectorY) != matrixA->height)
+		return 0;
+
+	if (!read_operands(vectorX, vectorX, vectorY, 0, request))
+		return 0;
+
+	argp = veo_args_alloc();
+	if (!argp)
+		return 0;
+
+	if (veo_args_set_i32(argp, 0, _ve_num_threads) != 0
+			|| veo_args_set_u64(argp, 1, matrixA->height) != 0
+			|| veo_args_set_hmem(argp, 2, matrixA->ve_arrays) != 0
+			|| veo_args_set_u64(argp, 3, matrixA->nnz) != 0
+			|| veo_args_set_hmem(argp, 4, ve_addr(vectorX)) != 0
+			|| veo_args_set_u64(argp, 5, VECTOR_STEP(vectorX)) != 0
+			|| veo_args_set_hmem(argp, 6, ve_addr(vectorY)) != 0
+			|| veo_args_set_u64(argp, 7, VECTOR_STEP(vectorY)) != 0) {
+		veo_args_free(argp);
+		return 0;
+	}
+
+	if (!ve_call(_lib_sparse_vector_mult, argp, NULL, request))
+		return 0;
+
+	written_on_ve(vectorY);
+	return 1;
+}
+
+static
+int sync_vh_ve_matrix_submit(struct matrix *matrix, struct matrix_request *request)
+{
+	if (!matrix || !ve_addr(matrix) || !matrix->vh_rows)
+		return 0;
+
+	return ve_read(matrix, request);
+}
+
+/* The host rows are valid as soon as the copy is queued, for the operations
+ * queued after it; the host reads them once the request is done */
+static
+int sync_ve_vh_matrix_submit(struct matrix *matrix, struct matrix_request *request)
+{
+	if (!matrix || !ve_addr(matrix) || !matrix->vh_rows)
+		return 0;
+
+	matrix = MATRIX_OWNER(matrix);
+
+	if (matrix->vh_valid)
+		return 1;
+
+	if (!ve_copy(matrix->vh_rows, matrix->ve_rows, matrix, request))
+		return 0;
+
+	matrix->vh_valid = 1;
+	return 1;
+}
+
+#ifdef MATRIX_LIB_UNIFIED
+/* Dispatch of the unified library, see matrix_lib.h. A VE call costs its
+ * latency, the sends of the operands whose VE rows are stale and the work at
+ * the speed of the VE; a host run the copies back of the operands whose host
+ * rows are stale and the work at the speed of the host. C stays where it was
+ * computed, so bringing it back is left to whoever reads it */
+
+/* Host and VE memory of the calibration, and the products it times on them */
+#define CALIBRATION_BYTES (8UL << 20)
+#define CALIBRATION_SMALL 4096UL
+#define CALIBRATION_GEMM 512UL
+#define CALIBRATION_RUNS 3
+
+#define CALIBRATE_COPY_SMALL 0
+#define CALIBRATE_COPY 1
+#define CALIBRATE_VE_CALL 2
+#define CALIBRATE_VE_SCALE 3
+#define CALIBRATE_VE_MULT 4
+#define CALIBRATE_HOST_SCALE 5
+#define CALIBRATE_HOST_MULT 6
+
+struct dispatch_model {
+	int calibrated;         /* 1 once measured, -1 if that failed        */
+	double xfer_latency;    /* seconds of a copy between the VH and VE   */
+	double xfer_bandwidth;  /* bytes per second of those copies          */
+	double call_latency;    /* seconds of a VE call waited for           */
+	double ve_flops;        /* operations per second of the VE products  */
+	double ve_bandwidth;    /* bytes per second read and written scaling */
+	double host_flops;
+	double host_bandwidth;
+};
+
+struct calibration {
+	float *buf;
+	void *hmem;
+	struct matrix ve_element, ve_scale, ve_a, ve_b, ve_c;
+	struct host_rows host_scale, host_a, host_b, host_c;
+};
+
+static int _dispatch_policy = MATRIX_DISPATCH_AUTO;
+static struct dispatch_model _dispatch_model;
+
+static
+double dispatch_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Dense float matrix of the calibration, at offset elements into its memory */
+static
+void calibration_matrix(struct calibration *cal, struct matrix *matrix, struct host_rows *rows,
+		unsigned long int height, unsigned long int width, unsigned long int offset)
+{
+	if (matrix) {
+		memset(matrix, 0, sizeof(struct matrix));
+		matrix->height = height;
+		matrix->width = width;
+		matrix->vh_rows = cal->buf + offset;
+		matrix->ve_rows = DTYPE_AT(cal->hmem, MATRIX_DTYPE_F32, offset);
+		matrix->dtype = MATRIX_DTYPE_F32;
+		matrix->stride = width;
+		matrix->vh_valid = 1;
+		matrix->ve_valid = 1;
+	}
+
+	if (rows) {
+		rows->height = height;
+		rows->width = width;
+		rows->rows = cal->buf + offset;
+		rows->dtype = MATRIX_DTYPE_F32;
+		rows->stride = width;
+		rows->transposed = 0;
+	}
+}
+
+static
+int calibration_step(struct calibration *cal, int step)
+{
+	struct matrix_request request, *req = sync_request(&request);
+
+	switch (step) {
+	case CALIBRATE_COPY_SMALL:
+		return veo_hmemcpy(cal->hmem, cal->buf, CALIBRATION_SMALL) == 0;
+	case CALIBRATE_COPY:
+		return veo_hmemcpy(cal->hmem, cal->buf, CALIBRATION_BYTES) == 0;
+	case CALIBRATE_VE_CALL:
+		return sync_result(scalar_matrix_mult_submit(1.0f, &cal->ve_element, req), req);
+	case CALIBRATE_VE_SCALE:
+		return sync_result(scalar_matrix_mult_submit(1.0f, &cal->ve_scale, req), req);
+	case CALIBRATE_VE_MULT:
+		return sync_result(matrix_matrix_mult_submit(&cal->ve_a, &cal->ve_b, &cal->ve_c, req), req);
+	case CALIBRATE_HOST_SCALE:
+		return host_rows_scale(1.0f, &cal->host_scale);
+	case CALIBRATE_HOST_MULT:
+		return host_rows_gemm(1.0f, &cal->host_a, &cal->host_b, 0.0f, &cal->host_c, 0, NULL);
+	}
+
+	return 0;
+}
+
+/* Best of a few timings of a step, after a run to warm up, or -1 if it failed */
+static
+double calibration_time(struct calibration *cal, int step)
+{
+	double best = -1.0, start, seconds;
+	int run;
+
+	for (run = 0; run <= CALIBRATION_RUNS; run++) {
+		start = dispatch_clock();
+		if (!calibration_step(cal, step))
+			return -1.0;
+
+		seconds = dispatch_clock() - start;
+		if (run > 0 && (best < 0.0 || seconds < best))
+			best = seconds;
+	}
+
+	return best;
+}
+
+/* Rate of work done in seconds beyond a fixed latency, which the timings of
+ * small steps can be all of */
+static
+double calibration_rate(double work, double seconds, double latency)
+{
+	seconds -= latency;
+	if (seconds < latency * 0.1)
+		seconds = latency * 0.1;
+	if (seconds < 1e-9)
+		seconds = 1e-9;
+
+	return work / seconds;
+}
+
+int calibrate_dispatch(void)
+{
+	struct dispatch_model model;
+	struct calibration cal;
+	double times[CALIBRATE_HOST_MULT + 1];
+	double gemm_flops = 2.0 * CALIBRATION_GEMM * CALIBRATION_GEMM * CALIBRATION_GEMM;
+	unsigned long int gemm_size = CALIBRATION_GEMM * CALIBRATION_GEMM;
+	int step;
+
+	if (!_ve_node || _ve_node->chain_active)
+		return 0;
+
+	ve_flush();
+
+	memset(&model, 0, sizeof(model));
+	model.calibrated = -1;
+
+	cal.buf = (float *)calloc(CALIBRATION_BYTES / sizeof(float), sizeof(float));
+	if (!cal.buf)
+		goto fail1;
+
+	if (veo_alloc_hmem(_ve_node->proc, &cal.hmem, CALIBRATION_BYTES) != 0)
+		goto fail2;
+
+	calibration_matrix(&cal, &cal.ve_element, NULL, 1, 1, 0);
+	calibration_matrix(&cal, &cal.ve_scale, &cal.host_scale,
+			CALIBRATION_BYTES / sizeof(float) / 1024, 1024, 0);
+	calibration_matrix(&cal, &cal.ve_a, &cal.host_a, CALIBRATION_GEMM, CALIBRATION_GEMM, 0);
+	calibration_matrix(&cal, &cal.ve_b, &cal.host_b, CALIBRATION_GEMM, CALIBRATION_GEMM, gemm_size);
+	calibration_matrix(&cal, &cal.ve_c, &cal.host_c, CALIBRATION_GEMM, CALIBRATION_GEMM, 2 * gemm_size);
+
+	for (step = 0; step <= CALIBRATE_HOST_MULT; step++) {
+		times[step] = calibration_time(&cal, step);
+		if (times[step] < 0.0)
+			goto fail3;
+	}
+
+	model.xfer_latency = times[CALIBRATE_COPY_SMALL];
+	model.xfer_bandwidth = calibration_rate(CALIBRATION_BYTES, times[CALIBRATE_COPY], model.xfer_latency);
+	model.call_latency = times[CALIBRATE_VE_CALL];
+	model.ve_bandwidth = calibration_rate(2.0 * CALIBRATION_BYTES, times[CALIBRATE_VE_SCALE], model.call_latency);
+	model.ve_flops = calibration_rate(gemm_flops, times[CALIBRATE_VE_MULT], model.call_latency);
+	model.host_bandwidth = calibration_rate(2.0 * CALIBRATION_BYTES, times[CALIBRATE_HOST_SCALE], 0.0);
+	model.host_flops = calibration_rate(gemm_flops, times[CALIBRATE_HOST_MULT], 0.0);
+	model.calibrated = 1;
+
+	veo_free_hmem(cal.hmem);
+	free(cal.buf);
+
+	_dispatch_model = model;
+	return 1;
+
+/* ERROR CLEANUP */
+fail3:
+	veo_free_hmem(cal.hmem);
+fail2:
+	free(cal.buf);
+fail1:
+	_dispatch_model = model;
+	return 0;
+}
+
+void set_dispatch_policy(int policy)
+{
+	if (policy == MATRIX_DISPATCH_HOST || policy == MATRIX_DISPATCH_VE)
+		_dispatch_policy = policy;
+	else
+		_dispatch_policy = MATRIX_DISPATCH_AUTO;
+}
+
+void set_host_number_threads(int num_threads)
+{
+	host_set_number_threads(num_threads);
+	_dispatch_model.calibrated = 0;
+}
+
+/* Seconds to copy the rows of the owners of num_matrices matrices, each once,
+ * to the VE if to_ve or else back to the host, where they are stale */
+static
+double dispatch_copies(struct matrix **matrices, int num_matrices, int to_ve)
+{
+	struct matrix *owner;
+	double seconds = 0.0;
+	int i, j;
+
+	for (i = 0; i < num_matrices; i++) {
+		owner = MATRIX_OWNER(matrices[i]);
+		for (j = 0; j < i && MATRIX_OWNER(matrices[j]) != owner; j++)
+			;
+		if (j < i || (to_ve ? owner->ve_valid : owner->vh_valid))
+			continue;
+
+		seconds += _dispatch_model.xfer_latency + (double)MATRIX_DTYPE_SIZE(owner->dtype)
+			* owner->height * owner->width / _dispatch_model.xfer_bandwidth;
+	}
+
+	return seconds;
+}
+
+/* Whether an operation of flops operations and bytes read and written, on
+ * result and the matrices it reads, runs on the VE */
+static
+int dispatch_ve(struct matrix *result, struct matrix **matrices, int num_matrices, double flops,
+		double bytes)
+{
+	double ve_seconds, host_seconds;
+	int i;
+
+	/* Whatever the policy, only loaded matrices can go to the VE */
+	if (!_ve_node || !loaded_matrix(result))
+		return 0;
+
+	for (i = 0; i < num_matrices; i++)
+		if (!loaded_matrix(matrices[i]))
+			return 0;
+
+	if (_dispatch_policy != MATRIX_DISPATCH_AUTO)
+		return _dispatch_policy == MATRIX_DISPATCH_VE;
+
+	/* The chain runs its operations on the VE in order */
+	if (_ve_node->chain_active)
+		return 1;
+
+	if (!_dispatch_model.calibrated)
+		calibrate_dispatch();
+
+	if (_dispatch_model.calibrated < 0)
+		return 1;
+
+	ve_seconds = _dispatch_model.call_latency + dispatch_copies(matrices, num_matrices, 1)
+		+ flops / _dispatch_model.ve_flops + bytes / _dispatch_model.ve_bandwidth;
+	host_seconds = dispatch_copies(matrices, num_matrices, 0)
+		+ flops / _dispatch_model.host_flops + bytes / _dispatch_model.host_bandwidth;
+
+	return ve_seconds < host_seconds;
+}
+
+static
+void host_rows(struct host_rows *rows, struct matrix *matrix)
+{
+	rows->height = matrix->height;
+	rows->width = matrix->width;
+	rows->rows = matrix->vh_rows;
+	rows->dtype = matrix->dtype;
+	rows->stride = matrix->stride;
+	rows->transposed = matrix->transposed;
+}
+
+/* The product runs on the host rows, brought back first where they are stale,
+ * once the queued commands, which may copy rows of C to the host, are done */
+static
+int host_gemm(float alpha, struct matrix *matrixA, struct matrix *matrixB, float beta,
+		struct matrix *matrixC, int flags, const struct matrix_epilogue *epilogue)
+{
+	struct host_rows a, b, c;
+
+	if (!matrixA || !matrixB || !matrixC || !matrixA->vh_rows || !matrixB->vh_rows || !matrixC->vh_rows)
+		return 0;
+
+	if (matrixC->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	ve_flush();
+
+	if (!vh_read(matrixA) || !vh_read(matrixB) || ((beta != 0.0f || matrixC->parent) && !vh_read(matrixC)))
+		return 0;
+
+	host_rows(&a, matrixA);
+	host_rows(&b, matrixB);
+	host_rows(&c, matrixC);
+
+	if (!host_rows_gemm(alpha, &a, &b, beta, &c, flags, epilogue))
+		return 0;
+
+	written_on_vh(matrixC);
+	return 1;
+}
+
+static
+int host_scale(float scalar_value, struct matrix *matrix)
+{
+	struct host_rows rows;
+
+	if (!matrix || !matrix->vh_rows)
+		return 0;
+
+	if (matrix->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	ve_flush();
+
+	if (!vh_read(matrix))
+		return 0;
+
+	host_rows(&rows, matrix);
+
+	if (!host_rows_scale(scalar_value, &rows))
+		return 0;
+
+	written_on_vh(matrix);
+	return 1;
+}
+
+/* A general product reads C when it adds to it, or when C is a view of rows
+ * copied as a whole */
+static
+int gemm_on_ve(struct matrix *matrixA, struct matrix *matrixB, float beta, struct matrix *matrixC, int flags)
+{
+	struct matrix *matrices[3] = { matrixA, matrixB, matrixC };
+	unsigned long int k;
+
+	if (!matrixA || !matrixB || !matrixC)
+		return 0;
+
+	k = flags & MATRIX_TRANS_A ? matrixA->height : matrixA->width;
+
+	return dispatch_ve(matrixC, matrices, beta != 0.0f || matrixC->parent ? 3 : 2,
+			2.0 * matrixC->height * matrixC->width * k, 0.0);
+}
+
+static
+int scale_on_ve(struct matrix *matrix)
+{
+	if (!matrix)
+		return 0;
+
+	return dispatch_ve(matrix, &matrix, 1, 0.0,
+			2.0 * MATRIX_DTYPE_SIZE(matrix->dtype) * matrix->height * matrix->width);
+}
+#endif
 
 int scalar_matrix_mult(float scalar_value, struct matrix *matrix)
 {
-	uint64_t veo_call_handle, veo_ret;
+	struct matrix_request request, *req;
+
+#ifdef MATRIX_LIB_UNIFIED
+	if (!scale_on_ve(matrix))
+		return host_scale(scalar_value, matrix);
+#endif
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(scalar_matrix_mult_submit(scalar_value, matrix, req), req);
+}
+
+int matrix_matrix_mult(struct matrix *matrixA, struct matrix * matrixB, struct matrix * matrixC)
+{
+	struct matrix_request request, *req;
+
+#ifdef MATRIX_LIB_UNIFIED
+	if (!gemm_on_ve(matrixA, matrixB, 0.0f, matrixC, 0))
+		return host_gemm(1.0f, matrixA, matrixB, 0.0f, matrixC, 0, NULL);
+#endif
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_matrix_mult_submit(matrixA, matrixB, matrixC, req), req);
+}
+
+int matrix_matrix_gemm(float alpha, struct matrix *matrixA, struct matrix *matrixB, float beta,
+		struct matrix *matrixC, int flags, const struct matrix_epilogue *epilogue)
+{
+	struct matrix_request request, *req;
+
+#ifdef MATRIX_LIB_UNIFIED
+	if (!gemm_on_ve(matrixA, matrixB, beta, matrixC, flags))
+		return host_gemm(alpha, matrixA, matrixB, beta, matrixC, flags, epilogue);
+#endif
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_matrix_gemm_submit(alpha, matrixA, matrixB, beta, matrixC, flags, epilogue, req), req);
+}
+
+int matrix_matrix_mult_batched(struct matrix **matrixA, struct matrix **matrixB, struct matrix **matrixC,
+		unsigned long int batch)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_matrix_mult_batched_submit(matrixA, matrixB, matrixC, batch, req), req);
+}
+
+int matrix_matrix_mult_strided(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC,
+		unsigned long int batch)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_matrix_mult_strided_submit(matrixA, matrixB, matrixC, batch, req), req);
+}
+
+int matrix_transpose(struct matrix *matrixA, struct matrix *matrixB)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_transpose_submit(matrixA, matrixB, req), req);
+}
+
+int matrix_vector_gemv(float alpha, struct matrix *matrixA, struct matrix *vectorX, float beta,
+		struct matrix *vectorY, int flags)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_vector_gemv_submit(alpha, matrixA, vectorX, beta, vectorY, flags, req), req);
+}
+
+int matrix_matrix_add(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_add_submit(matrixA, 1.0f, matrixB, matrixC, req), req);
+}
+
+int matrix_axpy(float alpha, struct matrix *matrixX, struct matrix *matrixY)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_add_submit(matrixY, alpha, matrixX, matrixY, req), req);
+}
+
+int sparse_matrix_mult(struct sparse_matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(sparse_matrix_mult_submit(matrixA, matrixB, matrixC, req), req);
+}
+
+int matrix_sparse_mult(struct matrix *matrixA, struct sparse_matrix *matrixB, struct matrix *matrixC)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(matrix_sparse_mult_submit(matrixA, matrixB, matrixC, req), req);
+}
+
+int sparse_vector_mult(struct sparse_matrix *matrixA, struct matrix *vectorX, struct matrix *vectorY)
+{
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
+		return 0;
+
+	req = sync_request(&request);
+	return sync_result(sparse_vector_mult_submit(matrixA, vectorX, vectorY, req), req);
+}
+
+struct matrix_request *scalar_matrix_mult_async(float scalar_value, struct matrix *matrix)
+{
+	struct matrix_request *request = async_request();
+
+	return async_result(request && scalar_matrix_mult_submit(scalar_value, matrix, request), request);
+}
+
+struct matrix_request *matrix_matrix_mult_async(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC)
+{
+	struct matrix_request *request = async_request();
+
+	return async_result(request && matrix_matrix_mult_submit(matrixA, matrixB, matrixC, request), request);
+}
+
+struct matrix_request *sync_vh_ve_matrix_async(struct matrix *matrix)
+{
+	struct matrix_request *request = async_request();
+
+	return async_result(request && sync_vh_ve_matrix_submit(matrix, request), request);
+}
+
+struct matrix_request *sync_ve_vh_matrix_async(struct matrix *matrix)
+{
+	struct matrix_request *request = async_request();
+
+	return async_result(request && sync_ve_vh_matrix_submit(matrix, request), request);
+}
+
+/* Waits for the request and frees it. Returns 1 if it succeeded */
+int wait_matrix_request(struct matrix_request *request)
+{
+	int ret;
+
+	if (!request)
+		return 0;
+
+	request_wait(request);
+	ret = !request->failed;
+	free(request);
+
+	return ret;
+}
+
+/* Returns 1 and frees the request, storing in result whether it succeeded, if
+ * it is done, 0 if it is still running */
+int test_matrix_request(struct matrix_request *request, int *result)
+{
+	if (!request)
+		return 0;
+
+	while (request->pending && node_retire(request->node, 0))
+		;
+
+	if (request->pending)
+		return 0;
+
+	if (result)
+		*result = !request->failed;
+	free(request);
+
+	return 1;
+}
+
+/* Waits for one of the requests, skipping the NULL ones, and frees it. Returns
+ * its index, which is set to NULL, or -1 if all are NULL */
+int wait_any_matrix_request(struct matrix_request **requests, int num_requests, int *result)
+{
+	struct ve_node *node = NULL;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < num_requests; ++i) {
+			if (!requests[i])
+				continue;
+
+			if (!requests[i]->pending) {
+				if (result)
+					*result = !requests[i]->failed;
+				free(requests[i]);
+				requests[i] = NULL;
+				return i;
+			}
+			node = requests[i]->node;
+		}
+
+		if (!node)
+			return -1;
+
+		/* The commands run in order, so the oldest finishes first */
+		node_retire(node, 1);
+	}
+}
+
+int ve_chain_begin(void)
+{
+	if (!_ve_node || _ve_node->chain_active)
+		return 0;
+
+	_ve_node->chain_active = 1;
+	_ve_node->chain_failed = 0;
+	return 1;
+}
+
+int ve_chain_end(void)
+{
 	int ret;
 
-	if (!_ve_proc)
+	if (!_ve_node || !_ve_node->chain_active)
+		return 0;
+
+	ve_flush();
+	ret = !_ve_node->chain_failed;
+	_ve_node->chain_active = 0;
+	_ve_node->chain_failed = 0;
+
+	return ret;
+}
+
+/* The products from and to the host rows read A and B there and overwrite the
+ * host rows of C, whose VE rows the commands queued before may still be using.
+ * They take views of whole rows, and the host rows around a view C must be
+ * valid too */
+static
+int vh_operands(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC)
+{
+	if (!MATRIX_DENSE(matrixA) || !MATRIX_DENSE(matrixB) || !MATRIX_DENSE(matrixC)
+			|| !float_operands(matrixA, matrixB, matrixC))
+		return 0;
+
+	ve_flush();
+
+	return vh_read(matrixA) && vh_read(matrixB) && (!matrixC->parent || vh_read(matrixC));
+}
+
+/* Requests in flight of a pipelined product, which are all waited for before
+ * it returns, even when one of them fails */
+#define PIPE_MAX_REQS 8
+
+struct ve_pipeline {
+	struct veo_thr_ctxt *ctxt[PIPE_MAX_REQS];
+	uint64_t reqid[PIPE_MAX_REQS];
+	int num_reqs;
+	int failed;
+};
+
+static
+uint64_t pipe_track(struct ve_pipeline *pipe, struct veo_thr_ctxt *ctxt, uint64_t reqid)
+{
+	if (reqid == VEO_REQUEST_ID_INVALID || pipe->num_reqs == PIPE_MAX_REQS) {
+		pipe->failed = 1;
+		return VEO_REQUEST_ID_INVALID;
+	}
+
+	pipe->ctxt[pipe->num_reqs] = ctxt;
+	pipe->reqid[pipe->num_reqs++] = reqid;
+
+	return reqid;
+}
+
+/* Waits for a tracked request, which must return expected */
+static
+int pipe_wait(struct ve_pipeline *pipe, struct veo_thr_ctxt *ctxt, uint64_t reqid, uint64_t expected)
+{
+	uint64_t veo_ret;
+	int i;
+
+	for (i = 0; i < pipe->num_reqs; ++i) {
+		if (pipe->ctxt[i] == ctxt && pipe->reqid[i] == reqid)
+			break;
+	}
+
+	if (i == pipe->num_reqs) {
+		pipe->failed = 1;
+		return 0;
+	}
+
+	pipe->ctxt[i] = pipe->ctxt[--pipe->num_reqs];
+	pipe->reqid[i] = pipe->reqid[pipe->num_reqs];
+
+	if (veo_call_wait_result(ctxt, reqid, &veo_ret) != VEO_COMMAND_OK || veo_ret != expected)
+		pipe->failed = 1;
+
+	return !pipe->failed;
+}
+
+static
+void pipe_drain(struct ve_pipeline *pipe)
+{
+	uint64_t veo_ret;
+
+	while (pipe->num_reqs) {
+		--pipe->num_reqs;
+		if (veo_call_wait_result(pipe->ctxt[pipe->num_reqs], pipe->reqid[pipe->num_reqs], &veo_ret) != VEO_COMMAND_OK)
+			pipe->failed = 1;
+	}
+}
+
+/* C = A * B from and to the host rows, without loading the matrices on the VE
+ * first: B is sent whole, then panels of rows of A are sent on the transfer
+ * context while the previous panels are multiplied, and the panels of C come
+ * back as soon as they are done. Two panels of A and of C live on the VE */
+int matrix_matrix_mult_pipelined(struct matrix *matrixA, struct matrix *matrixB, struct matrix *matrixC)
+{
+	struct ve_pipeline pipe;
+	struct veo_args *argp[2];
+	uint64_t mem_b, mem_a[2], mem_c[2];
+	uint64_t req_b, req_a[2], req_c[2], req_mult[2];
+	unsigned long int m, n, k, panel, num_panels, i, rows, last;
+	int ret = 0;
+
+	if (!_ve_node)
+		return 0;
+
+	if (!matrixA || !matrixA->vh_rows || !matrixB || !matrixB->vh_rows || !matrixC || !matrixC->vh_rows)
 		return 0;
 
-	if (!matrix || !matrix->vh_rows || !matrix->ve_rows)
+	if (matrixC->height != matrixA->height || matrixC->width != matrixB->width
+			|| matrixA->width != matrixB->height)
 		return 0;
 
-	veo_args_clear(_veo_argp);
+	if (!matrixC->height || !matrixC->width || !matrixA->width)
+		return 0;
 
-	ret = veo_args_set_i32(_veo_argp, 0, _ve_num_threads);
-	if (ret != 0)
+	if (matrixC->map_flags & MATRIX_MAP_READONLY)
 		return 0;
 
-	ret = veo_args_set_u64(_veo_argp, 1, matrix->height);
-	if (ret != 0)
+	if (!vh_operands(matrixA, matrixB, matrixC))
 		return 0;
 
-	ret = veo_args_set_u64(_veo_argp, 2, matrix->width);
-	if (ret != 0)
-		return 0;
+	m = matrixA->height;
+	n = matrixA->width;
+	k = matrixB->width;
+	panel = MIN(_ve_panel_rows, m);
+	num_panels = (m + panel - 1) / panel;
+
+	argp[0] = veo_args_alloc();
+	if (!argp[0])
+		goto fail1;
+
+	argp[1] = veo_args_alloc();
+	if (!argp[1])
+		goto fail2;
+
+	if (veo_alloc_mem(_ve_node->proc, &mem_b, sizeof(float) * n * k) != 0)
+		goto fail3;
 
-	ret = veo_args_set_hmem(_veo_argp, 3, matrix->ve_rows);
-	if (ret != 0)
-		return 0;
+	if (veo_alloc_mem(_ve_node->proc, &mem_a[0], 2 * sizeof(float) * panel * n) != 0)
+		goto fail4;
+	mem_a[1] = mem_a[0] + sizeof(float) * panel * n;
+
+	if (veo_alloc_mem(_ve_node->proc, &mem_c[0], 2 * sizeof(float) * panel * k) != 0)
+		goto fail5;
+	mem_c[1] = mem_c[0] + sizeof(float) * panel * k;
+
+	pipe.num_reqs = 0;
+	pipe.failed = 0;
+
+	req_b = pipe_track(&pipe, _ve_node->xfer_ctxt,
+			veo_async_write_mem(_ve_node->xfer_ctxt, mem_b, matrixB->vh_rows, sizeof(float) * n * k));
+	req_a[0] = pipe_track(&pipe, _ve_node->xfer_ctxt,
+			veo_async_write_mem(_ve_node->xfer_ctxt, mem_a[0], matrixA->vh_rows, sizeof(float) * panel * n));
+	if (num_panels > 1) {
+		rows = MIN(panel, m - panel);
+		req_a[1] = pipe_track(&pipe, _ve_node->xfer_ctxt,
+				veo_async_write_mem(_ve_node->xfer_ctxt, mem_a[1], matrixA->vh_rows + panel * n, sizeof(float) * rows * n));
+	}
 
-	ret = veo_args_set_float(_veo_argp, 4, scalar_value);
-	if (ret != 0)
-		return 0;
+	for (i = 0; i < num_panels && !pipe.failed; ++i) {
+		rows = MIN(panel, m - i * panel);
+
+		/* The transfer context runs in order, so once panel i of A is
+		 * on the VE, B is too and panel i - 2 of C is back */
+		if (i == 0)
+			pipe_wait(&pipe, _ve_node->xfer_ctxt, req_b, 0);
+		pipe_wait(&pipe, _ve_node->xfer_ctxt, req_a[i % 2], 0);
+		if (i >= 2)
+			pipe_wait(&pipe, _ve_node->xfer_ctxt, req_c[i % 2], 0);
+		if (pipe.failed)
+			break;
+
+		veo_args_clear(argp[i % 2]);
+		if (veo_args_set_i32(argp[i % 2], 0, _ve_num_threads) != 0
+				|| veo_args_set_u64(argp[i % 2], 1, rows) != 0
+				|| veo_args_set_u64(argp[i % 2], 2, n) != 0
+				|| veo_args_set_u64(argp[i % 2], 3, k) != 0
+				|| veo_args_set_u64(argp[i % 2], 4, mem_a[i % 2]) != 0
+				|| veo_args_set_u64(argp[i % 2], 5, mem_b) != 0
+				|| veo_args_set_u64(argp[i % 2], 6, mem_c[i % 2]) != 0) {
+			pipe.failed = 1;
+			break;
+		}
+
+		req_mult[i % 2] = pipe_track(&pipe, _ve_node->ctxt,
+				veo_call_async_by_name(_ve_node->ctxt, _ve_node->lib_handle, _lib_matrix_matrix_mult_panel, argp[i % 2]));
+
+		/* While panel i is multiplied, bring back panel i - 1 of C and
+		 * send panel i + 1 of A in the buffer it released */
+		if (i >= 1 && pipe_wait(&pipe, _ve_node->ctxt, req_mult[(i - 1) % 2], 1)) {
+			req_c[(i - 1) % 2] = pipe_track(&pipe, _ve_node->xfer_ctxt,
+					veo_async_read_mem(_ve_node->xfer_ctxt, matrixC->vh_rows + (i - 1) * panel * k,
+						mem_c[(i - 1) % 2], sizeof(float) * panel * k));
+
+			if (i + 1 < num_panels) {
+				req_a[(i + 1) % 2] = pipe_track(&pipe, _ve_node->xfer_ctxt,
+						veo_async_write_mem(_ve_node->xfer_ctxt, mem_a[(i + 1) % 2],
+							matrixA->vh_rows + (i + 1) * panel * n,
+							sizeof(float) * MIN(panel, m - (i + 1) * panel) * n));
+			}
+		}
+	}
 
-	veo_call_handle = veo_call_async_by_name(_veo_ctxt, _ve_lib_handle, _lib_scalar_matrix_mult, _veo_argp);
-	if (veo_call_handle == VEO_REQUEST_ID_INVALID)
-		return 0;
+	if (!pipe.failed) {
+		last = num_panels - 1;
+		if (pipe_wait(&pipe, _ve_node->ctxt, req_mult[last % 2], 1)) {
+			pipe_track(&pipe, _ve_node->xfer_ctxt,
+					veo_async_read_mem(_ve_node->xfer_ctxt, matrixC->vh_rows + last * panel * k,
+						mem_c[last % 2], sizeof(float) * (m - last * panel) * k));
+		}
+	}
 
-	ret = veo_call_wait_result(_veo_ctxt, veo_call_handle, &veo_ret);
-	if (ret != VEO_COMMAND_OK)
-		return 0;
+	pipe_drain(&pipe);
+	ret = !pipe.failed;
+	if (ret)
+		written_on_vh(matrixC);
 
-	return veo_ret == 1;
+	/* ERROR CLEANUP */
+	veo_free_mem(_ve_node->proc, mem_c[0]);
+fail5:
+	veo_free_mem(_ve_node->proc, mem_a[0]);
+fail4:
+	veo_free_mem(_ve_node->proc, mem_b);
+fail3:
+	veo_args_free(argp[1]);
+fail2:
+	veo_args_free(argp[0]);
+fail1:
+	return ret;
 }
 
-int matrix_matrix_mult(struct matrix *matrixA, struct matrix * matrixB, struct matrix * matrixC)
+/* C = A * B from and to the host rows on several nodes: each one gets B and a
+ * share of the rows of A, and sends back the same rows of C. The transfers and
+ * the call of each node are queued in order on its context, so the nodes and
+ * their links all work at the same time */
+int matrix_matrix_mult_sharded(struct ve_node **nodes, int num_nodes, struct matrix *matrixA,
+		struct matrix *matrixB, struct matrix *matrixC)
 {
-	uint64_t veo_call_handle, veo_ret;
-	unsigned long int m, n, k;
-	int ret;
-
-	if (!_ve_proc)
+	static const uint64_t expected[4] = {0, 0, 1, 0};
+	struct ve_pipeline pipe[VE_MAX_NODES];
+	struct veo_args *argp[VE_MAX_NODES];
+	uint64_t mem[VE_MAX_NODES], mem_a, mem_c, req[VE_MAX_NODES][4];
+	unsigned long int m, n, k, first, rows;
+	int i, j, num_started, ret = 1;
+
+	if (!nodes || num_nodes < 1 || num_nodes > VE_MAX_NODES)
 		return 0;
 
-	if (!matrixA || !matrixA->vh_rows || !matrixA->ve_rows
-			|| !matrixB || !matrixB->vh_rows || !matrixB->ve_rows
-			|| !matrixC || !matrixC->vh_rows || !matrixC->ve_rows )
+	for (i = 0; i < num_nodes; ++i) {
+		if (!nodes[i])
+			return 0;
+	}
+
+	if (!matrixA || !matrixA->vh_rows || !matrixB || !matrixB->vh_rows || !matrixC || !matrixC->vh_rows)
 		return 0;
 
 	if (matrixC->height != matrixA->height || matrixC->width != matrixB->width
 			|| matrixA->width != matrixB->height)
 		return 0;
 
-	m = matrixA->height;
-	n = matrixA->width;
-	k = matrixB->width;
-
-	veo_args_clear(_veo_argp);
-	ret = veo_args_set_i32(_veo_argp, 0, _ve_num_threads);
-	if (ret != 0)
+	if (!matrixC->height || !matrixC->width || !matrixA->width)
 		return 0;
 
-	ret = veo_args_set_u64(_veo_argp, 1, m);
-	if (ret != 0)
+	if (matrixC->map_flags & MATRIX_MAP_READONLY)
 		return 0;
 
-	ret = veo_args_set_u64(_veo_argp, 2, n);
-	if (ret != 0)
+	if (!vh_operands(matrixA, matrixB, matrixC))
 		return 0;
 
-	ret = veo_args_set_u64(_veo_argp, 3, k);
-	if (ret != 0)
-		return 0;
+	m = matrixA->height;
+	n = matrixA->width;
+	k = matrixB->width;
 
-	ret = veo_args_set_hmem(_veo_argp, 4, matrixA->ve_rows);
-	if (ret != 0)
-		return 0;
+	/* Nodes left without rows when m < num_nodes are not used */
+	if ((unsigned long int)num_nodes > m)
+		num_nodes = (int)m;
+
+	first = 0;
+	for (num_started = 0; num_started < num_nodes; ++num_started) {
+		i = num_started;
+		rows = m / num_nodes + ((unsigned long int)i < m % num_nodes);
+		pipe[i].num_reqs = 0;
+		pipe[i].failed = 0;
+
+		argp[i] = veo_args_alloc();
+		if (!argp[i])
+			break;
+
+		if (veo_alloc_mem(nodes[i]->proc, &mem[i], sizeof(float) * (n * k + rows * n + rows * k)) != 0) {
+			veo_args_free(argp[i]);
+			break;
+		}
+		mem_a = mem[i] + sizeof(float) * n * k;
+		mem_c = mem_a + sizeof(float) * rows * n;
+
+		if (veo_args_set_i32(argp[i], 0, _ve_num_threads) != 0
+				|| veo_args_set_u64(argp[i], 1, rows) != 0
+				|| veo_args_set_u64(argp[i], 2, n) != 0
+				|| veo_args_set_u64(argp[i], 3, k) != 0
+				|| veo_args_set_u64(argp[i], 4, mem_a) != 0
+				|| veo_args_set_u64(argp[i], 5, mem[i]) != 0
+				|| veo_args_set_u64(argp[i], 6, mem_c) != 0)
+			pipe[i].failed = 1;
+
+		req[i][0] = pipe_track(&pipe[i], nodes[i]->ctxt,
+				veo_async_write_mem(nodes[i]->ctxt, mem[i], matrixB->vh_rows, sizeof(float) * n * k));
+		req[i][1] = pipe_track(&pipe[i], nodes[i]->ctxt,
+				veo_async_write_mem(nodes[i]->ctxt, mem_a, matrixA->vh_rows + first * n, sizeof(float) * rows * n));
+		if (!pipe[i].failed) {
+			req[i][2] = pipe_track(&pipe[i], nodes[i]->ctxt,
+					veo_call_async_by_name(nodes[i]->ctxt, nodes[i]->lib_handle, _lib_matrix_matrix_mult_panel, argp[i]));
+		}
+		if (!pipe[i].failed) {
+			req[i][3] = pipe_track(&pipe[i], nodes[i]->ctxt,
+					veo_async_read_mem(nodes[i]->ctxt, matrixC->vh_rows + first * k, mem_c, sizeof(float) * rows * k));
+		}
+
+		first += rows;
+	}
 
-	ret = veo_args_set_hmem(_veo_argp, 5, matrixB->ve_rows);
-	if (ret != 0)
-		return 0;
+	if (num_started < num_nodes)
+		ret = 0;
 
-	ret = veo_args_set_hmem(_veo_argp, 6, matrixC->ve_rows);
-	if (ret != 0)
-		return 0;
+	for (i = 0; i < num_started; ++i) {
+		for (j = 0; j < 4 && !pipe[i].failed; ++j)
+			pipe_wait(&pipe[i], nodes[i]->ctxt, req[i][j], expected[j]);
 
-	veo_call_handle = veo_call_async_by_name(_veo_ctxt, _ve_lib_handle, _lib_matrix_matrix_mult, _veo_argp);
-	if (veo_call_handle == VEO_REQUEST_ID_INVALID)
-		return 0;
+		pipe_drain(&pipe[i]);
+		if (pipe[i].failed)
+			ret = 0;
 
-	ret = veo_call_wait_result(_veo_ctxt, veo_call_handle, &veo_ret);
-	if (ret != VEO_COMMAND_OK)
-		return 0;
+		veo_free_mem(nodes[i]->proc, mem[i]);
+		veo_args_free(argp[i]);
+	}
+
+	if (ret)
+		written_on_vh(matrixC);
+
+	return ret;
+}
 
-	return veo_ret == 1;
+void set_ve_panel_rows(unsigned long int rows)
+{
+	if (rows)
+		_ve_panel_rows = rows;
 }
 
 void set_ve_execution_node(int num_node)
 {
-	_ve_num_node = (num_node < 0 || num_node > 3) ? 0 : num_node;
+	_ve_num_node = (num_node < 0 || num_node >= VE_MAX_NODES) ? 0 : num_node;
 }
 
 void set_number_threads(int num_threads)
@@ -136,61 +2074,100 @@ void set_number_threads(int num_threads)
 		_ve_num_threads = 1;
 	else
 		_ve_num_threads = num_threads;
+
+#ifdef MATRIX_LIB_UNIFIED
+	_dispatch_model.calibrated = 0;
+#endif
 }
 
-int init_proc_ve_node(void)
+struct ve_node *open_ve_node(int num_node)
 {
-	if (_ve_proc)
-		goto fail1;
-
-	_ve_proc = veo_proc_create(_ve_num_node);
-	if (!_ve_proc)
+	struct ve_node *node = (struct ve_node *)calloc(1, sizeof(struct ve_node));
+	if (!node)
 		goto fail1;
 
-	_ve_lib_handle = veo_load_library(_ve_proc, _ve_lib_path);
-	if (!_ve_lib_handle)
+	node->num_node = num_node;
+	node->proc = veo_proc_create(num_node);
+	if (!node->proc)
 		goto fail2;
 
-	_veo_ctxt = veo_context_open(_ve_proc);
-	if (!_veo_ctxt)
+	node->lib_handle = veo_load_library(node->proc, _ve_lib_path);
+	if (!node->lib_handle)
 		goto fail3;
 
-	_veo_argp = veo_args_alloc();
-	if (!_veo_argp)
+	node->ctxt = veo_context_open(node->proc);
+	if (!node->ctxt)
 		goto fail4;
 
-	return 1;
+	/* Transfers of the pipelined product run on their own context, so
+	 * they overlap the kernels */
+	node->xfer_ctxt = veo_context_open(node->proc);
+	if (!node->xfer_ctxt)
+		goto fail5;
+
+	return node;
 
 	/* ERROR CLEANUP */
+fail5:
+	veo_context_close(node->ctxt);
 fail4:
-	veo_context_close(_veo_ctxt);
+	veo_unload_library(node->proc, node->lib_handle);
 fail3:
-	veo_unload_library(_ve_proc, _ve_lib_handle);
+	veo_proc_destroy(node->proc);
 fail2:
-	veo_proc_destroy(_ve_proc);
-	_ve_proc = NULL;
+	free(node);
 fail1:
-	return 0;
+	return NULL;
 }
 
-int close_proc_ve_node(void)
+int close_ve_node(struct ve_node *node)
 {
 	int ret = 1;
-	if (!_ve_proc)
+	if (!node)
 		return 0;
 
-	veo_args_free(_veo_argp);
+	while (node->num_cmds)
+		node_retire(node, 1);
+	if (node->chain_active && node->chain_failed)
+		ret = 0;
+
+	if (veo_context_close(node->xfer_ctxt) < 0)
+		ret = 0;
 
-	if (veo_context_close(_veo_ctxt) < 0)
+	if (veo_context_close(node->ctxt) < 0)
 		ret = 0;
 
-	if (veo_unload_library(_ve_proc, _ve_lib_handle) != 0)
+	if (veo_unload_library(node->proc, node->lib_handle) != 0)
 		ret = 0;
 
-	if (veo_proc_destroy(_ve_proc) < 0)
+	if (veo_proc_destroy(node->proc) < 0)
 		ret = 0;
 
-	_ve_proc = NULL;
+	free(node);
+	return ret;
+}
+
+int init_proc_ve_node(void)
+{
+	if (_ve_node)
+		return 0;
+
+	_ve_node = open_ve_node(_ve_num_node);
+#ifdef MATRIX_LIB_UNIFIED
+	_dispatch_model.calibrated = 0;
+#endif
+
+	return _ve_node != NULL;
+}
+
+int close_proc_ve_node(void)
+{
+	int ret = close_ve_node(_ve_node);
+
+	_ve_node = NULL;
+#ifdef MATRIX_LIB_UNIFIED
+	_dispatch_model.calibrated = 0;
+#endif
 	return ret;
 }
 
@@ -198,58 +2175,111 @@ int load_ve_matrix(struct matrix *matrix)
 {
 	int ret;
 
-	if (!_ve_proc || !matrix || !matrix->vh_rows || matrix->ve_rows)
+	if (!_ve_node || !matrix || !matrix->vh_rows || matrix->ve_rows || matrix->parent)
 		return 0;
 
-	ret = veo_alloc_hmem(_ve_proc, &matrix->ve_rows, sizeof(float) * matrix->height * matrix->width);
+	/* The rows are sent when the VE first reads them */
+	ret = veo_alloc_hmem(_ve_node->proc, &matrix->ve_rows,
+			MATRIX_DTYPE_SIZE(matrix->dtype) * matrix->height * matrix->width);
+	matrix->ve_valid = 0;
 
-	if (ret != 0)
-		return 0;
-	else
-		return sync_vh_ve_matrix(matrix);
+	return ret == 0;
 }
 
 int unload_ve_matrix(struct matrix *matrix)
 {
 	int ret;
 
-	if (!_ve_proc || !matrix || !matrix->vh_rows || !matrix->ve_rows)
+	if (!_ve_node || !matrix || !matrix->vh_rows || !matrix->ve_rows || matrix->parent)
 		return 0;
 
-	ret = sync_ve_vh_matrix(matrix);
+	/* The rows come back only if the VE changed them, once the queued
+	 * commands are done with them */
+	ret = vh_read(matrix);
 	ret &= veo_free_hmem(matrix->ve_rows) == 0;
 	matrix->ve_rows = NULL;
+	matrix->vh_valid = 1;
+	matrix->ve_valid = 0;
 
 	return ret;
 }
 
 int sync_vh_ve_matrix(struct matrix *matrix)
 {
-	if (!_ve_proc || !matrix || !matrix->ve_rows || !matrix->vh_rows)
+	struct matrix_request request, *req;
+
+	if (!_ve_node)
 		return 0;
 
-	return veo_hmemcpy(matrix->ve_rows, matrix->vh_rows, sizeof(float) * matrix->height * matrix->width) == 0;
+	req = sync_request(&request);
+	return sync_result(sync_vh_ve_matrix_submit(matrix, req), req);
 }
 
 int sync_ve_vh_matrix(struct matrix *matrix)
 {
-	if (!_ve_proc || !matrix || !matrix->ve_rows || !matrix->vh_rows)
+#ifdef MATRIX_LIB_UNIFIED
+	/* The products of matrices not loaded ran on the host */
+	if (matrix && matrix->vh_rows && !ve_addr(matrix))
+		return 1;
+#endif
+	if (!_ve_node || !matrix || !ve_addr(matrix) || !matrix->vh_rows)
+		return 0;
+
+	return vh_read(matrix);
+}
+
+/* The host wrote the rows, so the VE copy is stale. The commands queued
+ * before are waited for, as sending the rows again would change what they
+ * read */
+int touch_vh_matrix(struct matrix *matrix)
+{
+	if (!matrix || !matrix->vh_rows)
 		return 0;
 
-	return veo_hmemcpy(matrix->vh_rows, matrix->ve_rows, sizeof(float) * matrix->height * matrix->width) == 0;
+	if (matrix->map_flags & MATRIX_MAP_READONLY)
+		return 0;
+
+	matrix = MATRIX_OWNER(matrix);
+	if (matrix->ve_rows)
+		ve_flush();
+
+	matrix->vh_valid = 1;
+	matrix->ve_valid = 0;
+
+	return 1;
 }
 
 struct matrix *zero_matrix(unsigned long int height, unsigned long int width)
 {
-	struct matrix *matrix = (struct matrix *)malloc(sizeof(struct matrix));
+	return zero_matrix_dtype(height, width, MATRIX_DTYPE_F32);
+}
+
+struct matrix *zero_matrix_dtype(unsigned long int height, unsigned long int width, int dtype)
+{
+	struct matrix *matrix;
+
+	if (dtype < MATRIX_DTYPE_F32 || dtype > MATRIX_DTYPE_F16)
+		return NULL;
+
+	matrix = (struct matrix *)malloc(sizeof(struct matrix));
 	if (!matrix)
 		return NULL;
 
 	matrix->width = width;
 	matrix->height = height;
+	matrix->dtype = dtype;
+	matrix->stride = width;
+	matrix->transposed = 0;
+	matrix->parent = NULL;
+	matrix->offset = 0;
 
 	matrix->ve_rows = NULL;
-	matrix->vh_rows = (float *)calloc(height * width, sizeof(float));
+	matrix->map_addr = NULL;
+	matrix->map_size = 0;
+	matrix->map_flags = 0;
+	matrix->vh_valid = 1;
+	matrix->ve_valid = 0;
+	matrix->vh_rows = (float *)calloc(height * width, MATRIX_DTYPE_SIZE(dtype));
 	if (!matrix->vh_rows) {
 		free(matrix);
 		return NULL;
@@ -268,44 +2298,212 @@ struct matrix *new_matrix(unsigned long int height, unsigned long int width, flo
 	return matrix;
 }
 
+/* The rows of untransposed matrices are converted whole, the elements of
+ * transposed views one by one */
+struct matrix *convert_matrix(struct matrix *matrix, int dtype)
+{
+	struct matrix *copy;
+	unsigned long int lin, col;
+
+	if (!matrix || !matrix->vh_rows || !vh_read(matrix))
+		return NULL;
+
+	copy = zero_matrix_dtype(matrix->height, matrix->width, dtype);
+	for (lin = 0; copy && lin < matrix->height; ++lin) {
+		if (!matrix->transposed) {
+			matrix_dtype_convert(MATRIX_EL(copy, lin, 0), dtype, MATRIX_EL(matrix, lin, 0), matrix->dtype,
+					matrix->width);
+			continue;
+		}
+
+		for (col = 0; col < matrix->width; ++col)
+			matrix_dtype_convert(MATRIX_EL(copy, lin, col), dtype, MATRIX_EL(matrix, lin, col), matrix->dtype, 1);
+	}
+
+	return copy;
+}
+
+/* A formatted file gives its own dimensions, which must match m_width and
+ * m_height unless they are 0, and is checked against its checksums. A raw file
+ * of floats needs both dimensions */
 struct matrix *read_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height)
 {
-	FILE *handle;
+	struct matrix_file file;
 	struct matrix *matrix;
-	unsigned long int matrix_size = m_width * m_height;
 
-	matrix = zero_matrix(m_height, m_width);
-	if (!matrix)
+	if (matrix_file_open(file_name, &file) < 0) {
+		fprintf(stderr, "ERRO: não foi possível abrir arquivo \"%s\"\n", file_name);
 		goto fail1;
+	}
 
-	handle = fopen(file_name, "rb");
-	if (!handle) {
-		fprintf(stderr, "ERRO: não foi possível abrir arquivo \"%s\"\n", file_name);
+	if (!matrix_file_shape(&file, &m_width, &m_height)) {
+		fprintf(stderr, "ERRO: dimensões inválidas para o arquivo \"%s\"\n", file_name);
 		goto fail2;
 	}
 
-	fread(matrix->vh_rows, sizeof(float), matrix_size, handle);
-	fclose(handle);
+	matrix = zero_matrix_dtype(m_height, m_width, (int)file.header.dtype);
+	if (!matrix)
+		goto fail2;
+
+	if (!matrix_file_read(&file, matrix->vh_rows)) {
+		fprintf(stderr, "ERRO: arquivo \"%s\" menor que a matriz ou corrompido\n", file_name);
+		goto fail3;
+	}
+	matrix_file_close(&file);
 
 	return matrix;
 
 	/* ERROR CLEANUP */
-fail2:
+fail3:
 	delete_matrix(matrix);
+fail2:
+	matrix_file_close(&file);
 fail1:
 	return NULL;
 }
 
-void dump_matrix_binfile(const char *file_name, struct matrix *matrix)
+/* Builds a matrix whose host rows are the pages of the file, so they are only
+ * read when load_ve_matrix copies them to the VE, and the checksums of a
+ * formatted file are not checked. MATRIX_MAP_READONLY shares the pages with
+ * the file and never syncs the matrix back to the host; MATRIX_MAP_COW gives
+ * the matrix private copies of the pages it writes to */
+struct matrix *map_matrix_binfile(const char *file_name, unsigned long int m_width, unsigned long int m_height, int flags)
 {
-	FILE *handle = fopen(file_name, "wb");
-	if (!handle) {
+	struct stat st;
+	struct matrix_file file;
+	struct matrix *matrix;
+	unsigned long int size;
+
+	if (matrix_file_open(file_name, &file) < 0) {
 		fprintf(stderr, "ERRO: não foi possível abrir arquivo \"%s\"\n", file_name);
+		goto fail1;
+	}
+
+	/* Only data stored as the matrix rows can be used in place */
+	if (!matrix_file_shape(&file, &m_width, &m_height) || !matrix_file_is_dense(&file))
+		goto fail2;
+
+	size = file.header.data_offset + MATRIX_DTYPE_SIZE(file.header.dtype) * m_width * m_height;
+	if (fstat(file.fd, &st) != 0 || (unsigned long int)st.st_size < size)
+		goto fail2;
+
+	matrix = (struct matrix *)malloc(sizeof(struct matrix));
+	if (!matrix)
+		goto fail2;
+
+	if (flags & MATRIX_MAP_READONLY)
+		matrix->map_addr = mmap(NULL, size, PROT_READ, MAP_SHARED, file.fd, 0);
+	else
+		matrix->map_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.fd, 0);
+
+	if (matrix->map_addr == MAP_FAILED)
+		goto fail3;
+
+	matrix->height = m_height;
+	matrix->width = m_width;
+	matrix->dtype = (int)file.header.dtype;
+	matrix->stride = m_width;
+	matrix->transposed = 0;
+	matrix->parent = NULL;
+	matrix->offset = 0;
+	matrix->vh_rows = (float *)((char *)matrix->map_addr + file.header.data_offset);
+	matrix->ve_rows = NULL;
+	matrix->map_size = size;
+	matrix->map_flags = flags;
+	matrix->vh_valid = 1;
+	matrix->ve_valid = 0;
+
+	/* Start reading the file in the background */
+	madvise(matrix->vh_rows, size - file.header.data_offset, MADV_WILLNEED);
+	matrix_file_close(&file);
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail3:
+	free(matrix);
+fail2:
+	matrix_file_close(&file);
+fail1:
+	return NULL;
+}
+
+void dump_matrix_binfile(const char *file_name, struct matrix *matrix)
+{
+	unsigned long int lin, col;
+	unsigned long int size = MATRIX_DTYPE_SIZE(matrix->dtype);
+	void *rows = matrix->vh_rows;
+
+	if (!vh_read(matrix)) {
+		fprintf(stderr, "ERRO: não foi possível copiar a matriz do VE\n");
 		return;
 	}
 
-	fwrite(matrix->vh_rows, sizeof(float), matrix->height * matrix->width, handle);
-	fclose(handle);
+	/* The elements of views are gathered in a dense copy first */
+	if (!MATRIX_DENSE(matrix)) {
+		rows = malloc(size * matrix->height * matrix->width);
+		for (lin = 0; rows && lin < matrix->height; ++lin) {
+			for (col = 0; col < matrix->width; ++col)
+				memcpy(DTYPE_AT(rows, matrix->dtype, lin * matrix->width + col),
+						MATRIX_EL(matrix, lin, col), size);
+		}
+	}
+
+	if (!rows || !matrix_file_write(file_name, rows, matrix->height, matrix->width, matrix->dtype))
+		fprintf(stderr, "ERRO: não foi possível escrever arquivo \"%s\"\n", file_name);
+
+	if (rows != matrix->vh_rows)
+		free(rows);
+}
+
+/* Views share the host and VE rows of their owner, offset elements in */
+static
+struct matrix *build_view(struct matrix *matrix, unsigned long int r, unsigned long int c,
+		unsigned long int height, unsigned long int width, int transposed)
+{
+	struct matrix *view = (struct matrix *)malloc(sizeof(struct matrix));
+	if (!view)
+		return NULL;
+
+	*view = *matrix;
+	view->height = height;
+	view->width = width;
+	view->vh_rows = (float *)MATRIX_EL(matrix, r, c);
+	view->transposed = transposed;
+	view->parent = MATRIX_OWNER(matrix);
+	view->offset = matrix->offset
+		+ ((char *)view->vh_rows - (char *)matrix->vh_rows) / MATRIX_DTYPE_SIZE(matrix->dtype);
+	view->ve_rows = NULL;
+	view->map_addr = NULL;
+	view->map_size = 0;
+
+	return view;
+}
+
+struct matrix *view_matrix_rows(struct matrix *matrix, unsigned long int first_row, unsigned long int num_rows)
+{
+	if (!matrix || !matrix->vh_rows || !num_rows || first_row >= matrix->height
+			|| num_rows > matrix->height - first_row)
+		return NULL;
+
+	return build_view(matrix, first_row, 0, num_rows, matrix->width, matrix->transposed);
+}
+
+struct matrix *view_matrix_columns(struct matrix *matrix, unsigned long int first_column, unsigned long int num_columns)
+{
+	if (!matrix || !matrix->vh_rows || !num_columns || first_column >= matrix->width
+			|| num_columns > matrix->width - first_column)
+		return NULL;
+
+	return build_view(matrix, 0, first_column, matrix->height, num_columns, matrix->transposed);
+}
+
+struct matrix *view_matrix_transpose(struct matrix *matrix)
+{
+	if (!matrix || !matrix->vh_rows)
+		return NULL;
+
+	return build_view(matrix, 0, 0, matrix->width, matrix->height, !matrix->transposed);
 }
 
 void delete_matrix(struct matrix *matrix)
@@ -313,12 +2511,184 @@ void delete_matrix(struct matrix *matrix)
 	if (!matrix)
 		return;
 
-	if (matrix->vh_rows)
-		free(matrix->vh_rows);
-
-	if (matrix->ve_rows)
-		veo_free_hmem(matrix->ve_rows);
+	/* Views only own their struct */
+	if (!matrix->parent) {
+		if (matrix->map_addr)
+			munmap(matrix->map_addr, matrix->map_size);
+		else if (matrix->vh_rows)
+			free(matrix->vh_rows);
+
+		if (matrix->ve_rows) {
+			ve_flush();
+			veo_free_hmem(matrix->ve_rows);
+		}
+	}
 
 	free(matrix);
 }
 
+/* The arrays are sent at once, as the VE never writes them */
+int load_ve_sparse_matrix(struct sparse_matrix *matrix)
+{
+	unsigned long int offset;
+
+	if (!_ve_node || !matrix || matrix->ve_arrays)
+		return 0;
+
+	if (veo_alloc_hmem(_ve_node->proc, &matrix->ve_arrays, sparse_ve_size(matrix)) != 0)
+		goto fail1;
+
+	offset = sizeof(uint64_t) * (matrix->height + 1);
+	if (veo_hmemcpy(matrix->ve_arrays, matrix->row_ptr, offset) != 0
+			|| veo_hmemcpy((char *)matrix->ve_arrays + offset, matrix->values, sizeof(float) * matrix->nnz) != 0
+			|| veo_hmemcpy((char *)matrix->ve_arrays + offset + sizeof(float) * matrix->nnz, matrix->columns,
+				sizeof(uint32_t) * matrix->nnz) != 0)
+		goto fail2;
+
+	return 1;
+
+	/* ERROR CLEANUP */
+fail2:
+	veo_free_hmem(matrix->ve_arrays);
+fail1:
+	matrix->ve_arrays = NULL;
+	return 0;
+}
+
+/* Waits for the queued commands, which may read the arrays */
+int unload_ve_sparse_matrix(struct sparse_matrix *matrix)
+{
+	int ret;
+
+	if (!_ve_node || !matrix || !matrix->ve_arrays)
+		return 0;
+
+	ve_flush();
+	ret = veo_free_hmem(matrix->ve_arrays) == 0;
+	matrix->ve_arrays = NULL;
+
+	return ret;
+}
+
+static
+struct sparse_matrix *build_sparse_matrix(unsigned long int height, unsigned long int width, unsigned long int nnz)
+{
+	struct sparse_matrix *matrix;
+	unsigned long int size;
+
+	/* Counts from file headers may not fit in memory */
+	if (width > SPARSE_MAX_WIDTH || !matrix_size_add(height, 1, &size)
+			|| !matrix_size_mul(sizeof(unsigned long int), size, &size)
+			|| !matrix_size_mul(sizeof(float), nnz, &size))
+		return NULL;
+
+	matrix = (struct sparse_matrix *)malloc(sizeof(struct sparse_matrix));
+	if (!matrix)
+		goto fail1;
+
+	matrix->height = height;
+	matrix->width = width;
+	matrix->nnz = nnz;
+	matrix->row_ptr = (unsigned long int *)malloc(sizeof(unsigned long int) * (height + 1));
+	matrix->columns = (unsigned int *)malloc(sizeof(unsigned int) * (nnz ? nnz : 1));
+	matrix->values = (float *)malloc(sizeof(float) * (nnz ? nnz : 1));
+	matrix->ve_arrays = NULL;
+	if (!matrix->row_ptr || !matrix->columns || !matrix->values)
+		goto fail2;
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail2:
+	delete_sparse_matrix(matrix);
+fail1:
+	return NULL;
+}
+
+/* Counts the nonzeros of the host rows first, then stores them row by row */
+struct sparse_matrix *convert_sparse_matrix(struct matrix *matrix)
+{
+	struct sparse_matrix *sparse;
+	unsigned long int lin, col, nnz = 0;
+	float value;
+
+	if (!matrix || !matrix->vh_rows || !vh_read(matrix))
+		return NULL;
+
+	for (lin = 0; lin < matrix->height; ++lin) {
+		for (col = 0; col < matrix->width; ++col) {
+			matrix_dtype_convert(&value, MATRIX_DTYPE_F32, MATRIX_EL(matrix, lin, col), matrix->dtype, 1);
+			nnz += value != 0.0f;
+		}
+	}
+
+	sparse = build_sparse_matrix(matrix->height, matrix->width, nnz);
+	if (!sparse)
+		return NULL;
+
+	for (lin = 0, nnz = 0; lin < matrix->height; ++lin) {
+		sparse->row_ptr[lin] = nnz;
+		for (col = 0; col < matrix->width; ++col) {
+			matrix_dtype_convert(&value, MATRIX_DTYPE_F32, MATRIX_EL(matrix, lin, col), matrix->dtype, 1);
+			if (value == 0.0f)
+				continue;
+
+			sparse->columns[nnz] = (unsigned int)col;
+			sparse->values[nnz++] = value;
+		}
+	}
+	sparse->row_ptr[lin] = nnz;
+
+	return sparse;
+}
+
+struct sparse_matrix *read_sparse_binfile(const char *file_name)
+{
+	struct sparse_file file;
+	struct sparse_matrix *matrix;
+
+	if (!sparse_file_open(file_name, &file))
+		goto fail1;
+
+	matrix = build_sparse_matrix(file.header.height, file.header.width, file.header.nnz);
+	if (!matrix)
+		goto fail2;
+
+	if (!sparse_file_read(&file, (uint64_t *)matrix->row_ptr, matrix->columns, matrix->values))
+		goto fail3;
+
+	sparse_file_close(&file);
+
+	return matrix;
+
+	/* ERROR CLEANUP */
+fail3:
+	delete_sparse_matrix(matrix);
+fail2:
+	sparse_file_close(&file);
+fail1:
+	return NULL;
+}
+
+void dump_sparse_binfile(const char *file_name, struct sparse_matrix *matrix)
+{
+	if (!sparse_file_write(file_name, matrix->height, matrix->width, (const uint64_t *)matrix->row_ptr,
+				matrix->columns, matrix->values))
+		fprintf(stderr, "ERRO: não foi possível escrever arquivo \"%s\"\n", file_name);
+}
+
+void delete_sparse_matrix(struct sparse_matrix *matrix)
+{
+	if (!matrix)
+		return;
+
+	if (matrix->ve_arrays) {
+		ve_flush();
+		veo_free_hmem(matrix->ve_arrays);
+	}
+
+	free(matrix->row_ptr);
+	free(matrix->columns);
+	free(matrix->values);
+	free(matrix);
+}
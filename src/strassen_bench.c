@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "matrix_lib_o.h"
+#include "arg_lib.h"
+#include "timer.h"
+
+/* Runs of each product, the fastest one being reported */
+#define BENCH_RUNS 3
+
+/* Sizes of the square products, doubled from the first one */
+#define BENCH_FIRST_SIZE 512
+
+static unsigned long int default_cutoffs[] = {512, 1024, 2048};
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "FATAL ERROR: %s.\nAborting program...\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+/* Milliseconds of the fastest of BENCH_RUNS products */
+static float time_mult(int (*mult)(Matrix *, Matrix *, Matrix *), Matrix *matrixA, Matrix *matrixB,
+		Matrix *matrixC)
+{
+	double start;
+	float best = 0.0f, msec;
+	int run;
+
+	for (run = 0; run < BENCH_RUNS; ++run) {
+		start = monotonic_msec();
+		if (!mult(matrixA, matrixB, matrixC))
+			die("matrix multiplication failure");
+
+		msec = (float)(monotonic_msec() - start);
+		if (!run || msec < best)
+			best = msec;
+	}
+
+	return best;
+}
+
+/* Largest difference between the elements of C and of the reference, relative
+ * to the largest element of the reference */
+static double relative_error(Matrix *matrixC, Matrix *reference)
+{
+	unsigned long int i, size = reference->height * reference->width;
+	double diff = 0.0, norm = 0.0;
+
+	for (i = 0; i < size; ++i) {
+		diff = fmax(diff, fabs((double)matrixC->rows[i] - reference->rows[i]));
+		norm = fmax(norm, fabs((double)reference->rows[i]));
+	}
+
+	return norm > 0.0 ? diff / norm : diff;
+}
+
+/* Times the Strassen-Winograd products against matrix_matrix_mult on square
+ * matrices of growing size, for each cutoff, to find the size where they start
+ * to pay off on this machine */
+int main(int argc, char *argv[])
+{
+	unsigned long int max_size, size, i, num_cutoffs;
+	unsigned long int *cutoffs;
+	Matrix *matrixA, *matrixB, *matrixC, *reference;
+	float standard, fast;
+	int c;
+
+	if (argc < 3) {
+		fprintf(stderr, "USAGE: %s <num_threads> <max_size> [<cutoff> ...]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	set_number_threads(argtoi(argv[1]));
+	max_size = argtoul(argv[2]);
+	if (max_size < BENCH_FIRST_SIZE)
+		die("max_size below the first size");
+
+	if (argc > 3) {
+		num_cutoffs = (unsigned long int)argc - 3;
+		cutoffs = (unsigned long int *)malloc(sizeof(unsigned long int) * num_cutoffs);
+		if (!cutoffs)
+			die("out of memory");
+		for (c = 3; c < argc; ++c)
+			cutoffs[c - 3] = argtoul(argv[c]);
+	} else {
+		num_cutoffs = sizeof(default_cutoffs) / sizeof(default_cutoffs[0]);
+		cutoffs = default_cutoffs;
+	}
+
+	if (!init_thread_pool())
+		die("init_thread_pool()");
+
+	printf("%8s %8s %12s %12s %10s %10s %12s\n",
+			"size", "cutoff", "standard ms", "strassen ms", "GFLOP/s", "speedup", "rel. error");
+
+	for (size = BENCH_FIRST_SIZE; size <= max_size; size *= 2) {
+		matrixA = zero_matrix(size, size);
+		matrixB = zero_matrix(size, size);
+		matrixC = zero_matrix(size, size);
+		reference = zero_matrix(size, size);
+		if (!matrixA || !matrixB || !matrixC || !reference)
+			die("Matrixes creation failure");
+
+		for (i = 0; i < size * size; ++i) {
+			matrixA->rows[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+			matrixB->rows[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+		}
+
+		standard = time_mult(matrix_matrix_mult, matrixA, matrixB, reference);
+		printf("%8lu %8s %12.2f %12s %10.1f %10s %12s\n", size, "-", standard, "-",
+				2.0 * size * size * size / standard / 1e6, "-", "-");
+
+		/* Cutoffs above the size would not split the product */
+		for (i = 0; i < num_cutoffs; ++i) {
+			if (cutoffs[i] > size)
+				continue;
+
+			set_strassen_cutoff(cutoffs[i]);
+			fast = time_mult(matrix_matrix_mult_strassen, matrixA, matrixB, matrixC);
+			printf("%8lu %8lu %12.2f %12.2f %10.1f %10.2f %12.2e\n", size, cutoffs[i], standard, fast,
+					2.0 * size * size * size / fast / 1e6, standard / fast,
+					relative_error(matrixC, reference));
+		}
+
+		delete_matrix(matrixA);
+		delete_matrix(matrixB);
+		delete_matrix(matrixC);
+		delete_matrix(reference);
+	}
+
+	if (cutoffs != default_cutoffs)
+		free(cutoffs);
+
+	close_thread_pool();
+	return 0;
+}
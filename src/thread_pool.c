@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_pool.h"
+
+/* Persistent pool of worker threads. The workers are created once and park
+ * on a condition variable between jobs; a job is published by bumping the
+ * generation counter, and the caller sleeps until the last task is done */
+
+/* Deque of the items still owned by a worker, kept as the range [head, tail)
+ * packed in a single word so both ends move with one compare and swap. The
+ * owner takes items from the head and thieves take them from the tail */
+typedef struct pool_deque {
+	_Atomic uint64_t bounds;
+} __attribute__((aligned(64))) _pool_deque;
+
+typedef struct pool_worker {
+	_pool_deque deque;
+	pthread_t thread;
+	unsigned int tid;
+	unsigned long int generation;
+	void *scratch;
+	size_t scratch_size;
+} _pool_worker;
+
+typedef struct pool_job {
+	pool_task task;
+	char *args;
+	size_t args_size;
+	unsigned int num_tasks;
+} _pool_job;
+
+/* Lock order: pool_create_lock, pool_run_lock, pool_lock. Creating and
+ * destroying the pool holds the first two, so the first operations of
+ * concurrent callers start a single pool, and no job runs meanwhile */
+static pthread_mutex_t pool_create_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+
+static _pool_worker *pool_workers = NULL;
+static unsigned int pool_num_threads = 0;
+static unsigned long int pool_generation = 0;
+static unsigned int pool_pending = 0;
+static int pool_failed = 0;
+static int pool_shutdown = 0;
+static int pool_affinity = 0;
+static _pool_job pool_job;
+
+static
+void *pool_worker_main(void *args)
+{
+	_pool_worker *worker = (_pool_worker *)args;
+	_pool_job job;
+	int ret;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_generation == worker->generation && !pool_shutdown)
+			pthread_cond_wait(&pool_work_cond, &pool_lock);
+
+		if (pool_shutdown)
+			break;
+
+		worker->generation = pool_generation;
+		job = pool_job;
+
+		/* Workers past the number of tasks sit this job out */
+		if (worker->tid >= job.num_tasks)
+			continue;
+
+		pthread_mutex_unlock(&pool_lock);
+		ret = job.task(worker->tid, job.args + worker->tid * job.args_size);
+		pthread_mutex_lock(&pool_lock);
+
+		if (!ret)
+			pool_failed = 1;
+
+		if (--pool_pending == 0)
+			pthread_cond_signal(&pool_done_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return NULL;
+}
+
+/* Selects whether the workers of the pools created from now on are pinned,
+ * worker t to the t-th CPU the process is allowed to run on */
+void thread_pool_set_affinity(int enable)
+{
+	pthread_mutex_lock(&pool_create_lock);
+	pool_affinity = enable;
+	pthread_mutex_unlock(&pool_create_lock);
+}
+
+/* Sets in attr the CPU of worker tid out of the CPUs in allowed */
+static
+void pool_worker_cpu(pthread_attr_t *attr, const cpu_set_t *allowed, unsigned int tid)
+{
+	unsigned int cpu, nth;
+	cpu_set_t cpus;
+
+	nth = tid % (unsigned int)CPU_COUNT(allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, allowed) && nth-- == 0)
+			break;
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+}
+
+/* Must be called with pool_create_lock and pool_run_lock held, and no pool */
+static
+int pool_create(unsigned int num_threads)
+{
+	pthread_attr_t p_attr;
+	cpu_set_t allowed;
+	unsigned int t;
+	int pin;
+
+	if (num_threads < 1)
+		goto fail1;
+
+	pin = pool_affinity && sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	pool_workers = (_pool_worker *)aligned_alloc(64, num_threads * sizeof(_pool_worker));
+	if (!pool_workers)
+		goto fail1;
+	memset(pool_workers, 0, num_threads * sizeof(_pool_worker));
+
+	pool_shutdown = 0;
+	for (t = 0; t != num_threads; ++t) {
+		/* Jobs published before the worker existed are not its own */
+		pool_workers[t].tid = t;
+		pool_workers[t].generation = pool_generation;
+
+		pthread_attr_init(&p_attr);
+		if (pin)
+			pool_worker_cpu(&p_attr, &allowed, t);
+		if (pthread_create(&pool_workers[t].thread, &p_attr, pool_worker_main, &pool_workers[t])) {
+			pthread_attr_destroy(&p_attr);
+			goto fail2;
+		}
+		pthread_attr_destroy(&p_attr);
+	}
+
+	pool_num_threads = num_threads;
+
+	return 1;
+
+	/* ERROR CLEANUP */
+fail2:
+	pthread_mutex_lock(&pool_lock);
+	pool_shutdown = 1;
+	pthread_cond_broadcast(&pool_work_cond);
+	pthread_mutex_unlock(&pool_lock);
+	while (t--)
+		pthread_join(pool_workers[t].thread, NULL);
+	free(pool_workers);
+	pool_workers = NULL;
+fail1:
+	return 0;
+}
+
+/* Must be called with pool_create_lock and pool_run_lock held, and a pool */
+static
+void pool_destroy(void)
+{
+	unsigned int t;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_shutdown = 1;
+	pthread_cond_broadcast(&pool_work_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	for (t = 0; t != pool_num_threads; ++t) {
+		pthread_join(pool_workers[t].thread, NULL);
+		free(pool_workers[t].scratch);
+	}
+
+	free(pool_workers);
+	pool_workers = NULL;
+	pool_num_threads = 0;
+}
+
+int thread_pool_create(unsigned int num_threads)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool_create_lock);
+	pthread_mutex_lock(&pool_run_lock);
+	ret = !pool_workers && pool_create(num_threads);
+	pthread_mutex_unlock(&pool_run_lock);
+	pthread_mutex_unlock(&pool_create_lock);
+
+	return ret;
+}
+
+int thread_pool_destroy(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool_create_lock);
+	pthread_mutex_lock(&pool_run_lock);
+	ret = pool_workers != NULL;
+	if (ret)
+		pool_destroy();
+	pthread_mutex_unlock(&pool_run_lock);
+	pthread_mutex_unlock(&pool_create_lock);
+
+	return ret;
+}
+
+/* Creates a pool of num_threads workers unless one is running, and returns
+ * the number of workers of the running pool, 0 if it could not be created */
+unsigned int thread_pool_start(unsigned int num_threads)
+{
+	unsigned int size;
+
+	pthread_mutex_lock(&pool_create_lock);
+	if (!pool_workers) {
+		pthread_mutex_lock(&pool_run_lock);
+		pool_create(num_threads);
+		pthread_mutex_unlock(&pool_run_lock);
+	}
+	size = pool_num_threads;
+	pthread_mutex_unlock(&pool_create_lock);
+
+	return size;
+}
+
+/* Recreates a running pool with num_threads workers if it has another number
+ * of them, or anyway if restart is set, once the job running is done. Does
+ * nothing without a running pool */
+int thread_pool_resize(unsigned int num_threads, int restart)
+{
+	int ret = 1;
+
+	pthread_mutex_lock(&pool_create_lock);
+	if (pool_workers && (restart || pool_num_threads != num_threads)) {
+		pthread_mutex_lock(&pool_run_lock);
+		pool_destroy();
+		ret = pool_create(num_threads);
+		pthread_mutex_unlock(&pool_run_lock);
+	}
+	pthread_mutex_unlock(&pool_create_lock);
+
+	return ret;
+}
+
+unsigned int thread_pool_size(void)
+{
+	unsigned int size;
+
+	pthread_mutex_lock(&pool_create_lock);
+	size = pool_num_threads;
+	pthread_mutex_unlock(&pool_create_lock);
+
+	return size;
+}
+
+/* Publishes a job to the workers and waits for it. Must be called with
+ * pool_run_lock held */
+static
+int pool_dispatch(unsigned int num_tasks, pool_task task, void *args, size_t args_size)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_job.task = task;
+	pool_job.args = (char *)args;
+	pool_job.args_size = args_size;
+	pool_job.num_tasks = num_tasks;
+	pool_pending = num_tasks;
+	pool_failed = 0;
+	++pool_generation;
+	pthread_cond_broadcast(&pool_work_cond);
+
+	while (pool_pending)
+		pthread_cond_wait(&pool_done_cond, &pool_lock);
+
+	ret = !pool_failed;
+	pthread_mutex_unlock(&pool_lock);
+
+	return ret;
+}
+
+/* Runs task num_tasks times on the pool, passing the tid-th element of the
+ * args array (of elements of args_size bytes) to task tid, and waits for all of
+ * them. Concurrent callers are serialised. Returns 1 if every task succeeded */
+int thread_pool_run(unsigned int num_tasks, pool_task task, void *args, size_t args_size)
+{
+	int ret;
+
+	if (!task || num_tasks < 1)
+		return 0;
+
+	pthread_mutex_lock(&pool_run_lock);
+
+	if (!pool_workers || num_tasks > pool_num_threads) {
+		pthread_mutex_unlock(&pool_run_lock);
+		return 0;
+	}
+
+	ret = pool_dispatch(num_tasks, task, args, args_size);
+
+	pthread_mutex_unlock(&pool_run_lock);
+
+	return ret;
+}
+
+/* Returns a 64 bytes aligned buffer of at least size bytes owned by worker
+ * tid, kept between jobs and freed when the pool is destroyed. Must only be
+ * called from inside task tid */
+void *thread_pool_scratch(unsigned int tid, size_t size)
+{
+	_pool_worker *worker;
+
+	if (!pool_workers || tid >= pool_num_threads)
+		return NULL;
+
+	worker = &pool_workers[tid];
+	if (worker->scratch_size < size) {
+		free(worker->scratch);
+		worker->scratch_size = 0;
+		worker->scratch = aligned_alloc(64, (size + 63) & ~(size_t)63);
+		if (!worker->scratch)
+			return NULL;
+		worker->scratch_size = size;
+	}
+
+	return worker->scratch;
+}
+
+static
+int pool_deque_pop(_pool_deque *deque, unsigned long int *item)
+{
+	uint64_t bounds, head, tail;
+
+	bounds = atomic_load(&deque->bounds);
+	do {
+		head = bounds >> 32;
+		tail = bounds & 0xffffffff;
+		if (head >= tail)
+			return 0;
+	} while (!atomic_compare_exchange_weak(&deque->bounds, &bounds, ((head + 1) << 32) | tail));
+
+	*item = head;
+	return 1;
+}
+
+static
+int pool_deque_steal(_pool_deque *deque, unsigned long int *item)
+{
+	uint64_t bounds, head, tail;
+
+	bounds = atomic_load(&deque->bounds);
+	do {
+		head = bounds >> 32;
+		tail = bounds & 0xffffffff;
+		if (head >= tail)
+			return 0;
+	} while (!atomic_compare_exchange_weak(&deque->bounds, &bounds, (head << 32) | (tail - 1)));
+
+	*item = tail - 1;
+	return 1;
+}
+
+typedef struct pool_items_data {
+	pool_item_task task;
+	void *args;
+	unsigned int num_tasks;
+	atomic_int failed;
+} _pool_items_data;
+
+static
+int pool_items_task(unsigned int tid, void *args)
+{
+	_pool_items_data *data = (_pool_items_data *)args;
+	unsigned long int item;
+	unsigned int victim;
+
+	/* Drain the own deque first, then steal from the others starting at the
+	 * next worker, until every deque is empty */
+	while (pool_deque_pop(&pool_workers[tid].deque, &item)) {
+		if (!data->task(tid, item, data->args))
+			atomic_store(&data->failed, 1);
+	}
+
+	for (victim = (tid + 1) % data->num_tasks; victim != tid; victim = (victim + 1) % data->num_tasks) {
+		while (pool_deque_steal(&pool_workers[victim].deque, &item)) {
+			if (!data->task(tid, item, data->args))
+				atomic_store(&data->failed, 1);
+		}
+	}
+
+	return 1;
+}
+
+/* Runs task once for every item from 0 to num_items - 1 on num_tasks workers.
+ * Worker t starts with the t-th contiguous range of items and, once done with
+ * it, steals items from the end of the ranges of the other workers, so a slow
+ * or preempted worker does not hold the whole job back. Returns 1 if task
+ * succeeded on every item */
+int thread_pool_run_items(unsigned int num_tasks, unsigned long int num_items, pool_item_task task, void *args)
+{
+	_pool_items_data data;
+	unsigned long int items, rest, first, last;
+	unsigned int t;
+	int ret;
+
+	if (!task || num_tasks < 1 || num_items > 0xffffffff)
+		return 0;
+
+	pthread_mutex_lock(&pool_run_lock);
+
+	if (!pool_workers || num_tasks > pool_num_threads) {
+		pthread_mutex_unlock(&pool_run_lock);
+		return 0;
+	}
+
+	items = num_items / num_tasks;
+	rest = num_items % num_tasks;
+	for (t = 0, last = 0; t != num_tasks; ++t) {
+		first = last;
+		last = first + items + (t < rest);
+		atomic_store(&pool_workers[t].deque.bounds, ((uint64_t)first << 32) | last);
+	}
+
+	data.task = task;
+	data.args = args;
+	data.num_tasks = num_tasks;
+	atomic_init(&data.failed, 0);
+
+	ret = pool_dispatch(num_tasks, pool_items_task, &data, 0);
+
+	pthread_mutex_unlock(&pool_run_lock);
+
+	return ret && !atomic_load(&data.failed);
+}
@@ -0,0 +1,26 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <stddef.h>
+
+/* Task run by the workers of the pool. tid is the index of the task, from 0
+ * to num_tasks - 1, and args points to its own element of the arguments
+ * array. Returns 1 on success and 0 on failure */
+typedef int (*pool_task)(unsigned int tid, void *args);
+
+/* Task run once per item by thread_pool_run_items. tid is the worker running
+ * it and args is shared by all items */
+typedef int (*pool_item_task)(unsigned int tid, unsigned long int item, void *args);
+
+int thread_pool_create(unsigned int num_threads);
+int thread_pool_destroy(void);
+unsigned int thread_pool_start(unsigned int num_threads);
+int thread_pool_resize(unsigned int num_threads, int restart);
+void thread_pool_set_affinity(int enable);
+unsigned int thread_pool_size(void);
+
+int thread_pool_run(unsigned int num_tasks, pool_task task, void *args, size_t args_size);
+int thread_pool_run_items(unsigned int num_tasks, unsigned long int num_items, pool_item_task task, void *args);
+void *thread_pool_scratch(unsigned int tid, size_t size);
+
+#endif /* #ifndef _THREAD_POOL_H */
@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include "timer.h"
 
 /*
@@ -12,3 +14,17 @@ float timedifference_msec(struct timeval t0, struct timeval t1)
 	return (t1.tv_sec - t0.tv_sec) * 1000.0f + (t1.tv_usec - t0.tv_usec) / 1000.0f;
 }
 
+/*
+ * double monotonic_msec(void)
+ * Retorna o tempo do relogio monotonico (CLOCK_MONOTONIC) em milisegundos
+ * (tipo double). Ao contrario de gettimeofday, ele nao volta atras com os
+ * ajustes do relogio do sistema, e serve para medir intervalos curtos.
+ */
+
+double monotonic_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
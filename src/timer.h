@@ -4,6 +4,7 @@
 #include <sys/time.h>
 
 float timedifference_msec(struct timeval t0, struct timeval t1);
+double monotonic_msec(void);
 
 #endif
 
@@ -0,0 +1,60 @@
+#ifndef _VE_OFFLOAD_H
+#define _VE_OFFLOAD_H
+
+/* Subset of the VEO API emulated on the host by veo_emu.c, so the VH side of
+ * the library can be built and tested on machines without a VE */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VEO_REQUEST_ID_INVALID (~0UL)
+
+#define VEO_COMMAND_OK         0
+#define VEO_COMMAND_EXCEPTION  1
+#define VEO_COMMAND_ERROR      2
+#define VEO_COMMAND_UNFINISHED 3
+
+struct veo_proc_handle;
+struct veo_thr_ctxt;
+struct veo_args;
+
+struct veo_proc_handle *veo_proc_create(int venode);
+int veo_proc_destroy(struct veo_proc_handle *proc);
+
+uint64_t veo_load_library(struct veo_proc_handle *proc, const char *libname);
+int veo_unload_library(struct veo_proc_handle *proc, const uint64_t libhdl);
+uint64_t veo_get_sym(struct veo_proc_handle *proc, uint64_t libhdl, const char *symname);
+
+struct veo_thr_ctxt *veo_context_open(struct veo_proc_handle *proc);
+int veo_context_close(struct veo_thr_ctxt *ctx);
+
+struct veo_args *veo_args_alloc(void);
+void veo_args_free(struct veo_args *ca);
+void veo_args_clear(struct veo_args *ca);
+int veo_args_set_i32(struct veo_args *ca, int argnum, int32_t val);
+int veo_args_set_u32(struct veo_args *ca, int argnum, uint32_t val);
+int veo_args_set_i64(struct veo_args *ca, int argnum, int64_t val);
+int veo_args_set_u64(struct veo_args *ca, int argnum, uint64_t val);
+int veo_args_set_float(struct veo_args *ca, int argnum, float val);
+int veo_args_set_double(struct veo_args *ca, int argnum, double val);
+int veo_args_set_hmem(struct veo_args *ca, int argnum, void *val);
+
+uint64_t veo_call_async(struct veo_thr_ctxt *ctx, uint64_t addr, struct veo_args *ca);
+uint64_t veo_call_async_vh(struct veo_thr_ctxt *ctx, uint64_t (*func)(void *), void *arg);
+uint64_t veo_call_async_by_name(struct veo_thr_ctxt *ctx, uint64_t libhdl, const char *symname, struct veo_args *ca);
+int veo_call_peek_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp);
+int veo_call_wait_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp);
+
+int veo_alloc_mem(struct veo_proc_handle *proc, uint64_t *addr, const size_t size);
+int veo_free_mem(struct veo_proc_handle *proc, uint64_t addr);
+int veo_read_mem(struct veo_proc_handle *proc, void *dst, uint64_t src, size_t size);
+int veo_write_mem(struct veo_proc_handle *proc, uint64_t dst, const void *src, size_t size);
+uint64_t veo_async_read_mem(struct veo_thr_ctxt *ctx, void *dst, uint64_t src, size_t size);
+uint64_t veo_async_write_mem(struct veo_thr_ctxt *ctx, uint64_t dst, const void *src, size_t size);
+
+int veo_alloc_hmem(struct veo_proc_handle *proc, void **addr, const size_t size);
+int veo_free_hmem(void *addr);
+int veo_hmemcpy(void *dst, void *src, size_t size);
+int veo_is_ve_addr(const void *addr);
+
+#endif /* #ifndef _VE_OFFLOAD_H */
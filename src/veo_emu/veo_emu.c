@@ -0,0 +1,773 @@
+/* Host emulation of the VEO API, to build, test and profile the VH side of
+ * the library on machines without a VE:
+ *
+ *   gcc -shared -fPIC -o libveo_emu.so veo_emu.c -ldl -lpthread
+ *   gcc -shared -fPIC -fopenmp -I. -o matrix_lib_ve.so ../matrix_lib_ve.c -lm
+ *   gcc -I. -o matrix_lib_test ../matrix_lib_test.c ../matrix_lib_vh.c \
+ *       ../matrix_file.c ../timer.c -L. -lveo_emu
+ *
+ * or, from the top of the tree, make builds them in build/emu, and make check
+ * checks the VE kernels, pipelined and sharded products included, against the
+ * host library.
+ *
+ * The "VE" memory is host memory and the VE library is a host shared object
+ * run by one thread per context, which executes its commands in order as the
+ * real contexts do. hmem pointers are tagged so that the VH dereferencing one
+ * faults, as it would with real VE memory. Calls follow the x86-64 System V
+ * convention: up to EMU_MAX_INT_ARGS integer and EMU_MAX_FLOAT_ARGS floating
+ * point arguments, in any order.
+ *
+ * Transfers and calls can be given a latency and transfers a bandwidth, see
+ * veo_emu.h. Each node has its own link, and each direction of a link carries
+ * one transfer at a time, so concurrent transfers to a node queue for it as on
+ * its PCIe link while transfers to different nodes overlap */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ve_offload.h"
+#include "veo_hmem.h"
+#include "veo_emu.h"
+
+#define EMU_HMEM_TAG (1UL << 62)
+#define EMU_HMEM_NODE_SHIFT 56 /* hmem pointers also carry their node */
+#define EMU_MAX_NODES 64
+#define EMU_MAX_ARGS 32
+#define EMU_MAX_INT_ARGS 16
+#define EMU_MAX_FLOAT_ARGS 8
+
+#define EMU_MEM_HEADER 64 /* keeps the size of each allocation */
+
+#define ARG_NONE   0
+#define ARG_INT    1
+#define ARG_FLOAT  2
+#define ARG_DOUBLE 3
+
+#define LINK_WRITE 0
+#define LINK_READ  1
+
+#define CMD_CALL  0
+#define CMD_READ  1
+#define CMD_WRITE 2
+#define CMD_VH    3
+
+struct veo_proc_handle {
+	int venode;
+};
+
+/* Floating point arguments keep their bits in value, floats in the low 32 */
+struct veo_args {
+	int num_args;
+	int type[EMU_MAX_ARGS];
+	uint64_t value[EMU_MAX_ARGS];
+};
+
+struct emu_command {
+	uint64_t reqid;
+	int type;
+	int venode;
+	int done;
+	int status;
+	uint64_t result;
+
+	uint64_t addr;            /* function, or VE side of a transfer */
+	void *host;               /* host side of a transfer, or argument
+	                           * of a VH function                    */
+	size_t size;
+	struct veo_args args;
+
+	struct emu_command *next;
+};
+
+struct veo_thr_ctxt {
+	struct veo_proc_handle *proc;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int closing;
+	uint64_t next_reqid;
+	struct emu_command *head, *tail; /* queued and finished commands */
+};
+
+/* Configuration, link reservations and stats, shared by all processes */
+static struct {
+	pthread_mutex_t lock;
+	int configured;
+	int nodes;
+	double ns_per_byte;
+	uint64_t latency_ns;
+	uint64_t call_latency_ns;
+	int print_stats;
+	uint64_t link_free[EMU_MAX_NODES][2]; /* time each direction of the links frees up */
+	struct veo_emu_stats stats;
+} emu = {PTHREAD_MUTEX_INITIALIZER, 0, 8, 0.0, 0, 0, 0, {{0, 0}}, {0}};
+
+typedef uint64_t (*emu_function)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
+		uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
+		double, double, double, double, double, double, double, double);
+
+static
+uint64_t emu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+static
+void emu_sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(deadline / 1000000000UL);
+	ts.tv_nsec = (long)(deadline % 1000000000UL);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+static
+double emu_getenv(const char *name, double value)
+{
+	const char *env = getenv(name);
+
+	return env && *env ? strtod(env, NULL) : value;
+}
+
+/* Reads the configuration from the environment, unless veo_emu_configure was
+ * called first */
+static
+void emu_init(void)
+{
+	pthread_mutex_lock(&emu.lock);
+	if (!emu.configured) {
+		emu.configured = 1;
+		emu.nodes = (int)emu_getenv("VEO_EMU_NODES", 8);
+		if (emu.nodes > EMU_MAX_NODES)
+			emu.nodes = EMU_MAX_NODES;
+		emu.ns_per_byte = emu_getenv("VEO_EMU_BANDWIDTH", 0) > 0 ? 1.0 / emu_getenv("VEO_EMU_BANDWIDTH", 0) : 0.0;
+		emu.latency_ns = (uint64_t)(emu_getenv("VEO_EMU_LATENCY", 0) * 1000);
+		emu.call_latency_ns = (uint64_t)(emu_getenv("VEO_EMU_CALL_LATENCY", 0) * 1000);
+		emu.print_stats = getenv("VEO_EMU_STATS") != NULL;
+	}
+	pthread_mutex_unlock(&emu.lock);
+}
+
+void veo_emu_configure(int nodes, double bandwidth_gbs, double latency_us, double call_latency_us)
+{
+	pthread_mutex_lock(&emu.lock);
+	emu.configured = 1;
+	emu.nodes = nodes > EMU_MAX_NODES ? EMU_MAX_NODES : nodes;
+	emu.ns_per_byte = bandwidth_gbs > 0 ? 1.0 / bandwidth_gbs : 0.0;
+	emu.latency_ns = (uint64_t)(latency_us * 1000);
+	emu.call_latency_ns = (uint64_t)(call_latency_us * 1000);
+	pthread_mutex_unlock(&emu.lock);
+}
+
+void veo_emu_get_stats(struct veo_emu_stats *stats)
+{
+	pthread_mutex_lock(&emu.lock);
+	*stats = emu.stats;
+	pthread_mutex_unlock(&emu.lock);
+}
+
+/* Clears the counters, the memory allocated aside */
+void veo_emu_reset_stats(void)
+{
+	pthread_mutex_lock(&emu.lock);
+	memset(&emu.stats.calls, 0, (char *)&emu.stats.mem_bytes - (char *)&emu.stats.calls);
+	emu.stats.peak_mem_bytes = emu.stats.mem_bytes;
+	pthread_mutex_unlock(&emu.lock);
+}
+
+void veo_emu_print_stats(void)
+{
+	struct veo_emu_stats stats;
+
+	veo_emu_get_stats(&stats);
+	fprintf(stderr, "veo_emu: %lu calls in %.3f ms\n"
+			"veo_emu: %lu writes of %lu bytes in %.3f ms\n"
+			"veo_emu: %lu reads of %lu bytes in %.3f ms\n"
+			"veo_emu: %lu allocations, %lu frees, %lu bytes in use, %lu at peak\n",
+			stats.calls, stats.call_ns / 1e6,
+			stats.writes, stats.write_bytes, stats.write_ns / 1e6,
+			stats.reads, stats.read_bytes, stats.read_ns / 1e6,
+			stats.allocs, stats.frees, stats.mem_bytes, stats.peak_mem_bytes);
+}
+
+/* Copies size bytes over one direction of the link of a node: waits for it to
+ * be free, then for the latency and the time the bytes take at the bandwidth
+ * set */
+static
+void emu_transfer(int venode, int direction, void *dst, const void *src, size_t size)
+{
+	uint64_t start, end, now = emu_now();
+	uint64_t *link_free = &emu.link_free[venode][direction];
+
+	pthread_mutex_lock(&emu.lock);
+	start = *link_free > now ? *link_free : now;
+	end = start + emu.latency_ns + (uint64_t)(emu.ns_per_byte * (double)size);
+	*link_free = end;
+	pthread_mutex_unlock(&emu.lock);
+
+	memcpy(dst, src, size);
+	if (end > emu_now())
+		emu_sleep_until(end);
+
+	pthread_mutex_lock(&emu.lock);
+	if (direction == LINK_WRITE) {
+		emu.stats.writes++;
+		emu.stats.write_bytes += size;
+		emu.stats.write_ns += emu_now() - now;
+	} else {
+		emu.stats.reads++;
+		emu.stats.read_bytes += size;
+		emu.stats.read_ns += emu_now() - now;
+	}
+	pthread_mutex_unlock(&emu.lock);
+}
+
+static
+uint64_t emu_call(uint64_t addr, const struct veo_args *ca)
+{
+	uint64_t i_args[EMU_MAX_INT_ARGS] = {0};
+	double f_args[EMU_MAX_FLOAT_ARGS] = {0};
+	int i, num_i = 0, num_f = 0;
+	emu_function function = (emu_function)addr;
+	uint64_t start, ret;
+
+	/* Integer and floating point arguments go in separate registers, so
+	 * the function is called with all of them, each class in order. A
+	 * float is read from the low half of its register */
+	for (i = 0; i < ca->num_args; ++i) {
+		if (ca->type[i] == ARG_FLOAT || ca->type[i] == ARG_DOUBLE)
+			memcpy(&f_args[num_f++], &ca->value[i], sizeof(double));
+		else
+			i_args[num_i++] = ca->value[i];
+	}
+
+	start = emu_now();
+	if (emu.call_latency_ns)
+		emu_sleep_until(start + emu.call_latency_ns);
+
+	ret = function(i_args[0], i_args[1], i_args[2], i_args[3], i_args[4], i_args[5], i_args[6], i_args[7],
+			i_args[8], i_args[9], i_args[10], i_args[11], i_args[12], i_args[13], i_args[14], i_args[15],
+			f_args[0], f_args[1], f_args[2], f_args[3], f_args[4], f_args[5], f_args[6], f_args[7]);
+
+	pthread_mutex_lock(&emu.lock);
+	emu.stats.calls++;
+	emu.stats.call_ns += emu_now() - start;
+	pthread_mutex_unlock(&emu.lock);
+
+	return ret;
+}
+
+static
+void emu_execute(struct emu_command *cmd)
+{
+	cmd->status = VEO_COMMAND_OK;
+
+	switch (cmd->type) {
+	case CMD_CALL:
+		cmd->result = emu_call(cmd->addr, &cmd->args);
+		break;
+	case CMD_READ:
+		emu_transfer(cmd->venode, LINK_READ, cmd->host, (void *)cmd->addr, cmd->size);
+		cmd->result = 0;
+		break;
+	case CMD_WRITE:
+		emu_transfer(cmd->venode, LINK_WRITE, (void *)cmd->addr, cmd->host, cmd->size);
+		cmd->result = 0;
+		break;
+	case CMD_VH:
+		cmd->result = ((uint64_t (*)(void *))cmd->addr)(cmd->host);
+		break;
+	}
+}
+
+/* Runs the commands of the context in the order they were submitted */
+static
+void *emu_context_thread(void *args)
+{
+	struct veo_thr_ctxt *ctx = (struct veo_thr_ctxt *)args;
+	struct emu_command *cmd;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		for (cmd = ctx->head; cmd && cmd->done; cmd = cmd->next)
+			;
+
+		if (!cmd) {
+			if (ctx->closing)
+				break;
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&ctx->lock);
+		emu_execute(cmd);
+		pthread_mutex_lock(&ctx->lock);
+
+		cmd->done = 1;
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
+
+static
+uint64_t emu_submit(struct veo_thr_ctxt *ctx, struct emu_command *cmd)
+{
+	if (!ctx || !cmd) {
+		free(cmd);
+		return VEO_REQUEST_ID_INVALID;
+	}
+
+	cmd->venode = ctx->proc->venode;
+
+	pthread_mutex_lock(&ctx->lock);
+	cmd->reqid = ctx->next_reqid++;
+	cmd->done = 0;
+	cmd->next = NULL;
+	if (ctx->tail)
+		ctx->tail->next = cmd;
+	else
+		ctx->head = cmd;
+	ctx->tail = cmd;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return cmd->reqid;
+}
+
+/* Takes the result of a finished request out of the queue. Returns
+ * VEO_COMMAND_UNFINISHED if it is still running, or if wait is not set and
+ * it did not finish yet */
+static
+int emu_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp, int wait)
+{
+	struct emu_command *cmd, *prev = NULL;
+	int status;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (cmd = ctx->head; cmd && cmd->reqid != reqid; cmd = cmd->next)
+		prev = cmd;
+
+	if (!cmd) {
+		pthread_mutex_unlock(&ctx->lock);
+		return VEO_COMMAND_ERROR;
+	}
+
+	while (wait && !cmd->done)
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+	if (!cmd->done) {
+		pthread_mutex_unlock(&ctx->lock);
+		return VEO_COMMAND_UNFINISHED;
+	}
+
+	if (prev)
+		prev->next = cmd->next;
+	else
+		ctx->head = cmd->next;
+	if (ctx->tail == cmd)
+		ctx->tail = prev;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (retp)
+		*retp = cmd->result;
+	status = cmd->status;
+	free(cmd);
+
+	return status;
+}
+
+struct veo_proc_handle *veo_proc_create(int venode)
+{
+	struct veo_proc_handle *proc;
+
+	emu_init();
+	if (venode < 0 || venode >= emu.nodes)
+		return NULL;
+
+	proc = (struct veo_proc_handle *)malloc(sizeof(*proc));
+	if (proc)
+		proc->venode = venode;
+
+	return proc;
+}
+
+int veo_proc_destroy(struct veo_proc_handle *proc)
+{
+	if (!proc)
+		return -1;
+
+	if (emu.print_stats)
+		veo_emu_print_stats();
+
+	free(proc);
+	return 0;
+}
+
+uint64_t veo_load_library(struct veo_proc_handle *proc, const char *libname)
+{
+	if (!proc)
+		return 0;
+
+	return (uint64_t)dlopen(libname, RTLD_NOW | RTLD_LOCAL);
+}
+
+int veo_unload_library(struct veo_proc_handle *proc, const uint64_t libhdl)
+{
+	if (!proc || !libhdl)
+		return -1;
+
+	return dlclose((void *)libhdl);
+}
+
+uint64_t veo_get_sym(struct veo_proc_handle *proc, uint64_t libhdl, const char *symname)
+{
+	if (!proc || !libhdl)
+		return 0;
+
+	return (uint64_t)dlsym((void *)libhdl, symname);
+}
+
+struct veo_thr_ctxt *veo_context_open(struct veo_proc_handle *proc)
+{
+	struct veo_thr_ctxt *ctx;
+
+	if (!proc)
+		goto fail1;
+
+	ctx = (struct veo_thr_ctxt *)calloc(1, sizeof(*ctx));
+	if (!ctx)
+		goto fail1;
+
+	ctx->proc = proc;
+	ctx->next_reqid = 1;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+
+	if (pthread_create(&ctx->thread, NULL, emu_context_thread, ctx) != 0)
+		goto fail2;
+
+	return ctx;
+
+	/* ERROR CLEANUP */
+fail2:
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+fail1:
+	return NULL;
+}
+
+/* Runs the commands left and drops the results nobody collected */
+int veo_context_close(struct veo_thr_ctxt *ctx)
+{
+	struct emu_command *cmd;
+
+	if (!ctx)
+		return -1;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->closing = 1;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	pthread_join(ctx->thread, NULL);
+
+	while (ctx->head) {
+		cmd = ctx->head;
+		ctx->head = cmd->next;
+		free(cmd);
+	}
+
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+
+	return 0;
+}
+
+struct veo_args *veo_args_alloc(void)
+{
+	return (struct veo_args *)calloc(1, sizeof(struct veo_args));
+}
+
+void veo_args_free(struct veo_args *ca)
+{
+	free(ca);
+}
+
+void veo_args_clear(struct veo_args *ca)
+{
+	if (ca)
+		memset(ca, 0, sizeof(*ca));
+}
+
+static
+int emu_args_set(struct veo_args *ca, int argnum, int type, uint64_t value)
+{
+	int i, num_i = 0, num_f = 0;
+
+	if (!ca || argnum < 0 || argnum >= EMU_MAX_ARGS)
+		return -1;
+
+	ca->type[argnum] = type;
+	ca->value[argnum] = value;
+	if (argnum >= ca->num_args)
+		ca->num_args = argnum + 1;
+
+	for (i = 0; i < ca->num_args; ++i) {
+		if (ca->type[i] == ARG_FLOAT || ca->type[i] == ARG_DOUBLE)
+			++num_f;
+		else
+			++num_i;
+	}
+
+	return num_i <= EMU_MAX_INT_ARGS && num_f <= EMU_MAX_FLOAT_ARGS ? 0 : -1;
+}
+
+int veo_args_set_i32(struct veo_args *ca, int argnum, int32_t val)
+{
+	return emu_args_set(ca, argnum, ARG_INT, (uint64_t)(int64_t)val);
+}
+
+int veo_args_set_u32(struct veo_args *ca, int argnum, uint32_t val)
+{
+	return emu_args_set(ca, argnum, ARG_INT, val);
+}
+
+int veo_args_set_i64(struct veo_args *ca, int argnum, int64_t val)
+{
+	return emu_args_set(ca, argnum, ARG_INT, (uint64_t)val);
+}
+
+int veo_args_set_u64(struct veo_args *ca, int argnum, uint64_t val)
+{
+	return emu_args_set(ca, argnum, ARG_INT, val);
+}
+
+int veo_args_set_float(struct veo_args *ca, int argnum, float val)
+{
+	uint64_t bits = 0;
+
+	memcpy(&bits, &val, sizeof(val));
+	return emu_args_set(ca, argnum, ARG_FLOAT, bits);
+}
+
+int veo_args_set_double(struct veo_args *ca, int argnum, double val)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &val, sizeof(val));
+	return emu_args_set(ca, argnum, ARG_DOUBLE, bits);
+}
+
+int veo_args_set_hmem(struct veo_args *ca, int argnum, void *val)
+{
+	return emu_args_set(ca, argnum, ARG_INT, (uint64_t)val);
+}
+
+uint64_t veo_call_async(struct veo_thr_ctxt *ctx, uint64_t addr, struct veo_args *ca)
+{
+	struct emu_command *cmd;
+
+	if (!addr || !ca)
+		return VEO_REQUEST_ID_INVALID;
+
+	cmd = (struct emu_command *)calloc(1, sizeof(*cmd));
+	if (!cmd)
+		return VEO_REQUEST_ID_INVALID;
+
+	cmd->type = CMD_CALL;
+	cmd->addr = addr;
+	cmd->args = *ca;
+
+	return emu_submit(ctx, cmd);
+}
+
+uint64_t veo_call_async_vh(struct veo_thr_ctxt *ctx, uint64_t (*func)(void *), void *arg)
+{
+	struct emu_command *cmd;
+
+	if (!func)
+		return VEO_REQUEST_ID_INVALID;
+
+	cmd = (struct emu_command *)calloc(1, sizeof(*cmd));
+	if (!cmd)
+		return VEO_REQUEST_ID_INVALID;
+
+	cmd->type = CMD_VH;
+	cmd->addr = (uint64_t)func;
+	cmd->host = arg;
+
+	return emu_submit(ctx, cmd);
+}
+
+uint64_t veo_call_async_by_name(struct veo_thr_ctxt *ctx, uint64_t libhdl, const char *symname, struct veo_args *ca)
+{
+	if (!ctx)
+		return VEO_REQUEST_ID_INVALID;
+
+	return veo_call_async(ctx, veo_get_sym(ctx->proc, libhdl, symname), ca);
+}
+
+int veo_call_peek_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp)
+{
+	if (!ctx)
+		return VEO_COMMAND_ERROR;
+
+	return emu_result(ctx, reqid, retp, 0);
+}
+
+int veo_call_wait_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp)
+{
+	if (!ctx)
+		return VEO_COMMAND_ERROR;
+
+	return emu_result(ctx, reqid, retp, 1);
+}
+
+int veo_alloc_mem(struct veo_proc_handle *proc, uint64_t *addr, const size_t size)
+{
+	char *mem;
+
+	if (!proc || !addr)
+		return -1;
+
+	/* VE memory is 64 bytes aligned; the size is kept in front of it */
+	mem = (char *)aligned_alloc(64, EMU_MEM_HEADER + ((size + 63) & ~63UL));
+	if (!mem)
+		return -1;
+	*(size_t *)mem = size;
+
+	pthread_mutex_lock(&emu.lock);
+	emu.stats.allocs++;
+	emu.stats.mem_bytes += size;
+	if (emu.stats.mem_bytes > emu.stats.peak_mem_bytes)
+		emu.stats.peak_mem_bytes = emu.stats.mem_bytes;
+	pthread_mutex_unlock(&emu.lock);
+
+	*addr = (uint64_t)(mem + EMU_MEM_HEADER);
+	return 0;
+}
+
+int veo_free_mem(struct veo_proc_handle *proc, uint64_t addr)
+{
+	char *mem;
+
+	if (!proc || !addr)
+		return -1;
+
+	mem = (char *)addr - EMU_MEM_HEADER;
+
+	pthread_mutex_lock(&emu.lock);
+	emu.stats.frees++;
+	emu.stats.mem_bytes -= *(size_t *)mem;
+	pthread_mutex_unlock(&emu.lock);
+
+	free(mem);
+	return 0;
+}
+
+int veo_read_mem(struct veo_proc_handle *proc, void *dst, uint64_t src, size_t size)
+{
+	if (!proc)
+		return -1;
+
+	emu_transfer(proc->venode, LINK_READ, dst, (void *)src, size);
+	return 0;
+}
+
+int veo_write_mem(struct veo_proc_handle *proc, uint64_t dst, const void *src, size_t size)
+{
+	if (!proc)
+		return -1;
+
+	emu_transfer(proc->venode, LINK_WRITE, (void *)dst, src, size);
+	return 0;
+}
+
+static
+uint64_t emu_async_transfer(struct veo_thr_ctxt *ctx, int type, uint64_t addr, void *host, size_t size)
+{
+	struct emu_command *cmd = (struct emu_command *)calloc(1, sizeof(*cmd));
+
+	if (!cmd)
+		return VEO_REQUEST_ID_INVALID;
+
+	cmd->type = type;
+	cmd->addr = addr;
+	cmd->host = host;
+	cmd->size = size;
+
+	return emu_submit(ctx, cmd);
+}
+
+uint64_t veo_async_read_mem(struct veo_thr_ctxt *ctx, void *dst, uint64_t src, size_t size)
+{
+	return emu_async_transfer(ctx, CMD_READ, src, dst, size);
+}
+
+uint64_t veo_async_write_mem(struct veo_thr_ctxt *ctx, uint64_t dst, const void *src, size_t size)
+{
+	return emu_async_transfer(ctx, CMD_WRITE, dst, (void *)src, size);
+}
+
+int veo_alloc_hmem(struct veo_proc_handle *proc, void **addr, const size_t size)
+{
+	uint64_t mem;
+
+	if (!addr || veo_alloc_mem(proc, &mem, size) != 0)
+		return -1;
+
+	*addr = (void *)(mem | EMU_HMEM_TAG | (uint64_t)proc->venode << EMU_HMEM_NODE_SHIFT);
+	return 0;
+}
+
+int veo_free_hmem(void *addr)
+{
+	struct veo_proc_handle proc;
+
+	if (!veo_is_ve_addr(addr))
+		return -1;
+
+	return veo_free_mem(&proc, (uint64_t)veo_get_hmem_addr(addr));
+}
+
+static
+int emu_hmem_node(const void *addr)
+{
+	return (int)(((uint64_t)addr & ~EMU_HMEM_TAG) >> EMU_HMEM_NODE_SHIFT);
+}
+
+int veo_is_ve_addr(const void *addr)
+{
+	return ((uint64_t)addr & EMU_HMEM_TAG) != 0;
+}
+
+void *veo_get_hmem_addr(void *addr)
+{
+	return (void *)((uint64_t)addr & ((1UL << EMU_HMEM_NODE_SHIFT) - 1));
+}
+
+/* Either side may be hmem or host memory; only copies between the VH and the
+ * VE go over the link */
+int veo_hmemcpy(void *dst, void *src, size_t size)
+{
+	if (veo_is_ve_addr(dst) && !veo_is_ve_addr(src))
+		emu_transfer(emu_hmem_node(dst), LINK_WRITE, veo_get_hmem_addr(dst), src, size);
+	else if (!veo_is_ve_addr(dst) && veo_is_ve_addr(src))
+		emu_transfer(emu_hmem_node(src), LINK_READ, dst, veo_get_hmem_addr(src), size);
+	else
+		memcpy(veo_get_hmem_addr(dst), veo_get_hmem_addr(src), size);
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _VEO_EMU_H
+#define _VEO_EMU_H
+
+/* Extensions of the VEO emulator, to model the cost of the offload and
+ * measure it. They are also set from the environment when the first process
+ * is created:
+ *
+ *   VEO_EMU_NODES         number of VE nodes (default 8, at most 64)
+ *   VEO_EMU_BANDWIDTH     transfer bandwidth, GB/s in each direction
+ *                         (default 0, unlimited)
+ *   VEO_EMU_LATENCY       latency of each transfer, in us (default 0)
+ *   VEO_EMU_CALL_LATENCY  latency of each call, in us (default 0)
+ *   VEO_EMU_STATS         if set, the stats are printed to stderr when a
+ *                         process is destroyed */
+
+#include <stdint.h>
+
+struct veo_emu_stats {
+	uint64_t calls;        /* kernels run                     */
+	uint64_t call_ns;      /* time running them               */
+	uint64_t writes;       /* VH to VE transfers              */
+	uint64_t write_bytes;
+	uint64_t write_ns;     /* time the transfers took         */
+	uint64_t reads;        /* VE to VH transfers              */
+	uint64_t read_bytes;
+	uint64_t read_ns;
+	uint64_t allocs;       /* VE memory and hmem allocations  */
+	uint64_t frees;
+	uint64_t mem_bytes;    /* VE memory allocated now         */
+	uint64_t peak_mem_bytes;
+};
+
+void veo_emu_configure(int nodes, double bandwidth_gbs, double latency_us, double call_latency_us);
+void veo_emu_get_stats(struct veo_emu_stats *stats);
+void veo_emu_reset_stats(void);
+void veo_emu_print_stats(void);
+
+#endif /* #ifndef _VEO_EMU_H */
@@ -0,0 +1,8 @@
+#ifndef _VEO_HMEM_H
+#define _VEO_HMEM_H
+
+/* VE side of the emulated hmem API, for the kernels built for the host */
+
+void *veo_get_hmem_addr(void *addr);
+
+#endif /* #ifndef _VEO_HMEM_H */